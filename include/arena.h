@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace LWS {
+
+    // A view of a contiguous array that someone else owns, typically an arena.
+    template<typename T>
+    class ArraySpan {
+        public:
+        ArraySpan() : ptr(0), count(0) {}
+        ArraySpan(T* p, size_t n) : ptr(p), count(n) {}
+
+        inline size_t size() const { return count; }
+        inline bool empty() const { return count == 0; }
+        inline T* data() const { return ptr; }
+        inline T& operator[](size_t i) const { return ptr[i]; }
+        inline T* begin() const { return ptr; }
+        inline T* end() const { return ptr + count; }
+
+        private:
+        T* ptr;
+        size_t count;
+    };
+
+    // A monotonic (bump-pointer) allocator for objects that all die together,
+    // such as the BVH and block cluster tree rebuilt every iteration. Allocation
+    // just advances an offset into a block, and Reset releases everything at
+    // once without touching the individual objects, so their destructors must
+    // not free anything the arena owns. If an iteration overflows the current
+    // block, a larger one is added; Reset then merges them into a single block,
+    // so later iterations of a similar size allocate from one block only.
+    //
+    // An arena is not thread-safe. Code running inside a parallel region should
+    // allocate from its thread's sub-arena (Local) instead, after ReserveThreads
+    // has been called outside the region.
+    class MonotonicArena {
+        public:
+        struct Mark {
+            size_t block;
+            size_t offset;
+        };
+
+        explicit MonotonicArena(size_t blockBytes = 1 << 16);
+        ~MonotonicArena();
+
+        void* Allocate(size_t bytes, size_t align = alignof(std::max_align_t));
+
+        template<typename T>
+        inline T* AllocateArray(size_t n) {
+            return static_cast<T*>(Allocate(n * sizeof(T), alignof(T)));
+        }
+
+        template<typename T>
+        inline ArraySpan<T> AllocateSpan(size_t n) {
+            return ArraySpan<T>(AllocateArray<T>(n), n);
+        }
+
+        // Constructs an object in the arena. It is never destroyed by the arena.
+        template<typename T, typename... Args>
+        inline T* New(Args&&... args) {
+            return new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        }
+
+        // Makes sure the next `bytes` of allocations fit in the current block
+        void Reserve(size_t bytes);
+        // Releases every allocation, including those of the sub-arenas
+        void Reset();
+
+        // Everything allocated after GetMark is released by Rewind to that mark,
+        // for scratch memory that is reused many times within one iteration
+        inline Mark GetMark() const {
+            return Mark{current, offset};
+        }
+        inline void Rewind(const Mark &mark) {
+            current = mark.block;
+            offset = mark.offset;
+        }
+
+        // Creates sub-arenas for up to n threads; not thread-safe
+        void ReserveThreads(int n);
+        // The sub-arena for the calling OpenMP thread
+        MonotonicArena& Local();
+
+        // Allocations and bytes handed out since the last Reset, summed over
+        // sub-arenas; memory reused after a Rewind is counted again
+        size_t NumAllocations() const;
+        size_t BytesUsed() const;
+        // Memory currently held, whether used or not
+        size_t BytesReserved() const;
+
+        private:
+        MonotonicArena(const MonotonicArena&);
+        MonotonicArena& operator=(const MonotonicArena&);
+
+        struct Block {
+            char* data;
+            size_t size;
+        };
+
+        void addBlock(size_t bytes);
+        void freeBlocks();
+
+        std::vector<Block> blocks;
+        size_t current;
+        size_t offset;
+        size_t blockBytes;
+        size_t numAllocations;
+        size_t bytesUsed;
+        std::vector<std::unique_ptr<MonotonicArena>> threadArenas;
+    };
+}
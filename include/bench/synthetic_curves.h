@@ -0,0 +1,23 @@
+#pragma once
+
+#include "poly_curve_network.h"
+
+#include <string>
+
+namespace LWS {
+    namespace SyntheticCurves {
+
+        // A closed helix wound around a torus, with the given number of edges.
+        PolyCurveNetwork* Helix(int nEdges, int turns = 40);
+        // A smooth closed curve given by a random Fourier series; with many
+        // modes it passes close to itself everywhere, like a tangled knot.
+        PolyCurveNetwork* RandomKnot(int nEdges, unsigned int seed, int modes = 12);
+        // A cubic lattice of subdivided edges, with valence-6 junctions at the
+        // lattice points. Approximately nEdges edges in total.
+        PolyCurveNetwork* Lattice(int nEdges, int cellsPerSide = 8);
+
+        // Builds one of the above by name ("helix", "knot" or "lattice");
+        // returns 0 for an unknown name.
+        PolyCurveNetwork* Create(const std::string &name, int nEdges, unsigned int seed);
+    }
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace LWS {
+    namespace BinaryIO {
+
+        inline bool HostIsLittleEndian() {
+            uint16_t probe = 1;
+            unsigned char first;
+            std::memcpy(&first, &probe, 1);
+            return first == 1;
+        }
+
+        // All binary formats in this project are little-endian on disk;
+        // values are byte-swapped on the (rare) big-endian host.
+        template<typename T>
+        inline void SwapToLittleEndian(T &value) {
+            if (HostIsLittleEndian() || sizeof(T) == 1) return;
+            unsigned char bytes[sizeof(T)];
+            std::memcpy(bytes, &value, sizeof(T));
+            for (size_t i = 0; i < sizeof(T) / 2; i++) {
+                unsigned char tmp = bytes[i];
+                bytes[i] = bytes[sizeof(T) - 1 - i];
+                bytes[sizeof(T) - 1 - i] = tmp;
+            }
+            std::memcpy(&value, bytes, sizeof(T));
+        }
+
+        // 64-bit FNV-1a hash, used as a cheap integrity check on file payloads.
+        uint64_t Checksum(const char* data, size_t size);
+
+        // Appends little-endian values to an in-memory byte buffer.
+        class Writer {
+            public:
+            std::vector<char> bytes;
+
+            template<typename T>
+            void Write(T value) {
+                SwapToLittleEndian(value);
+                const char* p = reinterpret_cast<const char*>(&value);
+                bytes.insert(bytes.end(), p, p + sizeof(T));
+            }
+
+            template<typename T>
+            void WriteArray(const T* values, size_t count) {
+                if (HostIsLittleEndian()) {
+                    const char* p = reinterpret_cast<const char*>(values);
+                    bytes.insert(bytes.end(), p, p + count * sizeof(T));
+                }
+                else {
+                    for (size_t i = 0; i < count; i++) Write(values[i]);
+                }
+            }
+
+            void WriteBytes(const char* data, size_t size) {
+                bytes.insert(bytes.end(), data, data + size);
+            }
+
+            // Pads the buffer with zeros until its size is a multiple of the alignment.
+            void Align(size_t alignment) {
+                while (bytes.size() % alignment != 0) bytes.push_back(0);
+            }
+        };
+
+        // Reads little-endian values from a byte range. Any read past the end
+        // puts the reader in a failed state instead of touching invalid memory.
+        class Reader {
+            public:
+            Reader(const char* d, size_t s) : data(d), size(s), offset(0), failed(false) {}
+
+            template<typename T>
+            bool Read(T &value) {
+                if (!Has(sizeof(T))) return false;
+                std::memcpy(&value, data + offset, sizeof(T));
+                SwapToLittleEndian(value);
+                offset += sizeof(T);
+                return true;
+            }
+
+            template<typename T>
+            bool ReadArray(T* values, size_t count) {
+                if (count > 0 && !Has(count * sizeof(T))) return false;
+                if (HostIsLittleEndian()) {
+                    std::memcpy(values, data + offset, count * sizeof(T));
+                    offset += count * sizeof(T);
+                }
+                else {
+                    for (size_t i = 0; i < count; i++) Read(values[i]);
+                }
+                return true;
+            }
+
+            // Returns a pointer to the next `count` bytes and skips past them.
+            const char* Skip(size_t count) {
+                if (!Has(count)) return 0;
+                const char* p = data + offset;
+                offset += count;
+                return p;
+            }
+
+            void Align(size_t alignment) {
+                size_t padded = ((offset + alignment - 1) / alignment) * alignment;
+                if (padded > size) failed = true;
+                else offset = padded;
+            }
+
+            inline bool Has(size_t count) {
+                if (failed || count > size - offset) {
+                    failed = true;
+                    return false;
+                }
+                return true;
+            }
+
+            inline size_t Offset() const { return offset; }
+            inline size_t Remaining() const { return size - offset; }
+            inline bool Failed() const { return failed; }
+
+            private:
+            const char* data;
+            size_t size;
+            size_t offset;
+            bool failed;
+        };
+
+        // Reads an entire file into memory.
+        bool ReadFile(const std::string &fname, std::vector<char> &bytes);
+        // Writes to a temporary file next to the destination and renames it into place,
+        // so that readers never see a partially written file.
+        bool WriteFileAtomic(const std::string &fname, const std::vector<char> &bytes);
+    }
+}
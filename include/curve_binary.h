@@ -0,0 +1,96 @@
+#pragma once
+
+#include "poly_curve_network.h"
+#include "mapped_file.h"
+
+#include <cstdint>
+
+namespace LWS {
+    namespace CurveIO {
+
+        // Binary curve network format (.rcn). All values are little-endian.
+        //
+        //   header (48 bytes):
+        //     char[8]  magic "RCURVNET"
+        //     uint32   version
+        //     uint32   number of sections
+        //     uint64   number of vertices
+        //     uint64   number of edges
+        //     uint64   reserved (0)
+        //     uint64   reserved (0)
+        //   section table, one entry per section (24 bytes each):
+        //     uint32   section type (CurveSection)
+        //     uint32   reserved (0)
+        //     uint64   byte offset from the start of the file
+        //     uint64   byte size
+        //   section data, each starting on an 8-byte boundary.
+        //
+        // Positions and edges are always present; the rest are optional, and
+        // readers skip section types they don't know about.
+        enum class CurveSection : uint32_t {
+            Positions = 1,      // float64 x, y, z per vertex
+            Edges = 2,          // uint64 pair (prev, next) per edge
+            Pins = 3,           // int64 indices of pinned vertices
+            TangentPins = 4,    // int64 indices of vertices with pinned tangents
+            SurfacePins = 5,    // uint64 "all vertices" flag, then int64 indices
+            VertexTangents = 6, // float64 x, y, z per vertex
+            Constraints = 7     // int32 ConstraintType per applied constraint
+        };
+
+        const uint32_t binaryCurveVersion = 1;
+
+        // Writes the curve with its pins and applied constraints.
+        bool writeBinaryCurve(std::string fname, PolyCurveNetwork* curves, bool includeTangents = false);
+        // Writes bare geometry, without any pin or constraint sections.
+        bool writeBinaryCurve(std::string fname, const std::vector<Vector3> &positions,
+        const std::vector<std::array<size_t, 2>> &edges);
+
+        bool convertOBJToBinary(std::string objName, std::string binName);
+        bool convertBinaryToOBJ(std::string binName, std::string objName);
+
+        // A memory-mapped .rcn file. Positions and edges are accessed in place,
+        // without any parsing.
+        class MappedCurveFile {
+            public:
+            bool Open(std::string fname);
+
+            inline size_t NumVertices() const {
+                return nVerts;
+            }
+
+            inline size_t NumEdges() const {
+                return nEdges;
+            }
+
+            bool HasSection(CurveSection type) const;
+
+            // Raw row-major xyz positions and (prev, next) edge pairs, pointing into the mapping.
+            // Only valid on little-endian hosts; use the Fill* functions otherwise.
+            const double* Positions() const;
+            const uint64_t* Edges() const;
+
+            void FillPositions(Eigen::MatrixXd &positions) const;
+            void FillEdges(std::vector<std::array<size_t, 2>> &edges) const;
+            void FillTangents(Eigen::MatrixXd &tangents) const;
+
+            // Builds a curve network and applies any stored pins and constraints.
+            PolyCurveNetwork* CreateCurve() const;
+
+            private:
+            struct SectionEntry {
+                uint32_t type;
+                uint64_t offset;
+                uint64_t size;
+            };
+
+            const SectionEntry* FindSection(CurveSection type) const;
+            template<typename T>
+            void ReadSection(CurveSection type, size_t skipBytes, std::vector<T> &out) const;
+
+            MappedFile file;
+            size_t nVerts;
+            size_t nEdges;
+            std::vector<SectionEntry> sections;
+        };
+    }
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "geometrycentral/utilities/vector3.h"
+#include <Eigen/Core>
+
+#include <array>
+#include <vector>
+
+namespace LWS {
+
+    using namespace geometrycentral;
+
+    // A structure-of-arrays snapshot of the quantities the hot loops derive
+    // from vertex positions: vertex tangents and dual lengths, and edge
+    // midpoints, tangents and lengths, with one contiguous array per
+    // coordinate. Connectivity is flattened into CSR arrays, so walking a
+    // vertex's edges doesn't chase pointers through per-vertex vectors.
+    //
+    // The snapshot is not kept in sync automatically; it has to be refreshed
+    // with Update whenever the positions change.
+    class CurveGeometry {
+        public:
+        // Rebuilds the connectivity arrays for edges given as (prev, next) pairs
+        void SetTopology(int nVerts, const std::vector<std::array<size_t, 2>> &edges);
+        // Recomputes every derived quantity from the given positions
+        void Update(const Eigen::MatrixXd &positions);
+
+        inline int NumVertices() const {
+            return adjStart.size() - 1;
+        }
+
+        inline int NumEdges() const {
+            return edgePrev.size();
+        }
+
+        inline Vector3 Position(int v) const {
+            return Vector3{px(v), py(v), pz(v)};
+        }
+
+        inline Vector3 VertexTangent(int v) const {
+            return Vector3{tx(v), ty(v), tz(v)};
+        }
+
+        inline Vector3 Midpoint(int e) const {
+            return Vector3{mx(e), my(e), mz(e)};
+        }
+
+        inline Vector3 EdgeTangent(int e) const {
+            return Vector3{etx(e), ety(e), etz(e)};
+        }
+
+        inline int Degree(int v) const {
+            return adjStart[v + 1] - adjStart[v];
+        }
+
+        // Whether two edges are the same or share an endpoint
+        inline bool EdgesTouch(int e1, int e2) const {
+            return edgePrev[e1] == edgePrev[e2] || edgePrev[e1] == edgeNext[e2] ||
+                edgeNext[e1] == edgePrev[e2] || edgeNext[e1] == edgeNext[e2];
+        }
+
+        // Per-vertex quantities
+        Eigen::VectorXd px, py, pz;
+        Eigen::VectorXd tx, ty, tz;
+        Eigen::VectorXd dualLength;
+
+        // Per-edge quantities
+        Eigen::VectorXd mx, my, mz;
+        Eigen::VectorXd etx, ety, etz;
+        Eigen::VectorXd length;
+
+        // The edges of vertex v are adjEdge[adjStart[v] .. adjStart[v + 1]),
+        // in the same order as CurveVertex::edge, and adjVert holds the vertex
+        // across each of those edges
+        std::vector<int> adjStart;
+        std::vector<int> adjEdge;
+        std::vector<int> adjVert;
+        std::vector<int> edgePrev;
+        std::vector<int> edgeNext;
+    };
+}
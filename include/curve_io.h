@@ -1,5 +1,6 @@
 #pragma once
 
+#include <array>
 #include <string>
 #include <vector>
 
@@ -11,11 +12,24 @@ namespace LWS {
 
         std::vector<std::string> split(const std::string& s, char delimiter);
 
+        // Reads vertices and line elements from an OBJ file. The file is memory-mapped
+        // and split into chunks that are parsed in parallel. Polylines with more than
+        // two indices become one edge per consecutive pair.
         void readVerticesAndEdges(std::string fname, std::vector<Vector3> &all_positions,
         std::vector<std::array<size_t, 2>> &all_edges);
 
+        // Reads the boundary edges of all faces in an OBJ file.
         void readFaces(std::string fname, std::vector<std::array<size_t, 2>> &all_edges);
 
+        // Line-by-line versions of the above, using getline and stod.
+        void readVerticesAndEdgesStream(std::string fname, std::vector<Vector3> &all_positions,
+        std::vector<std::array<size_t, 2>> &all_edges);
+        void readFacesStream(std::string fname, std::vector<std::array<size_t, 2>> &all_edges);
+
+        // Times the streaming and memory-mapped readers on the same file,
+        // prints their throughput in MB/s, and checks that they agree.
+        void benchmarkReaders(std::string fname);
+
         void writeOBJLineElements(std::string fname, const std::vector<Vector3> &all_positions,
         const std::vector<std::vector<size_t> > &components);
         // Writes a collection of curves to an OBJ file, where they are described as
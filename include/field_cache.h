@@ -0,0 +1,107 @@
+#pragma once
+
+#include "implicit_surface.h"
+#include "mapped_file.h"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace LWS {
+
+    // A scalar field and its gradient, sampled on a sparse grid of bricks and
+    // interpolated trilinearly. Each brick covers brickSize^3 cells. A brick is
+    // only kept if, at every cell center, face center and edge midpoint, the
+    // interpolated value agrees with the exact field to within the tolerance, and
+    // the gradient to within its square root (both relative to the magnitude, or
+    // absolute below 1). This is a check at sample points, not a proof: a field
+    // with features smaller than half a cell can still exceed the tolerance in
+    // between. Lookups in any other brick report a miss, and callers evaluate the
+    // exact field instead.
+    //
+    // File format (.rcfield), little-endian:
+    //   char[8]  magic "RCFIELD1"
+    //   uint32   brick size (cells per side)
+    //   uint32   number of probe values
+    //   uint32   bricks along x, y, z
+    //   uint32   reserved (0)
+    //   float64  origin x, y, z, voxel size, tolerance
+    //   uint64   number of stored bricks
+    //   float64  probe values, used to detect a changed field
+    //   int32    brick table, x fastest; -1 for bricks that are not stored
+    //   (padding to 8 bytes)
+    //   float32  per brick, (brickSize + 1)^3 samples of value, gx, gy, gz
+    class SparseFieldCache {
+        public:
+        typedef std::function<void(Vector3 point, double &value, Vector3 &gradient)> Sampler;
+        static const int brickSize = 8;
+
+        SparseFieldCache();
+
+        // Samples the field over the box. If band > 0, the field is taken to be
+        // a signed distance, and only bricks that may lie within band of the zero
+        // set are sampled; otherwise every brick is.
+        void Build(Sampler sampler, Vector3 boxMin, Vector3 boxMax, double voxelSize, double band, double tolerance);
+
+        // Maps a cache written by Save, if it was built for the same box, voxel
+        // size and tolerance, and still matches the sampler at a few probe points.
+        bool Load(const std::string &fname, Sampler sampler, Vector3 boxMin, Vector3 boxMax, double voxelSize, double tolerance);
+        bool Save(const std::string &fname) const;
+
+        // Loads from fname if possible, and otherwise builds and saves there.
+        // An empty fname only builds.
+        void LoadOrBuild(const std::string &fname, Sampler sampler, Vector3 boxMin, Vector3 boxMax,
+            double voxelSize, double band, double tolerance);
+
+        // Returns false on a miss, leaving value and gradient untouched.
+        bool Lookup(Vector3 point, double &value, Vector3 &gradient) const;
+
+        size_t NumBricks() const;
+        size_t NumRejectedBricks() const;
+        size_t SizeInBytes() const;
+
+        private:
+        SparseFieldCache(const SparseFieldCache&);
+        SparseFieldCache& operator=(const SparseFieldCache&);
+
+        void setGrid(Vector3 boxMin, Vector3 boxMax, double voxelSize);
+        void computeProbes(Sampler &sampler, std::vector<double> &probes) const;
+
+        Vector3 origin;
+        double voxelSize;
+        double tolerance;
+        int dims[3];
+        size_t numBricks;
+        size_t numRejected;
+
+        // Point either into the vectors below, or into the mapped file
+        const int32_t* brickTable;
+        const float* samples;
+
+        std::vector<int32_t> ownedTable;
+        std::vector<float> ownedSamples;
+        std::vector<double> probes;
+        MappedFile file;
+    };
+
+    // Wraps a static implicit surface with a SparseFieldCache of its signed distance
+    // in a band around the surface. Points outside the band, or in bricks that failed
+    // the error check, are passed through to the wrapped surface.
+    class CachedImplicitSurface : public ImplicitSurface {
+        public:
+        // resolution is the number of voxels across the surface's bounding diameter.
+        // If cacheFile is not empty, the cache is read from it when it matches, and
+        // written to it otherwise.
+        CachedImplicitSurface(ImplicitSurface* surface, int resolution, double tolerance, std::string cacheFile = "");
+        virtual ~CachedImplicitSurface();
+        virtual double SignedDistance(Vector3 point);
+        virtual Vector3 GradientOfDistance(Vector3 point);
+        virtual double BoundingDiameter();
+        virtual Vector3 BoundingCenter();
+
+        private:
+        ImplicitSurface* surface;
+        SparseFieldCache cache;
+    };
+}
@@ -33,5 +33,9 @@ namespace LWS {
         static void SetPinTargets(PolyCurveNetwork* curves, Eigen::VectorXd &targets, int rowStart);
         static void SetTangentTargets(PolyCurveNetwork* curves, Eigen::VectorXd &targets, int rowStart);
         static void SetSurfaceTargets(PolyCurveNetwork* curves, Eigen::VectorXd &targets, int rowStart);
+
+        private:
+        // Positions of the surface-pinned vertices, as coordinate arrays for the batched surface queries
+        static void GatherSurfacePins(PolyCurveNetwork* curves, std::vector<double> &x, std::vector<double> &y, std::vector<double> &z);
     };
 }
\ No newline at end of file
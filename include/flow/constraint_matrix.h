@@ -0,0 +1,68 @@
+#pragma once
+
+#include "flow/gradient_constraint_enum.h"
+
+#include <Eigen/Sparse>
+#include <vector>
+
+namespace LWS {
+    class PolyCurveNetwork;
+
+    // The Jacobian B of a curve's applied constraints, kept between iterations.
+    // The sparsity pattern only depends on which constraints are applied and
+    // which vertices they involve, so it is built once; Refresh then recomputes
+    // the derivatives (in parallel, one task per constraint type) and writes
+    // them straight into B's value array. The pattern is rebuilt automatically
+    // if the constraints' structure changes.
+    //
+    // This is also a DomainConstraints, so it can be handed to anything that
+    // takes a VariableConstraintSet; AddTriplets then emits the cached entries
+    // without recomputing any derivatives.
+    class ConstraintMatrix : public DomainConstraints<ConstraintMatrix> {
+        public:
+        ConstraintMatrix(PolyCurveNetwork* c);
+
+        // Recomputes the entries of B at the current positions. Returns true
+        // if the sparsity pattern had to be rebuilt.
+        bool Refresh();
+
+        inline const Eigen::SparseMatrix<double>& Matrix() const {
+            return B;
+        }
+
+        // Number of times the pattern has been built, for diagnostics
+        inline int NumPatternBuilds() const {
+            return patternBuilds;
+        }
+
+        void AddTriplets(std::vector<Eigen::Triplet<double>> &triplets) const;
+        int NumConstraintRows() const;
+        int NumExpectedCols() const;
+        void SetTargetValues(Eigen::VectorXd &targets) const;
+        void NegativeConstraintValues(Eigen::VectorXd &b, Eigen::VectorXd &targets) const;
+
+        private:
+        // The rows belonging to one constraint type
+        struct Block {
+            ConstraintType type;
+            int rowStart;
+            int rows;
+            // Reused between refreshes so that they don't reallocate
+            std::vector<Eigen::Triplet<double>> triplets;
+            // For each triplet, its index into B's value array
+            std::vector<int> slots;
+        };
+
+        PolyCurveNetwork* curves;
+        VariableConstraintSet constraints;
+        std::vector<Block> blocks;
+        Eigen::SparseMatrix<double> B;
+        int cols;
+        int patternBuilds;
+
+        bool layoutMatches() const;
+        void resetLayout();
+        bool patternMatches(const Block &block) const;
+        void buildPattern();
+    };
+}
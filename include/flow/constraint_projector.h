@@ -0,0 +1,72 @@
+#pragma once
+
+#include "flow/constraint_matrix.h"
+
+#include <Eigen/SparseCholesky>
+#include <vector>
+
+namespace LWS {
+
+    // Projects vectors onto the null space of a constraint matrix B,
+    //
+    //   P v = v - B^T (B B^T)^{-1} B v,
+    //
+    // using a sparse LDL^T factorization of B B^T. B B^T has a fixed sparsity
+    // pattern as long as B does, so the fill-reducing ordering and symbolic
+    // factorization are computed once, along with a plan for forming B B^T's
+    // values directly from B's. Later updates only redo the numeric
+    // factorization, and skip even that if B's values haven't changed.
+    class ConstraintProjector {
+        public:
+        ConstraintProjector();
+
+        // Refactors for the current values of the given matrix
+        void Update(const ConstraintMatrix &constraints);
+
+        Eigen::VectorXd ProjectToNullspace(const Eigen::VectorXd &v) const;
+
+        template<typename V, typename Dest>
+        void ProjectToNullspace(V &v, Dest &out) const {
+            Eigen::VectorXd Bv = B * v;
+            Eigen::VectorXd x = solver.solve(Bv);
+            out = v - B.transpose() * x;
+        }
+
+        // Applies the pseudoinverse B^T (B B^T)^{-1} to a vector of constraint values
+        template<typename V, typename Dest>
+        void ApplyBPinv(V &phi, Dest &out) const {
+            Eigen::VectorXd x = solver.solve(phi);
+            out = B.transpose() * x;
+        }
+
+        inline int NumAnalyses() const { return numAnalyses; }
+        inline int NumFactorizations() const { return numFactorizations; }
+        // Times of the most recent symbolic and numeric factorizations
+        inline double LastAnalyzeMs() const { return lastAnalyzeMs; }
+        inline double LastFactorizeMs() const { return lastFactorizeMs; }
+
+        private:
+        // One product term of B B^T: BBT.values[target] += B.values[left] * B.values[right]
+        struct ProductTerm {
+            int target;
+            int left;
+            int right;
+        };
+
+        Eigen::SparseMatrix<double> B;
+        // Only the lower triangle is stored, which is all the solver reads
+        Eigen::SparseMatrix<double> BBT;
+        Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>, Eigen::Lower> solver;
+        std::vector<ProductTerm> productPlan;
+
+        const ConstraintMatrix* source;
+        int sourcePattern;
+        int numAnalyses;
+        int numFactorizations;
+        double lastAnalyzeMs;
+        double lastFactorizeMs;
+
+        void analyze();
+        void factorize();
+    };
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "poly_curve_network.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace LWS {
+
+    // Everything needed to resume a flow run exactly where it stopped:
+    // the curve itself, its pins and constraints, and the solver's
+    // internal progress (constraint targets, length scaling, step size,
+    // L-BFGS history).
+    struct FlowCheckpoint {
+        Eigen::MatrixXd positions;
+        std::vector<std::array<size_t, 2>> edges;
+        std::vector<ConstraintType> appliedConstraints;
+        std::vector<int> pinnedVertices;
+        std::vector<int> pinnedTangents;
+        std::vector<int> pinnedToSurface;
+        bool pinnedAllToSurface;
+
+        Eigen::VectorXd constraintTargets;
+        double alpha;
+        double beta;
+        double targetLength;
+        double lengthScaleStep;
+        bool useEdgeLengthScale;
+        bool useTotalLengthScale;
+        double lastStepSize;
+        double mg_backproj_threshold;
+        int iterNum;
+        // State of the adaptive solve tolerance
+        double solveTolerance;
+        double solveToleranceFirstGradNorm;
+        double lastRelativeDecrease;
+
+        // L-BFGS pairs, oldest first, and the point they were last updated at
+        int lbfgsMaxPairs;
+        std::vector<Eigen::VectorXd> lbfgsSteps;
+        std::vector<Eigen::VectorXd> lbfgsGradientChanges;
+        Eigen::VectorXd lbfgsPrevPositions;
+        Eigen::VectorXd lbfgsPrevGradient;
+
+        // Progress of the driver loop around the solver
+        int currentStep;
+        int subdivideCount;
+        double initialAverageLength;
+    };
+
+    namespace Checkpoint {
+        // Copies the curve topology, positions and pins into the checkpoint.
+        void FillFromCurve(PolyCurveNetwork* curves, FlowCheckpoint &cp);
+        // Creates a new curve network with the checkpointed positions, edges and pins.
+        PolyCurveNetwork* CreateCurve(FlowCheckpoint &cp);
+
+        void Serialize(const FlowCheckpoint &cp, std::vector<char> &bytes);
+        bool Deserialize(const std::vector<char> &bytes, FlowCheckpoint &cp);
+
+        bool Write(const std::string &fname, const FlowCheckpoint &cp);
+        bool Read(const std::string &fname, FlowCheckpoint &cp);
+    }
+
+    // Writes checkpoints on a background thread, so that the flow never
+    // stalls on disk I/O. At most one checkpoint is queued; if the flow
+    // produces a newer one before the old one was written, the old one is dropped.
+    class CheckpointWriter {
+        public:
+        CheckpointWriter();
+        ~CheckpointWriter();
+
+        // Takes ownership of the checkpoint contents (the argument is left empty).
+        void Submit(const std::string &fname, FlowCheckpoint &cp);
+        // Blocks until all submitted checkpoints are on disk.
+        void Flush();
+
+        private:
+        void Run();
+
+        std::thread worker;
+        std::mutex mutex;
+        std::condition_variable cond;
+        bool hasPending;
+        bool writing;
+        bool stopping;
+        std::string pendingName;
+        FlowCheckpoint pending;
+    };
+}
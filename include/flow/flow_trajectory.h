@@ -0,0 +1,120 @@
+#pragma once
+
+#include "poly_curve_network.h"
+#include "mapped_file.h"
+
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+namespace LWS {
+
+    // Trajectory file (.rctraj): the curve topology is stored once (and again
+    // whenever it changes), and each frame stores positions quantized to a fixed
+    // tolerance. Most frames are deltas against the previous frame; keyframes
+    // with absolute values are written periodically and after topology changes.
+    // Integers are zigzag varint coded, with runs of zeros collapsed.
+    //
+    //   header:  char[8] magic "RCTRAJ01", uint32 version, uint32 keyframe interval,
+    //            float64 quantization step (twice the tolerance)
+    //   records: uint8 type, uint32 frame, uint64 payload size, payload,
+    //            uint64 FNV-1a checksum of the payload
+    //
+    // A run that is killed mid-write leaves a readable file up to the last
+    // complete record.
+    enum class TrajectoryRecord : uint8_t {
+        Topology = 1,  // varint vertex count, varint edge count, varint (prev, next) per edge
+        Keyframe = 2,  // 3 * nVerts quantized coordinates
+        Delta = 3      // 3 * nVerts differences from the previous frame
+    };
+
+    // Records flow frames on a background thread. AddFrame only copies the
+    // positions (and the edges, if they changed); quantization, compression
+    // and disk writes happen on the worker. The queue is bounded, so if the
+    // disk falls far behind, AddFrame replaces the newest queued frame rather
+    // than blocking the flow or using unbounded memory.
+    class TrajectoryWriter {
+        public:
+        TrajectoryWriter(const std::string &fname, double tolerance, int keyframeInterval = 100, size_t maxQueued = 16);
+        ~TrajectoryWriter();
+
+        inline bool IsOpen() const {
+            return open;
+        }
+
+        void AddFrame(PolyCurveNetwork* curves);
+        // Writes all queued frames and closes the file.
+        void Finish();
+
+        private:
+        struct Frame {
+            int index;
+            bool topologyChanged;
+            Eigen::MatrixXd positions;
+            std::vector<std::array<size_t, 2>> edges;
+        };
+
+        void Run();
+        void Encode(Frame &frame);
+        void fillEdges(PolyCurveNetwork* curves, Frame &frame);
+        void WriteRecord(TrajectoryRecord type, int frame, const std::vector<char> &payload);
+
+        std::ofstream out;
+        std::string filename;
+        bool open;
+        double quantum;
+        int keyframeInterval;
+        size_t maxQueued;
+
+        // Owned by the calling thread
+        int numFrames;
+        int numMerged;
+        bool warnedFull;
+        int lastTopologyID;
+
+        // Owned by the worker thread
+        std::vector<int64_t> previous;
+        int framesSinceKeyframe;
+        size_t bytesWritten;
+        size_t rawBytes;
+
+        std::thread worker;
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::deque<Frame> queue;
+        bool stopping;
+    };
+
+    class TrajectoryReader {
+        public:
+        bool Open(const std::string &fname);
+
+        // Decodes the next frame. Returns false at the end of the file, or at
+        // the first incomplete or corrupt record.
+        bool NextFrame(Eigen::MatrixXd &positions, std::vector<std::array<size_t, 2>> &edges);
+
+        inline int FrameIndex() const {
+            return frameIndex;
+        }
+
+        inline double Tolerance() const {
+            return quantum / 2;
+        }
+
+        private:
+        MappedFile file;
+        size_t offset;
+        double quantum;
+        int frameIndex;
+        size_t nVerts;
+        std::vector<std::array<size_t, 2>> currentEdges;
+        std::vector<int64_t> current;
+        bool haveKeyframe;
+    };
+
+    // Writes every frame of the trajectory to directory/curveNNNN.obj, matching
+    // the numbering of the per-iteration OBJ output. The directory must exist.
+    bool exportTrajectoryToOBJ(const std::string &trajName, const std::string &directory);
+}
@@ -9,6 +9,8 @@ namespace LWS {
 
     class PolyCurveNetwork;
     int NumRowsForConstraint(ConstraintType type, PolyCurveNetwork* curve);
+    void AddTripletsOfConstraint(ConstraintType type, PolyCurveNetwork* curve,
+        std::vector<Eigen::Triplet<double>> &triplets, int start);
     std::string NameOfConstraint(ConstraintType type);
 
     class VariableConstraintSet : public DomainConstraints<VariableConstraintSet> {
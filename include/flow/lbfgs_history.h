@@ -0,0 +1,78 @@
+#pragma once
+
+#include <Eigen/Core>
+#include <vector>
+
+namespace LWS {
+
+    // The last few (step, gradient change) pairs of an optimization, used to
+    // apply the L-BFGS inverse Hessian approximation
+    //
+    //   H_k = V_{k-1}^T H_{k-1} V_{k-1} + rho_{k-1} s_{k-1} s_{k-1}^T,
+    //   V = I - rho y s^T,  rho = 1 / (y . s),
+    //
+    // starting from an arbitrary initial inverse Hessian H0 (e.g. a Sobolev
+    // solve) by the two-loop recursion (Nocedal and Wright, algorithm 7.4).
+    class LBFGSHistory {
+        public:
+        explicit LBFGSHistory(int maxPairs = 8);
+
+        void Clear();
+        // Stores a step s = x_{k+1} - x_k and gradient change y = g_{k+1} - g_k,
+        // dropping the oldest pair if the history is full. Pairs without enough
+        // positive curvature would make H indefinite, so they are skipped; returns
+        // whether the pair was stored.
+        bool AddPair(const Eigen::VectorXd &s, const Eigen::VectorXd &y);
+
+        inline int NumPairs() const {
+            return numPairs;
+        }
+        inline int MaxPairs() const {
+            return (int)steps.size();
+        }
+        // The i-th oldest stored pair
+        inline const Eigen::VectorXd& Step(int i) const {
+            return steps[slot(i)];
+        }
+        inline const Eigen::VectorXd& GradientChange(int i) const {
+            return gradientChanges[slot(i)];
+        }
+        // The most recently stored pair
+        inline const Eigen::VectorXd& LastStep() const {
+            return steps[slot(numPairs - 1)];
+        }
+        inline const Eigen::VectorXd& LastGradientChange() const {
+            return gradientChanges[slot(numPairs - 1)];
+        }
+
+        // Computes out = H g, where applyH0(q, r) must set r = H0 q.
+        template<typename ApplyH0>
+        void Apply(const Eigen::VectorXd &g, Eigen::VectorXd &out, ApplyH0 applyH0) const {
+            Eigen::VectorXd q = g;
+            std::vector<double> alphas(numPairs);
+            for (int i = numPairs - 1; i >= 0; i--) {
+                int k = slot(i);
+                alphas[i] = rhos[k] * steps[k].dot(q);
+                q -= alphas[i] * gradientChanges[k];
+            }
+            applyH0(q, out);
+            for (int i = 0; i < numPairs; i++) {
+                int k = slot(i);
+                double beta = rhos[k] * gradientChanges[k].dot(out);
+                out += (alphas[i] - beta) * steps[k];
+            }
+        }
+
+        private:
+        // Storage index of the i-th oldest pair
+        inline int slot(int i) const {
+            return (first + i) % (int)steps.size();
+        }
+
+        std::vector<Eigen::VectorXd> steps;
+        std::vector<Eigen::VectorXd> gradientChanges;
+        std::vector<double> rhos;
+        int first;
+        int numPairs;
+    };
+}
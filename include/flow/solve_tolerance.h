@@ -0,0 +1,51 @@
+#pragma once
+
+namespace LWS {
+
+    // Chooses the relative tolerance of the Sobolev solves at every iteration,
+    // in the spirit of inexact Newton forcing terms: far from equilibrium the
+    // line search only needs a rough descent direction, so the solve can be
+    // loose, while near convergence a loose solve is what limits progress.
+    //
+    // The tolerance is the smallest of a maximum, a term that shrinks with the
+    // norm of the projected gradient (relative to the first one seen), and a
+    // term that shrinks with the relative energy decrease of the last accepted
+    // step. It never grows by more than a factor of 2 between iterations.
+    class SolveTolerance {
+        public:
+        SolveTolerance(double reference = 1e-2, double minTol = 1e-4, double maxTol = 1e-1);
+
+        // Forgets the gradient history, e.g. when the curve is replaced.
+        void Reset();
+        // Chooses the tolerance for the next iteration. relativeDecrease is
+        // (E_before - E_after) / E_before for the last accepted step, or a
+        // negative value if there was none.
+        double Update(double gradNorm, double relativeDecrease);
+
+        inline double Current() const {
+            return current;
+        }
+        inline double FirstGradientNorm() const {
+            return firstGradNorm;
+        }
+        // Restores the state returned by Current and FirstGradientNorm, e.g. from a checkpoint
+        void Restore(double current, double firstGradNorm);
+        // The fixed tolerance the controller replaces
+        inline double Reference() const {
+            return reference;
+        }
+
+        // Estimates how many Krylov iterations a solve that took the given number
+        // of iterations at the current tolerance would have needed at the
+        // reference tolerance, assuming linear convergence. Negative if the
+        // current tolerance is the tighter one.
+        double EstimateSaved(double iterations) const;
+
+        private:
+        double reference;
+        double minTol;
+        double maxTol;
+        double current;
+        double firstGradNorm;
+    };
+}
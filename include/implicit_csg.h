@@ -0,0 +1,197 @@
+#pragma once
+
+#include "implicit_surface.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace LWS {
+
+    // Blending rules shared by the runtime unions in implicit_surface.cpp and
+    // the compile-time ones below, so that both give identical results.
+    namespace CSG {
+        // Weight of the first surface in a smooth union, in [0, 1].
+        // These helpers avoid fmin/fmax, float conversions and short-circuiting
+        // tests, any of which stops GCC from vectorizing the batched loops.
+        inline double SmoothUnionWeight(double d1, double d2, double k) {
+            return std::min(std::max(0.5 + 0.5 * (d2 - d1) / k, 0.0), 1.0);
+        }
+
+        inline double UnionDistance(double d1, double d2) {
+            return (d2 < d1) ? d2 : d1;
+        }
+
+        inline double SmoothUnionDistance(double d1, double d2, double k) {
+            double h = SmoothUnionWeight(d1, d2, k);
+            return ((1 - h) * d2 + h * d1) - k * h * (1 - h);
+        }
+
+        // One component of the gradient of SmoothUnionDistance, given the
+        // same component of the gradients of d1 and d2
+        inline double SmoothUnionGradient(double d1, double d2, double k, double g1, double g2) {
+            double h = SmoothUnionWeight(d1, d2, k);
+            // We need derivative of a clamp, which is just 0 outside of (0, 1)
+            double dh = ((h > 0) & (h < 1)) ? (g2 - g1) / (2 * k) : 0;
+            return (-dh * d2 + (1 - h) * g2) + (dh * d1 + h * g1) - k * (dh - 2 * h * dh);
+        }
+
+        // Bounding sphere of two children, as used by both kinds of union
+        inline Vector3 PairCenter(ImplicitSurface &s1, ImplicitSurface &s2) {
+            Vector3 c1 = s1.BoundingCenter();
+            Vector3 c2 = s2.BoundingCenter();
+            Vector3 mins{fmin(c1.x, c2.x), fmin(c1.y, c2.y), fmin(c1.z, c2.z)};
+            Vector3 maxs{fmax(c1.x, c2.x), fmax(c1.y, c2.y), fmax(c1.z, c2.z)};
+            return (mins + maxs) / 2;
+        }
+
+        inline double PairDiameter(ImplicitSurface &s1, ImplicitSurface &s2) {
+            Vector3 center = PairCenter(s1, s2);
+            double maxRadius = 0;
+            ImplicitSurface* surfaces[2] = {&s1, &s2};
+            for (int i = 0; i < 2; i++) {
+                Vector3 disp = center - surfaces[i]->BoundingCenter();
+                double l1dist = fmax(fabs(disp.x), fmax(fabs(disp.y), fabs(disp.z)));
+                maxRadius = fmax(maxRadius, l1dist + surfaces[i]->BoundingDiameter() / 2);
+            }
+            return maxRadius * 2;
+        }
+    }
+
+    // Unions whose children are known at compile time. The children are held by
+    // value and called non-virtually, so a tree like
+    //
+    //   StaticSmoothUnion<ImplicitTorus, ImplicitSphere>
+    //
+    // evaluates a batch with no dynamic dispatch below the root. They still derive
+    // from ImplicitSurface, so they can be used anywhere a runtime tree can. Scene
+    // files that union two spheres or tori get one of these (see scene_file.cpp).
+    template<typename A, typename B>
+    class StaticUnion : public ImplicitSurface {
+        public:
+        StaticUnion(const A &a, const B &b) : first(a), second(b) {}
+
+        virtual double SignedDistance(Vector3 point) {
+            return CSG::UnionDistance(first.A::SignedDistance(point), second.B::SignedDistance(point));
+        }
+
+        virtual Vector3 GradientOfDistance(Vector3 point) {
+            // Ties go to the first child, as in ImplicitUnion
+            if (second.B::SignedDistance(point) < first.A::SignedDistance(point)) {
+                return second.B::GradientOfDistance(point);
+            }
+            return first.A::GradientOfDistance(point);
+        }
+
+        virtual double BoundingDiameter() { return CSG::PairDiameter(first, second); }
+        virtual Vector3 BoundingCenter() { return CSG::PairCenter(first, second); }
+
+        virtual void SignedDistances(const double* x, const double* y, const double* z, size_t n, double* out) {
+            double d2[implicitBatchSize];
+            for (size_t start = 0; start < n; start += implicitBatchSize) {
+                size_t count = std::min(implicitBatchSize, n - start);
+                first.A::SignedDistances(x + start, y + start, z + start, count, out + start);
+                second.B::SignedDistances(x + start, y + start, z + start, count, d2);
+                #pragma omp simd
+                for (size_t i = 0; i < count; i++) {
+                    out[start + i] = CSG::UnionDistance(out[start + i], d2[i]);
+                }
+            }
+        }
+
+        virtual void GradientsOfDistance(const double* x, const double* y, const double* z, size_t n,
+        double* gx, double* gy, double* gz) {
+            double d1[implicitBatchSize], d2[implicitBatchSize];
+            double hx[implicitBatchSize], hy[implicitBatchSize], hz[implicitBatchSize];
+            for (size_t start = 0; start < n; start += implicitBatchSize) {
+                size_t count = std::min(implicitBatchSize, n - start);
+                const double *px = x + start, *py = y + start, *pz = z + start;
+                first.A::SignedDistances(px, py, pz, count, d1);
+                second.B::SignedDistances(px, py, pz, count, d2);
+                first.A::GradientsOfDistance(px, py, pz, count, gx + start, gy + start, gz + start);
+                second.B::GradientsOfDistance(px, py, pz, count, hx, hy, hz);
+                #pragma omp simd
+                for (size_t i = 0; i < count; i++) {
+                    bool useSecond = d2[i] < d1[i];
+                    gx[start + i] = useSecond ? hx[i] : gx[start + i];
+                    gy[start + i] = useSecond ? hy[i] : gy[start + i];
+                    gz[start + i] = useSecond ? hz[i] : gz[start + i];
+                }
+            }
+        }
+
+        A first;
+        B second;
+    };
+
+    template<typename A, typename B>
+    class StaticSmoothUnion : public ImplicitSurface {
+        public:
+        StaticSmoothUnion(const A &a, const B &b, double blendFactor) : first(a), second(b), k(blendFactor) {}
+
+        virtual double SignedDistance(Vector3 point) {
+            return CSG::SmoothUnionDistance(first.A::SignedDistance(point), second.B::SignedDistance(point), k);
+        }
+
+        virtual Vector3 GradientOfDistance(Vector3 point) {
+            double d1 = first.A::SignedDistance(point);
+            double d2 = second.B::SignedDistance(point);
+            Vector3 g1 = first.A::GradientOfDistance(point);
+            Vector3 g2 = second.B::GradientOfDistance(point);
+            return Vector3{CSG::SmoothUnionGradient(d1, d2, k, g1.x, g2.x),
+                           CSG::SmoothUnionGradient(d1, d2, k, g1.y, g2.y),
+                           CSG::SmoothUnionGradient(d1, d2, k, g1.z, g2.z)};
+        }
+
+        virtual double BoundingDiameter() { return CSG::PairDiameter(first, second); }
+        virtual Vector3 BoundingCenter() { return CSG::PairCenter(first, second); }
+
+        virtual void SignedDistances(const double* x, const double* y, const double* z, size_t n, double* out) {
+            const double blend = k;
+            double d2[implicitBatchSize];
+            for (size_t start = 0; start < n; start += implicitBatchSize) {
+                size_t count = std::min(implicitBatchSize, n - start);
+                first.A::SignedDistances(x + start, y + start, z + start, count, out + start);
+                second.B::SignedDistances(x + start, y + start, z + start, count, d2);
+                #pragma omp simd
+                for (size_t i = 0; i < count; i++) {
+                    out[start + i] = CSG::SmoothUnionDistance(out[start + i], d2[i], blend);
+                }
+            }
+        }
+
+        virtual void GradientsOfDistance(const double* x, const double* y, const double* z, size_t n,
+        double* gx, double* gy, double* gz) {
+            const double blend = k;
+            double d1[implicitBatchSize], d2[implicitBatchSize];
+            double hx[implicitBatchSize], hy[implicitBatchSize], hz[implicitBatchSize];
+            for (size_t start = 0; start < n; start += implicitBatchSize) {
+                size_t count = std::min(implicitBatchSize, n - start);
+                const double *px = x + start, *py = y + start, *pz = z + start;
+                first.A::SignedDistances(px, py, pz, count, d1);
+                second.B::SignedDistances(px, py, pz, count, d2);
+                first.A::GradientsOfDistance(px, py, pz, count, gx + start, gy + start, gz + start);
+                second.B::GradientsOfDistance(px, py, pz, count, hx, hy, hz);
+                #pragma omp simd
+                for (size_t i = 0; i < count; i++) {
+                    gx[start + i] = CSG::SmoothUnionGradient(d1[i], d2[i], blend, gx[start + i], hx[i]);
+                    gy[start + i] = CSG::SmoothUnionGradient(d1[i], d2[i], blend, gy[start + i], hy[i]);
+                    gz[start + i] = CSG::SmoothUnionGradient(d1[i], d2[i], blend, gz[start + i], hz[i]);
+                }
+            }
+        }
+
+        A first;
+        B second;
+        double k;
+    };
+
+    template<typename A, typename B>
+    StaticUnion<A, B> MakeUnion(const A &a, const B &b) {
+        return StaticUnion<A, B>(a, b);
+    }
+
+    template<typename A, typename B>
+    StaticSmoothUnion<A, B> MakeSmoothUnion(const A &a, const B &b, double blendFactor) {
+        return StaticSmoothUnion<A, B>(a, b, blendFactor);
+    }
+}
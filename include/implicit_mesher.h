@@ -0,0 +1,42 @@
+#pragma once
+
+#include "implicit_surface.h"
+
+#include <array>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace LWS {
+
+    // Extracts the zero set of an implicit surface with marching cubes, over a
+    // cubic grid covering the surface's bounding box. The grid is cut into slabs
+    // of cells along z; each slab is sampled with the batched surface queries and
+    // triangulated by its own CIsoSurface, and slabs run in parallel. Vertices on
+    // the plane shared by two slabs are welded, so the result is the same mesh a
+    // single pass would give. Only one wave of slab fields (one per thread) is
+    // held at a time, so memory grows with the output rather than the grid.
+    class ImplicitMesher {
+        public:
+        // resolution is the number of cells across the bounding diameter
+        ImplicitMesher(int resolution, int slabCells = 16);
+
+        void Extract(ImplicitSurface* surface, std::vector<Vector3> &vertices,
+            std::vector<std::array<size_t, 3>> &triangles);
+
+        private:
+        struct Slab {
+            std::vector<Vector3> vertices;
+            std::vector<std::array<size_t, 3>> triangles;
+            // Which vertices lie on the bottom and top planes of the slab, and
+            // their (x, y) positions there, used to weld neighboring slabs
+            std::vector<std::pair<uint64_t, size_t>> bottom;
+            std::vector<std::pair<uint64_t, size_t>> top;
+        };
+
+        void extractSlab(ImplicitSurface* surface, Vector3 lowerCorner, double cellSize, int zStart, int zCells, Slab &slab);
+
+        int resolution;
+        int slabCells;
+    };
+}
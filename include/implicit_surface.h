@@ -6,6 +6,10 @@ namespace LWS {
 
     using namespace geometrycentral;
 
+    // Batched evaluations work through their points in chunks of this size, so
+    // that composite surfaces can keep their temporaries on the stack.
+    const size_t implicitBatchSize = 256;
+
     class ImplicitSurface {
         public:
         virtual ~ImplicitSurface();
@@ -13,6 +17,14 @@ namespace LWS {
         virtual Vector3 GradientOfDistance(Vector3 point) = 0;
         virtual double BoundingDiameter() = 0;
         virtual Vector3 BoundingCenter() = 0;
+
+        // Batched versions of the above, over n points given as separate coordinate
+        // arrays. The defaults loop over the single-point versions; the surfaces
+        // below override them with vectorized loops, so a whole batch costs one
+        // virtual call per surface.
+        virtual void SignedDistances(const double* x, const double* y, const double* z, size_t n, double* out);
+        virtual void GradientsOfDistance(const double* x, const double* y, const double* z, size_t n,
+            double* gx, double* gy, double* gz);
     };
 
     class ImplicitSphere : public ImplicitSurface {
@@ -22,6 +34,9 @@ namespace LWS {
         virtual Vector3 GradientOfDistance(Vector3 point);
         virtual double BoundingDiameter();
         virtual Vector3 BoundingCenter();
+        virtual void SignedDistances(const double* x, const double* y, const double* z, size_t n, double* out);
+        virtual void GradientsOfDistance(const double* x, const double* y, const double* z, size_t n,
+            double* gx, double* gy, double* gz);
 
         private:
         double radius;
@@ -35,6 +50,9 @@ namespace LWS {
         virtual Vector3 GradientOfDistance(Vector3 point);
         virtual double BoundingDiameter();
         virtual Vector3 BoundingCenter();
+        virtual void SignedDistances(const double* x, const double* y, const double* z, size_t n, double* out);
+        virtual void GradientsOfDistance(const double* x, const double* y, const double* z, size_t n,
+            double* gx, double* gy, double* gz);
 
         private:
         double majorRadius;
@@ -49,6 +67,9 @@ namespace LWS {
         virtual Vector3 GradientOfDistance(Vector3 point);
         virtual double BoundingDiameter();
         virtual Vector3 BoundingCenter();
+        virtual void SignedDistances(const double* x, const double* y, const double* z, size_t n, double* out);
+        virtual void GradientsOfDistance(const double* x, const double* y, const double* z, size_t n,
+            double* gx, double* gy, double* gz);
     };
 
     class ImplicitDoubleTorus : public ImplicitSurface {
@@ -58,6 +79,9 @@ namespace LWS {
         virtual Vector3 GradientOfDistance(Vector3 point);
         virtual double BoundingDiameter();
         virtual Vector3 BoundingCenter();
+        virtual void SignedDistances(const double* x, const double* y, const double* z, size_t n, double* out);
+        virtual void GradientsOfDistance(const double* x, const double* y, const double* z, size_t n,
+            double* gx, double* gy, double* gz);
 
         private:
         double radius2;
@@ -70,6 +94,9 @@ namespace LWS {
         virtual Vector3 GradientOfDistance(Vector3 point);
         virtual double BoundingDiameter();
         virtual Vector3 BoundingCenter();
+        virtual void SignedDistances(const double* x, const double* y, const double* z, size_t n, double* out);
+        virtual void GradientsOfDistance(const double* x, const double* y, const double* z, size_t n,
+            double* gx, double* gy, double* gz);
 
         private:
         std::vector<ImplicitSurface*> surfaces;
@@ -82,6 +109,9 @@ namespace LWS {
         virtual Vector3 GradientOfDistance(Vector3 point);
         virtual double BoundingDiameter();
         virtual Vector3 BoundingCenter();
+        virtual void SignedDistances(const double* x, const double* y, const double* z, size_t n, double* out);
+        virtual void GradientsOfDistance(const double* x, const double* y, const double* z, size_t n,
+            double* gx, double* gy, double* gz);
         
         private:
         ImplicitSurface* surface1;
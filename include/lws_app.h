@@ -15,6 +15,7 @@
 #include "poly_curve_network.h"
 
 #include "scene_file.h"
+#include "flow/flow_trajectory.h"
 
 namespace LWS {
     class LWSApp {
@@ -33,8 +34,14 @@ namespace LWS {
         void AddPlaneObstacle(Vector3 center, Vector3 normal, double p, double weight);
         void AddSphereObstacle(Vector3 center, double radius);
         void SubdivideCurve();
-        void MeshImplicitSurface(ImplicitSurface* surface);
+        void RemeshCurve();
+        void MeshImplicitSurface(ImplicitSurface* surface, int resolution);
         void WriteImplicitSurface();
+        void EnableCheckpoints(std::string filename, int interval);
+        void ResumeFromCheckpoint(std::string filename);
+        void FlushCheckpoints();
+        void RecordTrajectory(std::string filename, double tolerance, int keyframeInterval);
+        void FinishTrajectory();
 
         void DisplayWireSphere(Vector3 center, double radius, std::string name);
         void DisplayPlane(Vector3 center, Vector3 normal, std::string name);
@@ -51,6 +58,7 @@ namespace LWS {
         void outputOBJFrame();
         void writeCurves( PolyCurveNetwork* network, const std::string& positionFilename, const std::string& tangentFilename );
         void benchmarkMethods();
+        void writeCheckpoint();
         
         SceneData sceneData;
         std::unique_ptr<surface::HalfedgeMesh> mesh;
@@ -66,6 +74,10 @@ namespace LWS {
         int screenshotNum;
         bool writeOBJs;
         int objNum;
+        std::string checkpointFile;
+        int checkpointInterval;
+        CheckpointWriter* checkpointWriter;
+        TrajectoryWriter* trajectoryWriter;
 
     };
 }
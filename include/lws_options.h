@@ -3,6 +3,15 @@
 #include "geometrycentral/surface/vertex_position_geometry.h"
 
 namespace LWS {
+    // How multigrid solves the Sobolev systems; see multigrid/krylov_solvers.h
+    enum class MultigridSolverType {
+        VCycleCG,           // V-cycles smoothed with conjugate gradients
+        VCycleChebyshev,    // V-cycles smoothed with Chebyshev polynomials
+        VCycleJacobi,       // V-cycles smoothed with damped block Jacobi
+        FGMRESVCycle,       // flexible GMRES, preconditioned with a V-cycle
+        FGMRESJacobi        // flexible GMRES, preconditioned with block Jacobi
+    };
+
     class LWSOptions {
         public:
         static bool outputFrames;
@@ -12,10 +21,20 @@ namespace LWS {
         static bool runTPE;
         static bool useSobolev;
         static bool useMultigrid;
+        static bool useLBFGS;
+        static bool useCircleSearch;
+        // Split and collapse edges towards a target length during the flow,
+        // instead of subdividing the whole curve
+        static bool adaptiveRemesh;
         static bool useBarnesHut;
         static bool normalizeView;
 
         static double tpeAlpha;
         static double tpeBeta;
+        // Separation coefficient for block cluster trees built by the solver
+        static double bctSeparation;
+        // Number of step sizes the line search evaluates at once, one per thread
+        static int lineSearchCandidates;
+        static MultigridSolverType multigridSolver;
     };
 }
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace LWS {
+
+    // Read-only view of a whole file. Uses mmap where available, and
+    // falls back to reading the file into memory otherwise.
+    class MappedFile {
+        public:
+        MappedFile();
+        ~MappedFile();
+
+        bool Open(const std::string &fname);
+        void Close();
+
+        inline const char* Data() const {
+            return data;
+        }
+
+        inline size_t Size() const {
+            return size;
+        }
+
+        inline bool IsOpen() const {
+            return open;
+        }
+
+        private:
+        MappedFile(const MappedFile&);
+        MappedFile& operator=(const MappedFile&);
+
+        const char* data;
+        size_t size;
+        bool open;
+        bool mapped;
+        std::vector<char> buffer;
+    };
+}
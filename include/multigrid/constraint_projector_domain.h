@@ -5,6 +5,13 @@
 #include "libgmultigrid/matrix_free.h"
 #include "product/dense_matrix.h"
 #include "constraint_projector_operator.h"
+#include "krylov_solvers.h"
+
+#include <algorithm>
+#include <cmath>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 namespace LWS {
 
@@ -20,8 +27,34 @@ namespace LWS {
         double epsilon;
         Constraint constraint;
         bool isTopLevel;
-
-        ConstraintProjectorDomain<Constraint>(PolyCurveNetwork* c, double a, double b, double sep, double diagEps = 0)
+        MonotonicArena* arena;
+        // Coarsen with PolyCurveNetwork::CoarsenLegacy, to compare against
+        bool legacyCoarsening;
+
+        // The curves of the levels below this one, each with the prolongation to it
+        // from the level above, planned by NumLevelsForCache before the hierarchy
+        // is built. Coarsen hands them out one level at a time.
+        mutable std::vector<PolyCurveNetwork*> plannedCurves;
+        mutable std::vector<MatrixProjectorOperator*> plannedOps;
+        mutable bool levelsPlanned;
+
+        // The next coarser level and the prolongation from it, both owned by the
+        // hierarchy, or 0 on the coarsest level; set by Coarsen
+        mutable const ConstraintProjectorDomain<Constraint>* coarser;
+        mutable MatrixProjectorOperator* prolongation;
+        // For BlockJacobiVCycle; both are computed on first use
+        mutable Eigen::VectorXd invDiag3;
+        mutable double jacobiDamping;
+
+        // The coarsest level is solved directly, and its matrix doesn't change
+        // while the hierarchy exists, so it is only factored once
+        mutable Eigen::PartialPivLU<Eigen::MatrixXd> coarseLU;
+        mutable bool coarseFactored;
+
+        // If an arena is given, every level's trees are allocated from it, and
+        // the hierarchy has to be deleted before the arena is reset
+        ConstraintProjectorDomain<Constraint>(PolyCurveNetwork* c, double a, double b, double sep, double diagEps = 0,
+            MonotonicArena* levelArena = 0)
         : constraint(c) {
             curves = c;
             alpha = a;
@@ -29,33 +62,82 @@ namespace LWS {
             sepCoeff = sep;
             nVerts = curves->NumVertices();
             epsilon = diagEps;
+            arena = levelArena;
 
-            bvh = CreateEdgeBVHFromCurve(curves);
-            tree = new BlockClusterTree(curves, bvh, sepCoeff, alpha, beta, epsilon);
+            bvh = CreateEdgeBVHFromCurve(curves, arena);
+            tree = new BlockClusterTree(curves, bvh, sepCoeff, alpha, beta, epsilon, arena);
             tree->SetBlockTreeMode(BlockTreeMode::Matrix3AndProjector);
 
-            curves->AddConstraintProjector(constraint);
+            // Reuses the curve's constraint matrix and factorization from earlier iterations
+            curves->UpdateConstraintProjector();
             // std::cout << "Made level with " << nVerts << std::endl;
             isTopLevel = true;
+            legacyCoarsening = false;
+            levelsPlanned = false;
+            coarser = 0;
+            prolongation = 0;
+            jacobiDamping = 0;
+            coarseFactored = false;
         }
 
         virtual ~ConstraintProjectorDomain<Constraint>() {
             if (!isTopLevel) {
                 delete curves;
             }
+            // Levels that were planned but never built
+            for (PolyCurveNetwork* c : plannedCurves) delete c;
+            for (MatrixProjectorOperator* op : plannedOps) delete op;
             delete tree;
             delete bvh;
         }
 
         virtual MultigridDomain<BlockClusterTree, MatrixProjectorOperator>* Coarsen(MatrixProjectorOperator* prolongOp) const {
-            PolyCurveNetwork* coarsened = curves->Coarsen(prolongOp);
-            ConstraintProjectorDomain<Constraint>* coarseDomain = new ConstraintProjectorDomain<Constraint>(coarsened, alpha, beta, sepCoeff, epsilon);
+            if (!levelsPlanned) NumLevelsForCache();
+            if (plannedCurves.empty()) {
+                std::cerr << "Asked to coarsen below the " << nVerts << "-vertex level, which is the coarsest" << std::endl;
+                throw 1;
+            }
+            PolyCurveNetwork* coarsened = plannedCurves.front();
+            MatrixProjectorOperator* planned = plannedOps.front();
+            prolongOp->matrices = planned->matrices;
+            prolongOp->edgeMatrices = planned->edgeMatrices;
+            prolongOp->lowerSize = planned->lowerSize;
+            prolongOp->upperSize = planned->upperSize;
+            delete planned;
+
+            ConstraintProjectorDomain<Constraint>* coarseDomain = new ConstraintProjectorDomain<Constraint>(coarsened, alpha, beta, sepCoeff, epsilon, arena);
+            coarseDomain->legacyCoarsening = legacyCoarsening;
+            // The rest of the plan belongs to the next level
+            coarseDomain->plannedCurves.assign(plannedCurves.begin() + 1, plannedCurves.end());
+            coarseDomain->plannedOps.assign(plannedOps.begin() + 1, plannedOps.end());
+            coarseDomain->levelsPlanned = true;
+            plannedCurves.clear();
+            plannedOps.clear();
             prolongOp->lowerP = coarseDomain->GetConstraintProjector();
             prolongOp->upperP = GetConstraintProjector();
             coarseDomain->isTopLevel = false;
+            coarser = coarseDomain;
+            prolongation = prolongOp;
             return coarseDomain;
         }
 
+        // Inverse of every vertex's 3x3 diagonal block (a multiple of the
+        // identity), repeated three times
+        const Eigen::VectorXd& InverseDiagonal3() const {
+            if (invDiag3.rows() == NumRows()) return invDiag3;
+            Eigen::VectorXd diag;
+            tree->FillDiagonal(diag);
+            invDiag3.resize(NumRows());
+            for (int i = 0; i < nVerts; i++) {
+                if (!(diag(i) > 0) || !std::isfinite(diag(i))) {
+                    std::cerr << "Diagonal block " << i << " of the " << nVerts << "-vertex level is " << diag(i) << std::endl;
+                    throw 1;
+                }
+                invDiag3.segment<3>(3 * i).setConstant(1.0 / diag(i));
+            }
+            return invDiag3;
+        }
+
         virtual BlockClusterTree* GetMultiplier() const {
             return tree;
         }
@@ -74,11 +156,71 @@ namespace LWS {
             b_aug.block(0, 0, b.rows(), 1) = b;
             b_aug.block(b.rows(), 0, constraintRows, 1).setZero();
 
-            Eigen::MatrixXd A = GetFullMatrix();
-            b_aug = A.partialPivLu().solve(b_aug);
+            if (!coarseFactored) {
+                coarseLU.compute(GetFullMatrix());
+                coarseFactored = true;
+            }
+            b_aug = coarseLU.solve(b_aug);
             return b_aug.block(0, 0, b.rows(), 1);
         }
 
+        // Number of levels to build below (and including) this one, so that
+        // the dense saddle matrix of the coarsest level fits in cache. The
+        // levels are coarsened here, so the depth follows the vertex counts
+        // coarsening actually reaches; it stops early once no vertex can be removed.
+        int NumLevelsForCache() const {
+            if (!levelsPlanned) {
+                double maxVerts = MaxCoarseVertices();
+                PolyCurveNetwork* level = curves;
+                while (level->NumVertices() > maxVerts) {
+                    MatrixProjectorOperator* op = new MatrixProjectorOperator();
+                    PolyCurveNetwork* next = legacyCoarsening ? level->CoarsenLegacy(op) : level->Coarsen(op);
+                    if (!next) {
+                        delete op;
+                        break;
+                    }
+                    plannedCurves.push_back(next);
+                    plannedOps.push_back(op);
+                    level = next;
+                }
+                levelsPlanned = true;
+            }
+            return 1 + plannedCurves.size();
+        }
+
+        // Largest vertex count whose saddle matrix, with 3n + rows(n) rows, fits
+        // in cache. Edge length rows (and surface rows, when every vertex is on
+        // the surface) shrink with the curve, at the rate they have on this level;
+        // the rest (barycenter, total length, pins) stay the same on every level.
+        double MaxCoarseVertices() const {
+            double maxRows = sqrt(CoarseSolveCacheBytes() / sizeof(double));
+            double scaledRows = 0, fixedRows = 0;
+            for (ConstraintType type : curves->appliedConstraints) {
+                double rows = NumRowsForConstraint(type, curves);
+                bool scales = (type == ConstraintType::EdgeLengths) ||
+                    (type == ConstraintType::Surface && curves->pinnedAllToSurface);
+                if (scales) scaledRows += rows;
+                else fixedRows += rows;
+            }
+            double rowsPerVertex = 3 + scaledRows / std::max(nVerts, 1);
+            return std::max(8.0, (maxRows - fixedRows) / rowsPerVertex);
+        }
+
+        // Vertex count of the coarsest level that NumLevelsForCache planned
+        int CoarsestVertices() const {
+            NumLevelsForCache();
+            return plannedCurves.empty() ? nVerts : plannedCurves.back()->NumVertices();
+        }
+
+        static size_t CoarseSolveCacheBytes() {
+            long bytes = 0;
+#if !defined(_WIN32) && defined(_SC_LEVEL2_CACHE_SIZE)
+            bytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+            // Not every platform reports its cache sizes
+            return (bytes > 0) ? bytes : (1 << 20);
+        }
+
         virtual int NumVertices() const {
             return nVerts;
         }
@@ -91,7 +233,7 @@ namespace LWS {
             return new MatrixProjectorOperator();
         }
 
-        NullSpaceProjector* GetConstraintProjector() const {
+        ConstraintProjector* GetConstraintProjector() const {
             return curves->constraintProjector;
         }
     };
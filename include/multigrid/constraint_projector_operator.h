@@ -1,6 +1,7 @@
 #pragma once
 
 #include "libgmultigrid/multigrid_operator.h"
+#include "flow/constraint_projector.h"
 
 namespace LWS {
 
@@ -15,8 +16,8 @@ namespace LWS {
 
         int lowerSize;
         int upperSize;
-        NullSpaceProjector* lowerP;
-        NullSpaceProjector* upperP;
+        ConstraintProjector* lowerP;
+        ConstraintProjector* upperP;
         
         std::vector<IndexedMatrix> matrices;
         std::vector<IndexedMatrix> edgeMatrices;
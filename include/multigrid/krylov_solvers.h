@@ -0,0 +1,443 @@
+#pragma once
+
+#include "libgmultigrid/matrix_free.h"
+#include "libgmultigrid/multigrid_hierarchy.h"
+#include "product/block_cluster_tree.h"
+#include "lws_options.h"
+
+#include <Eigen/Core>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace LWS {
+
+    // Chebyshev polynomial smoother, with the same interface as Eigen's iterative
+    // solvers so that it can be passed to MultigridHierarchy::VCycleSolve in place
+    // of EigenCG. Unlike CG it needs no inner products, only matrix-vector products,
+    // and it damps the upper part of the spectrum, [lambdaMax / 30, lambdaMax],
+    // where lambdaMax is estimated with a few power iterations in compute().
+    template<typename MatrixType>
+    class ChebyshevSmoother {
+        public:
+        ChebyshevSmoother() {
+            matrix = 0;
+            maxIters = -1;
+            tol = 0;
+            iters = 0;
+            err = 0;
+            lambdaMax = 0;
+        }
+
+        ChebyshevSmoother& compute(const MatrixType &A) {
+            matrix = &A;
+            // Power iteration from a fixed start, so that results are repeatable
+            Eigen::VectorXd v = Eigen::VectorXd::LinSpaced(A.rows(), 1, 2);
+            v.normalize();
+            double lambda = 0;
+            for (int i = 0; i < 6; i++) {
+                Eigen::VectorXd Av = A * v;
+                lambda = v.dot(Av);
+                double n = Av.norm();
+                if (!(n > 0)) break;
+                v = Av / n;
+            }
+            // Power iteration approaches the largest eigenvalue from below
+            lambdaMax = 1.1 * lambda;
+            return *this;
+        }
+
+        void setMaxIterations(int n) {
+            maxIters = n;
+        }
+        void setTolerance(double t) {
+            tol = t;
+        }
+        int maxIterations() const {
+            return (maxIters > 0) ? maxIters : 4;
+        }
+        double tolerance() const {
+            return tol;
+        }
+        int iterations() const {
+            return iters;
+        }
+        double error() const {
+            return err;
+        }
+        Eigen::ComputationInfo info() const {
+            return (matrix && lambdaMax > 0) ? Eigen::Success : Eigen::NumericalIssue;
+        }
+
+        template<typename Rhs>
+        Eigen::VectorXd solve(const Rhs &b) const {
+            Eigen::VectorXd x0 = Eigen::VectorXd::Zero(b.rows());
+            return solveWithGuess(b, x0);
+        }
+
+        template<typename Rhs, typename Guess>
+        Eigen::VectorXd solveWithGuess(const Rhs &b, const Guess &guess) const {
+            // Saad, Iterative Methods for Sparse Linear Systems, algorithm 12.1
+            Eigen::VectorXd x = guess;
+            iters = 0;
+            err = 0;
+            if (!matrix || !(lambdaMax > 0)) return x;
+
+            double lambdaMin = lambdaMax / 30;
+            double theta = (lambdaMax + lambdaMin) / 2;
+            double delta = (lambdaMax - lambdaMin) / 2;
+            double sigma = theta / delta;
+            double rho = 1 / sigma;
+
+            double bNorm = b.norm();
+            Eigen::VectorXd r = b - (*matrix) * x;
+            Eigen::VectorXd d = r / theta;
+            for (int k = 0; k < maxIterations(); k++) {
+                x += d;
+                r -= (*matrix) * d;
+                iters++;
+                err = (bNorm > 0) ? r.norm() / bNorm : 0;
+                if (err <= tol) break;
+                double rhoNext = 1 / (2 * sigma - rho);
+                d = (rhoNext * rho) * d + (2 * rhoNext / delta) * r;
+                rho = rhoNext;
+            }
+            return x;
+        }
+
+        private:
+        const MatrixType* matrix;
+        int maxIters;
+        double tol;
+        mutable int iters;
+        mutable double err;
+        double lambdaMax;
+    };
+
+    // Damped block-Jacobi smoother, x += omega P D^-1 (b - A x), where D holds
+    // a level's 3x3 diagonal blocks and P projects onto its constraint nullspace.
+    // It has the same interface as ChebyshevSmoother, except that compute() also
+    // takes the level's inverse diagonal (each block's inverse repeated three
+    // times) and projector, which the matrix-free operator can't provide; so it
+    // is driven by BlockJacobiVCycle below rather than by VCycleSolve. omega is
+    // 4 / (3 lambdaMax), with lambdaMax the largest eigenvalue of P D^-1 A from
+    // a few power iterations, unless a damping from an earlier compute() is given.
+    template<typename MatrixType>
+    class BlockJacobiSmoother {
+        public:
+        BlockJacobiSmoother() {
+            matrix = 0;
+            projector = 0;
+            maxIters = -1;
+            tol = 0;
+            iters = 0;
+            err = 0;
+            omega = 0;
+        }
+
+        BlockJacobiSmoother& compute(const MatrixType &A, const Eigen::VectorXd &invDiagonal3,
+        ConstraintProjector* levelProjector, double damping = 0) {
+            if (invDiagonal3.rows() != A.rows() || !levelProjector) {
+                std::cerr << "Block-Jacobi smoother needs the diagonal and projector of its "
+                    << A.rows() << "-row level" << std::endl;
+                throw 1;
+            }
+            matrix = &A;
+            invDiag3 = invDiagonal3;
+            projector = levelProjector;
+            omega = damping;
+            if (omega > 0) return *this;
+
+            Eigen::VectorXd v = Eigen::VectorXd::LinSpaced(A.rows(), 1, 2);
+            v.normalize();
+            double lambda = 0;
+            for (int i = 0; i < 6; i++) {
+                Eigen::VectorXd Av = A * v;
+                Eigen::VectorXd Mv = precondition(Av);
+                lambda = v.dot(Mv);
+                double n = Mv.norm();
+                if (!(n > 0)) break;
+                v = Mv / n;
+            }
+            omega = (lambda > 0) ? 4 / (3 * 1.1 * lambda) : 0;
+            return *this;
+        }
+
+        void setMaxIterations(int n) {
+            maxIters = n;
+        }
+        void setTolerance(double t) {
+            tol = t;
+        }
+        int maxIterations() const {
+            return (maxIters > 0) ? maxIters : 4;
+        }
+        double tolerance() const {
+            return tol;
+        }
+        int iterations() const {
+            return iters;
+        }
+        double error() const {
+            return err;
+        }
+        double damping() const {
+            return omega;
+        }
+        Eigen::ComputationInfo info() const {
+            return (matrix && omega > 0) ? Eigen::Success : Eigen::NumericalIssue;
+        }
+
+        template<typename Rhs>
+        Eigen::VectorXd solve(const Rhs &b) const {
+            Eigen::VectorXd x0 = Eigen::VectorXd::Zero(b.rows());
+            return solveWithGuess(b, x0);
+        }
+
+        template<typename Rhs, typename Guess>
+        Eigen::VectorXd solveWithGuess(const Rhs &b, const Guess &guess) const {
+            Eigen::VectorXd x = guess;
+            iters = 0;
+            err = 0;
+            if (!matrix || !(omega > 0)) return x;
+
+            double bNorm = b.norm();
+            Eigen::VectorXd r = b - (*matrix) * x;
+            for (int k = 0; k < maxIterations(); k++) {
+                Eigen::VectorXd d = omega * precondition(r);
+                x += d;
+                r -= (*matrix) * d;
+                iters++;
+                err = (bNorm > 0) ? r.norm() / bNorm : 0;
+                if (err <= tol) break;
+            }
+            return x;
+        }
+
+        private:
+        Eigen::VectorXd precondition(const Eigen::VectorXd &r) const {
+            Eigen::VectorXd scaled = invDiag3.cwiseProduct(r);
+            return projector->ProjectToNullspace(scaled);
+        }
+
+        const MatrixType* matrix;
+        ConstraintProjector* projector;
+        Eigen::VectorXd invDiag3;
+        int maxIters;
+        double tol;
+        mutable int iters;
+        mutable double err;
+        double omega;
+    };
+
+    // One V-cycle from the given level down: block-Jacobi smoothing before and
+    // after the correction from the next coarser level, and a direct solve on
+    // the coarsest. Each level supplies its own operator, diagonal and projector.
+    template<typename Domain>
+    Eigen::VectorXd BlockJacobiVCycle(const Domain* level, const Eigen::VectorXd &b) {
+        if (!level->coarser) {
+            Eigen::VectorXd rhs = b;
+            return level->DirectSolve(rhs);
+        }
+        using Matrix = Product::MatrixReplacement<typename Domain::MultType>;
+        Matrix A(level->GetMultiplier(), level->NumRows());
+        BlockJacobiSmoother<Matrix> smoother;
+        smoother.compute(A, level->InverseDiagonal3(), level->GetConstraintProjector(), level->jacobiDamping);
+        // The level's matrix doesn't change, so neither does the damping
+        level->jacobiDamping = smoother.damping();
+
+        Eigen::VectorXd x = smoother.solve(b);
+        Eigen::VectorXd r = b - A * x;
+        Eigen::VectorXd coarseB = level->prolongation->restrictWithTranspose(r);
+        x += level->prolongation->prolong(BlockJacobiVCycle(level->coarser, coarseB));
+        return smoother.solveWithGuess(b, x);
+    }
+
+    // Flexible GMRES with restarts (Saad, algorithm 9.6). The preconditioner may
+    // change from one iteration to the next, which is what allows a loosely
+    // converged V-cycle to be used as one. precondition(r, z) must set z ~ A^-1 r.
+    template<typename Matrix, typename Preconditioner>
+    Eigen::VectorXd FGMRES(const Matrix &A, const Eigen::VectorXd &b, double tol, Preconditioner precondition,
+    int restart = 30, int maxIters = 300) {
+        int n = b.rows();
+        Eigen::VectorXd x = Eigen::VectorXd::Zero(n);
+        double bNorm = b.norm();
+        if (bNorm == 0) return x;
+
+        std::vector<Eigen::VectorXd> V(restart + 1), Z(restart);
+        Eigen::MatrixXd H = Eigen::MatrixXd::Zero(restart + 1, restart);
+        Eigen::VectorXd cs(restart), sn(restart), g(restart + 1);
+
+        Eigen::VectorXd r = b;
+        double beta = bNorm;
+        int totalIters = 0;
+
+        while (totalIters < maxIters && beta > tol * bNorm) {
+            V[0] = r / beta;
+            g.setZero();
+            g(0) = beta;
+            H.setZero();
+
+            int k = 0;
+            for (; k < restart && totalIters < maxIters; k++) {
+                totalIters++;
+                precondition(V[k], Z[k]);
+                Eigen::VectorXd w = A * Z[k];
+                // Modified Gram-Schmidt
+                for (int i = 0; i <= k; i++) {
+                    H(i, k) = w.dot(V[i]);
+                    w -= H(i, k) * V[i];
+                }
+                H(k + 1, k) = w.norm();
+                V[k + 1] = (H(k + 1, k) > 0) ? Eigen::VectorXd(w / H(k + 1, k)) : w;
+
+                // Apply the previous rotations to the new column, then zero its last entry
+                for (int i = 0; i < k; i++) {
+                    double h = cs(i) * H(i, k) + sn(i) * H(i + 1, k);
+                    H(i + 1, k) = -sn(i) * H(i, k) + cs(i) * H(i + 1, k);
+                    H(i, k) = h;
+                }
+                double denom = std::hypot(H(k, k), H(k + 1, k));
+                cs(k) = (denom > 0) ? H(k, k) / denom : 1;
+                sn(k) = (denom > 0) ? H(k + 1, k) / denom : 0;
+                H(k, k) = denom;
+                H(k + 1, k) = 0;
+                g(k + 1) = -sn(k) * g(k);
+                g(k) = cs(k) * g(k);
+
+                if (std::abs(g(k + 1)) <= tol * bNorm) {
+                    k++;
+                    break;
+                }
+            }
+
+            // x += Z y, where H y = g on the leading k x k block
+            Eigen::VectorXd y = H.topLeftCorner(k, k).template triangularView<Eigen::Upper>().solve(g.head(k));
+            for (int i = 0; i < k; i++) {
+                x += y(i) * Z[i];
+            }
+            r = b - A * x;
+            beta = r.norm();
+        }
+
+        std::cout << "  FGMRES: " << totalIters << " iterations, relative residual " << (beta / bNorm) << std::endl;
+        return x;
+    }
+
+    // Tags that can stand in for a smoother in the multigrid solve templates of
+    // TPEFlowSolverSC, selecting an outer Krylov solver instead of plain V-cycles
+    struct VCyclePreconditioner {};
+    struct BlockJacobiPreconditioner {};
+    // V-cycles smoothed with BlockJacobiSmoother
+    struct BlockJacobiVCycles {};
+    template<typename Preconditioner>
+    struct FGMRESSolver {};
+    // Picks one of the above at runtime, from LWSOptions::multigridSolver
+    struct SelectedMultigridSolver {};
+
+    template<typename Smoother>
+    struct MultigridSolveImpl {
+        template<typename Domain>
+        static Eigen::VectorXd Solve(MultigridHierarchy<Domain>* solver, Eigen::VectorXd &b, double tol) {
+            return solver->template VCycleSolve<Smoother>(b, tol);
+        }
+    };
+
+    template<>
+    struct MultigridSolveImpl<FGMRESSolver<VCyclePreconditioner>> {
+        template<typename Domain>
+        static Eigen::VectorXd Solve(MultigridHierarchy<Domain>* solver, Eigen::VectorXd &b, double tol) {
+            using Solver = MultigridHierarchy<Domain>;
+            Product::MatrixReplacement<typename Domain::MultType> A(solver->GetTopLevelMultiplier(), solver->NumRows());
+            // Roughly one V-cycle per application
+            return FGMRES(A, b, tol, [&](const Eigen::VectorXd &r, Eigen::VectorXd &z) {
+                Eigen::VectorXd rhs = r;
+                z = solver->template VCycleSolve<typename Solver::EigenCG>(rhs, 0.5);
+            });
+        }
+    };
+
+    template<>
+    struct MultigridSolveImpl<FGMRESSolver<BlockJacobiPreconditioner>> {
+        template<typename Domain>
+        static Eigen::VectorXd Solve(MultigridHierarchy<Domain>* solver, Eigen::VectorXd &b, double tol) {
+            BlockClusterTree* tree = solver->GetTopLevelMultiplier();
+            ConstraintProjector* projector = tree->Curves()->constraintProjector;
+            Product::MatrixReplacement<typename Domain::MultType> A(tree, solver->NumRows());
+
+            // Every vertex's 3x3 diagonal block is a multiple of the identity
+            Eigen::VectorXd diag;
+            tree->FillDiagonal(diag);
+            Eigen::VectorXd invDiag3(3 * diag.rows());
+            for (int i = 0; i < diag.rows(); i++) {
+                invDiag3.segment<3>(3 * i).setConstant(1.0 / diag(i));
+            }
+            Eigen::VectorXd x = FGMRES(A, b, tol, [&](const Eigen::VectorXd &r, Eigen::VectorXd &z) {
+                Eigen::VectorXd scaled = invDiag3.cwiseProduct(r);
+                z = projector->ProjectToNullspace(scaled);
+            });
+            return projector->ProjectToNullspace(x);
+        }
+    };
+
+    template<>
+    struct MultigridSolveImpl<BlockJacobiVCycles> {
+        template<typename Domain>
+        static Eigen::VectorXd Solve(MultigridHierarchy<Domain>* solver, Eigen::VectorXd &b, double tol) {
+            const Domain* top = static_cast<const Domain*>(solver->levels[0]);
+            Product::MatrixReplacement<typename Domain::MultType> A(top->GetMultiplier(), top->NumRows());
+            Eigen::VectorXd x = Eigen::VectorXd::Zero(b.rows());
+            double bNorm = b.norm();
+            double rNorm = bNorm;
+            int cycles = 0;
+            while (cycles < 50 && rNorm > tol * bNorm) {
+                Eigen::VectorXd r = b - A * x;
+                x += BlockJacobiVCycle(top, r);
+                rNorm = (b - A * x).norm();
+                cycles++;
+            }
+            std::cout << "  Block-Jacobi V-cycles: " << cycles << " cycles, relative residual "
+                << ((bNorm > 0) ? rNorm / bNorm : 0) << std::endl;
+            return x;
+        }
+    };
+
+    template<>
+    struct MultigridSolveImpl<SelectedMultigridSolver> {
+        template<typename Domain>
+        static Eigen::VectorXd Solve(MultigridHierarchy<Domain>* solver, Eigen::VectorXd &b, double tol) {
+            using Solver = MultigridHierarchy<Domain>;
+            using Chebyshev = ChebyshevSmoother<Product::MatrixReplacement<typename Domain::MultType>>;
+            switch (LWSOptions::multigridSolver) {
+                case MultigridSolverType::VCycleChebyshev:
+                return MultigridSolveImpl<Chebyshev>::Solve(solver, b, tol);
+                case MultigridSolverType::VCycleJacobi:
+                return MultigridSolveImpl<BlockJacobiVCycles>::Solve(solver, b, tol);
+                case MultigridSolverType::FGMRESVCycle:
+                return MultigridSolveImpl<FGMRESSolver<VCyclePreconditioner>>::Solve(solver, b, tol);
+                case MultigridSolverType::FGMRESJacobi:
+                return MultigridSolveImpl<FGMRESSolver<BlockJacobiPreconditioner>>::Solve(solver, b, tol);
+                default:
+                return MultigridSolveImpl<typename Solver::EigenCG>::Solve(solver, b, tol);
+            }
+        }
+    };
+
+    // Solves G x = b to relative tolerance tol, with the hierarchy's V-cycles
+    // smoothed by Smoother, or with one of the Krylov wrappers above.
+    template<typename Smoother, typename Domain>
+    inline Eigen::VectorXd MultigridSolve(MultigridHierarchy<Domain>* solver, Eigen::VectorXd &b, double tol) {
+        return MultigridSolveImpl<Smoother>::Solve(solver, b, tol);
+    }
+
+    inline bool ParseMultigridSolverType(const std::string &name, MultigridSolverType &type) {
+        if (name == "cg") type = MultigridSolverType::VCycleCG;
+        else if (name == "chebyshev") type = MultigridSolverType::VCycleChebyshev;
+        else if (name == "jacobi") type = MultigridSolverType::VCycleJacobi;
+        else if (name == "fgmres") type = MultigridSolverType::FGMRESVCycle;
+        else if (name == "fgmres-jacobi") type = MultigridSolverType::FGMRESJacobi;
+        else return false;
+        return true;
+    }
+}
@@ -4,6 +4,8 @@
 #include "geometrycentral/surface/vertex_position_geometry.h"
 #include "geometrycentral/surface/halfedge_mesh.h"
 #include "spatial/tpe_bvh.h"
+#include "spatial/triangle_bvh.h"
+#include "field_cache.h"
 
 namespace LWS {
     using namespace geometrycentral;
@@ -19,9 +21,22 @@ namespace LWS {
         virtual void AddGradient(PolyCurveNetwork* curves, Eigen::MatrixXd &gradient);
         virtual double ComputeEnergy(PolyCurveNetwork* curves);
 
+        // Caches the potential and its gradient on a grid of the given resolution
+        // across the mesh, reusing cacheFile if it matches. Evaluation falls back
+        // to the BVH outside the grid and near the surface, where the cache can't
+        // meet the tolerance.
+        void CacheField(int resolution, double tolerance, std::string cacheFile = "");
+
+        // The original serial evaluation over a BVH of mesh vertices, kept for
+        // benchmarking. Its energy does not weight by area.
+        void AddGradientLegacy(PolyCurveNetwork* curves, Eigen::MatrixXd &gradient);
+        double ComputeEnergyLegacy(PolyCurveNetwork* curves);
+
         private:
         double p;
         double weight;
+        TriangleBVH* triangles;
+        SparseFieldCache* fieldCache;
         BVHNode3D* bvh;
         double AccumulateEnergy(BVHNode3D* node, Vector3 point);
         Vector3 AccumulateForce(BVHNode3D* node, Vector3 point);
@@ -5,8 +5,10 @@
 #include "Eigen/Core"
 #include "utils.h"
 #include "libgmultigrid/multigrid_operator.h"
-#include <unordered_set>
+#include "curve_geometry.h"
 #include "flow/gradient_constraint_enum.h"
+#include "flow/constraint_matrix.h"
+#include "flow/constraint_projector.h"
 #include "implicit_surface.h"
 #include "multigrid/constraint_projector_operator.h"
 
@@ -99,6 +101,12 @@ namespace LWS
             return pinnedToSurface.size();
         }
 
+        // Identifies this network's connectivity, which never changes after construction;
+        // no two networks created during a run share an ID
+        inline int TopologyID() const {
+            return topologyID;
+        }
+
         inline int NumComponents() {
             return verticesByComponent.size();
         }
@@ -131,12 +139,24 @@ namespace LWS
             return vertices[pinnedToSurface[i]];
         }
 
+        inline const std::vector<int>& GetPinnedVertexIndices() {
+            return pinnedVertices;
+        }
+
+        inline const std::vector<int>& GetPinnedTangentIndices() {
+            return pinnedTangents;
+        }
+
+        inline const std::vector<int>& GetPinnedToSurfaceIndices() {
+            return pinnedToSurface;
+        }
+
         inline bool isPinned(int i) {
-            return pinnedSet.count(i) > 0;
+            return pinnedFlags[i];
         }
 
         inline bool isTangentPinned(int i) {
-            return pinnedTangentSet.count(i) > 0;
+            return tangentPinnedFlags[i];
         }
 
         inline CurveEdge* GetEdge(int i) {
@@ -167,16 +187,38 @@ namespace LWS
         double TotalLength();
         Vector3 AreaVector();
         PolyCurveNetwork* Subdivide();
+        // Splits edges longer than 4/3 of the target length, and removes vertices
+        // next to edges shorter than 4/5 of it, where the target length at each
+        // vertex is given by targetLengths. Returns 0 if nothing changed. Otherwise,
+        // edgeTransfer maps values on the old edges, such as rest lengths, to the new ones.
+        PolyCurveNetwork* Remesh(const Eigen::VectorXd &targetLengths, Eigen::SparseMatrix<double> &edgeTransfer);
+        // Removes about half of the vertices for the next multigrid level, keeping
+        // junctions, endpoints, pins and sharp corners, and preferring to remove
+        // vertices where the curve is flattest. Returns 0, leaving op empty, if
+        // every vertex has to be kept.
         PolyCurveNetwork* Coarsen(MatrixProjectorOperator* op, bool doEdgeMatrix = false);
-
-        NullSpaceProjector* constraintProjector;
-        template<typename T>
-        void AddConstraintProjector(DomainConstraints<T> &constraints) {
-            if (constraintProjector) {
-                delete constraintProjector;
-            }
-            constraintProjector = new NullSpaceProjector(constraints);
+        // The coarsening Coarsen replaced: vertices removed by BFS parity, averaged
+        // from their neighbors, and kept ones fitted by least squares. Kept to
+        // compare against in rcurves_bench. Returns 0 like Coarsen.
+        PolyCurveNetwork* CoarsenLegacy(MatrixProjectorOperator* op, bool doEdgeMatrix = false);
+
+        ConstraintProjector* constraintProjector;
+
+        // The Jacobian of the applied constraints at the current positions. It is
+        // kept between calls, and only its values are recomputed unless the
+        // constraints have changed.
+        ConstraintMatrix& GetConstraintMatrix();
+        // Brings constraintProjector up to date with GetConstraintMatrix(),
+        // reusing its symbolic factorization when the pattern is unchanged
+        void UpdateConstraintProjector();
+
+        // Structure-of-arrays copy of the derived geometry, for hot loops that
+        // would otherwise recompute it through CurveVertex and CurveEdge
+        inline const CurveGeometry& Geometry() const {
+            return geometry;
         }
+        // Refreshes Geometry() from positions; call after positions change
+        void UpdateGeometry();
 
         Eigen::MatrixXd positions;
         std::vector<ConstraintType> appliedConstraints;
@@ -184,19 +226,34 @@ namespace LWS
 
         private:
         int nVerts;
+        int topologyID;
         std::vector<int> pinnedToSurface;
         std::vector<int> pinnedVertices;
-        std::unordered_set<int> pinnedSet;
+        std::vector<char> pinnedFlags;
         std::vector<int> pinnedTangents;
-        std::unordered_set<int> pinnedTangentSet;
+        std::vector<char> tangentPinnedFlags;
         std::vector<CurveVertex*> vertices;
         std::vector<CurveEdge*> edges;
+        // The structs that vertices and edges point into
+        std::vector<CurveVertex> vertexStorage;
+        std::vector<CurveEdge> edgeStorage;
         std::vector<std::vector<CurveEdge*>> adjacency;
 
         std::vector<std::vector<CurveVertex*>> verticesByComponent;
         std::vector<std::vector<CurveEdge*>> edgesByComponent;
 
+        ConstraintMatrix* constraintMatrix;
+        CurveGeometry geometry;
+
         void CleanUpStructs();
+        // Same as BendingAngle, but read from Geometry()
+        double SnapshotBendingAngle(int i) const;
+        // Which vertices Coarsen and CoarsenLegacy keep
+        void ChooseCoarseVertices(std::vector<char> &shouldKeep);
+        void ChooseCoarseVerticesLegacy(std::vector<char> &shouldKeep);
+        // Builds the coarse network and the prolongation from the kept vertices
+        PolyCurveNetwork* CoarsenKeeping(const std::vector<char> &shouldKeep, MatrixProjectorOperator* op,
+            bool doEdgeMatrix, bool legacy);
 
         inline Vector3 Position(int i) {
             return SelectRow(positions, i);
@@ -6,8 +6,11 @@
 #include "sobo_slobo.h"
 #include "libgmultigrid/domain_constraints.h"
 #include "poly_curve_network.h"
+#include "profiler.h"
 
 #include "Eigen/Dense"
+#include <atomic>
+#include <cstdint>
 #include <fstream>
 
 namespace LWS {
@@ -33,23 +36,26 @@ namespace LWS {
 
     class BlockClusterTree : public VectorMultiplier<BlockClusterTree> {
         public:
-        static long illSepTime;
-        static long wellSepTime;
-        static long traversalTime;
-
-        BlockClusterTree(PolyCurveNetwork* cg, BVHNode3D* tree, double sepCoeff, double a, double b, double e = 0.0);
+        // The cluster pair lists are stored in the given arena, or in one the
+        // tree creates and owns; the tree must be deleted before that arena is reset.
+        BlockClusterTree(PolyCurveNetwork* cg, BVHNode3D* tree, double sepCoeff, double a, double b, double e = 0.0,
+            MonotonicArena* sharedArena = 0);
         ~BlockClusterTree();
         // Loop over all currently inadmissible cluster pairs
         // and subdivide them to their children.
-        void splitInadmissibleNodes(int depth);
+        void splitInadmissibleNodes(int depth, std::vector<ClusterPair> &admissible, std::vector<ClusterPair> &inadmissible);
         static bool isPairAdmissible(ClusterPair pair, double coeff);
         static bool isPairSmallEnough(ClusterPair pair);
+        // Products computed by all trees so far, counted whether or not profiling is on
+        static std::atomic<uint64_t> numProducts;
 
         inline void refreshEdgeWeights() {
             tree_root->refreshWeightsVector(curves, BodyType::Edge);
         }
 
         void PrintData();
+        inline size_t NumAdmissiblePairs() const { return admissiblePairs.size(); }
+        inline size_t NumInadmissiblePairs() const { return inadmissiblePairs.size(); }
         void PrintAdmissibleClusters(std::ofstream &stream);
         void PrintInadmissibleClusters(std::ofstream &stream);
 
@@ -86,8 +92,8 @@ namespace LWS {
         void sum_AIJ_VJ_Low() const;
         void sum_AIJ_VJ_Low_Parallel() const;
 
-        void AfFullProduct(ClusterPair pair, const Eigen::MatrixXd &v_hat, Eigen::MatrixXd &result) const;
-        void AfFullProductLow(ClusterPair pair, const Eigen::VectorXd &v_mid, Eigen::VectorXd &result) const;
+        void AfFullProduct(ClusterPair pair, const Eigen::MatrixXd &v_hat, Eigen::Ref<Eigen::MatrixXd> result) const;
+        void AfFullProductLow(ClusterPair pair, const Eigen::VectorXd &v_mid, Eigen::Ref<Eigen::VectorXd> result) const;
         void AfApproxProduct(ClusterPair pair, const Eigen::MatrixXd &v_hat, Eigen::MatrixXd &result) const;
         void AfApproxProductLow(ClusterPair pair, const Eigen::VectorXd &v_mid, Eigen::VectorXd &result) const;
 
@@ -111,6 +117,15 @@ namespace LWS {
 
         void SetBlockTreeMode(BlockTreeMode m);
 
+        // Fills the diagonal of the (scalar) matrix that MultiplyVector applies,
+        // one entry per vertex, with the near field summed exactly. In the
+        // Matrix3 modes, each vertex's 3x3 diagonal block is this entry times I.
+        void FillDiagonal(Eigen::VectorXd &diag) const;
+
+        inline PolyCurveNetwork* Curves() const {
+            return curves;
+        }
+
         private:
         // Multiplies the inadmissible clusters for A * v, storing it in b.
         void MultiplyInadmissibleParallel(const Eigen::MatrixXd &v_hat, Eigen::MatrixXd &b_hat) const;
@@ -127,11 +142,15 @@ namespace LWS {
         double epsilon;
         PolyCurveNetwork* curves;
         BVHNode3D* tree_root;
-        std::vector<ClusterPair> admissiblePairs;
-        std::vector<std::vector<ClusterPair>> admissibleByCluster;
-
+        MonotonicArena* arena;
+        bool ownsArena;
+        // Admissible pairs are grouped by their first cluster: the pairs of the
+        // cluster with ID i are admissiblePairs[admissibleStart[i] .. admissibleStart[i + 1])
+        ArraySpan<ClusterPair> admissiblePairs;
+        ArraySpan<int> admissibleStart;
+        ArraySpan<ClusterPair> inadmissiblePairs;
+        // Only used during construction
         std::vector<ClusterPair> unresolvedPairs;
-        std::vector<ClusterPair> inadmissiblePairs;
         bool constraintsSet;
         Eigen::SparseMatrix<double> B;
     };
@@ -227,6 +246,9 @@ namespace LWS {
 
     template<typename V, typename Dest>
     void BlockClusterTree::Multiply(V &v, Dest &b) const {
+        PROFILE_SCOPE("BCT multiply");
+        PROFILE_COUNT(MatrixVectorProducts, 1);
+        numProducts.fetch_add(1, std::memory_order_relaxed);
         if (mode == BlockTreeMode::MatrixOnly) {
             MultiplyVector(v, b);
         }
@@ -250,19 +272,15 @@ namespace LWS {
         }
 
         else if (mode == BlockTreeMode::Matrix3AndProjector) {
-            long start = Utils::currentTimeMilliseconds();
             Eigen::VectorXd tmp(v.rows());
             tmp.setZero();
             curves->constraintProjector->ProjectToNullspace(v, tmp);
-            long proj1 = Utils::currentTimeMilliseconds();
 
             Eigen::VectorXd tmp2(v.rows());
             tmp2.setZero();
             MultiplyVector3(tmp, tmp2);
-            long proj2 = Utils::currentTimeMilliseconds();
 
             curves->constraintProjector->ProjectToNullspace(tmp2, b);
-            long end = Utils::currentTimeMilliseconds();
         }
 
         else if (mode == BlockTreeMode::Matrix3AndConstraints) {
@@ -297,20 +315,16 @@ namespace LWS {
         Eigen::VectorXd b_mid_inadm(nEdges);
         b_mid_inadm.setZero();
 
-        long illSepStart = Utils::currentTimeMilliseconds();
         // Multiply inadmissible blocks
+        PROFILE_PUSH("BCT near field");
         MultiplyInadmissibleParallel(v_hat, b_hat_inadm);
         MultiplyInadmissibleLowParallel(v_mid, b_mid_inadm);
-        long middle = Utils::currentTimeMilliseconds();
+        PROFILE_POP();
         // Multiply admissible blocks
+        PROFILE_PUSH("BCT far field");
         MultiplyAdmissibleFast(v_hat, b_hat_adm);
         MultiplyAdmissibleLowFast(v_mid, b_mid_adm);
-        long wellSepEnd = Utils::currentTimeMilliseconds();
-        long illTime = (middle - illSepStart);
-        long wellTime = (wellSepEnd - middle);
-
-        illSepTime += illTime;
-        wellSepTime += wellTime;
+        PROFILE_POP();
 
         b_hat_adm += b_hat_inadm;
         b_mid_adm += b_mid_inadm;
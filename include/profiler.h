@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+
+namespace LWS {
+
+    enum class ProfileCounter {
+        KernelEvaluations = 0,  // pairwise energy / metric kernel evaluations
+        TreeNodesVisited,       // BVH nodes touched by Barnes-Hut traversals
+        MatrixVectorProducts,   // hierarchical matrix products, i.e. Krylov iterations
+        LineSearchBacktracks,
+        BytesAllocated,
+        Allocations,            // calls to the global operator new (needs RCURVES_PROFILE_ALLOCATIONS)
+        NumCounters
+    };
+
+    // Per-phase performance tracing. Phases are nestable, per-thread scopes timed
+    // at microsecond resolution; each phase also records how much every counter
+    // grew while it was open (summed over all threads). Results can be written as
+    // a Chrome trace (chrome://tracing, Perfetto) or printed as a summary table.
+    //
+    // All hooks check Profiler::enabled first, so a disabled profiler costs one
+    // predictable branch per hook. Building without RCURVES_PROFILING removes the
+    // hooks entirely.
+    class Profiler {
+        public:
+        static bool enabled;
+
+        static void Enable();
+        static void Disable();
+        // Discards all recorded phases and counts. Only call while no phases are open.
+        static void Reset();
+
+        // Phase names must be string literals (they are stored by pointer).
+        static void Push(const char* name);
+        static void Pop();
+
+        static inline void Count(ProfileCounter counter, uint64_t amount) {
+            if (enabled) AddCount(counter, amount);
+        }
+
+        static uint64_t CounterTotal(ProfileCounter counter);
+        static const char* CounterName(ProfileCounter counter);
+
+        // Output functions read every thread's records, so they should be
+        // called when no timed work is running.
+        static bool WriteChromeTrace(const std::string &fname);
+        static void PrintSummary(std::ostream &out);
+
+        private:
+        static void AddCount(ProfileCounter counter, uint64_t amount);
+    };
+
+    class ProfileScope {
+        public:
+        inline explicit ProfileScope(const char* name) : active(Profiler::enabled) {
+            if (active) Profiler::Push(name);
+        }
+        inline ~ProfileScope() {
+            if (active) Profiler::Pop();
+        }
+
+        private:
+        ProfileScope(const ProfileScope&);
+        ProfileScope& operator=(const ProfileScope&);
+        bool active;
+    };
+}
+
+#ifdef RCURVES_PROFILING
+#define LWS_PROFILE_CONCAT_INNER(a, b) a##b
+#define LWS_PROFILE_CONCAT(a, b) LWS_PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) LWS::ProfileScope LWS_PROFILE_CONCAT(profileScope_, __LINE__)(name)
+#define PROFILE_PUSH(name) do { if (LWS::Profiler::enabled) LWS::Profiler::Push(name); } while (0)
+#define PROFILE_POP() do { if (LWS::Profiler::enabled) LWS::Profiler::Pop(); } while (0)
+#define PROFILE_COUNT(counter, amount) LWS::Profiler::Count(LWS::ProfileCounter::counter, amount)
+#else
+#define PROFILE_SCOPE(name) do {} while (0)
+#define PROFILE_PUSH(name) do {} while (0)
+#define PROFILE_POP() do {} while (0)
+#define PROFILE_COUNT(counter, amount) do {} while (0)
+#endif
@@ -53,6 +53,11 @@ namespace LWS {
         double tpe_alpha;
         double tpe_beta;
         double tpe_weight;
+        double bhErrorTarget;
+        double bctSeparation;
+        int fieldCacheResolution;
+        double fieldCacheTolerance;
+        int surfaceMeshResolution;
         std::vector<PotentialData> extraPotentials;
         bool useLengthScale;
         double edgeLengthScale;
@@ -11,12 +11,12 @@ namespace LWS {
         // Virtual destructor
         virtual ~SpatialTree() = 0;
         
-        // Compute the total energy contribution from a single vertex
-        virtual void accumulateVertexEnergy(double &result, CurveVertex* &i_pt,
+        // Compute the total energy contribution from vertex i
+        virtual void accumulateVertexEnergy(double &result, int i,
             PolyCurveNetwork* curves, double alpha, double beta) = 0;
 
-        // Compute the total TPE gradient at a single vertex and its neighbors
-        virtual void accumulateTPEGradient(Eigen::MatrixXd &gradients, CurveVertex* &i_pt,
+        // Compute the total TPE gradient at vertex i and its neighbors
+        virtual void accumulateTPEGradient(Eigen::MatrixXd &gradients, int i,
             PolyCurveNetwork* curves, double alpha, double beta) = 0;
 
         // Use the given spatial tree to compute the TPE gradient with Barnes-Hut.
@@ -6,6 +6,7 @@
 #include "geometrycentral/surface/halfedge_mesh.h"
 #include "geometrycentral/surface/vertex_position_geometry.h"
 #include "utils.h"
+#include "../arena.h"
 
 #include <fstream>
 #include <Eigen/Core>
@@ -23,6 +24,9 @@ namespace LWS {
     class BVHNode3D : public SpatialTree {
         public:
         static int globalID;
+        // Largest estimated relative error allowed for a single far-field
+        // interaction during traversal; see FarFieldError
+        static double errorTarget;
         int thisNodeID;
         int numNodes;
 
@@ -47,15 +51,28 @@ namespace LWS {
             }
         }
 
-        // Build a BVH of the given points
-        BVHNode3D(std::vector<VertexBody6D> &points, int axis, BVHNode3D* root, bool splitTangents);
+        // Build a BVH of the given points, which are reordered in place. Every
+        // node below the root is allocated from the root's arena, which is the
+        // given one, or one the root creates and owns; the nodes are gone once
+        // that arena is reset or deleted.
+        BVHNode3D(ArraySpan<VertexBody6D> points, int axis, BVHNode3D* root, bool splitTangents,
+            MonotonicArena* sharedArena = 0);
         virtual ~BVHNode3D();
 
+        // Copies the whole tree into the given arena, e.g. to refit it to other
+        // positions of the same curve. The copy shares this tree's cluster indices,
+        // so it must be destroyed (by calling its destructor, since it lives in
+        // the arena) before this tree is.
+        BVHNode3D* CopyInto(MonotonicArena* target);
+
         double totalMass;
         Vector3 centerOfMass;
         Vector3 averageTangent;
-        std::vector<int> clusterIndices;
+        // The elements in this cluster. A node's indices are its lesser child's
+        // followed by its greater child's, so they all share one array.
+        ArraySpan<int> clusterIndices;
         BVHNode3D* bvhRoot;
+        MonotonicArena* arena;
         Eigen::VectorXd fullMasses;
 
         // Fields for use by matrix-vector products; not used
@@ -88,13 +105,14 @@ namespace LWS {
         template<typename T>
         void recomputeCentersOfMass(T &curves);
         
-        // Compute the total energy contribution from a single vertex
-        virtual void accumulateVertexEnergy(double &result, CurveVertex* &i_pt, PolyCurveNetwork* curves, double alpha, double beta);
-        virtual void accumulateTPEGradient(Eigen::MatrixXd &gradients, CurveVertex* &i_pt, 
+        // Compute the total energy contribution from a single vertex. Both read
+        // the curve's geometry snapshot, which must be current.
+        virtual void accumulateVertexEnergy(double &result, int i, PolyCurveNetwork* curves, double alpha, double beta);
+        virtual void accumulateTPEGradient(Eigen::MatrixXd &gradients, int i,
             PolyCurveNetwork* curves, double alpha, double beta);
         int NumElements();
         
-        virtual double bodyEnergyEvaluation(CurveVertex* &i_pt, double alpha, double beta);
+        virtual double bodyEnergyEvaluation(const CurveGeometry &geom, int i, double alpha, double beta);
         virtual Vector3 bodyForceEvaluation(CurveVertex* &i_pt, double alpha, double beta);
 
         Vector3 exactGradient(CurveVertex* basePoint, PolyCurveNetwork* curves, double alpha, double beta);
@@ -102,7 +120,7 @@ namespace LWS {
         PosTan minBound();
         PosTan maxBound();
         Vector3 BoxCenter();
-        std::vector<BVHNode3D*> children;
+        ArraySpan<BVHNode3D*> children;
 
         // for visualization, assign each node a range of indices
         // determined by the (post)ordering of its leaves
@@ -125,13 +143,6 @@ namespace LWS {
         void accumulateChildren(std::vector<VertexBody6D> &result);
         Vector2 viewspaceBounds(Vector3 point);
 
-        inline void fillClusterMassVector(Eigen::VectorXd &w) {
-            w.setZero(clusterIndices.size());
-            for (size_t i = 0; i < clusterIndices.size(); i++) {
-                w(i) = bvhRoot->fullMasses(clusterIndices[i]);
-            }
-        }
-
         inline bool IsLeaf() {
             return isLeaf;
         }
@@ -142,22 +153,6 @@ namespace LWS {
             return body.elementIndex;
         }
 
-        inline int countBadNodes() {
-            if (isEmpty) return 0;
-            else if (isLeaf) {
-                if (testTangent()) return 0;
-                else return 1;
-            }
-            else {
-                int sum = 0;
-                if (!testTangent()) sum++;
-                for (BVHNode3D* child : children) {
-                    sum += child->countBadNodes();
-                } 
-                return sum;
-            }
-        }
-
         inline double nodeRatio(double d) {
             // Compute diagonal distance from corner to corner
             // double diag = norm(maxCoords.position - minCoords.position);
@@ -172,30 +167,41 @@ namespace LWS {
             // return fmax(spatialR / d, tangentR);
         }
 
-        bool shouldUseCell(Vector3 vertPos);
+        // Estimated relative error of evaluating a cluster as a single body, where
+        // sizeRatio is its radius over its distance and tangentSpread is the
+        // half-width of its cone of tangents. The cluster is evaluated at its center
+        // of mass with its average tangent, so the first-order terms of the kernel's
+        // Taylor expansion cancel; what remains is roughly second order in each
+        // spread, scaled by how steeply |T x (p - q)|^alpha / |p - q|^beta varies.
+        static inline double FarFieldError(double sizeRatio, double tangentSpread, double alpha, double beta) {
+            double spatialError = (alpha + beta) * (alpha + beta + 1) / 6 * sizeRatio * sizeRatio;
+            double tangentError = alpha * (alpha + 1) / 6 * tangentSpread * tangentSpread;
+            return spatialError + tangentError;
+        }
+
+        // Whether FarFieldError for this cell, seen from vertPos, is under errorTarget
+        // (use alpha = 0 for kernels that ignore tangents).
+        bool shouldUseCell(Vector3 vertPos, double alpha, double beta);
 
         VertexBody6D body;
 
         //private:
         int numElements;
-        double AxisSplittingPlane(std::vector<VertexBody6D> &points, int axis);
-        
-        inline bool testTangent() {
-            Vector3 tanDiag = maxCoords.tangent - minCoords.tangent;
-            double r = tanDiag.norm() / 2;
-            return r < thresholdTheta;
-        }
+        double AxisSplittingPlane(ArraySpan<VertexBody6D> points, int axis);
 
         template<typename T>
         void setLeafData(T &curves);
+        BVHNode3D* copyNode(MonotonicArena* target, BVHNode3D* copyRoot);
 
         int splitAxis;
         double splitPoint;
+        bool ownsArena;
+        // Number of leaves built so far; only used on the root during construction
+        size_t numIndexed;
         bool isEmpty;
         bool isLeaf;
         PosTan minCoords;
         PosTan maxCoords;
-        double thresholdTheta;
     };
 
     template<typename T>
@@ -206,21 +212,21 @@ namespace LWS {
     
     template<>
     inline void BVHNode3D::setLeafData(PolyCurveNetwork* &curves) {
+        const CurveGeometry &geom = curves->Geometry();
         if (body.type == BodyType::Vertex) {
-            CurveVertex* p = curves->GetVertex(body.elementIndex);
-            body.mass = p->DualLength();
-            body.pt.position = p->Position();
-            body.pt.tangent = p->Tangent();
+            int v = body.elementIndex;
+            body.mass = geom.dualLength(v);
+            body.pt.position = geom.Position(v);
+            body.pt.tangent = geom.VertexTangent(v);
         }
         else if (body.type == BodyType::Edge) {
-            CurveEdge* p1 = curves->GetEdge(body.elementIndex);
-
+            int e = body.elementIndex;
             // Mass of an edge is its length
-            body.mass = p1->Length();
+            body.mass = geom.length(e);
             // Use midpoint as center of mass
-            body.pt.position = p1->Midpoint();
+            body.pt.position = geom.Midpoint(e);
             // Tangent direction is normalized edge vector
-            body.pt.tangent = p1->Tangent();
+            body.pt.tangent = geom.EdgeTangent(e);
         }
 
         totalMass = body.mass;
@@ -307,8 +313,11 @@ namespace LWS {
         }
     }
 
-    BVHNode3D* CreateBVHFromCurve(PolyCurveNetwork *curves);
-    BVHNode3D* CreateEdgeBVHFromCurve(PolyCurveNetwork *curves);
+    // These refresh the curve's geometry snapshot before building, since
+    // every evaluation over the curve starts from one of these trees. If an
+    // arena is given, the tree must be deleted before the arena is reset.
+    BVHNode3D* CreateBVHFromCurve(PolyCurveNetwork *curves, MonotonicArena* arena = 0);
+    BVHNode3D* CreateEdgeBVHFromCurve(PolyCurveNetwork *curves, MonotonicArena* arena = 0);
     BVHNode3D* CreateBVHFromMesh(std::shared_ptr<geometrycentral::surface::HalfedgeMesh> &mesh,
         std::shared_ptr<geometrycentral::surface::VertexPositionGeometry> &geom);
 }
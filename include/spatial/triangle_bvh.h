@@ -0,0 +1,65 @@
+#pragma once
+
+#include "geometrycentral/utilities/vector3.h"
+
+#include <array>
+#include <vector>
+
+namespace LWS {
+    using namespace geometrycentral;
+
+    // A bounding volume hierarchy over the triangles of a mesh, stored as a flat
+    // array of nodes, for evaluating the potential
+    //
+    //   E(x) = integral over the mesh of 1 / |x - y|^p dA(y)
+    //
+    // and its gradient. Distant nodes are treated as a single mass (their area)
+    // at their area-weighted centroid, using the same error estimate as BVHNode3D
+    // (with a tighter target); nearby triangles are integrated by quadrature,
+    // subdividing them as the point gets closer. Queries do not allocate and are safe to run
+    // concurrently.
+    class TriangleBVH {
+        public:
+        // Largest estimated relative error allowed for a far node or triangle; see
+        // BVHNode3D::FarFieldError. The default keeps nodes at least as far away as
+        // the old diagonal / distance < 0.25 rule did for p = 2.
+        static double errorTarget;
+
+        TriangleBVH(const std::vector<Vector3> &positions, const std::vector<std::array<size_t, 3>> &triangles);
+
+        double Energy(Vector3 point, double p) const;
+        // Gradient of Energy with respect to the point
+        Vector3 Gradient(Vector3 point, double p) const;
+        // Adds both to energy and gradient in a single traversal
+        void Evaluate(Vector3 point, double p, double &energy, Vector3 &gradient) const;
+
+        inline size_t NumNodes() const { return nodes.size(); }
+        inline size_t NumTriangles() const { return tris.size(); }
+
+        private:
+        struct Triangle {
+            Vector3 a, b, c;
+            Vector3 centroid;
+            double area;
+        };
+
+        struct Node {
+            Vector3 center;
+            double mass;
+            // Half the diagonal of the bounding box
+            double radius;
+            int start;
+            int count;
+            // Index of the first child, with the second right after it; -1 for leaves
+            int left;
+        };
+
+        std::vector<Triangle> tris;
+        std::vector<Node> nodes;
+
+        // Fills in nodes[index] for the given range of triangles, recursively
+        void build(int index, int start, int count);
+        void integrateTriangle(Vector3 a, Vector3 b, Vector3 c, double area, Vector3 point, double p, int depth,
+            double &energy, Vector3 &gradient) const;
+    };
+}
@@ -64,6 +64,17 @@ namespace LWS {
         static VertJacobian edge_tangent_wrt_vert(CurveEdge* edge, CurveVertex* wrtVert);
         // Jacobian of the vertex tangent (average of surrounding edges) wrt a vertex
         static VertJacobian vertex_tangent_wrt_vert(CurveVertex* tangentVert, CurveVertex* wrtVert);
+
+        // Versions of the above that read from a geometry snapshot instead of going
+        // through CurveVertex, for the Barnes-Hut traversals. Vertices and edges are
+        // given by index; a TangentMassPoint here always stands for a cluster.
+        static double tpe_pair(const CurveGeometry &geom, int i, int j, double alpha, double beta);
+        static Vector3 tpe_grad(const CurveGeometry &geom, int x, int y, double alpha, double beta, int wrt);
+        static Vector3 tpe_grad(const CurveGeometry &geom, int x, const TangentMassPoint &y, double alpha, double beta, int wrt);
+        static Vector3 tpe_grad(const CurveGeometry &geom, const TangentMassPoint &x, int y, double alpha, double beta, int wrt);
+        static Vector3 length_wrt_vert(const CurveGeometry &geom, int lengthVert, int wrt);
+        static VertJacobian edge_tangent_wrt_vert(const CurveGeometry &geom, int edge, int wrtVert);
+        static VertJacobian vertex_tangent_wrt_vert(const CurveGeometry &geom, int tangentVert, int wrtVert);
     };
 
     inline double TPESC::tpe_Kf_pts(Vector3 p_x, Vector3 p_y, Vector3 tangent_x, double alpha, double beta) {
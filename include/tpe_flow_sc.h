@@ -8,7 +8,11 @@
 #include "libgmultigrid/matrix_free.h"
 #include "libgmultigrid/multigrid_hierarchy.h"
 #include "multigrid/constraint_projector_domain.h"
+#include "multigrid/krylov_solvers.h"
 #include "flow/gradient_constraint_enum.h"
+#include "flow/flow_checkpoint.h"
+#include "flow/lbfgs_history.h"
+#include "flow/solve_tolerance.h"
 
 #include "obstacles/obstacle.h"
 #include "extra_potentials.h"
@@ -34,9 +38,29 @@ namespace LWS {
         ConstraintClassType constraint;
 
         void ReplaceCurve(PolyCurveNetwork* new_p);
+        // Replaces the curve with a remeshed version of it, keeping the constraint
+        // targets and the solve tolerance state (but not the L-BFGS history);
+        // edgeTransfer is the matrix returned by PolyCurveNetwork::Remesh
+        void ReplaceCurve(PolyCurveNetwork* new_p, Eigen::SparseMatrix<double> &edgeTransfer);
         void EnablePerformanceLog(std::string logFile);
+        // Energy and gradient evaluations since the solver was created, for
+        // comparing how much work the step methods need
+        inline long NumEnergyEvaluations() const {
+            return numEnergyEvals;
+        }
+        inline long NumGradientEvaluations() const {
+            return numGradientEvals;
+        }
         void ClosePerformanceLog();
 
+        // Copies the curve and all solver progress into a checkpoint.
+        void FillCheckpoint(FlowCheckpoint &cp);
+        // Restores solver progress from a checkpoint; the solver's curve
+        // should already have been replaced with one created from the same checkpoint.
+        // Returns false, leaving the solver unchanged, if the checkpoint's constraints
+        // don't match the curve's.
+        bool RestoreCheckpoint(FlowCheckpoint &cp);
+
         void UpdateTargetLengths();
         void SetTotalLengthScaleTarget(double scale);
         void SetEdgeLengthScaleTarget(double scale);
@@ -61,6 +85,13 @@ namespace LWS {
         bool StepLSConstrained(bool useBH, bool useBackproj);
         bool StepSobolevLS(bool useBH, bool useBackproj);
         bool StepSobolevLSIterative(double epsilon, bool useBackproj);
+        // L-BFGS, using the multigrid Sobolev solve as the initial inverse Hessian.
+        // Pairs are kept across calls, and dropped when the curve changes size.
+        bool StepLBFGS(double epsilon, bool useBackproj);
+        // Sobolev descent along a circular arc fitted to the flow's curvature. The
+        // second derivative of the flow is solved for with multigrid, from a
+        // right-hand side differentiated with Barnes-Hut and block cluster trees.
+        bool StepSobolevCircleIterative(double epsilon, bool useBackproj);
 
         double ProjectGradient(Eigen::MatrixXd &gradients, Eigen::MatrixXd &A, Eigen::PartialPivLU<Eigen::MatrixXd> &lu);
         double ProjectSoboSloboGradient(Eigen::PartialPivLU<Eigen::MatrixXd> &lu, Eigen::MatrixXd &gradients);
@@ -76,7 +107,7 @@ namespace LWS {
             Eigen::VectorXd GB_phi = multiplier * B_pinv_phi;
             // Solve Gv = b by solving PGPv = Pb
             GB_phi = curveNetwork->constraintProjector->ProjectToNullspace(GB_phi);
-            Eigen::VectorXd v = solver->template VCycleSolve<Smoother>(GB_phi, tol);
+            Eigen::VectorXd v = MultigridSolve<Smoother>(solver, GB_phi, tol);
             v = B_pinv_phi - v;
             VectorXdIntoMatrix(v, output);
         }
@@ -88,9 +119,18 @@ namespace LWS {
 
         void SaveCurrentPositions();
         void RestoreOriginalPositions();
-        double LineSearchStep(Eigen::MatrixXd &gradients, double gradDot = 1, BVHNode3D* root = 0, bool resetStep = false);
-        double LineSearchStep(Eigen::MatrixXd &gradients, double initGuess, int doublingLimit, double gradDot, BVHNode3D* root);
+        // Backtracks along -gradients until the Armijo condition holds. slope is the
+        // derivative of the energy along -gradients (the dot product of the L2 gradient
+        // with gradients), used both in the Armijo test and to interpolate trial steps;
+        // if it is 0, gradients is assumed to be the L2 gradient.
+        double LineSearchStep(Eigen::MatrixXd &gradients, double gradDot = 1, BVHNode3D* root = 0, bool resetStep = false, double slope = 0);
+        double LineSearchStep(Eigen::MatrixXd &gradients, double initGuess, int doublingLimit, double gradDot, BVHNode3D* root, double slope = 0);
         double CircleSearchStep(Eigen::MatrixXd &P_dot, Eigen::MatrixXd &P_ddot, Eigen::MatrixXd &G, BVHNode3D* root);
+        // Same as above, given the products G * P_dot and G * P_ddot instead of G itself.
+        // Backtracks along the arc until the Armijo condition holds; returns 0 if no
+        // arc could be fitted or no step on it decreased the energy enough.
+        double CircleSearchStep(Eigen::MatrixXd &P_dot, Eigen::MatrixXd &P_ddot,
+            Eigen::VectorXd &G_Pd, Eigen::VectorXd &G_Pdd, BVHNode3D* root);
 
         double LSBackproject(Eigen::MatrixXd &gradients, double initGuess,
             Eigen::PartialPivLU<Eigen::MatrixXd> &lu, double gradDot, BVHNode3D* root);
@@ -113,19 +153,52 @@ namespace LWS {
         int iterNum;
         double targetLength;
         double ls_step_threshold;
+        // Tolerances of the multigrid solves and backprojection, chosen every iteration
         double mg_tolerance;
         double backproj_threshold;
         double mg_backproj_threshold;
+        SolveTolerance solveTolerance;
+        // Relative energy decrease of the last accepted step, or -1 before the first one
+        double lastRelativeDecrease;
+        uint64_t mgProductsAtStart;
+        double mgIterationsSaved;
         double lastStepSize;
+        // Energy evaluations made by the last line search
+        int lastLineSearchEvals;
+        // Energy and gradient evaluations since the solver was created
+        long numEnergyEvals;
+        long numGradientEvals;
         PolyCurveNetwork* curveNetwork;
         Eigen::MatrixXd originalPositionMatrix;
         Eigen::VectorXd constraintTargets;
         Eigen::VectorXd fullDerivVector;
+        // L-BFGS pairs, and the positions and projected gradient of the last L-BFGS step
+        LBFGSHistory lbfgs;
+        Eigen::VectorXd lbfgsPrevPositions;
+        Eigen::VectorXd lbfgsPrevGradient;
+        // Copies of the curve for evaluating line search candidates in parallel
+        std::vector<PolyCurveNetwork*> trialCurves;
+        // Backs the trees built during a step; reset at the start of the next one
+        MonotonicArena iterationArena;
         double alpha;
         double beta;
         void SetGradientStep(Eigen::MatrixXd &gradient, double delta);
+        double curveEnergy(PolyCurveNetwork* curves, SpatialTree *root);
+        double parallelLineSearch(Eigen::MatrixXd &gradient, double initGuess, double initialEnergy,
+            double slope, BVHNode3D* root, int numCandidates);
+        void clearTrialCurves();
         void SetCircleStep(Eigen::MatrixXd &P_dot, Eigen::MatrixXd &K, double sqrt_G, double R, double alpha_delta);
+        // Finite difference of (L2 gradient - G' * P_dot) along -P_dot, i.e. the
+        // right-hand side G * P_ddot of the differentiated Sobolev system
+        void differentiateSobolevRHS(Eigen::MatrixXd &P_dot, Eigen::MatrixXd &l2Gradient, BVHNode3D* root,
+            double epsilon, Eigen::VectorXd &rhs);
         double BackprojectConstraints(Eigen::PartialPivLU<Eigen::MatrixXd> &lu);
+        // Sets mg_tolerance and mg_backproj_threshold for this iteration from the
+        // projected gradient; the constraint projector must be up to date.
+        void updateSolveTolerance(Eigen::MatrixXd &l2gradients);
+        // Logs the products used by this iteration's solves, and roughly how many
+        // the fixed reference tolerance would have needed (only when profiling).
+        void reportSolveTolerance();
     };
 
     template<typename Domain, typename Smoother>
@@ -140,7 +213,7 @@ namespace LWS {
         // we really want to solve PGPx = Pb
         gradients3x = curveNetwork->constraintProjector->ProjectToNullspace(gradients3x);
         // Solve PGPx = Pb using multigrid
-        Eigen::VectorXd sobolevGradients = solver->template VCycleSolve<Smoother>(gradients3x, tol);
+        Eigen::VectorXd sobolevGradients = MultigridSolve<Smoother>(solver, gradients3x, tol);
         // Compute dot product with unprojected gradient, and copy into results vector
         double soboDot = gradients3x.dot(sobolevGradients); 
         // double dirDot = soboDot / (gradients3x.norm() * sobolevGradients.norm());
@@ -163,6 +236,7 @@ namespace LWS {
             Vector3 cur = p->Position();
             p->SetPosition(cur + SelectRow(correction, i));
         }
+        curveNetwork->UpdateGeometry();
         // Add length violations to RHS
         double maxViolation = constraint.FillConstraintValues(phi, constraintTargets, 0);
         std::cout << "  Constraint value = " << maxViolation << std::endl;
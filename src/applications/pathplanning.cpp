@@ -1,6 +1,7 @@
 #include "applications/pathplanning.h"
 #include <iostream>
 #include <fstream>
+#include <unordered_set>
 
 namespace LWS {
     namespace Applications {
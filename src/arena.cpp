@@ -0,0 +1,126 @@
+#include "arena.h"
+
+#include <omp.h>
+#include <algorithm>
+#include <cstdint>
+
+namespace LWS {
+
+    MonotonicArena::MonotonicArena(size_t blockBytes_) {
+        current = 0;
+        offset = 0;
+        blockBytes = blockBytes_;
+        numAllocations = 0;
+        bytesUsed = 0;
+    }
+
+    MonotonicArena::~MonotonicArena() {
+        freeBlocks();
+    }
+
+    void* MonotonicArena::Allocate(size_t bytes, size_t align) {
+        numAllocations++;
+        bytesUsed += bytes;
+
+        // Try the current block, then any blocks left over from before a Rewind
+        while (current < blocks.size()) {
+            Block &b = blocks[current];
+            uintptr_t base = reinterpret_cast<uintptr_t>(b.data);
+            size_t start = ((base + offset + align - 1) & ~(uintptr_t)(align - 1)) - base;
+            if (start + bytes <= b.size) {
+                offset = start + bytes;
+                return b.data + start;
+            }
+            if (current + 1 == blocks.size()) break;
+            current++;
+            offset = 0;
+        }
+
+        // Grow geometrically, so an iteration needs few blocks even before Reset merges them
+        addBlock(std::max(bytes + align, blockBytes));
+        blockBytes = 2 * blocks.back().size;
+        Block &b = blocks[current];
+        uintptr_t base = reinterpret_cast<uintptr_t>(b.data);
+        size_t start = ((base + align - 1) & ~(uintptr_t)(align - 1)) - base;
+        offset = start + bytes;
+        return b.data + start;
+    }
+
+    void MonotonicArena::Reserve(size_t bytes) {
+        while (current < blocks.size() && blocks[current].size - offset < bytes) {
+            if (current + 1 == blocks.size()) break;
+            current++;
+            offset = 0;
+        }
+        if (blocks.empty() || blocks[current].size - offset < bytes) {
+            addBlock(bytes);
+        }
+    }
+
+    void MonotonicArena::Reset() {
+        // Merge the blocks, so that an iteration that needs as much memory as
+        // this one did fits in a single block
+        if (blocks.size() > 1) {
+            size_t total = 0;
+            for (const Block &b : blocks) total += b.size;
+            freeBlocks();
+            addBlock(total);
+        }
+        current = 0;
+        offset = 0;
+        numAllocations = 0;
+        bytesUsed = 0;
+
+        for (std::unique_ptr<MonotonicArena> &sub : threadArenas) {
+            sub->Reset();
+        }
+    }
+
+    void MonotonicArena::ReserveThreads(int n) {
+        while ((int)threadArenas.size() < n) {
+            threadArenas.push_back(std::unique_ptr<MonotonicArena>(new MonotonicArena()));
+        }
+    }
+
+    MonotonicArena& MonotonicArena::Local() {
+        return *threadArenas[omp_get_thread_num()];
+    }
+
+    size_t MonotonicArena::NumAllocations() const {
+        size_t total = numAllocations;
+        for (const std::unique_ptr<MonotonicArena> &sub : threadArenas) {
+            total += sub->NumAllocations();
+        }
+        return total;
+    }
+
+    size_t MonotonicArena::BytesUsed() const {
+        size_t total = bytesUsed;
+        for (const std::unique_ptr<MonotonicArena> &sub : threadArenas) {
+            total += sub->BytesUsed();
+        }
+        return total;
+    }
+
+    size_t MonotonicArena::BytesReserved() const {
+        size_t total = 0;
+        for (const Block &b : blocks) total += b.size;
+        for (const std::unique_ptr<MonotonicArena> &sub : threadArenas) {
+            total += sub->BytesReserved();
+        }
+        return total;
+    }
+
+    void MonotonicArena::addBlock(size_t bytes) {
+        blocks.push_back(Block{static_cast<char*>(::operator new(bytes)), bytes});
+        current = blocks.size() - 1;
+        offset = 0;
+    }
+
+    void MonotonicArena::freeBlocks() {
+        for (const Block &b : blocks) {
+            ::operator delete(b.data);
+        }
+        blocks.clear();
+    }
+}
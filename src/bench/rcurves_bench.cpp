@@ -0,0 +1,576 @@
+#include "args/args.hxx"
+
+#include "bench/synthetic_curves.h"
+#include "tpe_flow_sc.h"
+#include "lws_options.h"
+#include "tpe_energy_sc.h"
+#include "spatial/tpe_bvh.h"
+#include "product/block_cluster_tree.h"
+#include "multigrid/constraint_projector_domain.h"
+#include "multigrid/krylov_solvers.h"
+#include "libgmultigrid/multigrid_hierarchy.h"
+#include "sobo_slobo.h"
+#include "obstacles/mesh_obstacle.h"
+#include "spatial/triangle_bvh.h"
+#include "implicit_csg.h"
+#include "geometrycentral/surface/meshio.h"
+
+#include <omp.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+
+using namespace LWS;
+
+namespace {
+
+    struct BenchConfig {
+        double alpha;
+        double beta;
+        double sep;
+        int reps;
+        unsigned int seed;
+        // Sizes above these are skipped for the quadratic-cost benchmarks
+        int maxDirectEdges;
+        int maxDenseVerts;
+    };
+
+    struct BenchResult {
+        std::string curve;
+        std::string bench;
+        int edges;
+        int threads;
+        int reps;
+        double minMs;
+        double medianMs;
+        double meanMs;
+    };
+
+    using MultigridDomain = ConstraintProjectorDomain<VariableConstraintSet>;
+    using MultigridSolver = MultigridHierarchy<MultigridDomain>;
+
+    double elapsedMs(std::chrono::steady_clock::time_point start) {
+        using namespace std::chrono;
+        return duration_cast<nanoseconds>(steady_clock::now() - start).count() / 1e6;
+    }
+
+    // Runs setup (untimed) and then the timed operation, once as a warmup and
+    // then `reps` times.
+    BenchResult runTimed(const BenchConfig &config, std::function<void()> setup, std::function<void()> op) {
+        std::vector<double> times;
+        for (int r = 0; r <= config.reps; r++) {
+            if (setup) setup();
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            op();
+            double t = elapsedMs(start);
+            if (r > 0) times.push_back(t);
+        }
+        std::sort(times.begin(), times.end());
+        BenchResult result;
+        result.reps = times.size();
+        result.minMs = times.front();
+        result.medianMs = times[times.size() / 2];
+        double sum = 0;
+        for (double t : times) sum += t;
+        result.meanMs = sum / times.size();
+        return result;
+    }
+
+    // Runs single V-cycles as a stationary iteration, x += V(b - A x), until the
+    // residual falls by a factor of 100 or 50 cycles have run. Returns the number
+    // of cycles, and sets factor to the mean residual reduction per cycle.
+    int measureVCycles(MultigridSolver* multigrid, const Eigen::VectorXd &b, double &factor) {
+        Product::MatrixReplacement<MultigridDomain::MultType> A(multigrid->GetTopLevelMultiplier(), multigrid->NumRows());
+        Eigen::VectorXd x = Eigen::VectorXd::Zero(b.rows());
+        Eigen::VectorXd r = b;
+        double r0 = b.norm();
+        double rNorm = r0;
+        int cycles = 0;
+        while (cycles < 50 && rNorm > 1e-2 * r0) {
+            // A tolerance this loose stops VCycleSolve after its first cycle
+            x += multigrid->VCycleSolve<MultigridSolver::EigenCG>(r, 0.99);
+            r = b - A * x;
+            rNorm = r.norm();
+            cycles++;
+        }
+        factor = (cycles > 0 && r0 > 0) ? std::pow(rNorm / r0, 1.0 / cycles) : 0;
+        return cycles;
+    }
+
+    void jitterPositions(PolyCurveNetwork* curves, std::mt19937 &rng, double scale) {
+        std::uniform_real_distribution<double> uniform(-scale, scale);
+        for (int i = 0; i < curves->NumVertices(); i++) {
+            for (int j = 0; j < 3; j++) {
+                curves->positions(i, j) += uniform(rng);
+            }
+        }
+        curves->UpdateGeometry();
+    }
+
+    double averageEdgeLength(PolyCurveNetwork* curves) {
+        return curves->TotalLength() / curves->NumEdges();
+    }
+
+    std::vector<std::string> splitList(const std::string &list) {
+        std::vector<std::string> items;
+        std::stringstream ss(list);
+        std::string item;
+        while (std::getline(ss, item, ',')) {
+            if (!item.empty()) items.push_back(item);
+        }
+        return items;
+    }
+
+    std::vector<int> parseIntList(const std::string &list) {
+        std::vector<int> values;
+        for (const std::string &item : splitList(list)) {
+            // Allow shorthands like 10k and 10M
+            double scale = 1;
+            std::string digits = item;
+            char last = digits.back();
+            if (last == 'k' || last == 'K') scale = 1e3;
+            if (last == 'm' || last == 'M') scale = 1e6;
+            if (scale > 1) digits.pop_back();
+            values.push_back((int)(std::stod(digits) * scale));
+        }
+        return values;
+    }
+
+    // Runs every selected benchmark on one curve, appending results.
+    void benchCurve(const std::string &curveName, PolyCurveNetwork* curves, const BenchConfig &config,
+    const std::vector<std::string> &selected, int threads, MeshObstacle* obstacle, std::vector<BenchResult> &results) {
+        auto enabled = [&](const std::string &name) {
+            return selected.empty() || std::find(selected.begin(), selected.end(), name) != selected.end();
+        };
+        int nVerts = curves->NumVertices();
+        int nEdges = curves->NumEdges();
+        std::mt19937 rng(config.seed);
+        double jitter = 1e-3 * averageEdgeLength(curves);
+
+        auto record = [&](const std::string &name, BenchResult r) {
+            r.curve = curveName;
+            r.bench = name;
+            r.edges = nEdges;
+            r.threads = threads;
+            results.push_back(r);
+            std::cout << "  " << std::left << std::setw(22) << name << std::right << std::fixed << std::setprecision(3)
+                << std::setw(12) << r.medianMs << " ms (min " << r.minMs << ")" << std::endl;
+        };
+
+        BVHNode3D* vertexBVH = CreateBVHFromCurve(curves);
+        BVHNode3D* edgeBVH = CreateEdgeBVHFromCurve(curves);
+
+        if (enabled("bvh_build")) {
+            record("bvh_build", runTimed(config, 0, [&]() {
+                delete CreateBVHFromCurve(curves);
+            }));
+        }
+        if (enabled("geometry_update")) {
+            record("geometry_update", runTimed(config, 0, [&]() {
+                curves->UpdateGeometry();
+            }));
+        }
+        if (enabled("bvh_refit")) {
+            record("bvh_refit", runTimed(config, [&]() { jitterPositions(curves, rng, jitter); }, [&]() {
+                vertexBVH->recomputeCentersOfMass(curves);
+            }));
+        }
+        if (enabled("energy_bh")) {
+            record("energy_bh", runTimed(config, 0, [&]() {
+                SpatialTree::TPEnergyBH(curves, vertexBVH, config.alpha, config.beta);
+            }));
+        }
+        Eigen::MatrixXd gradient(nVerts, 3);
+        if (enabled("gradient_bh")) {
+            record("gradient_bh", runTimed(config, [&]() { gradient.setZero(); }, [&]() {
+                SpatialTree::TPEGradientBarnesHut(curves, vertexBVH, gradient, config.alpha, config.beta);
+            }));
+        }
+        if (nEdges <= config.maxDirectEdges) {
+            if (enabled("energy_direct")) {
+                record("energy_direct", runTimed(config, 0, [&]() {
+                    TPESC::tpe_total(curves, config.alpha, config.beta);
+                }));
+            }
+            if (enabled("gradient_direct")) {
+                record("gradient_direct", runTimed(config, [&]() { gradient.setZero(); }, [&]() {
+                    TPESC::FillGradientVectorDirect(curves, gradient, config.alpha, config.beta);
+                }));
+            }
+        }
+
+        if (obstacle) {
+            if (enabled("obstacle_energy")) {
+                record("obstacle_energy", runTimed(config, 0, [&]() {
+                    obstacle->ComputeEnergy(curves);
+                }));
+                // Accuracy of the far-field target, against a traversal that opens every node
+                double approx = obstacle->ComputeEnergy(curves);
+                double savedTarget = TriangleBVH::errorTarget;
+                TriangleBVH::errorTarget = 0;
+                double reference = obstacle->ComputeEnergy(curves);
+                TriangleBVH::errorTarget = savedTarget;
+                std::cout << "  obstacle energy relative error " << std::scientific << std::setprecision(2)
+                    << fabs(approx - reference) / fabs(reference) << " at target " << savedTarget << std::endl;
+            }
+            if (enabled("obstacle_gradient")) {
+                record("obstacle_gradient", runTimed(config, [&]() { gradient.setZero(); }, [&]() {
+                    obstacle->AddGradient(curves, gradient);
+                }));
+            }
+            if (enabled("obstacle_energy_legacy")) {
+                record("obstacle_energy_legacy", runTimed(config, 0, [&]() {
+                    obstacle->ComputeEnergyLegacy(curves);
+                }));
+            }
+            if (enabled("obstacle_gradient_legacy")) {
+                record("obstacle_gradient_legacy", runTimed(config, [&]() { gradient.setZero(); }, [&]() {
+                    obstacle->AddGradientLegacy(curves, gradient);
+                }));
+            }
+        }
+
+        if (enabled("surface_scalar") || enabled("surface_batch") || enabled("surface_static")) {
+            // A torus blended with a sphere, evaluated at every vertex as the surface constraint does
+            Vector3 center = curves->Barycenter();
+            ImplicitTorus torus(1, 0.25, center);
+            ImplicitSphere sphere(0.5, center + Vector3{1, 0, 0});
+            ImplicitSmoothUnion runtimeUnion(&torus, &sphere, 0.2);
+            StaticSmoothUnion<ImplicitTorus, ImplicitSphere> staticUnion = MakeSmoothUnion(torus, sphere, 0.2);
+
+            std::vector<double> x(nVerts), y(nVerts), z(nVerts);
+            std::vector<double> dist(nVerts), gx(nVerts), gy(nVerts), gz(nVerts);
+            for (int i = 0; i < nVerts; i++) {
+                Vector3 p = curves->Position(curves->GetVertex(i));
+                x[i] = p.x;
+                y[i] = p.y;
+                z[i] = p.z;
+            }
+
+            if (enabled("surface_scalar")) {
+                ImplicitSurface* surface = &runtimeUnion;
+                record("surface_scalar", runTimed(config, 0, [&]() {
+                    for (int i = 0; i < nVerts; i++) {
+                        Vector3 p{x[i], y[i], z[i]};
+                        dist[i] = surface->SignedDistance(p);
+                        Vector3 g = surface->GradientOfDistance(p);
+                        gx[i] = g.x;
+                        gy[i] = g.y;
+                        gz[i] = g.z;
+                    }
+                }));
+            }
+            if (enabled("surface_batch")) {
+                ImplicitSurface* surface = &runtimeUnion;
+                record("surface_batch", runTimed(config, 0, [&]() {
+                    surface->SignedDistances(x.data(), y.data(), z.data(), nVerts, dist.data());
+                    surface->GradientsOfDistance(x.data(), y.data(), z.data(), nVerts, gx.data(), gy.data(), gz.data());
+                }));
+            }
+            if (enabled("surface_static")) {
+                record("surface_static", runTimed(config, 0, [&]() {
+                    staticUnion.SignedDistances(x.data(), y.data(), z.data(), nVerts, dist.data());
+                    staticUnion.GradientsOfDistance(x.data(), y.data(), z.data(), nVerts, gx.data(), gy.data(), gz.data());
+                }));
+            }
+        }
+
+        if (enabled("bct_build")) {
+            record("bct_build", runTimed(config, 0, [&]() {
+                BlockClusterTree tree(curves, edgeBVH, config.sep, config.alpha, config.beta);
+            }));
+        }
+        if (enabled("bct_multiply")) {
+            BlockClusterTree tree(curves, edgeBVH, config.sep, config.alpha, config.beta);
+            tree.SetBlockTreeMode(BlockTreeMode::Matrix3Only);
+            Eigen::VectorXd v = Eigen::VectorXd::Random(3 * nVerts);
+            Eigen::VectorXd b(3 * nVerts);
+            record("bct_multiply", runTimed(config, [&]() { b.setZero(); }, [&]() {
+                tree.Multiply(v, b);
+            }));
+        }
+
+        if (enabled("constraint_assembly")) {
+            VariableConstraintSet constraints(curves);
+            Eigen::SparseMatrix<double> B;
+            record("constraint_assembly", runTimed(config, 0, [&]() {
+                constraints.FillConstraintMatrix(B);
+            }));
+        }
+        if (enabled("constraint_refresh")) {
+            curves->GetConstraintMatrix();
+            record("constraint_refresh", runTimed(config, [&]() { jitterPositions(curves, rng, jitter); }, [&]() {
+                curves->GetConstraintMatrix();
+            }));
+        }
+
+        if (enabled("constraint_factorize")) {
+            curves->UpdateConstraintProjector();
+            record("constraint_factorize", runTimed(config, [&]() { jitterPositions(curves, rng, jitter); }, [&]() {
+                curves->UpdateConstraintProjector();
+            }));
+        }
+
+        // The Sobolev gradient of the L2 gradient is the input to the solves below
+        gradient.setZero();
+        SpatialTree::TPEGradientBarnesHut(curves, vertexBVH, gradient, config.alpha, config.beta);
+
+        if (enabled("mg_setup") || enabled("mg_solve") || enabled("mg_solve_chebyshev") || enabled("mg_solve_jacobi")
+            || enabled("mg_solve_fgmres") || enabled("mg_solve_fgmres_jacobi") || enabled("constraint_projection")) {
+            MultigridSolver* multigrid = 0;
+            BenchResult setup = runTimed(config, [&]() { if (multigrid) delete multigrid; }, [&]() {
+                MultigridDomain* domain = new MultigridDomain(curves, config.alpha, config.beta, config.sep);
+                multigrid = new MultigridSolver(domain, domain->NumLevelsForCache());
+            });
+            if (enabled("mg_setup")) {
+                record("mg_setup", setup);
+                MultigridDomain domain(curves, config.alpha, config.beta, config.sep);
+                int levels = domain.NumLevelsForCache();
+                std::cout << "  " << levels << " levels, coarsest " << domain.CoarsestVertices()
+                    << " vertices (at most " << (int)domain.MaxCoarseVertices() << " fit in "
+                    << MultigridDomain::CoarseSolveCacheBytes() / 1024 << " KiB)" << std::endl;
+            }
+
+            // Times the solve, then runs it once more to count its matrix-vector
+            // products on every level, so the smoothers can be compared by work
+            // as well as by time
+            auto benchSolve = [&](const std::string &name, std::function<void(Eigen::MatrixXd&, Eigen::MatrixXd&)> solve) {
+                Eigen::MatrixXd output(nVerts, 3);
+                record(name, runTimed(config, 0, [&]() {
+                    Eigen::MatrixXd input = gradient;
+                    solve(input, output);
+                }));
+                uint64_t before = BlockClusterTree::numProducts.load();
+                Eigen::MatrixXd input = gradient;
+                solve(input, output);
+                std::cout << "    " << (BlockClusterTree::numProducts.load() - before) << " products per solve" << std::endl;
+            };
+            TPEFlowSolverSC solver(curves, config.alpha, config.beta);
+
+            if (enabled("mg_solve")) {
+                benchSolve("mg_solve", [&](Eigen::MatrixXd &input, Eigen::MatrixXd &output) {
+                    solver.ProjectGradientMultigrid<MultigridDomain, MultigridSolver::EigenCG>(input, multigrid, output, 1e-2);
+                });
+            }
+            // The same solve with the other smoothers and Krylov wrappers
+            if (enabled("mg_solve_chebyshev")) {
+                using Chebyshev = ChebyshevSmoother<Product::MatrixReplacement<MultigridDomain::MultType>>;
+                benchSolve("mg_solve_chebyshev", [&](Eigen::MatrixXd &input, Eigen::MatrixXd &output) {
+                    solver.ProjectGradientMultigrid<MultigridDomain, Chebyshev>(input, multigrid, output, 1e-2);
+                });
+            }
+            if (enabled("mg_solve_jacobi")) {
+                benchSolve("mg_solve_jacobi", [&](Eigen::MatrixXd &input, Eigen::MatrixXd &output) {
+                    solver.ProjectGradientMultigrid<MultigridDomain, BlockJacobiVCycles>(input, multigrid, output, 1e-2);
+                });
+            }
+            if (enabled("mg_solve_fgmres")) {
+                benchSolve("mg_solve_fgmres", [&](Eigen::MatrixXd &input, Eigen::MatrixXd &output) {
+                    solver.ProjectGradientMultigrid<MultigridDomain, FGMRESSolver<VCyclePreconditioner>>(input, multigrid, output, 1e-2);
+                });
+            }
+            if (enabled("mg_solve_fgmres_jacobi")) {
+                benchSolve("mg_solve_fgmres_jacobi", [&](Eigen::MatrixXd &input, Eigen::MatrixXd &output) {
+                    solver.ProjectGradientMultigrid<MultigridDomain, FGMRESSolver<BlockJacobiPreconditioner>>(input, multigrid, output, 1e-2);
+                });
+            }
+            if (enabled("constraint_projection")) {
+                Eigen::VectorXd v = Eigen::VectorXd::Random(3 * nVerts);
+                record("constraint_projection", runTimed(config, 0, [&]() {
+                    Eigen::VectorXd projected = curves->constraintProjector->ProjectToNullspace(v);
+                }));
+            }
+            delete multigrid;
+        }
+
+        // Setup time and V-cycle convergence with the geometric coarsening, and
+        // with the BFS-parity coarsening it replaced
+        for (bool legacy : {false, true}) {
+            std::string name = legacy ? "mg_convergence_legacy" : "mg_convergence";
+            if (!enabled(name)) continue;
+            MultigridSolver* multigrid = 0;
+            record(name, runTimed(config, [&]() { if (multigrid) delete multigrid; }, [&]() {
+                MultigridDomain* domain = new MultigridDomain(curves, config.alpha, config.beta, config.sep);
+                domain->legacyCoarsening = legacy;
+                multigrid = new MultigridSolver(domain, domain->NumLevelsForCache());
+            }));
+
+            Eigen::VectorXd b(3 * nVerts);
+            MatrixIntoVectorX3(gradient, b);
+            b = curves->constraintProjector->ProjectToNullspace(b);
+            double factor = 0;
+            int cycles = measureVCycles(multigrid, b, factor);
+            std::cout << "    " << cycles << " V-cycles to reduce the residual 100x, convergence factor "
+                << std::setprecision(3) << factor << " per cycle" << std::endl;
+            delete multigrid;
+        }
+
+        if (enabled("line_search") || enabled("line_search_parallel")) {
+            // One full line search along the L2 gradient, serially and with one
+            // candidate step per group of threads (--ls-candidates 4)
+            TPEFlowSolverSC solver(curves, config.alpha, config.beta);
+            Eigen::MatrixXd startPositions = curves->positions;
+            Eigen::MatrixXd direction;
+            auto reset = [&]() {
+                curves->positions = startPositions;
+                curves->UpdateGeometry();
+                vertexBVH->recomputeCentersOfMass(curves);
+                direction = gradient;
+            };
+            int savedCandidates = LWSOptions::lineSearchCandidates;
+            if (enabled("line_search")) {
+                LWSOptions::lineSearchCandidates = 1;
+                record("line_search", runTimed(config, reset, [&]() {
+                    solver.LineSearchStep(direction, 1, vertexBVH, true);
+                }));
+            }
+            if (enabled("line_search_parallel")) {
+                LWSOptions::lineSearchCandidates = 4;
+                record("line_search_parallel", runTimed(config, reset, [&]() {
+                    solver.LineSearchStep(direction, 1, vertexBVH, true);
+                }));
+            }
+            LWSOptions::lineSearchCandidates = savedCandidates;
+            reset();
+        }
+
+        if (nVerts <= config.maxDenseVerts) {
+            VariableConstraintSet constraints(curves);
+            Eigen::MatrixXd A;
+            if (enabled("dense_assembly")) {
+                record("dense_assembly", runTimed(config, 0, [&]() {
+                    SobolevCurves::Sobolev3XWithConstraints(curves, constraints, config.alpha, config.beta, A);
+                }));
+            }
+            if (enabled("dense_factor")) {
+                if (A.rows() == 0) SobolevCurves::Sobolev3XWithConstraints(curves, constraints, config.alpha, config.beta, A);
+                Eigen::PartialPivLU<Eigen::MatrixXd> lu;
+                record("dense_factor", runTimed(config, 0, [&]() {
+                    lu.compute(A);
+                }));
+            }
+        }
+
+        delete vertexBVH;
+        delete edgeBVH;
+    }
+
+    void writeCSV(const std::string &fname, const std::vector<BenchResult> &results) {
+        std::ofstream out(fname);
+        out << "curve,edges,threads,bench,reps,min_ms,median_ms,mean_ms,edges_per_s" << std::endl;
+        for (const BenchResult &r : results) {
+            out << r.curve << "," << r.edges << "," << r.threads << "," << r.bench << "," << r.reps << ","
+                << r.minMs << "," << r.medianMs << "," << r.meanMs << "," << (r.edges / (r.medianMs / 1000)) << std::endl;
+        }
+        std::cout << "Wrote " << results.size() << " results to " << fname << std::endl;
+    }
+
+    void writeJSON(const std::string &fname, const std::vector<BenchResult> &results, const BenchConfig &config) {
+        std::ofstream out(fname);
+        out << "{\n  \"alpha\": " << config.alpha << ", \"beta\": " << config.beta << ", \"sep\": " << config.sep
+            << ", \"seed\": " << config.seed << ",\n  \"results\": [";
+        for (size_t i = 0; i < results.size(); i++) {
+            const BenchResult &r = results[i];
+            out << (i == 0 ? "\n" : ",\n") << "    {\"curve\": \"" << r.curve << "\", \"edges\": " << r.edges
+                << ", \"threads\": " << r.threads << ", \"bench\": \"" << r.bench << "\", \"reps\": " << r.reps
+                << ", \"min_ms\": " << r.minMs << ", \"median_ms\": " << r.medianMs << ", \"mean_ms\": " << r.meanMs << "}";
+        }
+        out << "\n  ]\n}" << std::endl;
+        std::cout << "Wrote " << results.size() << " results to " << fname << std::endl;
+    }
+}
+
+int main(int argc, char **argv) {
+    args::ArgumentParser parser("Benchmarks the solver's hot paths on synthetic curves.",
+        "Benchmarks: bvh_build, geometry_update, bvh_refit, energy_bh, gradient_bh, energy_direct, gradient_direct, bct_build, "
+        "bct_multiply, surface_scalar, surface_batch, surface_static, constraint_assembly, constraint_refresh, "
+        "constraint_factorize, mg_setup, mg_convergence, mg_convergence_legacy, "
+        "mg_solve, mg_solve_chebyshev, mg_solve_jacobi, mg_solve_fgmres, mg_solve_fgmres_jacobi, constraint_projection, "
+        "line_search, line_search_parallel, "
+        "dense_assembly, dense_factor; with --obstacle, also "
+        "obstacle_energy, obstacle_gradient and their _legacy versions.");
+    args::HelpFlag help(parser, "help", "Display this help menu", {'h', "help"});
+    args::ValueFlag<std::string> curvesFlag(parser, "curves", "Comma-separated curve families: helix, knot, lattice (default all)", {"curves"});
+    args::ValueFlag<std::string> sizesFlag(parser, "sizes", "Comma-separated edge counts, e.g. 1k,10k,1M (default 1k,10k,100k)", {"sizes"});
+    args::ValueFlag<std::string> benchFlag(parser, "bench", "Comma-separated benchmarks to run (default all)", {"bench"});
+    args::ValueFlag<std::string> threadsFlag(parser, "threads", "Comma-separated thread counts to sweep (default: all available)", {"threads"});
+    args::ValueFlag<int> repsFlag(parser, "reps", "Timed repetitions per benchmark (default 5)", {"reps"});
+    args::ValueFlag<unsigned int> seedFlag(parser, "seed", "Random seed (default 1)", {"seed"});
+    args::ValueFlag<double> alphaFlag(parser, "alpha", "Energy exponent alpha (default 3)", {"alpha"});
+    args::ValueFlag<double> betaFlag(parser, "beta", "Energy exponent beta (default 6)", {"beta"});
+    args::ValueFlag<double> sepFlag(parser, "sep", "Block cluster tree separation parameter (default 1)", {"sep"});
+    args::ValueFlag<int> maxDirectFlag(parser, "edges", "Largest curve for direct energy and gradient (default 20000)", {"max-direct"});
+    args::ValueFlag<int> maxDenseFlag(parser, "verts", "Largest curve for dense assembly and factorization (default 2000)", {"max-dense"});
+    args::ValueFlag<std::string> obstacleFlag(parser, "mesh", "Mesh to use for the obstacle benchmarks", {"obstacle"});
+    args::ValueFlag<std::string> csvFlag(parser, "csv", "Write results to this CSV file", {"csv"});
+    args::ValueFlag<std::string> jsonFlag(parser, "json", "Write results to this JSON file", {"json"});
+
+    try {
+        parser.ParseCLI(argc, argv);
+    }
+    catch (args::Help) {
+        std::cout << parser;
+        return 0;
+    }
+    catch (args::ParseError e) {
+        std::cerr << e.what() << std::endl;
+        std::cerr << parser;
+        return 1;
+    }
+
+    BenchConfig config;
+    config.alpha = alphaFlag ? alphaFlag.Get() : 3;
+    config.beta = betaFlag ? betaFlag.Get() : 6;
+    config.sep = sepFlag ? sepFlag.Get() : 1;
+    config.reps = std::max(1, repsFlag ? repsFlag.Get() : 5);
+    config.seed = seedFlag ? seedFlag.Get() : 1;
+    config.maxDirectEdges = maxDirectFlag ? maxDirectFlag.Get() : 20000;
+    config.maxDenseVerts = maxDenseFlag ? maxDenseFlag.Get() : 2000;
+
+    std::vector<std::string> curveNames = splitList(curvesFlag ? curvesFlag.Get() : "helix,knot,lattice");
+    std::vector<int> sizes = parseIntList(sizesFlag ? sizesFlag.Get() : "1k,10k,100k");
+    std::vector<std::string> selected = splitList(benchFlag ? benchFlag.Get() : "");
+    std::vector<int> threadCounts = threadsFlag ? parseIntList(threadsFlag.Get()) : std::vector<int>{omp_get_max_threads()};
+
+    MeshObstacle* obstacle = 0;
+    if (obstacleFlag) {
+        using namespace geometrycentral::surface;
+        std::unique_ptr<HalfedgeMesh> mesh;
+        std::unique_ptr<VertexPositionGeometry> geometry;
+        std::tie(mesh, geometry) = loadMesh(obstacleFlag.Get());
+        std::shared_ptr<HalfedgeMesh> meshShared(std::move(mesh));
+        std::shared_ptr<VertexPositionGeometry> geomShared(std::move(geometry));
+        geomShared->requireVertexPositions();
+        geomShared->requireVertexNormals();
+        geomShared->requireVertexDualAreas();
+        obstacle = new MeshObstacle(meshShared, geomShared, config.beta - config.alpha, 1);
+    }
+
+    std::vector<BenchResult> results;
+    for (const std::string &curveName : curveNames) {
+        for (int size : sizes) {
+            PolyCurveNetwork* curves = SyntheticCurves::Create(curveName, size, config.seed);
+            if (!curves) {
+                std::cerr << "Unknown curve family " << curveName << std::endl;
+                return 1;
+            }
+            for (int threads : threadCounts) {
+                omp_set_num_threads(threads);
+                std::cout << "== " << curveName << ", " << curves->NumEdges() << " edges, " << threads << " threads" << std::endl;
+                benchCurve(curveName, curves, config, selected, threads, obstacle, results);
+            }
+            delete curves;
+        }
+    }
+
+    if (obstacle) delete obstacle;
+    if (csvFlag) writeCSV(csvFlag.Get(), results);
+    if (jsonFlag) writeJSON(jsonFlag.Get(), results, config);
+    return 0;
+}
@@ -0,0 +1,315 @@
+#include "args/args.hxx"
+
+#include "bench/synthetic_curves.h"
+#include "curve_io.h"
+#include "curve_binary.h"
+#include "tpe_energy_sc.h"
+#include "spatial/tpe_bvh.h"
+#include "product/block_cluster_tree.h"
+#include "sobo_slobo.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+using namespace LWS;
+
+namespace {
+
+    // One parameter setting of one approximation, measured against the exact path.
+    struct SweepRow {
+        std::string kind;
+        double param;
+        // Relative error of the gradient (Barnes-Hut) or of the metric product (BCT)
+        double error;
+        // Relative error of the energy; Barnes-Hut only
+        double energyError;
+        double buildMs;
+        double evalMs;
+        uint64_t bytes;
+        uint64_t kernels;
+        size_t admissible;
+        size_t inadmissible;
+        bool pareto;
+    };
+
+    double elapsedMs(std::chrono::steady_clock::time_point start) {
+        using namespace std::chrono;
+        return duration_cast<nanoseconds>(steady_clock::now() - start).count() / 1e6;
+    }
+
+    std::vector<double> parseDoubleList(const std::string &list) {
+        std::vector<double> values;
+        std::stringstream ss(list);
+        std::string item;
+        while (std::getline(ss, item, ',')) {
+            if (!item.empty()) values.push_back(std::stod(item));
+        }
+        return values;
+    }
+
+    PolyCurveNetwork* loadCurve(const std::string &fname) {
+        if (fname.size() > 4 && fname.substr(fname.size() - 4) == ".rcn") {
+            CurveIO::MappedCurveFile file;
+            if (!file.Open(fname)) return 0;
+            return file.CreateCurve();
+        }
+        std::vector<Vector3> positions;
+        std::vector<std::array<size_t, 2>> edges;
+        CurveIO::readVerticesAndEdges(fname, positions, edges);
+        if (positions.empty()) {
+            std::cerr << "No vertices read from " << fname << std::endl;
+            return 0;
+        }
+        PolyCurveNetwork* curves = new PolyCurveNetwork(positions, edges);
+        curves->pinnedAllToSurface = false;
+        return curves;
+    }
+
+    // Marks the rows of the given kind that no other row of that kind beats
+    // in both error and total time.
+    void markPareto(std::vector<SweepRow> &rows, const std::string &kind) {
+        for (SweepRow &r : rows) {
+            if (r.kind != kind) continue;
+            r.pareto = true;
+            double cost = r.buildMs + r.evalMs;
+            for (const SweepRow &o : rows) {
+                if (&o == &r || o.kind != kind) continue;
+                double otherCost = o.buildMs + o.evalMs;
+                bool noWorse = o.error <= r.error && otherCost <= cost;
+                bool better = o.error < r.error || otherCost < cost;
+                if (noWorse && better) {
+                    r.pareto = false;
+                    break;
+                }
+            }
+        }
+    }
+
+    void printRows(const std::vector<SweepRow> &rows, const std::string &kind, const std::string &paramName) {
+        std::ios::fmtflags flags = std::cout.flags();
+        std::cout << std::left << std::setw(8) << paramName << std::right << std::setw(14) << "error"
+            << std::setw(12) << "build ms" << std::setw(12) << "eval ms" << std::setw(14) << "bytes"
+            << std::setw(14) << "kernels" << "  pareto" << std::endl;
+        for (const SweepRow &r : rows) {
+            if (r.kind != kind) continue;
+            std::cout.flags(flags);
+            std::cout << std::left << std::setw(8) << r.param << std::right << std::scientific << std::setprecision(3)
+                << std::setw(14) << r.error << std::fixed << std::setw(12) << r.buildMs << std::setw(12) << r.evalMs
+                << std::setw(14) << r.bytes << std::setw(14) << r.kernels << (r.pareto ? "  *" : "") << std::endl;
+        }
+        std::cout.flags(flags);
+    }
+
+    void writeCSV(const std::string &fname, const std::vector<SweepRow> &rows) {
+        std::ofstream out(fname);
+        out << "kind,param,error,energy_error,build_ms,eval_ms,bytes,kernel_evals,admissible,inadmissible,pareto" << std::endl;
+        for (const SweepRow &r : rows) {
+            out << r.kind << "," << r.param << "," << r.error << ",";
+            if (r.kind == "bh") out << r.energyError;
+            out << "," << r.buildMs << "," << r.evalMs << "," << r.bytes << "," << r.kernels << ","
+                << r.admissible << "," << r.inadmissible << "," << (r.pareto ? 1 : 0) << std::endl;
+        }
+        std::cout << "Wrote " << rows.size() << " settings to " << fname << std::endl;
+    }
+
+    void writeJSON(const std::string &fname, const std::vector<SweepRow> &rows, const std::string &curveName,
+    int nEdges, double alpha, double beta) {
+        std::ofstream out(fname);
+        out << "{\n  \"curve\": \"" << curveName << "\", \"edges\": " << nEdges
+            << ", \"alpha\": " << alpha << ", \"beta\": " << beta << ",\n  \"settings\": [";
+        for (size_t i = 0; i < rows.size(); i++) {
+            const SweepRow &r = rows[i];
+            out << (i == 0 ? "\n" : ",\n") << "    {\"kind\": \"" << r.kind << "\", \"param\": " << r.param
+                << ", \"error\": " << r.error;
+            if (r.kind == "bh") out << ", \"energy_error\": " << r.energyError;
+            out << ", \"build_ms\": " << r.buildMs << ", \"eval_ms\": " << r.evalMs << ", \"bytes\": " << r.bytes
+                << ", \"kernel_evals\": " << r.kernels << ", \"admissible\": " << r.admissible
+                << ", \"inadmissible\": " << r.inadmissible << ", \"pareto\": " << (r.pareto ? "true" : "false") << "}";
+        }
+        out << "\n  ]\n}" << std::endl;
+        std::cout << "Wrote " << rows.size() << " settings to " << fname << std::endl;
+    }
+}
+
+int main(int argc, char **argv) {
+    args::ArgumentParser parser("Measures the accuracy and cost of the Barnes-Hut error target and the "
+        "block cluster tree separation coefficient on one curve, against the exact energy, gradient and metric.");
+    args::HelpFlag help(parser, "help", "Display this help menu", {'h', "help"});
+    args::Positional<std::string> inFile(parser, "curve", "Curve to measure (.obj or .rcn)");
+    args::ValueFlag<std::string> syntheticFlag(parser, "family", "Use a synthetic curve instead: helix, knot or lattice", {"synthetic"});
+    args::ValueFlag<int> sizeFlag(parser, "edges", "Edge count of the synthetic curve (default 2000)", {"size"});
+    args::ValueFlag<std::string> targetsFlag(parser, "targets", "Comma-separated Barnes-Hut error targets (default 0.05,0.1,0.25,0.5,1)", {"targets"});
+    args::ValueFlag<std::string> sepsFlag(parser, "seps", "Comma-separated cluster separation coefficients (default 0.25,0.5,1,2)", {"seps"});
+    args::ValueFlag<double> alphaFlag(parser, "alpha", "Energy exponent alpha (default 3)", {"alpha"});
+    args::ValueFlag<double> betaFlag(parser, "beta", "Energy exponent beta (default 6)", {"beta"});
+    args::ValueFlag<int> repsFlag(parser, "reps", "Timed repetitions per setting; the minimum is reported (default 3)", {"reps"});
+    args::ValueFlag<unsigned int> seedFlag(parser, "seed", "Random seed (default 1)", {"seed"});
+    args::ValueFlag<std::string> csvFlag(parser, "csv", "Write results to this CSV file", {"csv"});
+    args::ValueFlag<std::string> jsonFlag(parser, "json", "Write results to this JSON file", {"json"});
+
+    try {
+        parser.ParseCLI(argc, argv);
+    }
+    catch (args::Help) {
+        std::cout << parser;
+        return 0;
+    }
+    catch (args::ParseError e) {
+        std::cerr << e.what() << std::endl;
+        std::cerr << parser;
+        return 1;
+    }
+
+    double alpha = alphaFlag ? alphaFlag.Get() : 3;
+    double beta = betaFlag ? betaFlag.Get() : 6;
+    int reps = std::max(1, repsFlag ? repsFlag.Get() : 3);
+    unsigned int seed = seedFlag ? seedFlag.Get() : 1;
+    std::vector<double> targets = parseDoubleList(targetsFlag ? targetsFlag.Get() : "0.05,0.1,0.25,0.5,1");
+    std::vector<double> seps = parseDoubleList(sepsFlag ? sepsFlag.Get() : "0.25,0.5,1,2");
+
+    PolyCurveNetwork* curves = 0;
+    std::string curveName;
+    if (syntheticFlag) {
+        curveName = syntheticFlag.Get();
+        curves = SyntheticCurves::Create(curveName, sizeFlag ? sizeFlag.Get() : 2000, seed);
+        if (!curves) {
+            std::cerr << "Unknown curve family " << curveName << std::endl;
+            return 1;
+        }
+    }
+    else if (inFile) {
+        curveName = inFile.Get();
+        curves = loadCurve(curveName);
+        if (!curves) return 1;
+    }
+    else {
+        std::cerr << "Specify a curve file or --synthetic" << std::endl;
+        std::cerr << parser;
+        return 1;
+    }
+
+    int nVerts = curves->NumVertices();
+    std::cout << "Curve " << curveName << ": " << nVerts << " vertices, " << curves->NumEdges() << " edges" << std::endl;
+#ifndef RCURVES_PROFILING
+    std::cout << "(built without RCURVES_PROFILING; memory and kernel counts will read 0)" << std::endl;
+#elif !defined(RCURVES_PROFILE_ALLOCATIONS)
+    std::cout << "(built without RCURVES_PROFILE_ALLOCATIONS; memory counts will read 0)" << std::endl;
+#endif
+
+    // Exact references, all quadratic in the number of vertices
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    double exactEnergy = TPESC::tpe_total(curves, alpha, beta);
+    double exactEnergyMs = elapsedMs(start);
+    Eigen::MatrixXd exactGradient(nVerts, 3);
+    exactGradient.setZero();
+    start = std::chrono::steady_clock::now();
+    TPESC::FillGradientVectorDirect(curves, exactGradient, alpha, beta);
+    double exactGradientMs = elapsedMs(start);
+
+    Eigen::MatrixXd A(nVerts, nVerts);
+    A.setZero();
+    start = std::chrono::steady_clock::now();
+    SobolevCurves::SobolevGramMatrix(curves, alpha, beta, A, 0);
+    double denseMs = elapsedMs(start);
+    srand(seed);
+    Eigen::VectorXd x = Eigen::VectorXd::Random(nVerts);
+    Eigen::VectorXd exactProduct = A * x;
+    A.resize(0, 0);
+
+    std::cout << "Exact energy " << exactEnergyMs << " ms, gradient " << exactGradientMs
+        << " ms, dense metric " << denseMs << " ms" << std::endl;
+
+    Profiler::Enable();
+    std::vector<SweepRow> rows;
+    double savedTarget = BVHNode3D::errorTarget;
+
+    for (double target : targets) {
+        BVHNode3D::errorTarget = target;
+        SweepRow row;
+        row.kind = "bh";
+        row.param = target;
+        row.buildMs = row.evalMs = 1e300;
+        row.admissible = row.inadmissible = 0;
+        row.pareto = false;
+
+        Eigen::MatrixXd gradient(nVerts, 3);
+        double energy = 0;
+        for (int r = 0; r < reps; r++) {
+            uint64_t bytesBefore = Profiler::CounterTotal(ProfileCounter::BytesAllocated);
+            start = std::chrono::steady_clock::now();
+            BVHNode3D* tree = CreateBVHFromCurve(curves);
+            row.buildMs = std::min(row.buildMs, elapsedMs(start));
+            row.bytes = Profiler::CounterTotal(ProfileCounter::BytesAllocated) - bytesBefore;
+
+            uint64_t kernelsBefore = Profiler::CounterTotal(ProfileCounter::KernelEvaluations);
+            gradient.setZero();
+            start = std::chrono::steady_clock::now();
+            energy = SpatialTree::TPEnergyBH(curves, tree, alpha, beta);
+            SpatialTree::TPEGradientBarnesHut(curves, tree, gradient, alpha, beta);
+            row.evalMs = std::min(row.evalMs, elapsedMs(start));
+            row.kernels = Profiler::CounterTotal(ProfileCounter::KernelEvaluations) - kernelsBefore;
+            delete tree;
+        }
+
+        row.error = (gradient - exactGradient).norm() / exactGradient.norm();
+        row.energyError = fabs(energy - exactEnergy) / fabs(exactEnergy);
+        rows.push_back(row);
+    }
+    BVHNode3D::errorTarget = savedTarget;
+
+    BVHNode3D* edgeBVH = CreateEdgeBVHFromCurve(curves);
+    for (double sep : seps) {
+        SweepRow row;
+        row.kind = "bct";
+        row.param = sep;
+        row.energyError = 0;
+        row.buildMs = row.evalMs = 1e300;
+        row.pareto = false;
+
+        Eigen::VectorXd product(nVerts);
+        for (int r = 0; r < reps; r++) {
+            uint64_t bytesBefore = Profiler::CounterTotal(ProfileCounter::BytesAllocated);
+            start = std::chrono::steady_clock::now();
+            BlockClusterTree* tree = new BlockClusterTree(curves, edgeBVH, sep, alpha, beta);
+            row.buildMs = std::min(row.buildMs, elapsedMs(start));
+            row.bytes = Profiler::CounterTotal(ProfileCounter::BytesAllocated) - bytesBefore;
+            tree->SetBlockTreeMode(BlockTreeMode::MatrixOnly);
+
+            uint64_t kernelsBefore = Profiler::CounterTotal(ProfileCounter::KernelEvaluations);
+            product.setZero();
+            start = std::chrono::steady_clock::now();
+            tree->Multiply(x, product);
+            row.evalMs = std::min(row.evalMs, elapsedMs(start));
+            row.kernels = Profiler::CounterTotal(ProfileCounter::KernelEvaluations) - kernelsBefore;
+
+            row.admissible = tree->NumAdmissiblePairs();
+            row.inadmissible = tree->NumInadmissiblePairs();
+            delete tree;
+        }
+        row.error = (product - exactProduct).norm() / exactProduct.norm();
+        rows.push_back(row);
+    }
+    delete edgeBVH;
+    Profiler::Disable();
+
+    markPareto(rows, "bh");
+    markPareto(rows, "bct");
+
+    std::cout << "\nBarnes-Hut energy and gradient (error is the relative gradient error)" << std::endl;
+    printRows(rows, "bh", "target");
+    std::cout << "\nBlock cluster tree metric product" << std::endl;
+    printRows(rows, "bct", "sep");
+    std::cout << "\n* = on the Pareto front of error against build + eval time" << std::endl;
+
+    if (csvFlag) writeCSV(csvFlag.Get(), rows);
+    if (jsonFlag) writeJSON(jsonFlag.Get(), rows, curveName, curves->NumEdges(), alpha, beta);
+
+    delete curves;
+    return 0;
+}
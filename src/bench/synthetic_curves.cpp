@@ -0,0 +1,113 @@
+#include "bench/synthetic_curves.h"
+
+#include <cmath>
+#include <random>
+
+namespace LWS {
+    namespace SyntheticCurves {
+
+        namespace {
+            PolyCurveNetwork* makeCurve(std::vector<Vector3> &positions, std::vector<std::array<size_t, 2>> &edges) {
+                PolyCurveNetwork* curves = new PolyCurveNetwork(positions, edges);
+                curves->pinnedAllToSurface = false;
+                curves->appliedConstraints.push_back(ConstraintType::Barycenter);
+                return curves;
+            }
+
+            void closeLoop(size_t nVerts, std::vector<std::array<size_t, 2>> &edges) {
+                edges.resize(nVerts);
+                for (size_t i = 0; i < nVerts; i++) {
+                    edges[i] = {i, (i + 1) % nVerts};
+                }
+            }
+        }
+
+        PolyCurveNetwork* Helix(int nEdges, int turns) {
+            std::vector<Vector3> positions(nEdges);
+            double R = 1, r = 0.3;
+            for (int i = 0; i < nEdges; i++) {
+                double t = 2 * M_PI * i / nEdges;
+                double s = turns * t;
+                positions[i] = Vector3{(R + r * cos(s)) * cos(t), (R + r * cos(s)) * sin(t), r * sin(s)};
+            }
+            std::vector<std::array<size_t, 2>> edges;
+            closeLoop(nEdges, edges);
+            return makeCurve(positions, edges);
+        }
+
+        PolyCurveNetwork* RandomKnot(int nEdges, unsigned int seed, int modes) {
+            std::mt19937 rng(seed);
+            std::normal_distribution<double> normal(0, 1);
+            std::vector<Vector3> a(modes), b(modes);
+            for (int k = 0; k < modes; k++) {
+                // Decay the coefficients so the curve stays smooth
+                double scale = 1.0 / (k + 1);
+                a[k] = scale * Vector3{normal(rng), normal(rng), normal(rng)};
+                b[k] = scale * Vector3{normal(rng), normal(rng), normal(rng)};
+            }
+
+            std::vector<Vector3> positions(nEdges);
+            for (int i = 0; i < nEdges; i++) {
+                double t = 2 * M_PI * i / nEdges;
+                Vector3 p{0, 0, 0};
+                for (int k = 0; k < modes; k++) {
+                    p += cos((k + 1) * t) * a[k] + sin((k + 1) * t) * b[k];
+                }
+                positions[i] = p;
+            }
+            std::vector<std::array<size_t, 2>> edges;
+            closeLoop(nEdges, edges);
+            return makeCurve(positions, edges);
+        }
+
+        PolyCurveNetwork* Lattice(int nEdges, int cellsPerSide) {
+            int n = cellsPerSide + 1;
+            // Three axis directions, each with n * n lines of cellsPerSide cells
+            int nLatticeEdges = 3 * n * n * cellsPerSide;
+            int subdivisions = std::max(1, nEdges / nLatticeEdges);
+            double spacing = 1.0 / cellsPerSide;
+
+            std::vector<Vector3> positions;
+            std::vector<std::array<size_t, 2>> edges;
+            for (int x = 0; x < n; x++) {
+                for (int y = 0; y < n; y++) {
+                    for (int z = 0; z < n; z++) {
+                        positions.push_back(spacing * Vector3{(double)x, (double)y, (double)z});
+                    }
+                }
+            }
+
+            int offsets[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+            for (int x = 0; x < n; x++) {
+                for (int y = 0; y < n; y++) {
+                    for (int z = 0; z < n; z++) {
+                        for (int axis = 0; axis < 3; axis++) {
+                            int x2 = x + offsets[axis][0], y2 = y + offsets[axis][1], z2 = z + offsets[axis][2];
+                            if (x2 >= n || y2 >= n || z2 >= n) continue;
+                            size_t start = (x * n + y) * n + z;
+                            size_t end = (x2 * n + y2) * n + z2;
+
+                            // Subdivide the lattice edge into a chain
+                            size_t prev = start;
+                            for (int s = 1; s < subdivisions; s++) {
+                                double t = (double)s / subdivisions;
+                                positions.push_back((1 - t) * positions[start] + t * positions[end]);
+                                edges.push_back({prev, positions.size() - 1});
+                                prev = positions.size() - 1;
+                            }
+                            edges.push_back({prev, end});
+                        }
+                    }
+                }
+            }
+            return makeCurve(positions, edges);
+        }
+
+        PolyCurveNetwork* Create(const std::string &name, int nEdges, unsigned int seed) {
+            if (name == "helix") return Helix(nEdges);
+            if (name == "knot") return RandomKnot(nEdges, seed);
+            if (name == "lattice") return Lattice(nEdges);
+            return 0;
+        }
+    }
+}
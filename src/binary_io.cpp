@@ -0,0 +1,66 @@
+#include "binary_io.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+namespace LWS {
+    namespace BinaryIO {
+
+        uint64_t Checksum(const char* data, size_t size) {
+            uint64_t hash = 14695981039346656037ULL;
+            for (size_t i = 0; i < size; i++) {
+                hash ^= (unsigned char)data[i];
+                hash *= 1099511628211ULL;
+            }
+            return hash;
+        }
+
+        bool ReadFile(const std::string &fname, std::vector<char> &bytes) {
+            std::ifstream file(fname, std::ios::binary | std::ios::ate);
+            if (!file.is_open()) {
+                std::cerr << "Could not open " << fname << " for reading" << std::endl;
+                return false;
+            }
+            std::streamsize size = file.tellg();
+            file.seekg(0, std::ios::beg);
+            bytes.resize(size);
+            if (size > 0 && !file.read(bytes.data(), size)) {
+                std::cerr << "Failed to read " << fname << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        bool WriteFileAtomic(const std::string &fname, const std::vector<char> &bytes) {
+            std::string tmpName = fname + ".tmp";
+            {
+                std::ofstream file(tmpName, std::ios::binary | std::ios::trunc);
+                if (!file.is_open()) {
+                    std::cerr << "Could not open " << tmpName << " for writing" << std::endl;
+                    return false;
+                }
+                file.write(bytes.data(), bytes.size());
+                if (!file) {
+                    std::cerr << "Failed to write " << tmpName << std::endl;
+                    return false;
+                }
+            }
+            // rename() won't replace an existing file on Windows
+#ifdef _WIN32
+            bool moved = MoveFileExA(tmpName.c_str(), fname.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+            bool moved = std::rename(tmpName.c_str(), fname.c_str()) == 0;
+#endif
+            if (!moved) {
+                std::cerr << "Could not move " << tmpName << " to " << fname << std::endl;
+                return false;
+            }
+            return true;
+        }
+    }
+}
@@ -0,0 +1,349 @@
+#include "curve_binary.h"
+#include "curve_io.h"
+#include "binary_io.h"
+
+#include <cstring>
+#include <iostream>
+
+namespace LWS {
+    namespace CurveIO {
+
+        namespace {
+            const char magic[8] = {'R', 'C', 'U', 'R', 'V', 'N', 'E', 'T'};
+            const size_t headerSize = 48;
+            const size_t sectionEntrySize = 24;
+
+            struct PendingSection {
+                CurveSection type;
+                BinaryIO::Writer data;
+            };
+
+            bool writeSections(std::string fname, size_t nVerts, size_t nEdges, std::vector<PendingSection> &sections) {
+                BinaryIO::Writer w;
+                w.WriteBytes(magic, 8);
+                w.Write<uint32_t>(binaryCurveVersion);
+                w.Write<uint32_t>(sections.size());
+                w.Write<uint64_t>(nVerts);
+                w.Write<uint64_t>(nEdges);
+                w.Write<uint64_t>(0);
+                w.Write<uint64_t>(0);
+
+                // Lay out the section data after the table, 8-byte aligned
+                uint64_t offset = headerSize + sectionEntrySize * sections.size();
+                for (PendingSection &s : sections) {
+                    w.Write<uint32_t>((uint32_t)s.type);
+                    w.Write<uint32_t>(0);
+                    w.Write<uint64_t>(offset);
+                    w.Write<uint64_t>(s.data.bytes.size());
+                    offset += s.data.bytes.size();
+                    offset = ((offset + 7) / 8) * 8;
+                }
+                for (PendingSection &s : sections) {
+                    w.WriteBytes(s.data.bytes.data(), s.data.bytes.size());
+                    w.Align(8);
+                }
+                return BinaryIO::WriteFileAtomic(fname, w.bytes);
+            }
+
+            void addGeometrySections(std::vector<PendingSection> &sections, const Eigen::MatrixXd &positions,
+            const std::vector<std::array<size_t, 2>> &edges) {
+                sections.push_back(PendingSection{CurveSection::Positions, BinaryIO::Writer()});
+                BinaryIO::Writer &pw = sections.back().data;
+                pw.bytes.reserve(positions.rows() * 3 * sizeof(double));
+                for (int i = 0; i < positions.rows(); i++) {
+                    pw.Write<double>(positions(i, 0));
+                    pw.Write<double>(positions(i, 1));
+                    pw.Write<double>(positions(i, 2));
+                }
+
+                sections.push_back(PendingSection{CurveSection::Edges, BinaryIO::Writer()});
+                BinaryIO::Writer &ew = sections.back().data;
+                ew.bytes.reserve(edges.size() * 2 * sizeof(uint64_t));
+                for (const std::array<size_t, 2> &e : edges) {
+                    ew.Write<uint64_t>(e[0]);
+                    ew.Write<uint64_t>(e[1]);
+                }
+            }
+
+            void addIndexSection(std::vector<PendingSection> &sections, CurveSection type, const std::vector<int> &indices) {
+                if (indices.empty()) return;
+                sections.push_back(PendingSection{type, BinaryIO::Writer()});
+                for (int i : indices) {
+                    sections.back().data.Write<int64_t>(i);
+                }
+            }
+        }
+
+        bool writeBinaryCurve(std::string fname, PolyCurveNetwork* curves, bool includeTangents) {
+            std::vector<std::array<size_t, 2>> edges(curves->NumEdges());
+            for (int i = 0; i < curves->NumEdges(); i++) {
+                CurveEdge* e = curves->GetEdge(i);
+                edges[i] = {(size_t)e->prevVert->GlobalIndex(), (size_t)e->nextVert->GlobalIndex()};
+            }
+
+            std::vector<PendingSection> sections;
+            addGeometrySections(sections, curves->positions, edges);
+            addIndexSection(sections, CurveSection::Pins, curves->GetPinnedVertexIndices());
+            addIndexSection(sections, CurveSection::TangentPins, curves->GetPinnedTangentIndices());
+
+            if (curves->pinnedAllToSurface || curves->NumPinnedToSurface() > 0) {
+                sections.push_back(PendingSection{CurveSection::SurfacePins, BinaryIO::Writer()});
+                BinaryIO::Writer &sw = sections.back().data;
+                sw.Write<uint64_t>(curves->pinnedAllToSurface ? 1 : 0);
+                // When everything is pinned, the flag alone is enough
+                if (!curves->pinnedAllToSurface) {
+                    for (int i : curves->GetPinnedToSurfaceIndices()) {
+                        sw.Write<int64_t>(i);
+                    }
+                }
+            }
+
+            if (includeTangents) {
+                sections.push_back(PendingSection{CurveSection::VertexTangents, BinaryIO::Writer()});
+                BinaryIO::Writer &tw = sections.back().data;
+                for (int i = 0; i < curves->NumVertices(); i++) {
+                    Vector3 t = curves->GetVertex(i)->Tangent();
+                    tw.Write<double>(t.x);
+                    tw.Write<double>(t.y);
+                    tw.Write<double>(t.z);
+                }
+            }
+
+            if (!curves->appliedConstraints.empty()) {
+                sections.push_back(PendingSection{CurveSection::Constraints, BinaryIO::Writer()});
+                for (ConstraintType type : curves->appliedConstraints) {
+                    sections.back().data.Write<int32_t>((int32_t)type);
+                }
+            }
+
+            return writeSections(fname, curves->NumVertices(), edges.size(), sections);
+        }
+
+        bool writeBinaryCurve(std::string fname, const std::vector<Vector3> &positions,
+        const std::vector<std::array<size_t, 2>> &edges) {
+            Eigen::MatrixXd posMatrix(positions.size(), 3);
+            for (size_t i = 0; i < positions.size(); i++) {
+                SetRow(posMatrix, i, positions[i]);
+            }
+            std::vector<PendingSection> sections;
+            addGeometrySections(sections, posMatrix, edges);
+            return writeSections(fname, positions.size(), edges.size(), sections);
+        }
+
+        bool convertOBJToBinary(std::string objName, std::string binName) {
+            std::vector<Vector3> positions;
+            std::vector<std::array<size_t, 2>> edges;
+            readVerticesAndEdges(objName, positions, edges);
+            if (edges.size() == 0) {
+                std::cout << "Did not find any OBJ line elements; reading edges from faces instead" << std::endl;
+                readFaces(objName, edges);
+            }
+            if (!writeBinaryCurve(binName, positions, edges)) return false;
+            std::cout << "Converted " << objName << " -> " << binName << std::endl;
+            return true;
+        }
+
+        bool convertBinaryToOBJ(std::string binName, std::string objName) {
+            MappedCurveFile file;
+            if (!file.Open(binName)) return false;
+
+            Eigen::MatrixXd posMatrix;
+            std::vector<std::array<size_t, 2>> edges;
+            file.FillPositions(posMatrix);
+            file.FillEdges(edges);
+
+            std::vector<Vector3> positions(posMatrix.rows());
+            for (int i = 0; i < posMatrix.rows(); i++) {
+                positions[i] = SelectRow(posMatrix, i);
+            }
+            std::vector<std::vector<size_t>> components(edges.size());
+            for (size_t i = 0; i < edges.size(); i++) {
+                components[i] = {edges[i][0], edges[i][1]};
+            }
+
+            if (file.HasSection(CurveSection::Pins) || file.HasSection(CurveSection::TangentPins) ||
+                file.HasSection(CurveSection::SurfacePins) || file.HasSection(CurveSection::Constraints)) {
+                std::cout << "Note: pins and constraints in " << binName << " cannot be represented in OBJ and were dropped" << std::endl;
+            }
+            writeOBJLineElements(objName, positions, components);
+            std::cout << "Converted " << binName << " -> " << objName << std::endl;
+            return true;
+        }
+
+        bool MappedCurveFile::Open(std::string fname) {
+            sections.clear();
+            nVerts = 0;
+            nEdges = 0;
+            if (!file.Open(fname)) return false;
+
+            BinaryIO::Reader r(file.Data(), file.Size());
+            const char* fileMagic = r.Skip(8);
+            if (!fileMagic || std::memcmp(fileMagic, magic, 8) != 0) {
+                std::cerr << fname << " is not a binary curve file" << std::endl;
+                return false;
+            }
+            uint32_t version = 0, nSections = 0;
+            uint64_t nv = 0, ne = 0, reserved = 0;
+            r.Read(version);
+            r.Read(nSections);
+            r.Read(nv);
+            r.Read(ne);
+            r.Read(reserved);
+            r.Read(reserved);
+            if (r.Failed() || version != binaryCurveVersion) {
+                std::cerr << "Unsupported binary curve version " << version << " in " << fname << std::endl;
+                return false;
+            }
+            nVerts = nv;
+            nEdges = ne;
+
+            for (uint32_t i = 0; i < nSections; i++) {
+                SectionEntry entry;
+                uint32_t pad;
+                r.Read(entry.type);
+                r.Read(pad);
+                r.Read(entry.offset);
+                r.Read(entry.size);
+                if (r.Failed() || entry.offset > file.Size() || entry.size > file.Size() - entry.offset || entry.offset % 8 != 0) {
+                    std::cerr << "Corrupt section table in " << fname << std::endl;
+                    return false;
+                }
+                sections.push_back(entry);
+            }
+
+            const SectionEntry* pos = FindSection(CurveSection::Positions);
+            const SectionEntry* edg = FindSection(CurveSection::Edges);
+            if (!pos || !edg || pos->size != nVerts * 3 * sizeof(double) || edg->size != nEdges * 2 * sizeof(uint64_t)) {
+                std::cerr << "Missing or malformed geometry in " << fname << std::endl;
+                return false;
+            }
+            const SectionEntry* tan = FindSection(CurveSection::VertexTangents);
+            if (tan && tan->size != nVerts * 3 * sizeof(double)) {
+                std::cerr << "Malformed tangent section in " << fname << std::endl;
+                return false;
+            }
+
+            // Validate edge indices once, so that users of Edges() can trust them
+            std::vector<uint64_t> edgeData;
+            const uint64_t* edgePtr = Edges();
+            if (!edgePtr) {
+                ReadSection(CurveSection::Edges, 0, edgeData);
+                edgePtr = edgeData.data();
+            }
+            for (size_t i = 0; i < 2 * nEdges; i++) {
+                if (edgePtr[i] >= nVerts) {
+                    std::cerr << "Edge " << (i / 2) << " in " << fname << " references a nonexistent vertex" << std::endl;
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        const MappedCurveFile::SectionEntry* MappedCurveFile::FindSection(CurveSection type) const {
+            for (const SectionEntry &entry : sections) {
+                if (entry.type == (uint32_t)type) return &entry;
+            }
+            return 0;
+        }
+
+        bool MappedCurveFile::HasSection(CurveSection type) const {
+            return FindSection(type) != 0;
+        }
+
+        template<typename T>
+        void MappedCurveFile::ReadSection(CurveSection type, size_t skipBytes, std::vector<T> &out) const {
+            out.clear();
+            const SectionEntry* entry = FindSection(type);
+            if (!entry || entry->size < skipBytes) return;
+            BinaryIO::Reader r(file.Data() + entry->offset + skipBytes, entry->size - skipBytes);
+            out.resize((entry->size - skipBytes) / sizeof(T));
+            r.ReadArray(out.data(), out.size());
+        }
+
+        const double* MappedCurveFile::Positions() const {
+            if (!BinaryIO::HostIsLittleEndian()) return 0;
+            return reinterpret_cast<const double*>(file.Data() + FindSection(CurveSection::Positions)->offset);
+        }
+
+        const uint64_t* MappedCurveFile::Edges() const {
+            if (!BinaryIO::HostIsLittleEndian()) return 0;
+            return reinterpret_cast<const uint64_t*>(file.Data() + FindSection(CurveSection::Edges)->offset);
+        }
+
+        void MappedCurveFile::FillPositions(Eigen::MatrixXd &positions) const {
+            const double* raw = Positions();
+            if (raw) {
+                positions = Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic, 3, Eigen::RowMajor>>(raw, nVerts, 3);
+            }
+            else {
+                std::vector<double> values;
+                ReadSection(CurveSection::Positions, 0, values);
+                positions = Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic, 3, Eigen::RowMajor>>(values.data(), nVerts, 3);
+            }
+        }
+
+        void MappedCurveFile::FillEdges(std::vector<std::array<size_t, 2>> &edges) const {
+            edges.resize(nEdges);
+            const uint64_t* raw = Edges();
+            std::vector<uint64_t> values;
+            if (!raw) {
+                ReadSection(CurveSection::Edges, 0, values);
+                raw = values.data();
+            }
+            for (size_t i = 0; i < nEdges; i++) {
+                edges[i] = {(size_t)raw[2 * i], (size_t)raw[2 * i + 1]};
+            }
+        }
+
+        void MappedCurveFile::FillTangents(Eigen::MatrixXd &tangents) const {
+            std::vector<double> values;
+            ReadSection(CurveSection::VertexTangents, 0, values);
+            if (values.empty()) {
+                tangents.setZero(0, 3);
+                return;
+            }
+            tangents = Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic, 3, Eigen::RowMajor>>(values.data(), nVerts, 3);
+        }
+
+        PolyCurveNetwork* MappedCurveFile::CreateCurve() const {
+            Eigen::MatrixXd positions;
+            std::vector<std::array<size_t, 2>> edges;
+            FillPositions(positions);
+            FillEdges(edges);
+            PolyCurveNetwork* curves = new PolyCurveNetwork(positions, edges);
+            curves->pinnedAllToSurface = false;
+
+            std::vector<int64_t> indices;
+            ReadSection(CurveSection::Pins, 0, indices);
+            for (int64_t i : indices) {
+                if (i >= 0 && (size_t)i < nVerts) curves->PinVertex(i);
+            }
+            ReadSection(CurveSection::TangentPins, 0, indices);
+            for (int64_t i : indices) {
+                if (i >= 0 && (size_t)i < nVerts) curves->PinTangent(i);
+            }
+
+            std::vector<uint64_t> allFlag;
+            ReadSection(CurveSection::SurfacePins, 0, allFlag);
+            if (!allFlag.empty() && allFlag[0] == 1) {
+                curves->pinnedAllToSurface = true;
+                for (size_t i = 0; i < nVerts; i++) {
+                    curves->PinToSurface(i);
+                }
+            }
+            else if (!allFlag.empty()) {
+                ReadSection(CurveSection::SurfacePins, sizeof(uint64_t), indices);
+                for (int64_t i : indices) {
+                    if (i >= 0 && (size_t)i < nVerts) curves->PinToSurface(i);
+                }
+            }
+
+            std::vector<int32_t> types;
+            ReadSection(CurveSection::Constraints, 0, types);
+            for (int32_t t : types) {
+                curves->appliedConstraints.push_back((ConstraintType)t);
+            }
+            return curves;
+        }
+    }
+}
@@ -0,0 +1,88 @@
+#include "curve_geometry.h"
+#include "profiler.h"
+
+#include <cmath>
+
+namespace LWS {
+
+    void CurveGeometry::SetTopology(int nVerts, const std::vector<std::array<size_t, 2>> &edges) {
+        int nEdges = edges.size();
+        edgePrev.resize(nEdges);
+        edgeNext.resize(nEdges);
+        adjStart.assign(nVerts + 1, 0);
+
+        for (int i = 0; i < nEdges; i++) {
+            edgePrev[i] = edges[i][0];
+            edgeNext[i] = edges[i][1];
+            adjStart[edgePrev[i] + 1]++;
+            adjStart[edgeNext[i] + 1]++;
+        }
+        for (int v = 0; v < nVerts; v++) {
+            adjStart[v + 1] += adjStart[v];
+        }
+
+        // Fill in edge order, which is the order PolyCurveNetwork builds adjacency in
+        std::vector<int> fill(adjStart.begin(), adjStart.end() - 1);
+        adjEdge.resize(2 * nEdges);
+        adjVert.resize(2 * nEdges);
+        for (int i = 0; i < nEdges; i++) {
+            adjEdge[fill[edgePrev[i]]] = i;
+            adjVert[fill[edgePrev[i]]++] = edgeNext[i];
+            adjEdge[fill[edgeNext[i]]] = i;
+            adjVert[fill[edgeNext[i]]++] = edgePrev[i];
+        }
+
+        px.setZero(nVerts); py.setZero(nVerts); pz.setZero(nVerts);
+        tx.setZero(nVerts); ty.setZero(nVerts); tz.setZero(nVerts);
+        dualLength.setZero(nVerts);
+        mx.setZero(nEdges); my.setZero(nEdges); mz.setZero(nEdges);
+        etx.setZero(nEdges); ety.setZero(nEdges); etz.setZero(nEdges);
+        length.setZero(nEdges);
+    }
+
+    void CurveGeometry::Update(const Eigen::MatrixXd &positions) {
+        PROFILE_SCOPE("Geometry snapshot");
+        int nVerts = NumVertices();
+        int nEdges = NumEdges();
+
+        px = positions.col(0);
+        py = positions.col(1);
+        pz = positions.col(2);
+
+        // Same formulas as CurveEdge and CurveVertex use
+        #pragma omp parallel for
+        for (int e = 0; e < nEdges; e++) {
+            int a = edgePrev[e];
+            int b = edgeNext[e];
+            double dx = px(b) - px(a);
+            double dy = py(b) - py(a);
+            double dz = pz(b) - pz(a);
+            double len = std::sqrt(dx * dx + dy * dy + dz * dz);
+
+            mx(e) = (px(b) + px(a)) / 2;
+            my(e) = (py(b) + py(a)) / 2;
+            mz(e) = (pz(b) + pz(a)) / 2;
+            etx(e) = dx / len;
+            ety(e) = dy / len;
+            etz(e) = dz / len;
+            length(e) = len;
+        }
+
+        #pragma omp parallel for
+        for (int v = 0; v < nVerts; v++) {
+            double sx = 0, sy = 0, sz = 0, sumLength = 0;
+            for (int k = adjStart[v]; k < adjStart[v + 1]; k++) {
+                int e = adjEdge[k];
+                sx += etx(e);
+                sy += ety(e);
+                sz += etz(e);
+                sumLength += length(e);
+            }
+            double norm = std::sqrt(sx * sx + sy * sy + sz * sz);
+            tx(v) = sx / norm;
+            ty(v) = sy / norm;
+            tz(v) = sz / norm;
+            dualLength(v) = sumLength / Degree(v);
+        }
+    }
+}
@@ -1,8 +1,15 @@
 #include "curve_io.h"
+#include "mapped_file.h"
+#include "utils.h"
 
 #include <sstream>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <omp.h>
 
 namespace LWS {
     namespace CurveIO {
@@ -20,7 +27,345 @@ namespace LWS {
             return tokens;
         }
 
+        namespace {
+            const double exactPowersOf10[] = {
+                1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+            };
+
+            inline bool isDigit(char c) {
+                return c >= '0' && c <= '9';
+            }
+
+            inline bool isBlank(char c) {
+                return c == ' ' || c == '\t' || c == '\r';
+            }
+
+            inline const char* skipBlanks(const char* p, const char* end) {
+                while (p < end && isBlank(*p)) p++;
+                return p;
+            }
+
+            inline const char* skipToken(const char* p, const char* end) {
+                while (p < end && !isBlank(*p)) p++;
+                return p;
+            }
+
+            // Parses a double starting at p, in the spirit of std::from_chars.
+            // Numbers whose decimal mantissa fits in 53 bits and whose exponent is
+            // small are converted exactly with a single multiply or divide (Clinger's
+            // fast path); anything else falls back to strtod, so results always
+            // match the streaming reader bit for bit.
+            inline const char* parseDouble(const char* p, const char* end, double &out) {
+                const char* start = p;
+                bool negative = false;
+                if (p < end && (*p == '-' || *p == '+')) {
+                    negative = (*p == '-');
+                    p++;
+                }
+
+                uint64_t mantissa = 0;
+                int significant = 0;
+                int exponent = 0;
+                bool anyDigits = false;
+
+                while (p < end && isDigit(*p)) {
+                    if (mantissa > 0 || *p != '0') significant++;
+                    if (significant <= 19) mantissa = mantissa * 10 + (*p - '0');
+                    else exponent++;
+                    anyDigits = true;
+                    p++;
+                }
+                if (p < end && *p == '.') {
+                    p++;
+                    while (p < end && isDigit(*p)) {
+                        if (mantissa > 0 || *p != '0') significant++;
+                        if (significant <= 19) {
+                            mantissa = mantissa * 10 + (*p - '0');
+                            exponent--;
+                        }
+                        anyDigits = true;
+                        p++;
+                    }
+                }
+                if (anyDigits && p < end && (*p == 'e' || *p == 'E')) {
+                    const char* q = p + 1;
+                    bool negExp = false;
+                    if (q < end && (*q == '-' || *q == '+')) {
+                        negExp = (*q == '-');
+                        q++;
+                    }
+                    if (q < end && isDigit(*q)) {
+                        int e = 0;
+                        while (q < end && isDigit(*q)) {
+                            if (e < 100000) e = e * 10 + (*q - '0');
+                            q++;
+                        }
+                        exponent += negExp ? -e : e;
+                        p = q;
+                    }
+                }
+
+                bool fastPath = anyDigits && significant <= 19 && mantissa <= (1ULL << 53)
+                    && exponent >= -22 && exponent <= 22;
+                if (fastPath) {
+                    double value = (double)mantissa;
+                    if (exponent < 0) value /= exactPowersOf10[-exponent];
+                    else value *= exactPowersOf10[exponent];
+                    out = negative ? -value : value;
+                    return p;
+                }
+
+                // Slow path: strtod needs a null-terminated copy of the token
+                const char* tokenEnd = skipToken(start, end);
+                size_t len = tokenEnd - start;
+                if (len == 0 || len > 511) return 0;
+                char buffer[512];
+                std::memcpy(buffer, start, len);
+                buffer[len] = 0;
+                char* parsedEnd = 0;
+                out = std::strtod(buffer, &parsedEnd);
+                if (parsedEnd == buffer) return 0;
+                return start + (parsedEnd - buffer);
+            }
+
+            // Parses an OBJ vertex reference such as "12", "-3" or "12/4/7",
+            // returning only the vertex index.
+            inline const char* parseIndex(const char* p, const char* end, long long &out) {
+                bool negative = false;
+                if (p < end && *p == '-') {
+                    negative = true;
+                    p++;
+                }
+                if (p >= end || !isDigit(*p)) return 0;
+                long long value = 0;
+                while (p < end && isDigit(*p)) {
+                    value = value * 10 + (*p - '0');
+                    p++;
+                }
+                out = negative ? -value : value;
+                // Skip texture / normal indices
+                return skipToken(p, end);
+            }
+
+            struct ParsedChunk {
+                std::vector<double> coords;
+                std::vector<long long> lineIndices;
+                std::vector<long long> faceIndices;
+                // Entries of the index lists that are relative to the vertices
+                // preceding this chunk, and still need the chunk's vertex offset added
+                std::vector<size_t> relativeLines;
+                std::vector<size_t> relativeFaces;
+                size_t numVertices;
+                size_t errorLine;
+                bool failed;
+            };
+
+            // Converts a 1-based (or negative, relative) OBJ index to a 0-based index
+            // that may still be relative to the start of the chunk.
+            inline long long toZeroBased(long long objIndex, size_t vertsSoFar, bool &relative) {
+                relative = (objIndex < 0);
+                if (relative) return (long long)vertsSoFar + objIndex;
+                return objIndex - 1;
+            }
+
+            void parseChunk(const char* p, const char* end, bool wantVerts, bool wantLines, bool wantFaces, ParsedChunk &chunk) {
+                chunk.numVertices = 0;
+                chunk.failed = false;
+                chunk.errorLine = 0;
+                std::vector<long long> polygon;
+                size_t lineNum = 0;
+
+                while (p < end) {
+                    const char* lineEnd = static_cast<const char*>(std::memchr(p, '\n', end - p));
+                    if (!lineEnd) lineEnd = end;
+                    lineNum++;
+                    const char* q = skipBlanks(p, lineEnd);
+
+                    if (q + 1 < lineEnd && isBlank(q[1]) && (q[0] == 'v' || q[0] == 'l' || q[0] == 'f')) {
+                        char type = q[0];
+                        q += 2;
+
+                        if (type == 'v') {
+                            if (wantVerts) {
+                                double xyz[3];
+                                for (int c = 0; c < 3 && q; c++) {
+                                    q = skipBlanks(q, lineEnd);
+                                    q = parseDouble(q, lineEnd, xyz[c]);
+                                }
+                                if (!q) {
+                                    chunk.failed = true;
+                                    chunk.errorLine = lineNum;
+                                    return;
+                                }
+                                chunk.coords.push_back(xyz[0]);
+                                chunk.coords.push_back(xyz[1]);
+                                chunk.coords.push_back(xyz[2]);
+                            }
+                            chunk.numVertices++;
+                        }
+                        else if ((type == 'l' && wantLines) || (type == 'f' && wantFaces)) {
+                            polygon.clear();
+                            q = skipBlanks(q, lineEnd);
+                            while (q && q < lineEnd) {
+                                long long index;
+                                q = parseIndex(q, lineEnd, index);
+                                if (q) {
+                                    polygon.push_back(index);
+                                    q = skipBlanks(q, lineEnd);
+                                }
+                            }
+                            if (!q || polygon.size() < 2) {
+                                chunk.failed = true;
+                                chunk.errorLine = lineNum;
+                                return;
+                            }
+
+                            std::vector<long long> &indices = (type == 'l') ? chunk.lineIndices : chunk.faceIndices;
+                            std::vector<size_t> &relative = (type == 'l') ? chunk.relativeLines : chunk.relativeFaces;
+                            // Polylines are open, faces are closed
+                            size_t nPairs = (type == 'l') ? polygon.size() - 1 : polygon.size();
+                            for (size_t i = 0; i < nPairs; i++) {
+                                long long ends[2] = {polygon[i], polygon[(i + 1) % polygon.size()]};
+                                for (int k = 0; k < 2; k++) {
+                                    bool isRelative;
+                                    long long index = toZeroBased(ends[k], chunk.numVertices, isRelative);
+                                    if (isRelative) relative.push_back(indices.size());
+                                    indices.push_back(index);
+                                }
+                            }
+                        }
+                    }
+                    p = lineEnd + 1;
+                }
+            }
+
+            // Resolves chunk-relative indices and appends all index pairs to the output.
+            bool appendEdges(std::vector<ParsedChunk> &chunks, std::vector<size_t> &vertexOffsets, bool lines,
+            std::vector<std::array<size_t, 2>> &all_edges) {
+                size_t total = 0;
+                for (ParsedChunk &chunk : chunks) {
+                    total += (lines ? chunk.lineIndices : chunk.faceIndices).size() / 2;
+                }
+                all_edges.reserve(all_edges.size() + total);
+
+                for (size_t c = 0; c < chunks.size(); c++) {
+                    std::vector<long long> &indices = lines ? chunks[c].lineIndices : chunks[c].faceIndices;
+                    std::vector<size_t> &relative = lines ? chunks[c].relativeLines : chunks[c].relativeFaces;
+                    for (size_t r : relative) {
+                        indices[r] += vertexOffsets[c];
+                    }
+                    for (size_t i = 0; i < indices.size(); i += 2) {
+                        if (indices[i] < 0 || indices[i + 1] < 0) {
+                            return false;
+                        }
+                        all_edges.push_back({(size_t)indices[i], (size_t)indices[i + 1]});
+                    }
+                }
+                return true;
+            }
+
+            // Parses an OBJ file into whichever of the outputs are non-null.
+            bool parseOBJ(std::string fname, std::vector<Vector3>* all_positions,
+            std::vector<std::array<size_t, 2>>* line_edges, std::vector<std::array<size_t, 2>>* face_edges) {
+                MappedFile file;
+                if (!file.Open(fname)) return false;
+
+                const char* data = file.Data();
+                size_t size = file.Size();
+
+                // Small files aren't worth the threading overhead
+                const size_t minChunkSize = 4 << 20;
+                int nChunks = std::max(1, std::min(omp_get_max_threads(), (int)(size / minChunkSize)));
+
+                // Split at line boundaries
+                std::vector<const char*> bounds(nChunks + 1);
+                bounds[0] = data;
+                bounds[nChunks] = data + size;
+                for (int c = 1; c < nChunks; c++) {
+                    const char* guess = data + (size / nChunks) * c;
+                    const char* nl = static_cast<const char*>(std::memchr(guess, '\n', data + size - guess));
+                    bounds[c] = nl ? nl + 1 : data + size;
+                    if (bounds[c] < bounds[c - 1]) bounds[c] = bounds[c - 1];
+                }
+
+                std::vector<ParsedChunk> chunks(nChunks);
+                #pragma omp parallel for schedule(static, 1)
+                for (int c = 0; c < nChunks; c++) {
+                    parseChunk(bounds[c], bounds[c + 1], all_positions != 0, line_edges != 0, face_edges != 0, chunks[c]);
+                }
+
+                std::vector<size_t> vertexOffsets(nChunks + 1, 0);
+                for (int c = 0; c < nChunks; c++) {
+                    if (chunks[c].failed) {
+                        // Count the lines before this chunk to report a file line number
+                        size_t lineNum = chunks[c].errorLine;
+                        for (const char* p = data; p < bounds[c]; p++) {
+                            if (*p == '\n') lineNum++;
+                        }
+                        std::cerr << "Could not parse line " << lineNum << " of " << fname << std::endl;
+                        return false;
+                    }
+                    vertexOffsets[c + 1] = vertexOffsets[c] + chunks[c].numVertices;
+                }
+
+                if (all_positions) {
+                    size_t start = all_positions->size();
+                    all_positions->resize(start + vertexOffsets[nChunks]);
+                    #pragma omp parallel for schedule(static, 1)
+                    for (int c = 0; c < nChunks; c++) {
+                        std::vector<double> &coords = chunks[c].coords;
+                        Vector3* dest = all_positions->data() + start + vertexOffsets[c];
+                        for (size_t i = 0; i < chunks[c].numVertices; i++) {
+                            dest[i] = Vector3{coords[3 * i], coords[3 * i + 1], coords[3 * i + 2]};
+                        }
+                    }
+                }
+
+                if ((line_edges && !appendEdges(chunks, vertexOffsets, true, *line_edges)) ||
+                    (face_edges && !appendEdges(chunks, vertexOffsets, false, *face_edges))) {
+                    std::cerr << "Negative vertex index in " << fname << std::endl;
+                    return false;
+                }
+                return true;
+            }
+
+            inline double megabytesPerSecond(size_t bytes, long ms) {
+                return (bytes / 1e6) / (std::max(ms, 1L) / 1000.0);
+            }
+
+            size_t fileSize(std::string fname) {
+                ifstream file(fname, ios::binary | ios::ate);
+                return file.is_open() ? (size_t)file.tellg() : 0;
+            }
+        }
+
         void readVerticesAndEdges(std::string fname, std::vector<Vector3> &all_positions,
+        std::vector<std::array<size_t, 2>> &all_edges) {
+            long start = Utils::currentTimeMilliseconds();
+            size_t nVerts = all_positions.size();
+            size_t nEdges = all_edges.size();
+
+            if (!parseOBJ(fname, &all_positions, &all_edges, 0)) {
+                std::cerr << "Failed to read curve from " << fname << std::endl;
+                exit(1);
+            }
+
+            long end = Utils::currentTimeMilliseconds();
+            std::cout << "Read " << (all_positions.size() - nVerts) << " vertices, " << (all_edges.size() - nEdges)
+                << " edges in " << (end - start) << " ms (" << megabytesPerSecond(fileSize(fname), end - start) << " MB/s)" << std::endl;
+        }
+
+        void readFaces(std::string fname, std::vector<std::array<size_t, 2>> &all_edges) {
+            size_t nEdges = all_edges.size();
+            if (!parseOBJ(fname, 0, 0, &all_edges)) {
+                std::cerr << "Failed to read faces from " << fname << std::endl;
+                exit(1);
+            }
+            std::cout << "Read " << (all_edges.size() - nEdges) << " edges from faces" << std::endl;
+        }
+
+        void readVerticesAndEdgesStream(std::string fname, std::vector<Vector3> &all_positions,
         std::vector<std::array<size_t, 2>> &all_edges) {
             
             ifstream myfile(fname);
@@ -45,7 +390,7 @@ namespace LWS {
             std::cout << "Read " << all_positions.size() << " vertices, " << all_edges.size() << " edges" << std::endl;
         }
 
-        void readFaces(std::string fname, std::vector<std::array<size_t, 2>> &all_edges) {
+        void readFacesStream(std::string fname, std::vector<std::array<size_t, 2>> &all_edges) {
             ifstream myfile(fname);
             string line;
 
@@ -71,6 +416,41 @@ namespace LWS {
 
         }
 
+        void benchmarkReaders(std::string fname) {
+            size_t bytes = fileSize(fname);
+            std::vector<Vector3> streamPositions, fastPositions;
+            std::vector<std::array<size_t, 2>> streamEdges, fastEdges;
+
+            long stream_start = Utils::currentTimeMilliseconds();
+            readVerticesAndEdgesStream(fname, streamPositions, streamEdges);
+            long stream_end = Utils::currentTimeMilliseconds();
+
+            long fast_start = Utils::currentTimeMilliseconds();
+            readVerticesAndEdges(fname, fastPositions, fastEdges);
+            long fast_end = Utils::currentTimeMilliseconds();
+
+            long streamTime = stream_end - stream_start;
+            long fastTime = fast_end - fast_start;
+            std::cout << "File size: " << (bytes / 1e6) << " MB" << std::endl;
+            std::cout << "  Streaming reader: " << streamTime << " ms (" << megabytesPerSecond(bytes, streamTime) << " MB/s)" << std::endl;
+            std::cout << "  Mapped reader:    " << fastTime << " ms (" << megabytesPerSecond(bytes, fastTime) << " MB/s, "
+                << omp_get_max_threads() << " threads)" << std::endl;
+
+            bool samePositions = (streamPositions.size() == fastPositions.size());
+            for (size_t i = 0; samePositions && i < fastPositions.size(); i++) {
+                samePositions = (streamPositions[i] == fastPositions[i]);
+            }
+            std::cout << "  Positions " << (samePositions ? "match" : "DIFFER") << std::endl;
+            if (streamEdges.size() == fastEdges.size()) {
+                std::cout << "  Edges " << ((streamEdges == fastEdges) ? "match" : "DIFFER") << std::endl;
+            }
+            else {
+                // The streaming reader only takes the first pair of each polyline
+                std::cout << "  Edge counts differ (" << streamEdges.size() << " vs " << fastEdges.size()
+                    << "); the file contains polylines longer than one segment" << std::endl;
+            }
+        }
+
         void writeOBJLineElements(std::string fname, const std::vector<Vector3> &all_positions,
         const std::vector<std::vector<size_t> > &components) {
 
@@ -0,0 +1,364 @@
+#include "field_cache.h"
+#include "binary_io.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace LWS {
+
+    namespace {
+        const char fieldMagic[8] = {'R', 'C', 'F', 'I', 'E', 'L', 'D', '1'};
+        const int samplesPerSide = SparseFieldCache::brickSize + 1;
+        const int floatsPerBrick = samplesPerSide * samplesPerSide * samplesPerSide * 4;
+        // Probe points per axis used to fingerprint the field
+        const int probesPerSide = 3;
+
+        inline bool withinTolerance(double error, double magnitude, double tolerance) {
+            return error <= tolerance * std::max(1.0, magnitude);
+        }
+
+        // Trilinearly interpolates value and gradient inside cell (lx, ly, lz) of a brick
+        inline void interpolateBrick(const float* brick, int lx, int ly, int lz, double tx, double ty, double tz,
+        double &value, Vector3 &gradient) {
+            double result[4] = {0, 0, 0, 0};
+            for (int corner = 0; corner < 8; corner++) {
+                int dx = corner & 1, dy = (corner >> 1) & 1, dz = (corner >> 2) & 1;
+                double w = (dx ? tx : 1 - tx) * (dy ? ty : 1 - ty) * (dz ? tz : 1 - tz);
+                const float* s = brick + 4 * (((lz + dz) * samplesPerSide + (ly + dy)) * samplesPerSide + (lx + dx));
+                for (int c = 0; c < 4; c++) result[c] += w * s[c];
+            }
+            value = result[0];
+            gradient = Vector3{result[1], result[2], result[3]};
+        }
+    }
+
+    SparseFieldCache::SparseFieldCache() {
+        origin = Vector3{0, 0, 0};
+        voxelSize = 1;
+        tolerance = 0;
+        dims[0] = dims[1] = dims[2] = 0;
+        numBricks = 0;
+        numRejected = 0;
+        brickTable = 0;
+        samples = 0;
+    }
+
+    void SparseFieldCache::setGrid(Vector3 boxMin, Vector3 boxMax, double h) {
+        origin = boxMin;
+        voxelSize = h;
+        Vector3 extent = boxMax - boxMin;
+        double brickWidth = brickSize * h;
+        dims[0] = std::max(1, (int)ceil(extent.x / brickWidth));
+        dims[1] = std::max(1, (int)ceil(extent.y / brickWidth));
+        dims[2] = std::max(1, (int)ceil(extent.z / brickWidth));
+    }
+
+    void SparseFieldCache::computeProbes(Sampler &sampler, std::vector<double> &values) const {
+        values.clear();
+        double width = brickSize * voxelSize;
+        for (int k = 0; k < probesPerSide; k++) {
+            for (int j = 0; j < probesPerSide; j++) {
+                for (int i = 0; i < probesPerSide; i++) {
+                    // Fractions 0.1, 0.5, 0.9 of the way across the grid
+                    Vector3 f{0.1 + 0.4 * i, 0.1 + 0.4 * j, 0.1 + 0.4 * k};
+                    Vector3 p = origin + Vector3{f.x * dims[0], f.y * dims[1], f.z * dims[2]} * width;
+                    double value;
+                    Vector3 gradient;
+                    sampler(p, value, gradient);
+                    values.push_back(value);
+                }
+            }
+        }
+    }
+
+    void SparseFieldCache::Build(Sampler sampler, Vector3 boxMin, Vector3 boxMax, double h, double band, double tol) {
+        file.Close();
+        setGrid(boxMin, boxMax, h);
+        tolerance = tol;
+        computeProbes(sampler, probes);
+
+        int totalBricks = dims[0] * dims[1] * dims[2];
+        std::vector<std::vector<float>> built(totalBricks);
+        double halfDiagonal = sqrt(3.0) * brickSize * h / 2;
+        size_t rejected = 0;
+
+        #pragma omp parallel for schedule(dynamic) reduction(+ : rejected)
+        for (int b = 0; b < totalBricks; b++) {
+            int bx = b % dims[0];
+            int by = (b / dims[0]) % dims[1];
+            int bz = b / (dims[0] * dims[1]);
+            Vector3 corner = origin + Vector3{(double)bx, (double)by, (double)bz} * (brickSize * h);
+
+            double value;
+            Vector3 gradient;
+            if (band > 0) {
+                // Signed distances change by at most the distance moved, so the
+                // center tells us whether the brick can reach the band
+                sampler(corner + Vector3{1, 1, 1} * (brickSize * h / 2), value, gradient);
+                if (fabs(value) > band + halfDiagonal) continue;
+            }
+
+            std::vector<float> brick(floatsPerBrick);
+            for (int k = 0; k < samplesPerSide; k++) {
+                for (int j = 0; j < samplesPerSide; j++) {
+                    for (int i = 0; i < samplesPerSide; i++) {
+                        sampler(corner + Vector3{(double)i, (double)j, (double)k} * h, value, gradient);
+                        float* s = &brick[4 * ((k * samplesPerSide + j) * samplesPerSide + i)];
+                        s[0] = value;
+                        s[1] = gradient.x;
+                        s[2] = gradient.y;
+                        s[3] = gradient.z;
+                    }
+                }
+            }
+
+            // Check the interpolant on the half-cell grid: at every cell center,
+            // face center and edge midpoint, i.e. every point between samples
+            // where it is least constrained along one or more axes
+            bool accurate = true;
+            const int halfSteps = 2 * brickSize;
+            for (int k = 0; k <= halfSteps && accurate; k++) {
+                for (int j = 0; j <= halfSteps && accurate; j++) {
+                    for (int i = 0; i <= halfSteps && accurate; i++) {
+                        // Even indices on every axis are the samples themselves
+                        if (i % 2 == 0 && j % 2 == 0 && k % 2 == 0) continue;
+                        int ci = std::min(i / 2, brickSize - 1);
+                        int cj = std::min(j / 2, brickSize - 1);
+                        int ck = std::min(k / 2, brickSize - 1);
+                        sampler(corner + Vector3{i * 0.5, j * 0.5, k * 0.5} * h, value, gradient);
+                        double approxValue;
+                        Vector3 approxGradient;
+                        interpolateBrick(&brick[0], ci, cj, ck, i * 0.5 - ci, j * 0.5 - cj, k * 0.5 - ck,
+                            approxValue, approxGradient);
+                        accurate = withinTolerance(fabs(approxValue - value), fabs(value), tol) &&
+                            withinTolerance(norm(approxGradient - gradient), norm(gradient), sqrt(tol));
+                    }
+                }
+            }
+            if (accurate) built[b].swap(brick);
+            else rejected++;
+        }
+
+        ownedTable.assign(totalBricks, -1);
+        numBricks = 0;
+        for (int b = 0; b < totalBricks; b++) {
+            if (!built[b].empty()) ownedTable[b] = numBricks++;
+        }
+        ownedSamples.resize(numBricks * floatsPerBrick);
+        for (int b = 0; b < totalBricks; b++) {
+            if (ownedTable[b] >= 0) {
+                std::copy(built[b].begin(), built[b].end(), ownedSamples.begin() + (size_t)ownedTable[b] * floatsPerBrick);
+            }
+        }
+        numRejected = rejected;
+        brickTable = ownedTable.data();
+        samples = ownedSamples.data();
+    }
+
+    bool SparseFieldCache::Save(const std::string &fname) const {
+        BinaryIO::Writer w;
+        w.WriteBytes(fieldMagic, 8);
+        w.Write<uint32_t>(brickSize);
+        w.Write<uint32_t>(probes.size());
+        for (int i = 0; i < 3; i++) w.Write<uint32_t>(dims[i]);
+        w.Write<uint32_t>(0);
+        w.Write<double>(origin.x);
+        w.Write<double>(origin.y);
+        w.Write<double>(origin.z);
+        w.Write<double>(voxelSize);
+        w.Write<double>(tolerance);
+        w.Write<uint64_t>(numBricks);
+        w.WriteArray(probes.data(), probes.size());
+        w.WriteArray(brickTable, (size_t)dims[0] * dims[1] * dims[2]);
+        w.Align(8);
+        w.WriteArray(samples, numBricks * floatsPerBrick);
+        return BinaryIO::WriteFileAtomic(fname, w.bytes);
+    }
+
+    bool SparseFieldCache::Load(const std::string &fname, Sampler sampler, Vector3 boxMin, Vector3 boxMax, double h, double tol) {
+        file.Close();
+        // A missing cache isn't an error; it just hasn't been built yet
+        if (!std::ifstream(fname).good()) return false;
+        if (!file.Open(fname)) return false;
+
+        BinaryIO::Reader r(file.Data(), file.Size());
+        const char* magic = r.Skip(8);
+        uint32_t fileBrickSize = 0, numProbes = 0, fileDims[3] = {0, 0, 0}, reserved;
+        double fileOrigin[3], fileVoxelSize = 0, fileTolerance = 0;
+        uint64_t fileBricks = 0;
+        r.Read(fileBrickSize);
+        r.Read(numProbes);
+        for (int i = 0; i < 3; i++) r.Read(fileDims[i]);
+        r.Read(reserved);
+        for (int i = 0; i < 3; i++) r.Read(fileOrigin[i]);
+        r.Read(fileVoxelSize);
+        r.Read(fileTolerance);
+        r.Read(fileBricks);
+        if (!magic || r.Failed() || std::memcmp(magic, fieldMagic, 8) != 0 || fileBrickSize != (uint32_t)brickSize) {
+            std::cerr << fname << " is not a field cache; rebuilding it" << std::endl;
+            file.Close();
+            return false;
+        }
+
+        // The cache must describe the same grid, at the same accuracy
+        setGrid(boxMin, boxMax, h);
+        bool sameGrid = fileDims[0] == (uint32_t)dims[0] && fileDims[1] == (uint32_t)dims[1] && fileDims[2] == (uint32_t)dims[2] &&
+            fileOrigin[0] == origin.x && fileOrigin[1] == origin.y && fileOrigin[2] == origin.z &&
+            fileVoxelSize == h && fileTolerance == tol;
+        if (!sameGrid) {
+            std::cout << "Field cache " << fname << " was built for different settings; rebuilding it" << std::endl;
+            file.Close();
+            return false;
+        }
+
+        std::vector<double> fileProbes(numProbes);
+        r.ReadArray(fileProbes.data(), numProbes);
+        computeProbes(sampler, probes);
+        bool sameField = !r.Failed() && fileProbes.size() == probes.size();
+        for (size_t i = 0; sameField && i < probes.size(); i++) {
+            sameField = fabs(fileProbes[i] - probes[i]) <= 1e-9 * std::max(1.0, fabs(probes[i]));
+        }
+        if (!sameField) {
+            std::cout << "Field cache " << fname << " is out of date; rebuilding it" << std::endl;
+            file.Close();
+            return false;
+        }
+
+        size_t tableSize = (size_t)dims[0] * dims[1] * dims[2];
+        size_t tableOffset = r.Offset();
+        if (!r.Has(tableSize * sizeof(int32_t))) {
+            std::cerr << "Field cache " << fname << " is truncated; rebuilding it" << std::endl;
+            file.Close();
+            return false;
+        }
+        r.Skip(tableSize * sizeof(int32_t));
+        r.Align(8);
+        size_t samplesOffset = r.Offset();
+        if (r.Failed() || fileBricks > r.Remaining() / (floatsPerBrick * sizeof(float))) {
+            std::cerr << "Field cache " << fname << " is truncated; rebuilding it" << std::endl;
+            file.Close();
+            return false;
+        }
+
+        if (BinaryIO::HostIsLittleEndian()) {
+            // Use the mapped data in place
+            brickTable = reinterpret_cast<const int32_t*>(file.Data() + tableOffset);
+            samples = reinterpret_cast<const float*>(file.Data() + samplesOffset);
+            ownedTable.clear();
+            ownedSamples.clear();
+        }
+        else {
+            BinaryIO::Reader tableReader(file.Data() + tableOffset, tableSize * sizeof(int32_t));
+            ownedTable.resize(tableSize);
+            tableReader.ReadArray(ownedTable.data(), tableSize);
+            BinaryIO::Reader sampleReader(file.Data() + samplesOffset, fileBricks * floatsPerBrick * sizeof(float));
+            ownedSamples.resize(fileBricks * floatsPerBrick);
+            sampleReader.ReadArray(ownedSamples.data(), ownedSamples.size());
+            brickTable = ownedTable.data();
+            samples = ownedSamples.data();
+        }
+
+        for (size_t b = 0; b < tableSize; b++) {
+            if (brickTable[b] >= (int64_t)fileBricks) {
+                std::cerr << "Field cache " << fname << " is corrupt; rebuilding it" << std::endl;
+                file.Close();
+                brickTable = 0;
+                samples = 0;
+                return false;
+            }
+        }
+        numBricks = fileBricks;
+        numRejected = 0;
+        tolerance = tol;
+        return true;
+    }
+
+    void SparseFieldCache::LoadOrBuild(const std::string &fname, Sampler sampler, Vector3 boxMin, Vector3 boxMax,
+    double h, double band, double tol) {
+        if (!fname.empty() && Load(fname, sampler, boxMin, boxMax, h, tol)) {
+            std::cout << "Loaded field cache " << fname << " (" << numBricks << " bricks, "
+                << SizeInBytes() / (1024.0 * 1024.0) << " MB)" << std::endl;
+            return;
+        }
+        Build(sampler, boxMin, boxMax, h, band, tol);
+        std::cout << "Built field cache with " << numBricks << " bricks (" << SizeInBytes() / (1024.0 * 1024.0) << " MB); "
+            << numRejected << " bricks missed the error bound and use the exact field" << std::endl;
+        if (!fname.empty() && Save(fname)) {
+            std::cout << "Wrote field cache to " << fname << std::endl;
+        }
+    }
+
+    bool SparseFieldCache::Lookup(Vector3 point, double &value, Vector3 &gradient) const {
+        if (!brickTable) return false;
+        Vector3 rel = (point - origin) / voxelSize;
+        int cells[3] = {dims[0] * brickSize, dims[1] * brickSize, dims[2] * brickSize};
+        // Written to also reject NaN
+        if (!(rel.x >= 0 && rel.y >= 0 && rel.z >= 0 && rel.x < cells[0] && rel.y < cells[1] && rel.z < cells[2])) {
+            return false;
+        }
+        int cx = (int)rel.x, cy = (int)rel.y, cz = (int)rel.z;
+        int bx = cx / brickSize, by = cy / brickSize, bz = cz / brickSize;
+        int32_t index = brickTable[((size_t)bz * dims[1] + by) * dims[0] + bx];
+        if (index < 0) return false;
+
+        const float* brick = samples + (size_t)index * floatsPerBrick;
+        interpolateBrick(brick, cx - bx * brickSize, cy - by * brickSize, cz - bz * brickSize,
+            rel.x - cx, rel.y - cy, rel.z - cz, value, gradient);
+        return true;
+    }
+
+    size_t SparseFieldCache::NumBricks() const {
+        return numBricks;
+    }
+
+    size_t SparseFieldCache::NumRejectedBricks() const {
+        return numRejected;
+    }
+
+    size_t SparseFieldCache::SizeInBytes() const {
+        return (size_t)dims[0] * dims[1] * dims[2] * sizeof(int32_t) + numBricks * floatsPerBrick * sizeof(float);
+    }
+
+    CachedImplicitSurface::CachedImplicitSurface(ImplicitSurface* s, int resolution, double tolerance, std::string cacheFile) {
+        surface = s;
+        double diameter = surface->BoundingDiameter();
+        double h = diameter / std::max(1, resolution);
+        // Keep a brick's width of cache on either side of the surface
+        double band = SparseFieldCache::brickSize * h;
+        Vector3 halfExtent = Vector3{1, 1, 1} * (diameter / 2 + band);
+        Vector3 center = surface->BoundingCenter();
+
+        SparseFieldCache::Sampler sampler = [s](Vector3 p, double &value, Vector3 &gradient) {
+            value = s->SignedDistance(p);
+            gradient = s->GradientOfDistance(p);
+        };
+        cache.LoadOrBuild(cacheFile, sampler, center - halfExtent, center + halfExtent, h, band, tolerance);
+    }
+
+    CachedImplicitSurface::~CachedImplicitSurface() {}
+
+    double CachedImplicitSurface::SignedDistance(Vector3 point) {
+        double value;
+        Vector3 gradient;
+        if (cache.Lookup(point, value, gradient)) return value;
+        return surface->SignedDistance(point);
+    }
+
+    Vector3 CachedImplicitSurface::GradientOfDistance(Vector3 point) {
+        double value;
+        Vector3 gradient;
+        if (cache.Lookup(point, value, gradient)) return gradient;
+        return surface->GradientOfDistance(point);
+    }
+
+    double CachedImplicitSurface::BoundingDiameter() {
+        return surface->BoundingDiameter();
+    }
+
+    Vector3 CachedImplicitSurface::BoundingCenter() {
+        return surface->BoundingCenter();
+    }
+}
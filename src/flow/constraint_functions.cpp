@@ -4,6 +4,20 @@
 #include "tpe_energy_sc.h"
 
 namespace LWS {
+
+    void ConstraintFunctions::GatherSurfacePins(PolyCurveNetwork* curves,
+    std::vector<double> &x, std::vector<double> &y, std::vector<double> &z) {
+        int nPins = curves->NumPinnedToSurface();
+        x.resize(nPins);
+        y.resize(nPins);
+        z.resize(nPins);
+        for (int i = 0; i < nPins; i++) {
+            Vector3 p = curves->GetPinnedToSurface(i)->Position();
+            x[i] = p.x;
+            y[i] = p.y;
+            z[i] = p.z;
+        }
+    }
     
     void ConstraintFunctions::NegativeBarycenterViolation(PolyCurveNetwork* curves,
     Eigen::VectorXd &b, Eigen::VectorXd &targets, int rowStart) {
@@ -63,12 +77,14 @@ namespace LWS {
 
     void ConstraintFunctions::NegativeSurfaceViolation(PolyCurveNetwork* curves, Eigen::VectorXd &b, Eigen::VectorXd &targets, int rowStart) {
         int nPins = curves->NumPinnedToSurface();
+        std::vector<double> x, y, z, distances(nPins);
+        GatherSurfacePins(curves, x, y, z);
+        curves->constraintSurface->SignedDistances(x.data(), y.data(), z.data(), nPins, distances.data());
 
         for (int i = 0; i < nPins; i++) {
             CurveVertex* v = curves->GetPinnedToSurface(i);
             int row = rowStart + v->GlobalIndex();
-            double distance = curves->constraintSurface->SignedDistance(v->Position());
-            b(row) = -distance;
+            b(row) = -distances[i];
         }
     }
 
@@ -185,16 +201,18 @@ namespace LWS {
 
     void ConstraintFunctions::AddSurfaceTriplets(PolyCurveNetwork* curves, std::vector<Eigen::Triplet<double>> &triplets, int rowStart) {
         int nPins = curves->NumPinnedToSurface();
+        std::vector<double> x, y, z, gx(nPins), gy(nPins), gz(nPins);
+        GatherSurfacePins(curves, x, y, z);
+        curves->constraintSurface->GradientsOfDistance(x.data(), y.data(), z.data(), nPins, gx.data(), gy.data(), gz.data());
 
         for (int i = 0; i < nPins; i++) {
             CurveVertex* v = curves->GetPinnedToSurface(i);
-            Vector3 gradient = curves->constraintSurface->GradientOfDistance(v->Position());
             int id = v->GlobalIndex();
             int row = rowStart + i;
 
-            triplets.push_back(Eigen::Triplet<double>(row, 3 * id, gradient.x));
-            triplets.push_back(Eigen::Triplet<double>(row, 3 * id + 1, gradient.y));
-            triplets.push_back(Eigen::Triplet<double>(row, 3 * id + 2, gradient.z));
+            triplets.push_back(Eigen::Triplet<double>(row, 3 * id, gx[i]));
+            triplets.push_back(Eigen::Triplet<double>(row, 3 * id + 1, gy[i]));
+            triplets.push_back(Eigen::Triplet<double>(row, 3 * id + 2, gz[i]));
         }
     }
 
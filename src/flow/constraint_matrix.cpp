@@ -0,0 +1,142 @@
+#include "flow/constraint_matrix.h"
+#include "poly_curve_network.h"
+
+#include <algorithm>
+
+namespace LWS {
+
+    ConstraintMatrix::ConstraintMatrix(PolyCurveNetwork* c) : constraints(c) {
+        curves = c;
+        cols = 0;
+        patternBuilds = 0;
+    }
+
+    bool ConstraintMatrix::layoutMatches() const {
+        if (patternBuilds == 0) return false;
+        if (cols != curves->NumVertices() * 3) return false;
+        if (blocks.size() != curves->appliedConstraints.size()) return false;
+
+        for (size_t i = 0; i < blocks.size(); i++) {
+            ConstraintType type = curves->appliedConstraints[i];
+            if (blocks[i].type != type) return false;
+            if (blocks[i].rows != NumRowsForConstraint(type, curves)) return false;
+        }
+        return true;
+    }
+
+    void ConstraintMatrix::resetLayout() {
+        blocks.resize(curves->appliedConstraints.size());
+        int rowStart = 0;
+        for (size_t i = 0; i < blocks.size(); i++) {
+            blocks[i].type = curves->appliedConstraints[i];
+            blocks[i].rowStart = rowStart;
+            blocks[i].rows = NumRowsForConstraint(blocks[i].type, curves);
+            rowStart += blocks[i].rows;
+        }
+        cols = curves->NumVertices() * 3;
+    }
+
+    bool ConstraintMatrix::patternMatches(const Block &block) const {
+        if (block.triplets.size() != block.slots.size()) return false;
+        const int* outer = B.outerIndexPtr();
+        const int* inner = B.innerIndexPtr();
+        // B is column-major, so each slot must hold the triplet's row and lie in its column
+        for (size_t i = 0; i < block.triplets.size(); i++) {
+            const Eigen::Triplet<double> &t = block.triplets[i];
+            int slot = block.slots[i];
+            if (inner[slot] != t.row() || slot < outer[t.col()] || slot >= outer[t.col() + 1]) return false;
+        }
+        return true;
+    }
+
+    bool ConstraintMatrix::Refresh() {
+        bool sameLayout = layoutMatches();
+        if (!sameLayout) resetLayout();
+
+        int nBlocks = blocks.size();
+        #pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < nBlocks; i++) {
+            blocks[i].triplets.clear();
+            AddTripletsOfConstraint(blocks[i].type, curves, blocks[i].triplets, blocks[i].rowStart);
+        }
+
+        bool samePattern = sameLayout;
+        for (int i = 0; i < nBlocks && samePattern; i++) {
+            samePattern = patternMatches(blocks[i]);
+        }
+        if (!samePattern) {
+            buildPattern();
+            return true;
+        }
+
+        // Blocks own disjoint rows, and so disjoint slots of B
+        double* values = B.valuePtr();
+        #pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < nBlocks; i++) {
+            Block &block = blocks[i];
+            for (int slot : block.slots) values[slot] = 0;
+            // Duplicate entries are summed, as setFromTriplets does
+            for (size_t j = 0; j < block.triplets.size(); j++) {
+                values[block.slots[j]] += block.triplets[j].value();
+            }
+        }
+        return false;
+    }
+
+    void ConstraintMatrix::buildPattern() {
+        size_t total = 0;
+        for (const Block &block : blocks) total += block.triplets.size();
+
+        std::vector<Eigen::Triplet<double>> all;
+        all.reserve(total);
+        for (const Block &block : blocks) {
+            all.insert(all.end(), block.triplets.begin(), block.triplets.end());
+        }
+
+        int rows = NumConstraintRows();
+        B.resize(rows, cols);
+        B.setFromTriplets(all.begin(), all.end());
+        B.makeCompressed();
+
+        // Find where each triplet ended up
+        const int* outer = B.outerIndexPtr();
+        const int* inner = B.innerIndexPtr();
+        for (Block &block : blocks) {
+            block.slots.resize(block.triplets.size());
+            for (size_t i = 0; i < block.triplets.size(); i++) {
+                const Eigen::Triplet<double> &t = block.triplets[i];
+                const int* begin = inner + outer[t.col()];
+                const int* end = inner + outer[t.col() + 1];
+                block.slots[i] = std::lower_bound(begin, end, t.row()) - inner;
+            }
+        }
+        patternBuilds++;
+    }
+
+    void ConstraintMatrix::AddTriplets(std::vector<Eigen::Triplet<double>> &triplets) const {
+        triplets.reserve(triplets.size() + B.nonZeros());
+        for (int k = 0; k < B.outerSize(); k++) {
+            for (Eigen::SparseMatrix<double>::InnerIterator it(B, k); it; ++it) {
+                triplets.push_back(Eigen::Triplet<double>(it.row(), it.col(), it.value()));
+            }
+        }
+    }
+
+    int ConstraintMatrix::NumConstraintRows() const {
+        int rows = 0;
+        for (const Block &block : blocks) rows += block.rows;
+        return rows;
+    }
+
+    int ConstraintMatrix::NumExpectedCols() const {
+        return cols;
+    }
+
+    void ConstraintMatrix::SetTargetValues(Eigen::VectorXd &targets) const {
+        constraints.SetTargetValues(targets);
+    }
+
+    void ConstraintMatrix::NegativeConstraintValues(Eigen::VectorXd &b, Eigen::VectorXd &targets) const {
+        constraints.NegativeConstraintValues(b, targets);
+    }
+}
@@ -0,0 +1,110 @@
+#include "flow/constraint_projector.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+namespace LWS {
+
+    namespace {
+        double elapsedMs(std::chrono::steady_clock::time_point start) {
+            using namespace std::chrono;
+            return duration_cast<microseconds>(steady_clock::now() - start).count() / 1000.0;
+        }
+    }
+
+    ConstraintProjector::ConstraintProjector() {
+        source = 0;
+        sourcePattern = 0;
+        numAnalyses = 0;
+        numFactorizations = 0;
+        lastAnalyzeMs = 0;
+        lastFactorizeMs = 0;
+    }
+
+    void ConstraintProjector::Update(const ConstraintMatrix &constraints) {
+        const Eigen::SparseMatrix<double> &M = constraints.Matrix();
+        bool samePattern = (numAnalyses > 0) && (source == &constraints) && (sourcePattern == constraints.NumPatternBuilds());
+
+        if (samePattern) {
+            // Nothing to do if the positions haven't moved since the last update
+            if (std::equal(M.valuePtr(), M.valuePtr() + M.nonZeros(), B.valuePtr())) return;
+            std::copy(M.valuePtr(), M.valuePtr() + M.nonZeros(), B.valuePtr());
+        }
+        else {
+            B = M;
+            source = &constraints;
+            sourcePattern = constraints.NumPatternBuilds();
+            analyze();
+        }
+        factorize();
+    }
+
+    Eigen::VectorXd ConstraintProjector::ProjectToNullspace(const Eigen::VectorXd &v) const {
+        Eigen::VectorXd out;
+        ProjectToNullspace(v, out);
+        return out;
+    }
+
+    void ConstraintProjector::analyze() {
+        PROFILE_SCOPE("Constraint symbolic factorization");
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        // Entry (i, j) of B B^T is the sum over columns k of B(i, k) B(j, k), so
+        // every pair of entries sharing a column contributes one term
+        std::vector<Eigen::Triplet<double>> triplets;
+        std::vector<ProductTerm> terms;
+        const int* outer = B.outerIndexPtr();
+        const int* inner = B.innerIndexPtr();
+        for (int k = 0; k < B.outerSize(); k++) {
+            for (int a = outer[k]; a < outer[k + 1]; a++) {
+                for (int b = outer[k]; b <= a; b++) {
+                    // Rows are sorted within a column, so inner[a] >= inner[b]
+                    triplets.push_back(Eigen::Triplet<double>(inner[a], inner[b], 0));
+                    terms.push_back(ProductTerm{0, a, b});
+                }
+            }
+        }
+        // Keep the diagonal even for constraints with empty rows, so the pattern is complete
+        for (int i = 0; i < B.rows(); i++) {
+            triplets.push_back(Eigen::Triplet<double>(i, i, 0));
+        }
+
+        BBT.resize(B.rows(), B.rows());
+        BBT.setFromTriplets(triplets.begin(), triplets.end());
+        BBT.makeCompressed();
+
+        const int* bbtOuter = BBT.outerIndexPtr();
+        const int* bbtInner = BBT.innerIndexPtr();
+        for (ProductTerm &term : terms) {
+            int row = inner[term.left];
+            int col = inner[term.right];
+            term.target = std::lower_bound(bbtInner + bbtOuter[col], bbtInner + bbtOuter[col + 1], row) - bbtInner;
+        }
+        productPlan.swap(terms);
+
+        solver.analyzePattern(BBT);
+        numAnalyses++;
+        lastAnalyzeMs = elapsedMs(start);
+    }
+
+    void ConstraintProjector::factorize() {
+        PROFILE_SCOPE("Constraint numeric factorization");
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        double* target = BBT.valuePtr();
+        const double* values = B.valuePtr();
+        std::fill(target, target + BBT.nonZeros(), 0.0);
+        for (const ProductTerm &term : productPlan) {
+            target[term.target] += values[term.left] * values[term.right];
+        }
+
+        solver.factorize(BBT);
+        if (solver.info() != Eigen::Success) {
+            std::cerr << "Factorization of the constraint matrix failed; are some constraints redundant?" << std::endl;
+        }
+        numFactorizations++;
+        lastFactorizeMs = elapsedMs(start);
+    }
+}
@@ -0,0 +1,310 @@
+#include "flow/flow_checkpoint.h"
+#include "binary_io.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <iostream>
+
+namespace LWS {
+
+    namespace Checkpoint {
+        // File layout (all little-endian):
+        //   char[8]  magic "RCCKPT01"
+        //   uint32   version
+        //   payload  (see Serialize)
+        //   uint64   FNV-1a checksum of the payload
+        const char magic[8] = {'R', 'C', 'C', 'K', 'P', 'T', '0', '1'};
+        const uint32_t version = 3;
+
+        void FillFromCurve(PolyCurveNetwork* curves, FlowCheckpoint &cp) {
+            cp.positions = curves->positions;
+            int nEdges = curves->NumEdges();
+            cp.edges.resize(nEdges);
+            for (int i = 0; i < nEdges; i++) {
+                CurveEdge* e = curves->GetEdge(i);
+                cp.edges[i] = {(size_t)e->prevVert->GlobalIndex(), (size_t)e->nextVert->GlobalIndex()};
+            }
+            cp.appliedConstraints = curves->appliedConstraints;
+            cp.pinnedVertices = curves->GetPinnedVertexIndices();
+            cp.pinnedTangents = curves->GetPinnedTangentIndices();
+            cp.pinnedToSurface = curves->GetPinnedToSurfaceIndices();
+            cp.pinnedAllToSurface = curves->pinnedAllToSurface;
+        }
+
+        PolyCurveNetwork* CreateCurve(FlowCheckpoint &cp) {
+            PolyCurveNetwork* curves = new PolyCurveNetwork(cp.positions, cp.edges);
+            curves->appliedConstraints = cp.appliedConstraints;
+            for (int i : cp.pinnedVertices) curves->PinVertex(i);
+            for (int i : cp.pinnedTangents) curves->PinTangent(i);
+            for (int i : cp.pinnedToSurface) curves->PinToSurface(i);
+            curves->pinnedAllToSurface = cp.pinnedAllToSurface;
+            return curves;
+        }
+
+        template<typename T>
+        void writeVector(BinaryIO::Writer &w, const std::vector<T> &v) {
+            w.Write<uint64_t>(v.size());
+            w.WriteArray(v.data(), v.size());
+        }
+
+        template<typename T>
+        bool readVector(BinaryIO::Reader &r, std::vector<T> &v) {
+            uint64_t n = 0;
+            if (!r.Read(n) || n > r.Remaining() / sizeof(T)) return false;
+            v.resize(n);
+            return r.ReadArray(v.data(), n);
+        }
+
+        void writeVectorXd(BinaryIO::Writer &w, const Eigen::VectorXd &v) {
+            w.Write<uint64_t>(v.rows());
+            w.WriteArray(v.data(), v.rows());
+        }
+
+        bool readVectorXd(BinaryIO::Reader &r, Eigen::VectorXd &v) {
+            uint64_t n = 0;
+            if (!r.Read(n) || n > r.Remaining() / sizeof(double)) return false;
+            v.setZero(n);
+            return r.ReadArray(v.data(), n);
+        }
+
+        void Serialize(const FlowCheckpoint &cp, std::vector<char> &bytes) {
+            BinaryIO::Writer w;
+            w.WriteBytes(magic, 8);
+            w.Write<uint32_t>(version);
+            size_t payloadStart = w.bytes.size();
+
+            // Positions are stored row-major, one xyz triple per vertex
+            uint64_t nVerts = cp.positions.rows();
+            w.Write<uint64_t>(nVerts);
+            for (uint64_t i = 0; i < nVerts; i++) {
+                w.Write<double>(cp.positions(i, 0));
+                w.Write<double>(cp.positions(i, 1));
+                w.Write<double>(cp.positions(i, 2));
+            }
+            w.Write<uint64_t>(cp.edges.size());
+            for (const std::array<size_t, 2> &e : cp.edges) {
+                w.Write<uint64_t>(e[0]);
+                w.Write<uint64_t>(e[1]);
+            }
+
+            std::vector<int32_t> types;
+            for (ConstraintType type : cp.appliedConstraints) {
+                types.push_back((int32_t)type);
+            }
+            writeVector(w, types);
+            writeVector(w, std::vector<int32_t>(cp.pinnedVertices.begin(), cp.pinnedVertices.end()));
+            writeVector(w, std::vector<int32_t>(cp.pinnedTangents.begin(), cp.pinnedTangents.end()));
+            writeVector(w, std::vector<int32_t>(cp.pinnedToSurface.begin(), cp.pinnedToSurface.end()));
+            w.Write<uint8_t>(cp.pinnedAllToSurface);
+
+            writeVectorXd(w, cp.constraintTargets);
+
+            w.Write<double>(cp.alpha);
+            w.Write<double>(cp.beta);
+            w.Write<double>(cp.targetLength);
+            w.Write<double>(cp.lengthScaleStep);
+            w.Write<uint8_t>(cp.useEdgeLengthScale);
+            w.Write<uint8_t>(cp.useTotalLengthScale);
+            w.Write<double>(cp.lastStepSize);
+            w.Write<double>(cp.mg_backproj_threshold);
+            w.Write<int32_t>(cp.iterNum);
+            w.Write<double>(cp.solveTolerance);
+            w.Write<double>(cp.solveToleranceFirstGradNorm);
+            w.Write<double>(cp.lastRelativeDecrease);
+
+            w.Write<int32_t>(cp.lbfgsMaxPairs);
+            w.Write<uint64_t>(cp.lbfgsSteps.size());
+            for (size_t i = 0; i < cp.lbfgsSteps.size(); i++) {
+                writeVectorXd(w, cp.lbfgsSteps[i]);
+                writeVectorXd(w, cp.lbfgsGradientChanges[i]);
+            }
+            writeVectorXd(w, cp.lbfgsPrevPositions);
+            writeVectorXd(w, cp.lbfgsPrevGradient);
+
+            w.Write<int32_t>(cp.currentStep);
+            w.Write<int32_t>(cp.subdivideCount);
+            w.Write<double>(cp.initialAverageLength);
+
+            uint64_t sum = BinaryIO::Checksum(w.bytes.data() + payloadStart, w.bytes.size() - payloadStart);
+            w.Write<uint64_t>(sum);
+            bytes.swap(w.bytes);
+        }
+
+        bool Deserialize(const std::vector<char> &bytes, FlowCheckpoint &cp) {
+            if (bytes.size() < 8 + 4 + 8 || std::memcmp(bytes.data(), magic, 8) != 0) {
+                std::cerr << "Not a checkpoint file" << std::endl;
+                return false;
+            }
+            size_t payloadEnd = bytes.size() - 8;
+            BinaryIO::Reader trailer(bytes.data() + payloadEnd, 8);
+            uint64_t storedSum = 0;
+            trailer.Read(storedSum);
+            if (storedSum != BinaryIO::Checksum(bytes.data() + 12, payloadEnd - 12)) {
+                std::cerr << "Checkpoint checksum mismatch (file is truncated or corrupt)" << std::endl;
+                return false;
+            }
+
+            BinaryIO::Reader r(bytes.data() + 8, payloadEnd - 8);
+            uint32_t fileVersion = 0;
+            r.Read(fileVersion);
+            if (fileVersion != version) {
+                std::cerr << "Unsupported checkpoint version " << fileVersion << std::endl;
+                return false;
+            }
+
+            uint64_t nVerts = 0;
+            if (!r.Read(nVerts) || nVerts > r.Remaining() / (3 * sizeof(double))) return false;
+            cp.positions.setZero(nVerts, 3);
+            for (uint64_t i = 0; i < nVerts; i++) {
+                r.Read(cp.positions(i, 0));
+                r.Read(cp.positions(i, 1));
+                r.Read(cp.positions(i, 2));
+            }
+            uint64_t nEdges = 0;
+            if (!r.Read(nEdges) || nEdges > r.Remaining() / (2 * sizeof(uint64_t))) return false;
+            cp.edges.resize(nEdges);
+            for (uint64_t i = 0; i < nEdges; i++) {
+                uint64_t v1 = 0, v2 = 0;
+                r.Read(v1);
+                r.Read(v2);
+                if (v1 >= nVerts || v2 >= nVerts) {
+                    std::cerr << "Checkpoint edge " << i << " references a nonexistent vertex" << std::endl;
+                    return false;
+                }
+                cp.edges[i] = {(size_t)v1, (size_t)v2};
+            }
+
+            std::vector<int32_t> types, pins, tangentPins, surfacePins;
+            if (!readVector(r, types) || !readVector(r, pins) ||
+                !readVector(r, tangentPins) || !readVector(r, surfacePins)) return false;
+            cp.appliedConstraints.clear();
+            for (int32_t t : types) {
+                cp.appliedConstraints.push_back((ConstraintType)t);
+            }
+            cp.pinnedVertices.assign(pins.begin(), pins.end());
+            cp.pinnedTangents.assign(tangentPins.begin(), tangentPins.end());
+            cp.pinnedToSurface.assign(surfacePins.begin(), surfacePins.end());
+            uint8_t flag = 0;
+            r.Read(flag);
+            cp.pinnedAllToSurface = flag;
+
+            if (!readVectorXd(r, cp.constraintTargets)) return false;
+
+            r.Read(cp.alpha);
+            r.Read(cp.beta);
+            r.Read(cp.targetLength);
+            r.Read(cp.lengthScaleStep);
+            r.Read(flag);
+            cp.useEdgeLengthScale = flag;
+            r.Read(flag);
+            cp.useTotalLengthScale = flag;
+            r.Read(cp.lastStepSize);
+            r.Read(cp.mg_backproj_threshold);
+            int32_t iter = 0, step = 0, subdivs = 0, maxPairs = 0;
+            r.Read(iter);
+            r.Read(cp.solveTolerance);
+            r.Read(cp.solveToleranceFirstGradNorm);
+            r.Read(cp.lastRelativeDecrease);
+
+            uint64_t numPairs = 0;
+            r.Read(maxPairs);
+            if (!r.Read(numPairs) || numPairs > (uint64_t)std::max(maxPairs, 0)) return false;
+            cp.lbfgsMaxPairs = maxPairs;
+            cp.lbfgsSteps.resize(numPairs);
+            cp.lbfgsGradientChanges.resize(numPairs);
+            for (uint64_t i = 0; i < numPairs; i++) {
+                if (!readVectorXd(r, cp.lbfgsSteps[i]) || !readVectorXd(r, cp.lbfgsGradientChanges[i])) return false;
+            }
+            if (!readVectorXd(r, cp.lbfgsPrevPositions) || !readVectorXd(r, cp.lbfgsPrevGradient)) return false;
+
+            r.Read(step);
+            r.Read(subdivs);
+            r.Read(cp.initialAverageLength);
+            cp.iterNum = iter;
+            cp.currentStep = step;
+            cp.subdivideCount = subdivs;
+
+            if (r.Failed()) {
+                std::cerr << "Checkpoint ended unexpectedly" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        bool Write(const std::string &fname, const FlowCheckpoint &cp) {
+            std::vector<char> bytes;
+            Serialize(cp, bytes);
+            return BinaryIO::WriteFileAtomic(fname, bytes);
+        }
+
+        bool Read(const std::string &fname, FlowCheckpoint &cp) {
+            std::vector<char> bytes;
+            if (!BinaryIO::ReadFile(fname, bytes)) return false;
+            return Deserialize(bytes, cp);
+        }
+    }
+
+    CheckpointWriter::CheckpointWriter() {
+        hasPending = false;
+        writing = false;
+        stopping = false;
+        worker = std::thread(&CheckpointWriter::Run, this);
+    }
+
+    CheckpointWriter::~CheckpointWriter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cond.notify_all();
+        worker.join();
+    }
+
+    void CheckpointWriter::Submit(const std::string &fname, FlowCheckpoint &cp) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (hasPending) {
+                std::cout << "Previous checkpoint still queued; replacing it with iteration " << cp.iterNum << std::endl;
+            }
+            pendingName = fname;
+            std::swap(pending, cp);
+            hasPending = true;
+        }
+        // cp now holds the older checkpoint that was replaced, if there was one
+        cp = FlowCheckpoint();
+        cond.notify_all();
+    }
+
+    void CheckpointWriter::Flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [this] { return !hasPending && !writing; });
+    }
+
+    void CheckpointWriter::Run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cond.wait(lock, [this] { return hasPending || stopping; });
+            // Drain the last checkpoint before shutting down
+            if (!hasPending) break;
+
+            FlowCheckpoint cp;
+            std::swap(cp, pending);
+            std::string fname = pendingName;
+            hasPending = false;
+            writing = true;
+            lock.unlock();
+
+            long start = Utils::currentTimeMilliseconds();
+            bool ok = Checkpoint::Write(fname, cp);
+            long end = Utils::currentTimeMilliseconds();
+            if (ok) {
+                std::cout << "Wrote checkpoint for iteration " << cp.iterNum << " to " << fname
+                    << " (" << (end - start) << " ms)" << std::endl;
+            }
+
+            lock.lock();
+            writing = false;
+            cond.notify_all();
+        }
+    }
+}
@@ -0,0 +1,378 @@
+#include "flow/flow_trajectory.h"
+#include "binary_io.h"
+#include "curve_io.h"
+
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+
+namespace LWS {
+
+    namespace {
+        const char magic[8] = {'R', 'C', 'T', 'R', 'A', 'J', '0', '1'};
+        const uint32_t version = 1;
+        const size_t headerSize = 8 + 4 + 4 + 8;
+        const size_t recordHeaderSize = 1 + 4 + 8;
+
+        inline uint64_t zigzag(int64_t v) {
+            return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+        }
+
+        inline int64_t unzigzag(uint64_t u) {
+            return (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+        }
+
+        inline void writeVarint(std::vector<char> &bytes, uint64_t v) {
+            while (v >= 0x80) {
+                bytes.push_back((char)((v & 0x7f) | 0x80));
+                v >>= 7;
+            }
+            bytes.push_back((char)v);
+        }
+
+        inline bool readVarint(const char* &p, const char* end, uint64_t &v) {
+            v = 0;
+            for (int shift = 0; shift < 64 && p < end; shift += 7) {
+                uint8_t b = (uint8_t)*p++;
+                v |= (uint64_t)(b & 0x7f) << shift;
+                if (!(b & 0x80)) return true;
+            }
+            return false;
+        }
+
+        // Nonzero values are written as zigzag varints, which are never 0, so a
+        // 0 byte can introduce a run: it is followed by the run length.
+        void encodeInts(const std::vector<int64_t> &values, std::vector<char> &bytes) {
+            size_t i = 0;
+            while (i < values.size()) {
+                if (values[i] == 0) {
+                    size_t run = 0;
+                    while (i < values.size() && values[i] == 0) {
+                        run++;
+                        i++;
+                    }
+                    bytes.push_back(0);
+                    writeVarint(bytes, run);
+                }
+                else {
+                    writeVarint(bytes, zigzag(values[i]));
+                    i++;
+                }
+            }
+        }
+
+        bool decodeInts(const char* p, const char* end, std::vector<int64_t> &values) {
+            size_t i = 0;
+            while (i < values.size()) {
+                uint64_t u;
+                if (!readVarint(p, end, u)) return false;
+                if (u == 0) {
+                    uint64_t run;
+                    if (!readVarint(p, end, run) || run > values.size() - i) return false;
+                    for (uint64_t j = 0; j < run; j++) values[i++] = 0;
+                }
+                else {
+                    values[i++] = unzigzag(u);
+                }
+            }
+            return p == end;
+        }
+    }
+
+    TrajectoryWriter::TrajectoryWriter(const std::string &fname, double tolerance, int keyframeInterval_, size_t maxQueued_) {
+        filename = fname;
+        // Rounding to the nearest multiple of the step is off by at most half a step
+        quantum = 2 * tolerance;
+        keyframeInterval = (keyframeInterval_ > 0) ? keyframeInterval_ : 1;
+        maxQueued = (maxQueued_ > 0) ? maxQueued_ : 1;
+        numFrames = 0;
+        numMerged = 0;
+        warnedFull = false;
+        lastTopologyID = -1;
+        framesSinceKeyframe = 0;
+        bytesWritten = 0;
+        rawBytes = 0;
+        stopping = false;
+
+        out.open(fname, std::ios::binary | std::ios::trunc);
+        open = out.is_open() && tolerance > 0;
+        if (!open) {
+            std::cerr << "Could not open trajectory file " << fname << " (tolerance " << tolerance << ")" << std::endl;
+            return;
+        }
+
+        BinaryIO::Writer w;
+        w.WriteBytes(magic, 8);
+        w.Write<uint32_t>(version);
+        w.Write<uint32_t>(keyframeInterval);
+        w.Write<double>(quantum);
+        out.write(w.bytes.data(), w.bytes.size());
+        bytesWritten += w.bytes.size();
+
+        worker = std::thread(&TrajectoryWriter::Run, this);
+    }
+
+    TrajectoryWriter::~TrajectoryWriter() {
+        Finish();
+    }
+
+    void TrajectoryWriter::AddFrame(PolyCurveNetwork* curves) {
+        if (!open) return;
+
+        Frame frame;
+        frame.positions = curves->positions;
+        // Networks never change connectivity in place, so comparing IDs is enough
+        frame.topologyChanged = (curves->TopologyID() != lastTopologyID);
+        lastTopologyID = curves->TopologyID();
+
+        fillEdges(curves, frame);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (queue.size() >= maxQueued) {
+            // Rather than wait for the disk, replace the newest queued frame,
+            // keeping its index and any topology record it carried. The worker
+            // only takes frames from the front, so the back is still pending.
+            if (!warnedFull) {
+                std::cout << "Trajectory writer is behind; merging frames until it catches up" << std::endl;
+                warnedFull = true;
+            }
+            Frame &newest = queue.back();
+            frame.index = newest.index;
+            if (newest.topologyChanged && !frame.topologyChanged) {
+                frame.topologyChanged = true;
+                fillEdges(curves, frame);
+            }
+            newest = std::move(frame);
+            numMerged++;
+            return;
+        }
+        frame.index = numFrames++;
+        queue.push_back(std::move(frame));
+        cond.notify_all();
+    }
+
+    void TrajectoryWriter::fillEdges(PolyCurveNetwork* curves, Frame &frame) {
+        if (!frame.topologyChanged) return;
+        int nEdges = curves->NumEdges();
+        frame.edges.resize(nEdges);
+        for (int i = 0; i < nEdges; i++) {
+            CurveEdge* e = curves->GetEdge(i);
+            frame.edges[i] = {(size_t)e->prevVert->GlobalIndex(), (size_t)e->nextVert->GlobalIndex()};
+        }
+    }
+
+    void TrajectoryWriter::Finish() {
+        if (!open) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cond.notify_all();
+        worker.join();
+        out.close();
+        open = false;
+
+        std::cout << "Wrote " << numFrames << " frames to " << filename << " (" << bytesWritten << " bytes, "
+            << (bytesWritten > 0 ? (double)rawBytes / bytesWritten : 0) << "x smaller than raw positions)" << std::endl;
+        if (numMerged > 0) {
+            std::cout << numMerged << " steps were merged into later frames while the writer was behind" << std::endl;
+        }
+    }
+
+    void TrajectoryWriter::Run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cond.wait(lock, [this] { return !queue.empty() || stopping; });
+            // Drain the queue before shutting down
+            if (queue.empty()) break;
+
+            Frame frame = std::move(queue.front());
+            queue.pop_front();
+            cond.notify_all();
+            lock.unlock();
+
+            Encode(frame);
+
+            lock.lock();
+        }
+        out.flush();
+    }
+
+    void TrajectoryWriter::Encode(Frame &frame) {
+        size_t nVerts = frame.positions.rows();
+        rawBytes += nVerts * 3 * sizeof(double);
+
+        if (frame.topologyChanged) {
+            std::vector<char> payload;
+            writeVarint(payload, nVerts);
+            writeVarint(payload, frame.edges.size());
+            for (const std::array<size_t, 2> &e : frame.edges) {
+                writeVarint(payload, e[0]);
+                writeVarint(payload, e[1]);
+            }
+            WriteRecord(TrajectoryRecord::Topology, frame.index, payload);
+        }
+
+        std::vector<int64_t> quantized(3 * nVerts);
+        for (size_t i = 0; i < nVerts; i++) {
+            for (int j = 0; j < 3; j++) {
+                quantized[3 * i + j] = std::llround(frame.positions(i, j) / quantum);
+            }
+        }
+
+        bool keyframe = frame.topologyChanged || framesSinceKeyframe >= keyframeInterval;
+        std::vector<char> payload;
+        if (keyframe) {
+            encodeInts(quantized, payload);
+            framesSinceKeyframe = 0;
+        }
+        else {
+            // Deltas are taken between quantized values, so errors don't accumulate
+            std::vector<int64_t> delta(quantized.size());
+            for (size_t i = 0; i < quantized.size(); i++) {
+                delta[i] = quantized[i] - previous[i];
+            }
+            encodeInts(delta, payload);
+        }
+        framesSinceKeyframe++;
+        WriteRecord(keyframe ? TrajectoryRecord::Keyframe : TrajectoryRecord::Delta, frame.index, payload);
+        previous.swap(quantized);
+
+        if (keyframe) out.flush();
+    }
+
+    void TrajectoryWriter::WriteRecord(TrajectoryRecord type, int frame, const std::vector<char> &payload) {
+        BinaryIO::Writer w;
+        w.Write<uint8_t>((uint8_t)type);
+        w.Write<uint32_t>(frame);
+        w.Write<uint64_t>(payload.size());
+        out.write(w.bytes.data(), w.bytes.size());
+        out.write(payload.data(), payload.size());
+
+        BinaryIO::Writer trailer;
+        trailer.Write<uint64_t>(BinaryIO::Checksum(payload.data(), payload.size()));
+        out.write(trailer.bytes.data(), trailer.bytes.size());
+        bytesWritten += w.bytes.size() + payload.size() + trailer.bytes.size();
+    }
+
+    bool TrajectoryReader::Open(const std::string &fname) {
+        offset = 0;
+        quantum = 0;
+        frameIndex = -1;
+        nVerts = 0;
+        haveKeyframe = false;
+        currentEdges.clear();
+        current.clear();
+        if (!file.Open(fname)) return false;
+
+        BinaryIO::Reader r(file.Data(), file.Size());
+        const char* fileMagic = r.Skip(8);
+        uint32_t fileVersion = 0, interval = 0;
+        if (!fileMagic || std::memcmp(fileMagic, magic, 8) != 0) {
+            std::cerr << fname << " is not a trajectory file" << std::endl;
+            return false;
+        }
+        r.Read(fileVersion);
+        r.Read(interval);
+        r.Read(quantum);
+        if (r.Failed() || fileVersion != version || !(quantum > 0)) {
+            std::cerr << "Unsupported trajectory version " << fileVersion << " in " << fname << std::endl;
+            return false;
+        }
+        offset = headerSize;
+        return true;
+    }
+
+    bool TrajectoryReader::NextFrame(Eigen::MatrixXd &positions, std::vector<std::array<size_t, 2>> &edges) {
+        while (offset + recordHeaderSize <= file.Size()) {
+            BinaryIO::Reader r(file.Data() + offset, file.Size() - offset);
+            uint8_t type = 0;
+            uint32_t frame = 0;
+            uint64_t size = 0;
+            r.Read(type);
+            r.Read(frame);
+            r.Read(size);
+            const char* payload = (size <= r.Remaining()) ? r.Skip(size) : 0;
+            uint64_t sum = 0;
+            if (!payload || !r.Read(sum) || sum != BinaryIO::Checksum(payload, size)) {
+                std::cerr << "Trajectory ends with an incomplete record after frame " << frameIndex << std::endl;
+                return false;
+            }
+            offset += r.Offset();
+            const char* end = payload + size;
+
+            if (type == (uint8_t)TrajectoryRecord::Topology) {
+                uint64_t nv, ne;
+                if (!readVarint(payload, end, nv) || !readVarint(payload, end, ne) || ne > size) return false;
+                currentEdges.resize(ne);
+                for (uint64_t i = 0; i < ne; i++) {
+                    uint64_t v1, v2;
+                    if (!readVarint(payload, end, v1) || !readVarint(payload, end, v2) || v1 >= nv || v2 >= nv) {
+                        std::cerr << "Corrupt topology record in trajectory" << std::endl;
+                        return false;
+                    }
+                    currentEdges[i] = {(size_t)v1, (size_t)v2};
+                }
+                nVerts = nv;
+                haveKeyframe = false;
+                continue;
+            }
+
+            std::vector<int64_t> values(3 * nVerts);
+            if (!decodeInts(payload, end, values)) {
+                std::cerr << "Corrupt frame " << frame << " in trajectory" << std::endl;
+                return false;
+            }
+            if (type == (uint8_t)TrajectoryRecord::Keyframe) {
+                current.swap(values);
+                haveKeyframe = true;
+            }
+            else if (type == (uint8_t)TrajectoryRecord::Delta && haveKeyframe) {
+                for (size_t i = 0; i < current.size(); i++) {
+                    current[i] += values[i];
+                }
+            }
+            else {
+                // Unknown record type, or a delta without a base to apply it to
+                continue;
+            }
+
+            frameIndex = frame;
+            positions.setZero(nVerts, 3);
+            for (size_t i = 0; i < nVerts; i++) {
+                for (int j = 0; j < 3; j++) {
+                    positions(i, j) = current[3 * i + j] * quantum;
+                }
+            }
+            edges = currentEdges;
+            return true;
+        }
+        return false;
+    }
+
+    bool exportTrajectoryToOBJ(const std::string &trajName, const std::string &directory) {
+        TrajectoryReader reader;
+        if (!reader.Open(trajName)) return false;
+
+        Eigen::MatrixXd positions;
+        std::vector<std::array<size_t, 2>> edges;
+        int count = 0;
+        while (reader.NextFrame(positions, edges)) {
+            std::vector<Vector3> all_positions(positions.rows());
+            for (int i = 0; i < positions.rows(); i++) {
+                all_positions[i] = SelectRow(positions, i);
+            }
+            std::vector<std::vector<size_t>> components(edges.size());
+            for (size_t i = 0; i < edges.size(); i++) {
+                components[i] = {edges[i][0], edges[i][1]};
+            }
+
+            char buffer[16];
+            std::snprintf(buffer, sizeof(buffer), "%04d", reader.FrameIndex());
+            CurveIO::writeOBJLineElements(directory + "/curve" + std::string(buffer) + ".obj", all_positions, components);
+            count++;
+        }
+        std::cout << "Exported " << count << " frames (tolerance " << reader.Tolerance() << ") to " << directory << std::endl;
+        return count > 0;
+    }
+}
@@ -0,0 +1,37 @@
+#include "flow/lbfgs_history.h"
+
+namespace LWS {
+
+    LBFGSHistory::LBFGSHistory(int maxPairs) {
+        steps.resize(maxPairs);
+        gradientChanges.resize(maxPairs);
+        rhos.resize(maxPairs);
+        first = 0;
+        numPairs = 0;
+    }
+
+    void LBFGSHistory::Clear() {
+        first = 0;
+        numPairs = 0;
+    }
+
+    bool LBFGSHistory::AddPair(const Eigen::VectorXd &s, const Eigen::VectorXd &y) {
+        double sy = s.dot(y);
+        if (!(sy > 1e-10 * s.norm() * y.norm())) return false;
+
+        int k;
+        if (numPairs < MaxPairs()) {
+            k = slot(numPairs);
+            numPairs++;
+        }
+        else {
+            // Overwrite the oldest pair
+            k = first;
+            first = (first + 1) % MaxPairs();
+        }
+        steps[k] = s;
+        gradientChanges[k] = y;
+        rhos[k] = 1.0 / sy;
+        return true;
+    }
+}
@@ -0,0 +1,47 @@
+#include "flow/solve_tolerance.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace LWS {
+
+    SolveTolerance::SolveTolerance(double ref, double minT, double maxT) {
+        reference = ref;
+        minTol = minT;
+        maxTol = maxT;
+        Reset();
+    }
+
+    void SolveTolerance::Reset() {
+        current = reference;
+        firstGradNorm = 0;
+    }
+
+    void SolveTolerance::Restore(double cur, double firstNorm) {
+        current = std::min(std::max(cur, minTol), maxTol);
+        firstGradNorm = firstNorm;
+    }
+
+    double SolveTolerance::Update(double gradNorm, double relativeDecrease) {
+        if (!(gradNorm > 0) || !std::isfinite(gradNorm)) {
+            return current;
+        }
+        if (firstGradNorm == 0) {
+            firstGradNorm = gradNorm;
+        }
+
+        double eta = maxTol;
+        eta = std::min(eta, maxTol * std::sqrt(gradNorm / firstGradNorm));
+        if (relativeDecrease >= 0) {
+            eta = std::min(eta, 0.5 * std::sqrt(relativeDecrease));
+        }
+        eta = std::min(eta, 2 * current);
+        current = std::max(minTol, eta);
+        return current;
+    }
+
+    double SolveTolerance::EstimateSaved(double iterations) const {
+        if (iterations <= 0 || current >= 1) return 0;
+        return iterations * (std::log(reference) / std::log(current) - 1);
+    }
+}
@@ -0,0 +1,133 @@
+#include "implicit_mesher.h"
+#include "marchingcubes/CIsoSurface.h"
+
+#include <omp.h>
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+
+namespace LWS {
+
+    namespace {
+        // Identifies a vertex on a slab boundary plane by the exact bits of its
+        // in-plane coordinates. Both slabs sample the same points on that plane,
+        // so they compute bitwise identical positions there.
+        inline uint64_t planeKey(float x, float y) {
+            uint32_t bx, by;
+            memcpy(&bx, &x, sizeof(float));
+            memcpy(&by, &y, sizeof(float));
+            return ((uint64_t)bx << 32) | by;
+        }
+    }
+
+    ImplicitMesher::ImplicitMesher(int resolution_, int slabCells_) {
+        resolution = std::max(1, resolution_);
+        slabCells = std::max(1, slabCells_);
+    }
+
+    void ImplicitMesher::Extract(ImplicitSurface* surface, std::vector<Vector3> &vertices,
+    std::vector<std::array<size_t, 3>> &triangles) {
+        vertices.clear();
+        triangles.clear();
+
+        Vector3 center = surface->BoundingCenter();
+        double diameter = surface->BoundingDiameter();
+        double cellSize = diameter / resolution;
+        double radius = diameter / 2;
+        Vector3 lowerCorner = center - Vector3{radius, radius, radius};
+
+        int numSlabs = (resolution + slabCells - 1) / slabCells;
+        int waveSize = omp_get_max_threads();
+        std::vector<Slab> wave(waveSize);
+
+        // Global indices of the vertices on the top plane of the previous slab
+        std::unordered_map<uint64_t, size_t> seam;
+
+        for (int waveStart = 0; waveStart < numSlabs; waveStart += waveSize) {
+            int waveEnd = std::min(numSlabs, waveStart + waveSize);
+
+            #pragma omp parallel for schedule(dynamic)
+            for (int s = waveStart; s < waveEnd; s++) {
+                int zStart = s * slabCells;
+                int zCells = std::min(slabCells, resolution - zStart);
+                extractSlab(surface, lowerCorner, cellSize, zStart, zCells, wave[s - waveStart]);
+            }
+
+            // Append the slabs in order, welding each one's bottom to the previous top
+            for (int s = waveStart; s < waveEnd; s++) {
+                Slab &slab = wave[s - waveStart];
+                std::vector<size_t> globalIndex(slab.vertices.size(), (size_t)-1);
+
+                for (const std::pair<uint64_t, size_t> &b : slab.bottom) {
+                    std::unordered_map<uint64_t, size_t>::const_iterator it = seam.find(b.first);
+                    if (it != seam.end()) globalIndex[b.second] = it->second;
+                }
+                for (size_t i = 0; i < slab.vertices.size(); i++) {
+                    if (globalIndex[i] == (size_t)-1) {
+                        globalIndex[i] = vertices.size();
+                        vertices.push_back(slab.vertices[i]);
+                    }
+                }
+                for (const std::array<size_t, 3> &t : slab.triangles) {
+                    triangles.push_back({globalIndex[t[0]], globalIndex[t[1]], globalIndex[t[2]]});
+                }
+
+                seam.clear();
+                for (const std::pair<uint64_t, size_t> &t : slab.top) {
+                    seam[t.first] = globalIndex[t.second];
+                }
+
+                // Release the slab's memory before the next wave
+                slab = Slab();
+            }
+        }
+    }
+
+    void ImplicitMesher::extractSlab(ImplicitSurface* surface, Vector3 lowerCorner, double cellSize,
+    int zStart, int zCells, Slab &slab) {
+        size_t numCorners = resolution + 1;
+        size_t nRow = numCorners;
+        size_t nSlice = numCorners * numCorners;
+
+        // Sample the slab one row of x at a time
+        std::vector<double> field(nSlice * (zCells + 1));
+        std::vector<double> xs(numCorners), ys(numCorners), zs(numCorners);
+        for (size_t x = 0; x < numCorners; x++) {
+            xs[x] = lowerCorner.x + x * cellSize;
+        }
+        for (int z = 0; z <= zCells; z++) {
+            double zPos = lowerCorner.z + (zStart + z) * cellSize;
+            for (size_t y = 0; y < numCorners; y++) {
+                double yPos = lowerCorner.y + y * cellSize;
+                std::fill(ys.begin(), ys.end(), yPos);
+                std::fill(zs.begin(), zs.end(), zPos);
+                surface->SignedDistances(xs.data(), ys.data(), zs.data(), numCorners, &field[nSlice * z + nRow * y]);
+            }
+        }
+
+        CIsoSurface<double> iso;
+        float cellLength = cellSize;
+        iso.GenerateSurface(field.data(), 0, resolution, resolution, zCells, cellLength, cellLength, cellLength);
+
+        // CIsoSurface computes plane z = k as k * cellLength, so this matches it exactly
+        float topZ = zCells * cellLength;
+        Vector3 slabCorner = lowerCorner + Vector3{0, 0, zStart * cellSize};
+
+        slab.vertices.resize(iso.m_nVertices);
+        for (unsigned int i = 0; i < iso.m_nVertices; i++) {
+            float x = iso.m_ppt3dVertices[i][0];
+            float y = iso.m_ppt3dVertices[i][1];
+            float z = iso.m_ppt3dVertices[i][2];
+            slab.vertices[i] = slabCorner + Vector3{x, y, z};
+            if (z == 0) slab.bottom.push_back(std::make_pair(planeKey(x, y), (size_t)i));
+            if (z == topZ) slab.top.push_back(std::make_pair(planeKey(x, y), (size_t)i));
+        }
+
+        slab.triangles.resize(iso.m_nTriangles);
+        for (unsigned int i = 0; i < iso.m_nTriangles; i++) {
+            slab.triangles[i] = {(size_t)iso.m_piTriangleIndices[3 * i],
+                                 (size_t)iso.m_piTriangleIndices[3 * i + 1],
+                                 (size_t)iso.m_piTriangleIndices[3 * i + 2]};
+        }
+    }
+}
@@ -1,12 +1,31 @@
 #include "implicit_surface.h"
+#include "implicit_csg.h"
 #include "utils.h"
 
 #include "geometrycentral/utilities/vector2.h"
 
+#include <algorithm>
+
 namespace LWS {
 
     ImplicitSurface::~ImplicitSurface() {}
 
+    void ImplicitSurface::SignedDistances(const double* x, const double* y, const double* z, size_t n, double* out) {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = SignedDistance(Vector3{x[i], y[i], z[i]});
+        }
+    }
+
+    void ImplicitSurface::GradientsOfDistance(const double* x, const double* y, const double* z, size_t n,
+    double* gx, double* gy, double* gz) {
+        for (size_t i = 0; i < n; i++) {
+            Vector3 g = GradientOfDistance(Vector3{x[i], y[i], z[i]});
+            gx[i] = g.x;
+            gy[i] = g.y;
+            gz[i] = g.z;
+        }
+    }
+
     ImplicitSphere::ImplicitSphere(double r, Vector3 c) {
         radius = r;
         center = c;
@@ -28,6 +47,30 @@ namespace LWS {
         return center;
     }
 
+    void ImplicitSphere::SignedDistances(const double* x, const double* y, const double* z, size_t n, double* out) {
+        // Copy members to locals, so the compiler knows the outputs can't alias them
+        const Vector3 c = center;
+        const double r = radius;
+        #pragma omp simd
+        for (size_t i = 0; i < n; i++) {
+            double dx = x[i] - c.x, dy = y[i] - c.y, dz = z[i] - c.z;
+            out[i] = sqrt(dx * dx + dy * dy + dz * dz) - r;
+        }
+    }
+
+    void ImplicitSphere::GradientsOfDistance(const double* x, const double* y, const double* z, size_t n,
+    double* gx, double* gy, double* gz) {
+        const Vector3 c = center;
+        #pragma omp simd
+        for (size_t i = 0; i < n; i++) {
+            double dx = x[i] - c.x, dy = y[i] - c.y, dz = z[i] - c.z;
+            double r = sqrt(dx * dx + dy * dy + dz * dz);
+            gx[i] = dx / r;
+            gy[i] = dy / r;
+            gz[i] = dz / r;
+        }
+    }
+
     ImplicitTorus::ImplicitTorus(double major, double minor, Vector3 c) {
         majorRadius = major;
         minorRadius = minor;
@@ -66,6 +109,35 @@ namespace LWS {
     Vector3 ImplicitTorus::BoundingCenter() {
         return center;
     }
+
+    void ImplicitTorus::SignedDistances(const double* x, const double* y, const double* z, size_t n, double* out) {
+        const Vector3 c = center;
+        const double R = majorRadius, r = minorRadius;
+        #pragma omp simd
+        for (size_t i = 0; i < n; i++) {
+            double px = x[i] - c.x, py = y[i] - c.y, pz = z[i] - c.z;
+            double normAll = px * px + py * py + pz * pz;
+            double normXZ = sqrt(px * px + pz * pz);
+            out[i] = sqrt(normAll - 2 * R * normXZ + R * R) - r;
+        }
+    }
+
+    void ImplicitTorus::GradientsOfDistance(const double* x, const double* y, const double* z, size_t n,
+    double* gx, double* gy, double* gz) {
+        const Vector3 c = center;
+        const double R = majorRadius, r = minorRadius;
+        #pragma omp simd
+        for (size_t i = 0; i < n; i++) {
+            double px = x[i] - c.x, py = y[i] - c.y, pz = z[i] - c.z;
+            double normAll = px * px + py * py + pz * pz;
+            double normXZ = sqrt(px * px + pz * pz);
+            double sqTerm = sqrt(normAll - 2 * R * normXZ + R * R);
+            double scale = 1.0 / (2 * sqTerm);
+            gx[i] = scale * (2 * px - (2 * px * R) / normXZ);
+            gy[i] = scale * (2 * py);
+            gz[i] = scale * (2 * pz - (2 * pz * R) / normXZ);
+        }
+    }
     
     YZeroPlane::YZeroPlane() {}
 
@@ -85,6 +157,17 @@ namespace LWS {
         return Vector3{0, 0.01, 0};
     }
 
+    void YZeroPlane::SignedDistances(const double* x, const double* y, const double* z, size_t n, double* out) {
+        std::copy(y, y + n, out);
+    }
+
+    void YZeroPlane::GradientsOfDistance(const double* x, const double* y, const double* z, size_t n,
+    double* gx, double* gy, double* gz) {
+        std::fill(gx, gx + n, 0.0);
+        std::fill(gy, gy + n, 1.0);
+        std::fill(gz, gz + n, 0.0);
+    }
+
     ImplicitDoubleTorus::ImplicitDoubleTorus(double r2) {
         radius2 = r2;
     }
@@ -123,6 +206,31 @@ namespace LWS {
         return Vector3{0, 0, 0};
     }
 
+    void ImplicitDoubleTorus::SignedDistances(const double* x, const double* y, const double* z, size_t n, double* out) {
+        const double r2 = radius2;
+        #pragma omp simd
+        for (size_t i = 0; i < n; i++) {
+            double px = x[i] + 2;
+            double inner = (px * (px - 1) * (px - 1) * (px - 2) + y[i] * y[i]);
+            out[i] = inner * inner + z[i] * z[i] - r2;
+        }
+    }
+
+    void ImplicitDoubleTorus::GradientsOfDistance(const double* x, const double* y, const double* z, size_t n,
+    double* gx, double* gy, double* gz) {
+        #pragma omp simd
+        for (size_t i = 0; i < n; i++) {
+            double px = x[i] + 2;
+            double x2 = px * px;
+            double x3 = x2 * px;
+            double x4 = x3 * px;
+            double polyn = x4 - 4 * x3 + 5 * x2 - 2 * px + y[i] * y[i];
+            gx[i] = 2 * polyn * (4 * x3 - 12 * x2 + 10 * px - 2);
+            gy[i] = 4 * y[i] * polyn;
+            gz[i] = 2 * z[i];
+        }
+    }
+
     ImplicitUnion::ImplicitUnion(ImplicitSurface* s1, ImplicitSurface* s2) {
         surfaces.push_back(s1);
         surfaces.push_back(s2);
@@ -178,6 +286,60 @@ namespace LWS {
         return (mins + maxs) / 2;
     }
 
+    void ImplicitUnion::SignedDistances(const double* x, const double* y, const double* z, size_t n, double* out) {
+        double dist[implicitBatchSize];
+        for (size_t start = 0; start < n; start += implicitBatchSize) {
+            size_t count = std::min(implicitBatchSize, n - start);
+            surfaces[0]->SignedDistances(x + start, y + start, z + start, count, out + start);
+            for (size_t s = 1; s < surfaces.size(); s++) {
+                surfaces[s]->SignedDistances(x + start, y + start, z + start, count, dist);
+                #pragma omp simd
+                for (size_t i = 0; i < count; i++) {
+                    out[start + i] = CSG::UnionDistance(out[start + i], dist[i]);
+                }
+            }
+        }
+    }
+
+    void ImplicitUnion::GradientsOfDistance(const double* x, const double* y, const double* z, size_t n,
+    double* gx, double* gy, double* gz) {
+        double minDist[implicitBatchSize], dist[implicitBatchSize];
+        double hx[implicitBatchSize], hy[implicitBatchSize], hz[implicitBatchSize];
+        int minIndex[implicitBatchSize];
+
+        for (size_t start = 0; start < n; start += implicitBatchSize) {
+            size_t count = std::min(implicitBatchSize, n - start);
+            const double *px = x + start, *py = y + start, *pz = z + start;
+
+            // Find the closest surface to each point; ties go to the first one
+            surfaces[0]->SignedDistances(px, py, pz, count, minDist);
+            std::fill(minIndex, minIndex + count, 0);
+            for (size_t s = 1; s < surfaces.size(); s++) {
+                surfaces[s]->SignedDistances(px, py, pz, count, dist);
+                for (size_t i = 0; i < count; i++) {
+                    if (dist[i] < minDist[i]) {
+                        minDist[i] = dist[i];
+                        minIndex[i] = s;
+                    }
+                }
+            }
+
+            // Then take the gradient of whichever surface won
+            surfaces[0]->GradientsOfDistance(px, py, pz, count, gx + start, gy + start, gz + start);
+            for (size_t s = 1; s < surfaces.size(); s++) {
+                if (std::find(minIndex, minIndex + count, (int)s) == minIndex + count) continue;
+                surfaces[s]->GradientsOfDistance(px, py, pz, count, hx, hy, hz);
+                for (size_t i = 0; i < count; i++) {
+                    if (minIndex[i] == (int)s) {
+                        gx[start + i] = hx[i];
+                        gy[start + i] = hy[i];
+                        gz[start + i] = hz[i];
+                    }
+                }
+            }
+        }
+    }
+
     ImplicitSmoothUnion::ImplicitSmoothUnion(ImplicitSurface* s1, ImplicitSurface* s2, double blendFactor) {
         surface1 = s1;
         surface2 = s2;
@@ -187,29 +349,19 @@ namespace LWS {
     double ImplicitSmoothUnion::SignedDistance(Vector3 p) {
         double d1 = surface1->SignedDistance(p);
         double d2 = surface2->SignedDistance(p);
-        float h = clamp(0.5 + 0.5 * (d2 - d1) / k, 0.0, 1.0);
-        return ((1 - h) * d2 + h * d1) - k * h * (1 - h);
+        return CSG::SmoothUnionDistance(d1, d2, k);
     }
 
 
     Vector3 ImplicitSmoothUnion::GradientOfDistance(Vector3 point) {
         double d1 = surface1->SignedDistance(point);
         double d2 = surface2->SignedDistance(point);
-        float h = clamp(0.5 + 0.5 * (d2 - d1) / k, 0.0, 1.0);
-
         Vector3 deriv_d1 = surface1->GradientOfDistance(point);
         Vector3 deriv_d2 = surface2->GradientOfDistance(point);
-        // We need derivative of a clamp, which is just 0 outside of (0, 1)
-        Vector3 deriv_h{0, 0, 0};
-        if (h > 0 && h < 1) {
-            deriv_h = (1.0 / (2 * k)) * (deriv_d2 - deriv_d1);
-        }
-
-        Vector3 deriv_term1 = (-deriv_h * d2 + (1 - h) * deriv_d2);
-        Vector3 deriv_term2 = (deriv_h * d1 + h * deriv_d1);
-        Vector3 deriv_term3 = -k * (deriv_h - 2 * h * deriv_h);
 
-        return deriv_term1 + deriv_term2 + deriv_term3;
+        return Vector3{CSG::SmoothUnionGradient(d1, d2, k, deriv_d1.x, deriv_d2.x),
+                       CSG::SmoothUnionGradient(d1, d2, k, deriv_d1.y, deriv_d2.y),
+                       CSG::SmoothUnionGradient(d1, d2, k, deriv_d1.z, deriv_d2.z)};
     }
 
     double ImplicitSmoothUnion::BoundingDiameter() {
@@ -238,6 +390,38 @@ namespace LWS {
         return (mins + maxs) / 2;
     }
 
+    void ImplicitSmoothUnion::SignedDistances(const double* x, const double* y, const double* z, size_t n, double* out) {
+        const double blend = k;
+        double d2[implicitBatchSize];
+        for (size_t start = 0; start < n; start += implicitBatchSize) {
+            size_t count = std::min(implicitBatchSize, n - start);
+            surface1->SignedDistances(x + start, y + start, z + start, count, out + start);
+            surface2->SignedDistances(x + start, y + start, z + start, count, d2);
+            #pragma omp simd
+            for (size_t i = 0; i < count; i++) {
+                out[start + i] = CSG::SmoothUnionDistance(out[start + i], d2[i], blend);
+            }
+        }
+    }
 
+    void ImplicitSmoothUnion::GradientsOfDistance(const double* x, const double* y, const double* z, size_t n,
+    double* gx, double* gy, double* gz) {
+        const double blend = k;
+        double d1[implicitBatchSize], d2[implicitBatchSize];
+        double hx[implicitBatchSize], hy[implicitBatchSize], hz[implicitBatchSize];
+        for (size_t start = 0; start < n; start += implicitBatchSize) {
+            size_t count = std::min(implicitBatchSize, n - start);
+            const double *px = x + start, *py = y + start, *pz = z + start;
+            surface1->SignedDistances(px, py, pz, count, d1);
+            surface2->SignedDistances(px, py, pz, count, d2);
+            surface1->GradientsOfDistance(px, py, pz, count, gx + start, gy + start, gz + start);
+            surface2->GradientsOfDistance(px, py, pz, count, hx, hy, hz);
+            #pragma omp simd
+            for (size_t i = 0; i < count; i++) {
+                gx[start + i] = CSG::SmoothUnionGradient(d1[i], d2[i], blend, gx[start + i], hx[i]);
+                gy[start + i] = CSG::SmoothUnionGradient(d1[i], d2[i], blend, gy[start + i], hy[i]);
+                gz[start + i] = CSG::SmoothUnionGradient(d1[i], d2[i], blend, gz[start + i], hz[i]);
+            }
+        }
+    }
 }
-
@@ -30,9 +30,12 @@
 #include <fstream>
 #include <queue>
 
-#include "marchingcubes/CIsoSurface.h"
+#include "implicit_mesher.h"
 
 #include "curve_io.h"
+#include "curve_binary.h"
+#include "field_cache.h"
+#include "profiler.h"
 
 using namespace geometrycentral;
 using namespace geometrycentral::surface;
@@ -131,6 +134,92 @@ namespace LWS
     writeCurves(curves, "objs/curve" + std::string(buffer) + ".obj", "objTangents/curve" + std::string(buffer) + ".obj");
   }
 
+  void LWSApp::EnableCheckpoints(std::string filename, int interval)
+  {
+    checkpointFile = filename;
+    checkpointInterval = (interval > 0) ? interval : 1;
+    if (!checkpointWriter)
+    {
+      checkpointWriter = new CheckpointWriter();
+    }
+    std::cout << "Writing a checkpoint to " << checkpointFile << " every " << checkpointInterval << " steps" << std::endl;
+  }
+
+  void LWSApp::FlushCheckpoints()
+  {
+    if (checkpointWriter)
+    {
+      checkpointWriter->Flush();
+    }
+  }
+
+  void LWSApp::RecordTrajectory(std::string filename, double tolerance, int keyframeInterval)
+  {
+    if (trajectoryWriter)
+    {
+      delete trajectoryWriter;
+    }
+    trajectoryWriter = new TrajectoryWriter(filename, tolerance, keyframeInterval);
+    if (!trajectoryWriter->IsOpen())
+    {
+      exit(1);
+    }
+    std::cout << "Recording trajectory to " << filename << " with tolerance " << tolerance << std::endl;
+    // Record the starting state as the first frame
+    trajectoryWriter->AddFrame(curves);
+  }
+
+  void LWSApp::FinishTrajectory()
+  {
+    if (trajectoryWriter)
+    {
+      trajectoryWriter->Finish();
+    }
+  }
+
+  void LWSApp::writeCheckpoint()
+  {
+    // Snapshot the state here; serializing and writing happen on the writer thread
+    FlowCheckpoint cp;
+    tpeSolver->FillCheckpoint(cp);
+    cp.currentStep = currentStep;
+    cp.subdivideCount = subdivideCount;
+    cp.initialAverageLength = initialAverageLength;
+    checkpointWriter->Submit(checkpointFile, cp);
+  }
+
+  void LWSApp::ResumeFromCheckpoint(std::string filename)
+  {
+    FlowCheckpoint cp;
+    if (!Checkpoint::Read(filename, cp))
+    {
+      std::cerr << "Could not resume from checkpoint " << filename << std::endl;
+      exit(1);
+    }
+
+    PolyCurveNetwork *resumed = Checkpoint::CreateCurve(cp);
+    resumed->constraintSurface = curves->constraintSurface;
+    tpeSolver->ReplaceCurve(resumed);
+    if (!tpeSolver->RestoreCheckpoint(cp))
+    {
+      std::cerr << "Checkpoint " << filename << " has " << cp.constraintTargets.rows() << " constraint targets, but the curve has "
+                << tpeSolver->constraint.NumConstraintRows() << " constraint rows" << std::endl;
+      exit(1);
+    }
+    delete curves;
+    curves = resumed;
+
+    currentStep = cp.currentStep;
+    subdivideCount = cp.subdivideCount;
+    initialAverageLength = cp.initialAverageLength;
+    LWSOptions::tpeAlpha = cp.alpha;
+    LWSOptions::tpeBeta = cp.beta;
+
+    DisplayCurves(curves, curveName);
+    std::cout << "Resumed from " << filename << " at step " << currentStep << " (" << curves->NumVertices()
+              << " vertices, " << subdivideCount << " subdivisions)" << std::endl;
+  }
+
   void LWSApp::benchmarkMethods()
   {
     size_t nVerts = curves->NumVertices();
@@ -153,7 +242,7 @@ namespace LWS
     using MultigridSolver = MultigridHierarchy<MultigridDomain>;
     double sep = 1.0;
     MultigridDomain *domain = new MultigridDomain(curves, 3, 6, sep, 0);
-    MultigridSolver *multigrid = new MultigridSolver(domain);
+    MultigridSolver *multigrid = new MultigridSolver(domain, domain->NumLevelsForCache());
     long mg_setup_end = Utils::currentTimeMilliseconds();
     std::cout << "  Multigrid setup: " << (mg_setup_end - mg_setup_start) << " ms" << std::endl;
 
@@ -241,6 +330,10 @@ namespace LWS
     ImGui::Checkbox("Use Barnes-Hut", &LWSOptions::useBarnesHut);
     ImGui::SameLine(160);
     ImGui::Checkbox("Use multigrid", &LWSOptions::useMultigrid);
+    ImGui::Checkbox("Use L-BFGS", &LWSOptions::useLBFGS);
+    ImGui::SameLine(160);
+    ImGui::Checkbox("Use circle search", &LWSOptions::useCircleSearch);
+    ImGui::Checkbox("Adaptive remeshing", &LWSOptions::adaptiveRemesh);
 
     if (LWSOptions::runTPE || buttonStepTPE)
     {
@@ -259,7 +352,15 @@ namespace LWS
       bool good_step;
       if (LWSOptions::useSobolev)
       {
-        if (LWSOptions::useMultigrid)
+        if (LWSOptions::useMultigrid && LWSOptions::useLBFGS)
+        {
+          good_step = tpeSolver->StepLBFGS(0, useBackproj);
+        }
+        else if (LWSOptions::useMultigrid && LWSOptions::useCircleSearch)
+        {
+          good_step = tpeSolver->StepSobolevCircleIterative(0, useBackproj);
+        }
+        else if (LWSOptions::useMultigrid)
         {
           good_step = tpeSolver->StepSobolevLSIterative(0, useBackproj);
         }
@@ -299,11 +400,18 @@ namespace LWS
         numStuckIterations = 0;
       }
 
-      double averageLength = curves->TotalLength() / curves->NumEdges();
-      if (averageLength > 2 * initialAverageLength && subdivideCount < subdivideLimit)
+      if (LWSOptions::adaptiveRemesh)
+      {
+        RemeshCurve();
+      }
+      else
       {
-        subdivideCount++;
-        SubdivideCurve();
+        double averageLength = curves->TotalLength() / curves->NumEdges();
+        if (averageLength > 2 * initialAverageLength && subdivideCount < subdivideLimit)
+        {
+          subdivideCount++;
+          SubdivideCurve();
+        }
       }
 
       if (LWSOptions::outputFrames)
@@ -314,6 +422,14 @@ namespace LWS
       {
         outputOBJFrame();
       }
+      if (trajectoryWriter)
+      {
+        trajectoryWriter->AddFrame(curves);
+      }
+      if (checkpointWriter && (currentStep % checkpointInterval == 0 || !LWSOptions::runTPE))
+      {
+        writeCheckpoint();
+      }
     }
 
     if (ImGui::Button("Curve to OBJ"))
@@ -451,6 +567,11 @@ namespace LWS
       {
         std::cout << "Adding scene obstacle from " << data.filename << " (weight " << data.weight << ")" << std::endl;
         AddMeshObstacle(data.filename, Vector3{0, 0, 0}, beta - alpha, data.weight);
+        if (sceneData.fieldCacheResolution > 0)
+        {
+          MeshObstacle *obstacle = static_cast<MeshObstacle *>(tpeSolver->obstacles.back());
+          obstacle->CacheField(sceneData.fieldCacheResolution, sceneData.fieldCacheTolerance, data.filename + ".rcfield");
+        }
       }
 
       for (PlaneObstacleData &data : sceneData.planes)
@@ -620,70 +741,53 @@ namespace LWS
     curves = subdivided;
   }
 
-  void LWSApp::MeshImplicitSurface(ImplicitSurface *surface)
+  void LWSApp::RemeshCurve()
   {
-    CIsoSurface<double> *iso = new CIsoSurface<double>();
-
-    std::cout << "Meshing the supplied implicit surface using marching cubes..." << std::endl;
-
-    const int numCells = 50;
-    Vector3 center = surface->BoundingCenter();
-    double diameter = surface->BoundingDiameter();
-    double cellSize = diameter / numCells;
-    double radius = diameter / 2;
-
-    Vector3 lowerCorner = center - Vector3{radius, radius, radius};
-
-    int numCorners = numCells + 1;
-
-    double field[numCorners * numCorners * numCorners];
-
-    int nSlice = numCorners * numCorners;
-    int nRow = numCorners;
-
-    for (int x = 0; x < numCorners; x++)
+    // Aim for the starting edge length, but shorter where the curve
+    // turns by more than about 20 degrees per edge
+    int nVerts = curves->NumVertices();
+    Eigen::VectorXd targetLengths(nVerts);
+    for (int i = 0; i < nVerts; i++)
     {
-      for (int y = 0; y < numCorners; y++)
+      double h = initialAverageLength;
+      double angle = curves->BendingAngle(i);
+      if (angle > 0)
       {
-        for (int z = 0; z < numCorners; z++)
-        {
-          Vector3 samplePt = lowerCorner + Vector3{(double)x, (double)y, (double)z} * cellSize;
-          double value = surface->SignedDistance(samplePt);
-          field[nSlice * z + nRow * y + x] = value;
-        }
+        h = fmin(h, M_PI / 8 * curves->GetVertex(i)->DualLength() / angle);
       }
+      targetLengths(i) = fmax(h, initialAverageLength / 4);
     }
 
-    iso->GenerateSurface(field, 0, numCells, numCells, numCells, cellSize, cellSize, cellSize);
-
-    std::vector<glm::vec3> nodes;
-    std::vector<std::array<size_t, 3>> triangles;
-
-    int nVerts = iso->m_nVertices;
-
-    for (int i = 0; i < nVerts; i++)
+    Eigen::SparseMatrix<double> edgeTransfer;
+    PolyCurveNetwork *remeshed = curves->Remesh(targetLengths, edgeTransfer);
+    if (!remeshed)
     {
-      double x = iso->m_ppt3dVertices[i][0];
-      double y = iso->m_ppt3dVertices[i][1];
-      double z = iso->m_ppt3dVertices[i][2];
-
-      Vector3 p = lowerCorner + Vector3{x, y, z};
-      nodes.push_back(glm::vec3{p.x, p.y, p.z});
+      return;
     }
+    glm::vec3 col = polyscope::getCurveNetwork(curveName)->baseColor;
+    DisplayCurves(remeshed, curveName);
+    polyscope::getCurveNetwork(curveName)->baseColor = col;
+    tpeSolver->ReplaceCurve(remeshed, edgeTransfer);
+    delete curves;
+    curves = remeshed;
+  }
+
+  void LWSApp::MeshImplicitSurface(ImplicitSurface *surface, int resolution)
+  {
+    std::cout << "Meshing the supplied implicit surface using marching cubes (" << resolution << " cells across)..." << std::endl;
 
-    int nTris = iso->m_nTriangles;
+    std::vector<Vector3> vertices;
+    std::vector<std::array<size_t, 3>> triangles;
+    ImplicitMesher(resolution).Extract(surface, vertices, triangles);
 
-    for (int i = 0; i < nTris; i++)
+    std::vector<glm::vec3> nodes;
+    nodes.reserve(vertices.size());
+    for (const Vector3 &p : vertices)
     {
-      int i1 = iso->m_piTriangleIndices[3 * i];
-      int i2 = iso->m_piTriangleIndices[3 * i + 1];
-      int i3 = iso->m_piTriangleIndices[3 * i + 2];
-
-      triangles.push_back({(size_t)i1, (size_t)i2, (size_t)i3});
+      nodes.push_back(glm::vec3{p.x, p.y, p.z});
     }
 
     polyscope::registerSurfaceMesh("implicitSurface", nodes, triangles);
-    delete iso;
   }
 
   void LWSApp::WriteImplicitSurface()
@@ -866,6 +970,19 @@ namespace LWS
   {
     if (curves)
       delete curves;
+    std::string binaryExt = ".rcn";
+    if (filename.size() >= binaryExt.size() && filename.compare(filename.size() - binaryExt.size(), binaryExt.size(), binaryExt) == 0)
+    {
+      std::cout << "Make curves from binary curve file " << filename << std::endl;
+      CurveIO::MappedCurveFile binaryFile;
+      if (!binaryFile.Open(filename))
+      {
+        exit(1);
+      }
+      curves = binaryFile.CreateCurve();
+      curveName = polyscope::guessNiceNameFromPath(filename);
+      return;
+    }
     std::cout << "Make curves from indexed loop in " << filename << std::endl;
 
     std::vector<Vector3> all_positions;
@@ -891,6 +1008,8 @@ namespace LWS
 
     LWSOptions::tpeAlpha = data.tpe_alpha;
     LWSOptions::tpeBeta = data.tpe_beta;
+    LWSOptions::bctSeparation = data.bctSeparation;
+    BVHNode3D::errorTarget = data.bhErrorTarget;
 
     sceneData = data;
 
@@ -929,7 +1048,13 @@ namespace LWS
     if (data.constraintSurface)
     {
       curves->constraintSurface = data.constraintSurface;
-      MeshImplicitSurface(curves->constraintSurface);
+      if (data.fieldCacheResolution > 0)
+      {
+        curves->constraintSurface = new CachedImplicitSurface(data.constraintSurface, data.fieldCacheResolution,
+                                                              data.fieldCacheTolerance, filename + ".surface.rcfield");
+      }
+      // Mesh the exact surface rather than the cache, which only covers a band around it
+      MeshImplicitSurface(data.constraintSurface, data.surfaceMeshResolution);
     }
 
     if (data.constrainAllToSurface)
@@ -983,6 +1108,10 @@ void processFile(LWS::LWSApp *app, string filename)
   {
     app->processLoopFile(filename);
   }
+  else if (endsWith(filename, ".rcn"))
+  {
+    app->processLoopFile(filename);
+  }
   else if (endsWith(filename, ".txt"))
   {
     app->processSceneFile(filename);
@@ -1012,6 +1141,19 @@ int main(int argc, char **argv)
   args::Positional<string> file(parser, "curve", "Space curve to process");
   args::ValueFlagList<string> obstacleFiles(parser, "obstacles", "Obstacles to add", {'o'});
   args::ValueFlagList<string> visualizeFiles(parser, "visualize", "Extra meshes to visualize", {'v'});
+  args::ValueFlag<string> checkpointFile(parser, "checkpoint", "Periodically write the flow state to this file", {"checkpoint"});
+  args::ValueFlag<int> checkpointInterval(parser, "steps", "Number of steps between checkpoints (default 50)", {"checkpoint-every"});
+  args::ValueFlag<string> resumeFile(parser, "resume", "Resume the flow from a checkpoint file", {"resume"});
+  args::ValueFlag<string> recordFile(parser, "record", "Record the flow trajectory to this file", {"record"});
+  args::ValueFlag<double> recordTolerance(parser, "tolerance", "Position tolerance for the recorded trajectory (default 1e-6)", {"record-tolerance"});
+  args::ValueFlag<int> keyframeInterval(parser, "frames", "Number of frames between trajectory keyframes (default 100)", {"keyframe-every"});
+  args::ValueFlag<string> exportDir(parser, "directory", "Export a recorded trajectory to an OBJ sequence in this directory and exit", {"export-trajectory"});
+  args::ValueFlag<string> profileFile(parser, "trace", "Record per-phase timings and counters, written as a Chrome trace to this file on exit", {"profile"});
+  args::ValueFlag<string> convertFile(parser, "output", "Convert the curve file between .obj and binary .rcn formats and exit", {"convert"});
+  args::ValueFlag<int> lineSearchCandidates(parser, "n", "Number of line search step sizes to evaluate in parallel, one per thread (default 1)", {"ls-candidates"});
+  args::ValueFlag<string> mgSolver(parser, "solver", "Multigrid solver: cg, chebyshev, jacobi, fgmres or fgmres-jacobi (default cg)", {"mg-solver"});
+  args::Flag remesh(parser, "remesh", "Split and collapse edges towards the starting edge length during the flow, instead of subdividing", {"remesh"});
+  args::Flag benchmarkIO(parser, "benchmark-io", "Compare OBJ reader throughput on the given curve file and exit", {"benchmark-io"});
 
   // Parse args
   try
@@ -1037,6 +1179,53 @@ int main(int argc, char **argv)
     return 1;
   }
 
+  if (benchmarkIO)
+  {
+    LWS::CurveIO::benchmarkReaders(file.Get());
+    return 0;
+  }
+
+  if (exportDir)
+  {
+    return LWS::exportTrajectoryToOBJ(file.Get(), exportDir.Get()) ? 0 : 1;
+  }
+
+  if (convertFile)
+  {
+    bool converted = false;
+    if (endsWith(file.Get(), ".rcn") && endsWith(convertFile.Get(), ".obj"))
+    {
+      converted = LWS::CurveIO::convertBinaryToOBJ(file.Get(), convertFile.Get());
+    }
+    else if (endsWith(convertFile.Get(), ".rcn"))
+    {
+      converted = LWS::CurveIO::convertOBJToBinary(file.Get(), convertFile.Get());
+    }
+    else
+    {
+      std::cerr << "Conversion needs a .rcn input with .obj output, or a .rcn output" << std::endl;
+    }
+    return converted ? 0 : 1;
+  }
+
+  if (profileFile)
+  {
+    LWS::Profiler::Enable();
+  }
+  if (lineSearchCandidates)
+  {
+    LWS::LWSOptions::lineSearchCandidates = lineSearchCandidates.Get();
+  }
+  if (remesh)
+  {
+    LWS::LWSOptions::adaptiveRemesh = true;
+  }
+  if (mgSolver && !LWS::ParseMultigridSolverType(mgSolver.Get(), LWS::LWSOptions::multigridSolver))
+  {
+    std::cerr << "Unknown multigrid solver " << mgSolver.Get() << std::endl;
+    return 1;
+  }
+
   // Options
   polyscope::options::autocenterStructures = false;
   // polyscope::view::windowWidth = 600;
@@ -1063,6 +1252,20 @@ int main(int argc, char **argv)
   app->initSolver();
   std::cout << "Set up solver" << std::endl;
 
+  if (resumeFile)
+  {
+    app->ResumeFromCheckpoint(resumeFile.Get());
+  }
+  if (checkpointFile)
+  {
+    app->EnableCheckpoints(checkpointFile.Get(), checkpointInterval ? checkpointInterval.Get() : 50);
+  }
+  if (recordFile)
+  {
+    app->RecordTrajectory(recordFile.Get(), recordTolerance ? recordTolerance.Get() : 1e-6,
+                          keyframeInterval ? keyframeInterval.Get() : 100);
+  }
+
   if (obstacleFiles)
   {
     for (string obsFile : obstacleFiles)
@@ -1085,5 +1288,14 @@ int main(int argc, char **argv)
   // Show the gui
   polyscope::show();
 
+  app->FlushCheckpoints();
+  app->FinishTrajectory();
+
+  if (profileFile)
+  {
+    LWS::Profiler::WriteChromeTrace(profileFile.Get());
+    LWS::Profiler::PrintSummary(std::cout);
+  }
+
   return 0;
 }
@@ -9,9 +9,15 @@ namespace LWS {
     bool LWSOptions::runTPE;
     bool LWSOptions::useSobolev = true;
     bool LWSOptions::useMultigrid = false;
+    bool LWSOptions::useLBFGS = false;
+    bool LWSOptions::useCircleSearch = false;
+    bool LWSOptions::adaptiveRemesh = false;
     bool LWSOptions::useBarnesHut = true;
     bool LWSOptions::normalizeView = false;
     
     double LWSOptions::tpeAlpha = 3;
     double LWSOptions::tpeBeta = 6;
+    double LWSOptions::bctSeparation = 1;
+    int LWSOptions::lineSearchCandidates = 1;
+    MultigridSolverType LWSOptions::multigridSolver = MultigridSolverType::VCycleCG;
 }
@@ -0,0 +1,77 @@
+#include "mapped_file.h"
+#include "binary_io.h"
+
+#include <iostream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace LWS {
+
+    MappedFile::MappedFile() {
+        data = 0;
+        size = 0;
+        open = false;
+        mapped = false;
+    }
+
+    MappedFile::~MappedFile() {
+        Close();
+    }
+
+    bool MappedFile::Open(const std::string &fname) {
+        Close();
+#ifndef _WIN32
+        int fd = ::open(fname.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Could not open " << fname << " for reading" << std::endl;
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            std::cerr << "Could not stat " << fname << std::endl;
+            ::close(fd);
+            return false;
+        }
+        size = st.st_size;
+        if (size > 0) {
+            void* p = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                madvise(p, size, MADV_SEQUENTIAL);
+                data = static_cast<const char*>(p);
+                mapped = true;
+            }
+        }
+        ::close(fd);
+        if (mapped || size == 0) {
+            open = true;
+            return true;
+        }
+#endif
+        // mmap unavailable or failed; read the whole file instead
+        if (!BinaryIO::ReadFile(fname, buffer)) {
+            return false;
+        }
+        data = buffer.data();
+        size = buffer.size();
+        open = true;
+        return true;
+    }
+
+    void MappedFile::Close() {
+#ifndef _WIN32
+        if (mapped) {
+            munmap(const_cast<char*>(data), size);
+        }
+#endif
+        buffer.clear();
+        data = 0;
+        size = 0;
+        open = false;
+        mapped = false;
+    }
+}
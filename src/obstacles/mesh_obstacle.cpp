@@ -1,5 +1,6 @@
 #include "obstacles/mesh_obstacle.h"
 #include "tpe_energy_sc.h"
+#include "utils.h"
 
 namespace LWS {
     MeshObstacle::MeshObstacle(std::shared_ptr<HalfedgeMesh> m, std::shared_ptr<VertexPositionGeometry> geom, double p_exp, double w) {
@@ -8,24 +9,96 @@ namespace LWS {
         p = p_exp;
         weight = w;
         bvh = CreateBVHFromMesh(m, geom);
+
+        std::vector<Vector3> positions(mesh->nVertices());
+        for (size_t i = 0; i < positions.size(); i++) {
+            positions[i] = geometry->inputVertexPositions[mesh->vertex(i)];
+        }
+        // Fan-triangulate any polygons
+        std::vector<std::array<size_t, 3>> tris;
+        for (const std::vector<size_t> &face : mesh->getFaceVertexList()) {
+            for (size_t i = 1; i + 1 < face.size(); i++) {
+                tris.push_back({face[0], face[i], face[i + 1]});
+            }
+        }
+        triangles = new TriangleBVH(positions, tris);
+        fieldCache = 0;
+    }
+
+    void MeshObstacle::CacheField(int resolution, double tolerance, std::string cacheFile) {
+        Vector3 boxMin = geometry->inputVertexPositions[mesh->vertex(0)];
+        Vector3 boxMax = boxMin;
+        for (size_t i = 0; i < mesh->nVertices(); i++) {
+            boxMin = vector_min(boxMin, geometry->inputVertexPositions[mesh->vertex(i)]);
+            boxMax = vector_max(boxMax, geometry->inputVertexPositions[mesh->vertex(i)]);
+        }
+        // Pad by half the diameter, so that curves around the mesh stay inside
+        double diameter = norm(boxMax - boxMin);
+        Vector3 pad = Vector3{1, 1, 1} * (diameter / 2);
+
+        TriangleBVH* bvh = triangles;
+        double exponent = p;
+        SparseFieldCache::Sampler sampler = [bvh, exponent](Vector3 point, double &value, Vector3 &gradient) {
+            value = 0;
+            gradient = Vector3{0, 0, 0};
+            bvh->Evaluate(point, exponent, value, gradient);
+        };
+        if (!fieldCache) fieldCache = new SparseFieldCache();
+        fieldCache->LoadOrBuild(cacheFile, sampler, boxMin - pad, boxMax + pad, 2 * diameter / std::max(1, resolution), 0, tolerance);
     }
 
     MeshObstacle::~MeshObstacle() {
         if (bvh) {
             delete bvh;
         }
+        if (triangles) {
+            delete triangles;
+        }
+        if (fieldCache) {
+            delete fieldCache;
+        }
     }
 
     void MeshObstacle::AddGradient(PolyCurveNetwork* curves, Eigen::MatrixXd &gradient) {
         int nVerts = curves->NumVertices();
+        #pragma omp parallel for
         for (int i = 0; i < nVerts; i++) {
             Vector3 pos = curves->GetVertex(i)->Position();
-            Vector3 force = AccumulateForce(bvh, pos);
+            double energy;
+            Vector3 force;
+            if (!fieldCache || !fieldCache->Lookup(pos, energy, force)) {
+                force = triangles->Gradient(pos, p);
+            }
             AddToRow(gradient, i, force * weight);
         }
     }
 
     double MeshObstacle::ComputeEnergy(PolyCurveNetwork* curves) {
+        int nVerts = curves->NumVertices();
+        double sumE = 0;
+        #pragma omp parallel for reduction(+ : sumE)
+        for (int i = 0; i < nVerts; i++) {
+            Vector3 pos = curves->GetVertex(i)->Position();
+            double energy;
+            Vector3 force;
+            if (!fieldCache || !fieldCache->Lookup(pos, energy, force)) {
+                energy = triangles->Energy(pos, p);
+            }
+            sumE += energy;
+        }
+        return weight * sumE;
+    }
+
+    void MeshObstacle::AddGradientLegacy(PolyCurveNetwork* curves, Eigen::MatrixXd &gradient) {
+        int nVerts = curves->NumVertices();
+        for (int i = 0; i < nVerts; i++) {
+            Vector3 pos = curves->GetVertex(i)->Position();
+            Vector3 force = AccumulateForce(bvh, pos);
+            AddToRow(gradient, i, force * weight);
+        }
+    }
+
+    double MeshObstacle::ComputeEnergyLegacy(PolyCurveNetwork* curves) {
         int nVerts = curves->NumVertices();
         double sumE = 0;
         for (int i = 0; i < nVerts; i++) {
@@ -50,7 +123,7 @@ namespace LWS {
             return bodyEnergy(node, point, p);
         }
         else {
-            if (node->shouldUseCell(point)) {
+            if (node->shouldUseCell(point, 0, p)) {
                 return bodyEnergy(node, point, p);
             }
             else {
@@ -84,7 +157,7 @@ namespace LWS {
             return bodyForce(node, point, p);
         }
         else {
-            if (node->shouldUseCell(point)) {
+            if (node->shouldUseCell(point, 0, p)) {
                 return bodyForce(node, point, p);
             }
             else {
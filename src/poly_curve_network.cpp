@@ -1,9 +1,17 @@
 #include "poly_curve_network.h"
+#include "profiler.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <queue>
 
 namespace LWS {
 
+    namespace {
+        std::atomic<int> nextTopologyID(0);
+    }
+
     bool CurveVertex::operator ==(const CurveVertex &other) {
         return (other.curve == curve) && (other.id == id);
     }
@@ -36,20 +44,48 @@ namespace LWS {
     PolyCurveNetwork::~PolyCurveNetwork() {
         CleanUpStructs();
         if (constraintProjector) delete constraintProjector;
+        if (constraintMatrix) delete constraintMatrix;
+    }
+
+    ConstraintMatrix& PolyCurveNetwork::GetConstraintMatrix() {
+        if (!constraintMatrix) {
+            constraintMatrix = new ConstraintMatrix(this);
+        }
+        constraintMatrix->Refresh();
+        return *constraintMatrix;
+    }
+
+    void PolyCurveNetwork::UpdateConstraintProjector() {
+        if (!constraintProjector) {
+            constraintProjector = new ConstraintProjector();
+        }
+        constraintProjector->Update(GetConstraintMatrix());
+    }
+
+    void PolyCurveNetwork::UpdateGeometry() {
+        geometry.Update(positions);
     }
 
     void PolyCurveNetwork::InitStructs(std::vector<std::array<size_t, 2>> &es) {
         constraintProjector = 0;
-
-        // Create all vertex structs
+        constraintMatrix = 0;
+        constraintSurface = 0;
+        pinnedAllToSurface = false;
+        topologyID = nextTopologyID++;
+        pinnedFlags.assign(nVerts, false);
+        tangentPinnedFlags.assign(nVerts, false);
+
+        // Create all vertex structs, in one block rather than one allocation each
+        vertexStorage.resize(nVerts);
         for (int i = 0; i < nVerts; i++) {
-            vertices.push_back(new CurveVertex());
+            vertices.push_back(&vertexStorage[i]);
             vertices[i]->id = i;
             vertices[i]->curve = this;
         }
         // Create all edge structs
+        edgeStorage.resize(es.size());
         for (size_t i = 0; i < es.size(); i++) {
-            edges.push_back(new CurveEdge());
+            edges.push_back(&edgeStorage[i]);
             // Assume that the edge is oriented towards the second vertex,
             // and away from the first vertex
             edges[i]->prevVert = vertices[es[i][0]];
@@ -58,18 +94,16 @@ namespace LWS {
             adjacency[es[i][1]].push_back(edges[i]);
             edges[i]->id = i;
         }
+
+        geometry.SetTopology(nVerts, es);
+        UpdateGeometry();
     }
 
     void PolyCurveNetwork::CleanUpStructs() {
-        // Delete all vertex structs
-        for (int i = 0; i < nVerts; i++) {
-            delete vertices[i];
-        }
-        // Delete all edge structs
-        int nEdges = NumEdges();
-        for (int i = 0; i < nEdges; i++) {
-            delete edges[i];
-        }
+        vertices.clear();
+        edges.clear();
+        vertexStorage.clear();
+        edgeStorage.clear();
     }
 
     void PolyCurveNetwork::FindComponents() {
@@ -150,16 +184,16 @@ namespace LWS {
 
     void PolyCurveNetwork::PinVertex(int i) {
         // Add if not already pinned
-        if (!pinnedSet.count(i)) {
+        if (!pinnedFlags[i]) {
             pinnedVertices.push_back(i);
-            pinnedSet.insert(i);
+            pinnedFlags[i] = true;
         }
     }
 
     void PolyCurveNetwork::PinTangent(int i) {
-        if (!pinnedTangentSet.count(i)) {
+        if (!tangentPinnedFlags[i]) {
             pinnedTangents.push_back(i);
-            pinnedTangentSet.insert(i);
+            tangentPinnedFlags[i] = true;
         }
     }
 
@@ -303,171 +337,418 @@ namespace LWS {
         return p;
     }
 
-    PolyCurveNetwork* PolyCurveNetwork::Coarsen(MatrixProjectorOperator* op, bool doEdgeMatrix) {
-        Eigen::SparseMatrix<double> prolongMatrix, edgeMatrix;
+    PolyCurveNetwork* PolyCurveNetwork::Remesh(const Eigen::VectorXd &targetLengths, Eigen::SparseMatrix<double> &edgeTransfer) {
+        PROFILE_SCOPE("Remesh");
+        UpdateGeometry();
+        const CurveGeometry &geom = geometry;
         int nEdges = NumEdges();
-        // Determine which vertices should be kept and which shouldn't
-        std::vector<bool> shouldKeep(nVerts);
-        std::vector<bool> explored(nVerts);
-        std::vector<bool> seenEdges(nEdges);
-        std::queue<std::pair<CurveVertex*, bool>> frontier;
-        // Map fine indices to coarse ones in the next curve
-        std::vector<int> fineToCoarse(nVerts);
-        int coarseCount = 0;
 
+        // Split edges that are too long
+        std::vector<char> split(nEdges);
+        int numSplits = 0;
+        for (int e = 0; e < nEdges; e++) {
+            double h = (targetLengths(geom.edgePrev[e]) + targetLengths(geom.edgeNext[e])) / 2;
+            split[e] = geom.length(e) > 4.0 / 3.0 * h;
+            if (split[e]) numSplits++;
+        }
+
+        // Remove vertices next to an edge that is too short, as long as the edge
+        // that replaces their two edges isn't too long. Endpoints, junctions and
+        // pins stay, no two neighbors are removed, and every component keeps at
+        // least three vertices.
+        std::vector<char> removed(nVerts, false);
+        std::vector<int> componentSize(NumComponents());
+        for (int c = 0; c < NumComponents(); c++) {
+            componentSize[c] = verticesByComponent[c].size();
+        }
+        std::vector<char> surfacePinned(nVerts, false);
+        if (!pinnedAllToSurface) {
+            for (int pin : pinnedToSurface) {
+                surfacePinned[pin] = true;
+            }
+        }
+
+        int numRemoved = 0;
         for (int i = 0; i < nVerts; i++) {
-            shouldKeep[i] = false;
-            explored[i] = false;
-            fineToCoarse[i] = -1;
+            if (geom.Degree(i) != 2 || pinnedFlags[i] || tangentPinnedFlags[i] || surfacePinned[i]) continue;
+            int a = geom.adjStart[i];
+            int e0 = geom.adjEdge[a];
+            int e1 = geom.adjEdge[a + 1];
+            int c = vertices[i]->component;
+            if (split[e0] || split[e1] || removed[geom.adjVert[a]] || removed[geom.adjVert[a + 1]] || componentSize[c] <= 3) continue;
+            // The two edges have to run through the vertex in the same direction
+            if (!(geom.edgeNext[e0] == i && geom.edgePrev[e1] == i) && !(geom.edgePrev[e0] == i && geom.edgeNext[e1] == i)) continue;
+
+            double h = targetLengths(i);
+            double l0 = geom.length(e0);
+            double l1 = geom.length(e1);
+            if (fmin(l0, l1) < 0.8 * h && l0 + l1 < 4.0 / 3.0 * h) {
+                removed[i] = true;
+                componentSize[c]--;
+                numRemoved++;
+            }
         }
-        for (int i = 0; i < nEdges; i++) {
-            seenEdges[i] = false;
+
+        if (numSplits == 0 && numRemoved == 0) {
+            return 0;
         }
 
-        for (int i = 0; i < NumComponents(); i++) {
-            frontier.push(std::pair<CurveVertex*, bool>(verticesByComponent[i][0], true));
+        std::vector<int> oldToNew(nVerts);
+        int newCount = 0;
+        for (int i = 0; i < nVerts; i++) {
+            oldToNew[i] = removed[i] ? -1 : newCount++;
         }
 
-        while (!frontier.empty()) {
-            std::pair<CurveVertex*, bool> next_pair = frontier.front();
-            CurveVertex* next = next_pair.first;
-            bool tentativeKeep = next_pair.second;
-            frontier.pop();
-            if (!explored[next->id]) {
-                explored[next->id] = true;
-                // Keep it either if we previous said we should, if the vertex is pinned, or if
-                // the vertex is an "interesting" one (i.e. degree neq 2)
-                bool keep = tentativeKeep || (next->numEdges() != 2) || isPinned(next->id) || isTangentPinned(next->id);
-                // Also check if any of the neighbors are already marked to be deleted
-                int nEdges_i = next->numEdges();
-                for (int i = 0; i < nEdges_i; i++) {
-                    CurveVertex* neighbor = next->edge(i)->Opposite(next);
-                    // If any neighbor is already marked to be deleted, then we need to
-                    // keep this one
-                    if (explored[neighbor->id] && !shouldKeep[neighbor->id]) {
-                        keep = true;
+        Eigen::MatrixXd newPositions(newCount + numSplits, 3);
+        for (int i = 0; i < nVerts; i++) {
+            if (!removed[i]) {
+                newPositions.row(oldToNew[i]) = positions.row(i);
+            }
+        }
+
+        // Each new edge's rest length is made up of the old ones it came from
+        std::vector<std::array<size_t, 2>> newEdges;
+        std::vector<Eigen::Triplet<double>> triplets;
+        newEdges.reserve(nEdges + numSplits);
+
+        for (int e = 0; e < nEdges; e++) {
+            int prev = geom.edgePrev[e];
+            int next = geom.edgeNext[e];
+            if (removed[prev] || removed[next]) continue;
+
+            if (split[e]) {
+                int mid = newCount++;
+                Vector3 midpoint = (geom.Position(prev) + geom.Position(next)) / 2;
+                // Put new vertices of a curve that lives on a surface back onto it
+                if (pinnedAllToSurface && constraintSurface) {
+                    Vector3 grad = constraintSurface->GradientOfDistance(midpoint);
+                    double g2 = norm2(grad);
+                    if (g2 > 0) {
+                        midpoint -= constraintSurface->SignedDistance(midpoint) / g2 * grad;
                     }
                 }
+                SetRow(newPositions, mid, midpoint);
+                triplets.push_back(Eigen::Triplet<double>(newEdges.size(), e, 0.5));
+                newEdges.push_back({(size_t)oldToNew[prev], (size_t)mid});
+                triplets.push_back(Eigen::Triplet<double>(newEdges.size(), e, 0.5));
+                newEdges.push_back({(size_t)mid, (size_t)oldToNew[next]});
+            }
+            else {
+                triplets.push_back(Eigen::Triplet<double>(newEdges.size(), e, 1));
+                newEdges.push_back({(size_t)oldToNew[prev], (size_t)oldToNew[next]});
+            }
+        }
+        for (int i = 0; i < nVerts; i++) {
+            if (!removed[i]) continue;
+            int a = geom.adjStart[i];
+            int e0 = geom.adjEdge[a];
+            int e1 = geom.adjEdge[a + 1];
+            int newPrev, newNext;
+            if (geom.edgeNext[e0] == i) {
+                newPrev = oldToNew[geom.edgePrev[e0]];
+                newNext = oldToNew[geom.edgeNext[e1]];
+            }
+            else {
+                newPrev = oldToNew[geom.edgePrev[e1]];
+                newNext = oldToNew[geom.edgeNext[e0]];
+            }
+            triplets.push_back(Eigen::Triplet<double>(newEdges.size(), e0, 1));
+            triplets.push_back(Eigen::Triplet<double>(newEdges.size(), e1, 1));
+            newEdges.push_back({(size_t)newPrev, (size_t)newNext});
+        }
+
+        edgeTransfer.resize(newEdges.size(), nEdges);
+        edgeTransfer.setFromTriplets(triplets.begin(), triplets.end());
+
+        PolyCurveNetwork* p = new PolyCurveNetwork(newPositions, newEdges);
+
+        // Pins are never removed, and keep their order
+        for (int pin : pinnedVertices) {
+            p->PinVertex(oldToNew[pin]);
+        }
+        for (int pin : pinnedTangents) {
+            p->PinTangent(oldToNew[pin]);
+        }
+
+        p->constraintSurface = constraintSurface;
+        if (pinnedAllToSurface) {
+            p->pinnedAllToSurface = true;
+            for (int i = 0; i < p->NumVertices(); i++) {
+                p->PinToSurface(i);
+            }
+        }
+        else {
+            for (int pin : pinnedToSurface) {
+                p->PinToSurface(oldToNew[pin]);
+            }
+        }
+
+        for (ConstraintType type : appliedConstraints) {
+            p->appliedConstraints.push_back(type);
+        }
+
+        std::cout << "Remeshed: split " << numSplits << " edges and removed " << numRemoved
+            << " vertices (" << nVerts << " -> " << p->NumVertices() << " vertices)" << std::endl;
+        return p;
+    }
+
+    PolyCurveNetwork* PolyCurveNetwork::Coarsen(MatrixProjectorOperator* op, bool doEdgeMatrix) {
+        PROFILE_SCOPE("Coarsen");
+        UpdateGeometry();
+        std::vector<char> shouldKeep(nVerts);
+        ChooseCoarseVertices(shouldKeep);
+        return CoarsenKeeping(shouldKeep, op, doEdgeMatrix, false);
+    }
+
+    PolyCurveNetwork* PolyCurveNetwork::CoarsenLegacy(MatrixProjectorOperator* op, bool doEdgeMatrix) {
+        PROFILE_SCOPE("Coarsen");
+        UpdateGeometry();
+        std::vector<char> shouldKeep(nVerts);
+        ChooseCoarseVerticesLegacy(shouldKeep);
+        return CoarsenKeeping(shouldKeep, op, doEdgeMatrix, true);
+    }
+
+    void PolyCurveNetwork::ChooseCoarseVertices(std::vector<char> &shouldKeep) {
+        const CurveGeometry &geom = geometry;
+
+        // Junctions, endpoints and pins always survive to the coarse level, and so
+        // do sharp corners, unless that would leave nothing to coarsen
+        std::vector<char> fixed(nVerts);
+        bool keepCorners = true;
+        int coarseCount = 0;
 
-                shouldKeep[next->id] = keep;
-                if (keep) {
-                    int coarseID = coarseCount;
-                    coarseCount++;
-                    fineToCoarse[next->id] = coarseID;
+        for (int attempt = 0; attempt < 2 && coarseCount == 0; attempt++) {
+            #pragma omp parallel for
+            for (int i = 0; i < nVerts; i++) {
+                bool corner = keepCorners && geom.Degree(i) == 2 && SnapshotBendingAngle(i) > M_PI / 2;
+                fixed[i] = (geom.Degree(i) != 2) || pinnedFlags[i] || tangentPinnedFlags[i] || corner;
+                shouldKeep[i] = true;
+            }
+            if (!pinnedAllToSurface) {
+                for (int pin : pinnedToSurface) {
+                    fixed[pin] = true;
                 }
-                else {
-                    fineToCoarse[next->id] = -42;
+            }
+
+            // A closed loop with nothing fixed on it is cut at its sharpest vertex
+            for (int c = 0; c < NumComponents(); c++) {
+                int sharpest = -1;
+                double sharpestAngle = -1;
+                for (CurveVertex* v : verticesByComponent[c]) {
+                    if (fixed[v->id]) {
+                        sharpest = -1;
+                        break;
+                    }
+                    double angle = SnapshotBendingAngle(v->id);
+                    if (angle > sharpestAngle) {
+                        sharpest = v->id;
+                        sharpestAngle = angle;
+                    }
                 }
-                for (int e = 0; e < next->numEdges(); e++) {
-                    CurveVertex* neighbor = next->edge(e)->Opposite(next);
-                    if (!explored[neighbor->id]) {
-                        frontier.push(std::pair<CurveVertex*, bool>(neighbor, !keep));
+                if (sharpest >= 0) fixed[sharpest] = true;
+            }
+
+            std::vector<int> fixedList;
+            for (int i = 0; i < nVerts; i++) {
+                if (fixed[i]) fixedList.push_back(i);
+            }
+
+            // Every run of unfixed vertices between two fixed ones is coarsened on
+            // its own, so the runs are handled in parallel
+            #pragma omp parallel for schedule(dynamic, 16)
+            for (size_t f = 0; f < fixedList.size(); f++) {
+                int start = fixedList[f];
+                std::vector<int> run;
+                std::vector<double> gain;
+                for (int k = geom.adjStart[start]; k < geom.adjStart[start + 1]; k++) {
+                    int firstEdge = geom.adjEdge[k];
+                    int lastEdge = firstEdge;
+                    int cur = geom.adjVert[k];
+                    run.clear();
+                    while (!fixed[cur]) {
+                        run.push_back(cur);
+                        int a = geom.adjStart[cur];
+                        lastEdge = (geom.adjEdge[a] == lastEdge) ? geom.adjEdge[a + 1] : geom.adjEdge[a];
+                        cur = (geom.edgePrev[lastEdge] == cur) ? geom.edgeNext[lastEdge] : geom.edgePrev[lastEdge];
+                    }
+                    // Each run is reached from both of its ends; only one of them handles it
+                    if (run.empty() || firstEdge > lastEdge) continue;
+
+                    // Remove as many vertices as possible without removing two
+                    // neighbors, and among those choices, remove the flattest ones
+                    int m = run.size();
+                    gain.resize(m);
+                    for (int i = 0; i < m; i++) {
+                        gain[i] = 2 - SnapshotBendingAngle(run[i]) / M_PI;
+                    }
+                    std::vector<double> best(m + 1);
+                    best[0] = 0;
+                    best[1] = gain[0];
+                    for (int i = 2; i <= m; i++) {
+                        best[i] = fmax(best[i - 1], best[i - 2] + gain[i - 1]);
+                    }
+                    for (int i = m; i >= 1;) {
+                        if (i == 1 || best[i - 2] + gain[i - 1] >= best[i - 1]) {
+                            shouldKeep[run[i - 1]] = false;
+                            i -= 2;
+                        }
+                        else i--;
                     }
                 }
             }
+
+            coarseCount = 0;
+            for (int i = 0; i < nVerts; i++) {
+                if (shouldKeep[i]) coarseCount++;
+            }
+            if (coarseCount == nVerts) coarseCount = 0;
+            keepCorners = false;
         }
+    }
 
-        std::vector<Eigen::Triplet<double>> triplets;
+    void PolyCurveNetwork::ChooseCoarseVerticesLegacy(std::vector<char> &shouldKeep) {
+        // Breadth-first search from each component's first vertex, alternately
+        // keeping and removing vertices; junctions, endpoints and pins are kept,
+        // and so is any vertex next to one that was already removed
+        std::vector<char> explored(nVerts, false);
+        std::queue<std::pair<CurveVertex*, bool>> frontier;
+        for (int i = 0; i < NumComponents(); i++) {
+            frontier.push(std::pair<CurveVertex*, bool>(verticesByComponent[i][0], true));
+        }
 
-        // Assemble the prolongation operator
-        for (CurveVertex* v_i : vertices) {
-            if (shouldKeep[v_i->id]) {
-                // If we kept the vertex, then we need to look up the index of
-                // the corresponding vertex in the coarsened network
-                int coarseI = fineToCoarse[v_i->id];
-                triplets.push_back(Eigen::Triplet<double>(v_i->id, coarseI, 1));
+        while (!frontier.empty()) {
+            CurveVertex* next = frontier.front().first;
+            bool keep = frontier.front().second;
+            frontier.pop();
+            if (explored[next->id]) continue;
+            explored[next->id] = true;
+
+            keep = keep || (next->numEdges() != 2) || isPinned(next->id) || isTangentPinned(next->id);
+            for (int e = 0; e < next->numEdges(); e++) {
+                CurveVertex* neighbor = next->edge(e)->Opposite(next);
+                if (explored[neighbor->id] && !shouldKeep[neighbor->id]) {
+                    keep = true;
+                }
             }
-            else {
-                // Otherwise, if we deleted the vertex, we need to find the index
-                // of the two neighboring coarsened vertices
-                if (v_i->numEdges() != 2) {
-                    std::cerr << "Deleted an edge with vertex valence != 2" << std::endl;
-                    throw 1;
+            shouldKeep[next->id] = keep;
+
+            for (int e = 0; e < next->numEdges(); e++) {
+                CurveVertex* neighbor = next->edge(e)->Opposite(next);
+                if (!explored[neighbor->id]) {
+                    frontier.push(std::pair<CurveVertex*, bool>(neighbor, !keep));
                 }
-                int n0 = v_i->edge(0)->Opposite(v_i)->id;
-                int n1 = v_i->edge(1)->Opposite(v_i)->id;
+            }
+        }
+        if (!pinnedAllToSurface) {
+            for (int pin : pinnedToSurface) {
+                shouldKeep[pin] = true;
+            }
+        }
+    }
+
+    PolyCurveNetwork* PolyCurveNetwork::CoarsenKeeping(const std::vector<char> &shouldKeep,
+    MatrixProjectorOperator* op, bool doEdgeMatrix, bool legacy) {
+        // Every vertex is a junction, endpoint or pin, so there is no coarser level
+        if (std::find(shouldKeep.begin(), shouldKeep.end(), 0) == shouldKeep.end()) {
+            return 0;
+        }
+        const CurveGeometry &geom = geometry;
+        int nEdges = NumEdges();
 
-                int coarseI1 = fineToCoarse[n0];
-                int coarseI2 = fineToCoarse[n1];
+        // Map fine indices to coarse ones in the next curve
+        std::vector<int> fineToCoarse(nVerts);
+        int coarseCount = 0;
+        for (int i = 0; i < nVerts; i++) {
+            fineToCoarse[i] = shouldKeep[i] ? coarseCount++ : -1;
+        }
 
-                triplets.push_back(Eigen::Triplet<double>(v_i->id, coarseI1, 0.5));
-                triplets.push_back(Eigen::Triplet<double>(v_i->id, coarseI2, 0.5));
+        // Assemble the prolongation operator. Removed vertices are interpolated
+        // linearly in arc length between their two neighbors, which reproduces
+        // any function that is linear along the curve; the legacy operator
+        // averages the two neighbors instead.
+        std::vector<Eigen::Triplet<double>> triplets;
+        triplets.reserve(2 * nVerts);
+        for (int i = 0; i < nVerts; i++) {
+            if (shouldKeep[i]) {
+                triplets.push_back(Eigen::Triplet<double>(i, fineToCoarse[i], 1));
+            }
+            else {
+                int a = geom.adjStart[i];
+                double l0 = geom.length(geom.adjEdge[a]);
+                double l1 = geom.length(geom.adjEdge[a + 1]);
+                double w0 = (l0 + l1 > 0 && !legacy) ? l1 / (l0 + l1) : 0.5;
+                triplets.push_back(Eigen::Triplet<double>(i, fineToCoarse[geom.adjVert[a]], w0));
+                triplets.push_back(Eigen::Triplet<double>(i, fineToCoarse[geom.adjVert[a + 1]], 1 - w0));
             }
         }
 
-        prolongMatrix.resize(vertices.size(), coarseCount);
+        Eigen::SparseMatrix<double> prolongMatrix, edgeMatrix;
+        prolongMatrix.resize(nVerts, coarseCount);
         prolongMatrix.setFromTriplets(triplets.begin(), triplets.end());
         op->matrices.push_back(IndexedMatrix{prolongMatrix, 0, 0});
-        
-        // Assemble the edge prolongation operator
+
+        // Fine edges between two kept vertices carry over, and the two edges
+        // around each removed vertex merge into one
         std::vector<Eigen::Triplet<double>> edgeTriplets;
         std::vector<std::array<size_t, 2>> coarseEdges;
+        coarseEdges.reserve(nEdges);
 
-        for (CurveVertex* v_i : vertices) {
-            if (shouldKeep[v_i->id]) {
-                // Look for neighbors that have both endpoints kept
-                for (int e = 0; e < v_i->numEdges(); e++) {
-                    CurveEdge* e_i = v_i->edge(e);
-                    if (seenEdges[e_i->id]) continue;
-                    seenEdges[e_i->id] = true;
-                    CurveVertex* v_neighbor = e_i->Opposite(v_i);
-                    // If both endpoints of the edge were kept,
-                    // then map the old one to the new one with
-                    // weight 1
-                    if (shouldKeep[v_neighbor->id]) {
-                        int coarseID = coarseEdges.size();
-                        size_t coarsePrev = fineToCoarse[e_i->prevVert->id];
-                        size_t coarseNext = fineToCoarse[e_i->nextVert->id];
-                        coarseEdges.push_back({coarsePrev, coarseNext});
-                        int fineID = e_i->id;
-                        if (doEdgeMatrix) {
-                            edgeTriplets.push_back(Eigen::Triplet<double>(fineID, coarseID, 1));
-                        }
-                    }
+        for (int e = 0; e < nEdges; e++) {
+            int prev = geom.edgePrev[e];
+            int next = geom.edgeNext[e];
+            if (shouldKeep[prev] && shouldKeep[next]) {
+                if (doEdgeMatrix) {
+                    edgeTriplets.push_back(Eigen::Triplet<double>(e, coarseEdges.size(), 1));
                 }
+                coarseEdges.push_back({(size_t)fineToCoarse[prev], (size_t)fineToCoarse[next]});
+            }
+        }
+        for (int i = 0; i < nVerts; i++) {
+            if (shouldKeep[i]) continue;
+            int a = geom.adjStart[i];
+            int e0 = geom.adjEdge[a];
+            int e1 = geom.adjEdge[a + 1];
+            int coarsePrev, coarseNext;
+
+            if (geom.edgeNext[e0] == i && geom.edgePrev[e1] == i) {
+                coarsePrev = fineToCoarse[geom.edgePrev[e0]];
+                coarseNext = fineToCoarse[geom.edgeNext[e1]];
+            }
+            else if (geom.edgePrev[e0] == i && geom.edgeNext[e1] == i) {
+                coarsePrev = fineToCoarse[geom.edgePrev[e1]];
+                coarseNext = fineToCoarse[geom.edgeNext[e0]];
             }
             else {
-                // This means we deleted a vertex, so both its neighbors were kept,
-                // and one longer edge runs between them
-                size_t coarsePrev, coarseNext;
-                int finePrev, fineNext;
-
-                if (v_i == v_i->edge(0)->nextVert && v_i == v_i->edge(1)->prevVert) {
-                    coarsePrev = fineToCoarse[v_i->edge(0)->prevVert->id];
-                    coarseNext = fineToCoarse[v_i->edge(1)->nextVert->id];
-                }
-                else if (v_i == v_i->edge(0)->prevVert && v_i == v_i->edge(1)->nextVert) {
-                    coarsePrev = fineToCoarse[v_i->edge(1)->prevVert->id];
-                    coarseNext = fineToCoarse[v_i->edge(0)->nextVert->id];
-                }
-                else {
-                    std::cerr << "Couldn't orient edge pair" << std::endl;
-                    throw 1;
-                }
-                int coarseID = coarseEdges.size();
-                coarseEdges.push_back({coarsePrev, coarseNext});
-                if (doEdgeMatrix) {
-                    edgeTriplets.push_back(Eigen::Triplet<double>(v_i->edge(0)->id, coarseID, 0.5));
-                    edgeTriplets.push_back(Eigen::Triplet<double>(v_i->edge(1)->id, coarseID, 0.5));
-                }
+                std::cerr << "Couldn't orient edge pair" << std::endl;
+                throw 1;
             }
+            if (doEdgeMatrix) {
+                edgeTriplets.push_back(Eigen::Triplet<double>(e0, coarseEdges.size(), 0.5));
+                edgeTriplets.push_back(Eigen::Triplet<double>(e1, coarseEdges.size(), 0.5));
+            }
+            coarseEdges.push_back({(size_t)coarsePrev, (size_t)coarseNext});
         }
 
         if (doEdgeMatrix) {
-            edgeMatrix.resize(edges.size(), coarseEdges.size());
+            edgeMatrix.resize(nEdges, coarseEdges.size());
             edgeMatrix.setFromTriplets(edgeTriplets.begin(), edgeTriplets.end());
             op->edgeMatrices.push_back(IndexedMatrix{edgeMatrix, 0, 0});
         }
 
-        std::vector<int> vertCounts(coarseCount);
-
-        for (auto &e : coarseEdges) {
-            vertCounts[e[0]]++;
-            vertCounts[e[1]]++;
+        // Kept vertices stay exactly where they are, or in the legacy version,
+        // are fitted to the fine positions by least squares
+        Eigen::MatrixXd coarsePosMat(coarseCount, 3);
+        if (legacy) {
+            coarsePosMat = ApplyPinv(prolongMatrix, positions);
+        }
+        else {
+            #pragma omp parallel for
+            for (int i = 0; i < nVerts; i++) {
+                if (shouldKeep[i]) {
+                    coarsePosMat.row(fineToCoarse[i]) = positions.row(i);
+                }
+            }
         }
-
-        // Get the coarsened positions
-        Eigen::MatrixXd coarsePosMat = ApplyPinv(prolongMatrix, positions);
         PolyCurveNetwork* p = new PolyCurveNetwork(coarsePosMat, coarseEdges);
         op->lowerSize = p->NumVertices();
         op->upperSize = NumVertices();
@@ -480,10 +761,33 @@ namespace LWS {
             p->PinTangent(fineToCoarse[pin]);
         }
 
+        p->constraintSurface = constraintSurface;
+        if (pinnedAllToSurface) {
+            p->pinnedAllToSurface = true;
+            for (int i = 0; i < p->NumVertices(); i++) {
+                p->PinToSurface(i);
+            }
+        }
+        else {
+            for (int pin : pinnedToSurface) {
+                p->PinToSurface(fineToCoarse[pin]);
+            }
+        }
+
         for (ConstraintType type : appliedConstraints) {
             p->appliedConstraints.push_back(type);
         }
 
         return p;
     }
-}
\ No newline at end of file
+
+    double PolyCurveNetwork::SnapshotBendingAngle(int i) const {
+        const CurveGeometry &geom = geometry;
+        if (geom.Degree(i) != 2) return 0;
+        int a = geom.adjStart[i];
+        Vector3 p = geom.Position(i);
+        Vector3 e_prev = p - geom.Position(geom.adjVert[a]);
+        Vector3 e_next = geom.Position(geom.adjVert[a + 1]) - p;
+        return atan2(norm(cross(e_prev, e_next)), dot(e_prev, e_next));
+    }
+}
@@ -1,20 +1,21 @@
 #include "product/block_cluster_tree.h"
 #include "utils.h"
+#include "profiler.h"
 
 #include <omp.h>
 #include <thread>
 #include <fstream>
+#include <algorithm>
 #include <sstream>
 #include <queue>
 #include <map>
 
 namespace LWS {
 
-    long BlockClusterTree::illSepTime = 0;
-    long BlockClusterTree::wellSepTime = 0;
-    long BlockClusterTree::traversalTime = 0;
+    std::atomic<uint64_t> BlockClusterTree::numProducts(0);
 
-    BlockClusterTree::BlockClusterTree(PolyCurveNetwork* cg, BVHNode3D* tree, double sepCoeff, double a, double b, double e) {
+    BlockClusterTree::BlockClusterTree(PolyCurveNetwork* cg, BVHNode3D* tree, double sepCoeff, double a, double b, double e,
+    MonotonicArena* sharedArena) {
         curves = cg;
         alpha = a;
         beta = b;
@@ -30,12 +31,38 @@ namespace LWS {
         nVerts = curves->NumVertices();
         constraintsSet = false;
 
-        admissibleByCluster.resize(tree->numNodes);
+        std::vector<ClusterPair> admissible, inadmissible;
         int depth = 0;
         while (unresolvedPairs.size() > 0) {
-            splitInadmissibleNodes(depth);
+            splitInadmissibleNodes(depth, admissible, inadmissible);
             depth++;
         }
+        std::vector<ClusterPair>().swap(unresolvedPairs);
+
+        // Now that the sizes are known, move the pairs into the arena
+        int numNodes = tree->numNodes;
+        size_t bytes = (admissible.size() + inadmissible.size()) * sizeof(ClusterPair) + (numNodes + 1) * sizeof(int) + 64;
+        ownsArena = !sharedArena;
+        arena = (sharedArena) ? sharedArena : new MonotonicArena(bytes);
+        arena->Reserve(bytes);
+
+        // Counting sort by first cluster, keeping each cluster's pairs in the order they were found
+        admissibleStart = arena->AllocateSpan<int>(numNodes + 1);
+        std::fill(admissibleStart.begin(), admissibleStart.end(), 0);
+        for (const ClusterPair &p : admissible) {
+            admissibleStart[p.cluster1->thisNodeID + 1]++;
+        }
+        for (int i = 0; i < numNodes; i++) {
+            admissibleStart[i + 1] += admissibleStart[i];
+        }
+        admissiblePairs = arena->AllocateSpan<ClusterPair>(admissible.size());
+        std::vector<int> fill(admissibleStart.begin(), admissibleStart.end() - 1);
+        for (const ClusterPair &p : admissible) {
+            admissiblePairs[fill[p.cluster1->thisNodeID]++] = p;
+        }
+
+        inadmissiblePairs = arena->AllocateSpan<ClusterPair>(inadmissible.size());
+        std::copy(inadmissible.begin(), inadmissible.end(), inadmissiblePairs.begin());
 
 #ifdef DUMP_BCT_VISUALIZATION
         writeVisualization();
@@ -52,9 +79,10 @@ namespace LWS {
 
     BlockClusterTree::~BlockClusterTree() {
         //delete threadpool;
+        if (ownsArena) delete arena;
     }
 
-    void BlockClusterTree::splitInadmissibleNodes(int depth) {
+    void BlockClusterTree::splitInadmissibleNodes(int depth, std::vector<ClusterPair> &admissible, std::vector<ClusterPair> &inadmissible) {
         std::vector<ClusterPair> nextPairs;
 
         for (ClusterPair pair : unresolvedPairs) {
@@ -66,15 +94,14 @@ namespace LWS {
             else if (pair.cluster1->NumElements() == 1 && pair.cluster2->NumElements() == 1) {
                 // If this is two singleton vertices, put in the inadmissible list
                 // so they get multiplied accurately
-                inadmissiblePairs.push_back(pair);
+                inadmissible.push_back(pair);
             }
             else if (isPairAdmissible(pair, separationCoeff)) {
                 // If the pair is admissible, mark it as such and leave it
-                admissiblePairs.push_back(pair);
-                admissibleByCluster[pair.cluster1->thisNodeID].push_back(pair);
+                admissible.push_back(pair);
             }
             else if (isPairSmallEnough(pair)) {
-                inadmissiblePairs.push_back(pair);
+                inadmissible.push_back(pair);
             }
             else {
                 // Otherwise, subdivide it into child pairs
@@ -87,8 +114,7 @@ namespace LWS {
             }
         }
         // Replace the inadmissible pairs by the next set
-        unresolvedPairs.clear();
-        unresolvedPairs = nextPairs;
+        unresolvedPairs.swap(nextPairs);
     }
 
     bool BlockClusterTree::isPairSmallEnough(ClusterPair pair) {
@@ -132,26 +158,68 @@ namespace LWS {
         mode = m;
     }
 
-    void BlockClusterTree::sum_AIJ_VJ() const {
-        // First accumulate the sums of a_IJ * V_J from admissible cluster pairs
-        for (size_t i = 0; i < admissibleByCluster.size(); i++) {
-            if (admissibleByCluster[i].size() > 0) {
-                for (auto &pair : admissibleByCluster[i]) {
-                    double a_IJ = SobolevCurves::MetricDistanceTerm(alpha, beta,
-                        pair.cluster1->centerOfMass, pair.cluster2->centerOfMass,
-                        pair.cluster1->averageTangent, pair.cluster2->averageTangent);
-                    pair.cluster1->aIJ_VJ += a_IJ * pair.cluster2->V_I;
+    void BlockClusterTree::FillDiagonal(Eigen::VectorXd &diag) const {
+        const CurveGeometry &geom = curves->Geometry();
+        const Eigen::VectorXd &masses = tree_root->bvhRoot->fullMasses;
+
+        // Both edge operators have the form 2 * (diag(A 1) - A), with no entries
+        // between touching edges, so their diagonals are twice their row sums.
+        // The far field's row sums are already in Af_1; add the near field's.
+        Eigen::VectorXd rowSums = Af_1;
+        Eigen::VectorXd rowSumsLow = Af_1_low;
+        for (const ClusterPair &pair : inadmissiblePairs) {
+            for (int e1 : pair.cluster1->clusterIndices) {
+                Vector3 mid1 = geom.Midpoint(e1);
+                Vector3 tan1 = geom.EdgeTangent(e1);
+                double sum = 0, sumLow = 0;
+                for (int e2 : pair.cluster2->clusterIndices) {
+                    if (geom.EdgesTouch(e1, e2)) continue;
+                    Vector3 mid2 = geom.Midpoint(e2);
+                    Vector3 tan2 = geom.EdgeTangent(e2);
+                    sum += masses(e2) * SobolevCurves::MetricDistanceTerm(alpha, beta, mid1, mid2, tan1, tan2);
+                    sumLow += masses(e2) * SobolevCurves::MetricDistanceTermLow(alpha, beta, mid1, mid2, tan1, tan2);
                 }
+                rowSums(e1) += masses(e1) * sum;
+                rowSumsLow(e1) += masses(e1) * sumLow;
             }
         }
+
+        // Two edges at the same vertex never interact, so each vertex only sees
+        // the diagonal entries of its own edges, through D_f (weight 1 / length)
+        // and the midpoint average (weight 1 / 2)
+        diag.setZero(nVerts);
+        for (int i = 0; i < curves->NumEdges(); i++) {
+            CurveEdge* edge = curves->GetEdge(i);
+            int e = edge->GlobalIndex();
+            double length = norm(edge->Vector());
+            double d = 2 * rowSums(e) / (length * length) + 0.5 * rowSumsLow(e);
+            diag(edge->prevVert->GlobalIndex()) += d;
+            diag(edge->nextVert->GlobalIndex()) += d;
+        }
+        for (int i = 0; i < nVerts; i++) {
+            diag(i) += epsilon * curves->GetVertex(i)->DualLength();
+        }
     }
 
-    void BlockClusterTree::sum_AIJ_VJ_Parallel() const {
+    void BlockClusterTree::sum_AIJ_VJ() const {
         // First accumulate the sums of a_IJ * V_J from admissible cluster pairs
-        #pragma omp parallel for shared(admissibleByCluster)
-        for (size_t i = 0; i < admissibleByCluster.size(); i++) {
-            if (admissibleByCluster[i].size() > 0) {
-                for (auto &pair : admissibleByCluster[i]) {
+        for (const ClusterPair &pair : admissiblePairs) {
+            double a_IJ = SobolevCurves::MetricDistanceTerm(alpha, beta,
+                pair.cluster1->centerOfMass, pair.cluster2->centerOfMass,
+                pair.cluster1->averageTangent, pair.cluster2->averageTangent);
+            pair.cluster1->aIJ_VJ += a_IJ * pair.cluster2->V_I;
+        }
+    }
+
+    void BlockClusterTree::sum_AIJ_VJ_Parallel() const {
+        // First accumulate the sums of a_IJ * V_J from admissible cluster pairs.
+        // Each cluster's pairs only write to that cluster, so clusters can run in parallel.
+        int nClusters = admissibleStart.size() - 1;
+        #pragma omp parallel for
+        for (int i = 0; i < nClusters; i++) {
+            if (admissibleStart[i + 1] > admissibleStart[i]) {
+                for (int k = admissibleStart[i]; k < admissibleStart[i + 1]; k++) {
+                    const ClusterPair &pair = admissiblePairs[k];
                     double a_IJ = SobolevCurves::MetricDistanceTerm(alpha, beta,
                         pair.cluster1->centerOfMass, pair.cluster2->centerOfMass,
                         pair.cluster1->averageTangent, pair.cluster2->averageTangent);
@@ -163,24 +231,23 @@ namespace LWS {
 
     void BlockClusterTree::sum_AIJ_VJ_Low() const {
         // First accumulate the sums of a_IJ * V_J from admissible cluster pairs
-        for (size_t i = 0; i < admissibleByCluster.size(); i++) {
-            if (admissibleByCluster[i].size() > 0) {
-                for (auto &pair : admissibleByCluster[i]) {
-                    double a_IJ = SobolevCurves::MetricDistanceTermLow(alpha, beta,
-                        pair.cluster1->centerOfMass, pair.cluster2->centerOfMass,
-                        pair.cluster1->averageTangent, pair.cluster2->averageTangent);
-                    pair.cluster1->aIJ_VJ += a_IJ * pair.cluster2->V_I;
-                }
-            }
+        for (const ClusterPair &pair : admissiblePairs) {
+            double a_IJ = SobolevCurves::MetricDistanceTermLow(alpha, beta,
+                pair.cluster1->centerOfMass, pair.cluster2->centerOfMass,
+                pair.cluster1->averageTangent, pair.cluster2->averageTangent);
+            pair.cluster1->aIJ_VJ += a_IJ * pair.cluster2->V_I;
         }
     }
 
     void BlockClusterTree::sum_AIJ_VJ_Low_Parallel() const {
-        // First accumulate the sums of a_IJ * V_J from admissible cluster pairs
-        #pragma omp parallel for shared(admissibleByCluster)
-        for (size_t i = 0; i < admissibleByCluster.size(); i++) {
-            if (admissibleByCluster[i].size() > 0) {
-                for (auto &pair : admissibleByCluster[i]) {
+        // First accumulate the sums of a_IJ * V_J from admissible cluster pairs.
+        // Each cluster's pairs only write to that cluster, so clusters can run in parallel.
+        int nClusters = admissibleStart.size() - 1;
+        #pragma omp parallel for
+        for (int i = 0; i < nClusters; i++) {
+            if (admissibleStart[i + 1] > admissibleStart[i]) {
+                for (int k = admissibleStart[i]; k < admissibleStart[i + 1]; k++) {
+                    const ClusterPair &pair = admissiblePairs[k];
                     double a_IJ = SobolevCurves::MetricDistanceTermLow(alpha, beta,
                         pair.cluster1->centerOfMass, pair.cluster2->centerOfMass,
                         pair.cluster1->averageTangent, pair.cluster2->averageTangent);
@@ -191,6 +258,7 @@ namespace LWS {
     }
 
     void BlockClusterTree::MultiplyAdmissibleFast(const Eigen::MatrixXd &v_hat, Eigen::MatrixXd &b_hat) const {
+        PROFILE_COUNT(KernelEvaluations, 3 * admissiblePairs.size());
         for (int i = 0; i < 3; i++) {
             b_hat.col(i) = MultiplyAf(v_hat.col(i));
         }
@@ -199,16 +267,23 @@ namespace LWS {
     }
 
     void BlockClusterTree::MultiplyAdmissibleLowFast(const Eigen::VectorXd &v_mid, Eigen::VectorXd &b_mid) const {
+        PROFILE_COUNT(KernelEvaluations, admissiblePairs.size());
         b_mid = MultiplyAfLow(v_mid);
         b_mid = 2 * (Af_1_low.asDiagonal() * v_mid - b_mid);
     }
 
     void BlockClusterTree::MultiplyInadmissibleLowParallel(const Eigen::VectorXd &v_mid, Eigen::VectorXd &b_mid) const {
-        Eigen::VectorXd partialOutput = b_mid;
-        partialOutput.setZero();
-        
-        #pragma omp parallel firstprivate(partialOutput) shared(v_mid, b_mid, inadmissiblePairs)
+        arena->ReserveThreads(omp_get_max_threads());
+
+        #pragma omp parallel shared(v_mid, b_mid)
         {
+            // Each thread's partial sums go in its sub-arena, so repeated
+            // products reuse the same memory instead of allocating it again
+            MonotonicArena &scratch = arena->Local();
+            MonotonicArena::Mark mark = scratch.GetMark();
+            Eigen::Map<Eigen::VectorXd> partialOutput(scratch.AllocateArray<double>(b_mid.rows()), b_mid.rows());
+            partialOutput.setZero();
+
             #pragma omp for
             for (size_t i = 0; i < inadmissiblePairs.size(); i++) {
                 AfFullProductLow(inadmissiblePairs[i], v_mid, partialOutput);
@@ -217,15 +292,20 @@ namespace LWS {
             {
                 b_mid += partialOutput;
             }
+            scratch.Rewind(mark);
         }
     }
 
     void BlockClusterTree::MultiplyInadmissibleParallel(const Eigen::MatrixXd &v_hat, Eigen::MatrixXd &b_hat) const {
-        Eigen::MatrixXd partialOutput = b_hat;
-        partialOutput.setZero();
+        arena->ReserveThreads(omp_get_max_threads());
 
-        #pragma omp parallel firstprivate(partialOutput) shared(v_hat, b_hat, inadmissiblePairs)
+        #pragma omp parallel shared(v_hat, b_hat)
         {
+            MonotonicArena &scratch = arena->Local();
+            MonotonicArena::Mark mark = scratch.GetMark();
+            Eigen::Map<Eigen::MatrixXd> partialOutput(scratch.AllocateArray<double>(b_hat.size()), b_hat.rows(), b_hat.cols());
+            partialOutput.setZero();
+
             #pragma omp for
             for (size_t i = 0; i < inadmissiblePairs.size(); i++) {
                 AfFullProduct(inadmissiblePairs[i], v_hat, partialOutput);
@@ -234,28 +314,29 @@ namespace LWS {
             {
                 b_hat += partialOutput;
             }
+            scratch.Rewind(mark);
         }
     }
 
-    void BlockClusterTree::AfFullProduct(ClusterPair pair, const Eigen::MatrixXd &v_hat, Eigen::MatrixXd &result) const
+    void BlockClusterTree::AfFullProduct(ClusterPair pair, const Eigen::MatrixXd &v_hat, Eigen::Ref<Eigen::MatrixXd> result) const
     {
-        std::vector<double> a_times_one(pair.cluster1->clusterIndices.size());
-        std::vector<Vector3> a_times_v(pair.cluster1->clusterIndices.size());
-        
+        PROFILE_COUNT(KernelEvaluations, pair.cluster1->clusterIndices.size() * pair.cluster2->clusterIndices.size());
+        const CurveGeometry &geom = curves->Geometry();
+
         for (size_t i = 0; i < pair.cluster1->clusterIndices.size(); i++) {
             int e1index = pair.cluster1->clusterIndices[i];
-            CurveEdge* p1 = curves->GetEdge(e1index);
             double l1 = tree_root->bvhRoot->fullMasses(e1index);
+            Vector3 mid1 = geom.Midpoint(e1index);
+            Vector3 tan1 = geom.EdgeTangent(e1index);
+            double a_times_one = 0;
+            Vector3 a_times_v{0, 0, 0};
 
             for (size_t j = 0; j < pair.cluster2->clusterIndices.size(); j++) {
                 int e2index = pair.cluster2->clusterIndices[j];
-                CurveEdge* p2 = curves->GetEdge(e2index);
-                bool isNeighbors = (p1 == p2 || p1->IsNeighbors(p2));
-                
-                Vector3 mid1 = p1->Midpoint();
-                Vector3 mid2 = p2->Midpoint();
-                Vector3 tan1 = p1->Tangent();
-                Vector3 tan2 = p2->Tangent();
+                bool isNeighbors = geom.EdgesTouch(e1index, e2index);
+
+                Vector3 mid2 = geom.Midpoint(e2index);
+                Vector3 tan2 = geom.EdgeTangent(e2index);
 
                 double l2 = tree_root->bvhRoot->fullMasses(e2index);
 
@@ -266,40 +347,42 @@ namespace LWS {
 
                 // We dot this row of Af(i, j) with the all-ones vector, which means we
                 // just add up all entries of that row.
-                a_times_one[i] += af_ij;
+                a_times_one += af_ij;
 
                 // We also dot it with v_hat(J).
-                a_times_v[i] += af_ij * SelectRow(v_hat, e2index);
+                a_times_v += af_ij * SelectRow(v_hat, e2index);
             }
 
-            a_times_one[i] *= l1;
-            a_times_v[i] *= l1;
+            a_times_one *= l1;
+            a_times_v *= l1;
 
             // We've computed everything from row i now, so add to the results vector
-            Vector3 toAdd = 2 * (a_times_one[i] * SelectRow(v_hat, e1index) - a_times_v[i]);
-            AddToRow(result, e1index, toAdd);
+            Vector3 toAdd = 2 * (a_times_one * SelectRow(v_hat, e1index) - a_times_v);
+            result(e1index, 0) += toAdd.x;
+            result(e1index, 1) += toAdd.y;
+            result(e1index, 2) += toAdd.z;
         }
     }
 
-    void BlockClusterTree::AfFullProductLow(ClusterPair pair, const Eigen::VectorXd &v_mid, Eigen::VectorXd &result) const
+    void BlockClusterTree::AfFullProductLow(ClusterPair pair, const Eigen::VectorXd &v_mid, Eigen::Ref<Eigen::VectorXd> result) const
     {
-        std::vector<double> a_times_one(pair.cluster1->clusterIndices.size());
-        std::vector<double> a_times_v(pair.cluster1->clusterIndices.size());
+        PROFILE_COUNT(KernelEvaluations, pair.cluster1->clusterIndices.size() * pair.cluster2->clusterIndices.size());
+        const CurveGeometry &geom = curves->Geometry();
 
         for (size_t i = 0; i < pair.cluster1->clusterIndices.size(); i++) {
             int e1index = pair.cluster1->clusterIndices[i];
-            CurveEdge* p1 = curves->GetEdge(e1index);
             double l1 = tree_root->bvhRoot->fullMasses(e1index);
+            Vector3 mid1 = geom.Midpoint(e1index);
+            Vector3 tan1 = geom.EdgeTangent(e1index);
+            double a_times_one = 0;
+            double a_times_v = 0;
 
             for (size_t j = 0; j < pair.cluster2->clusterIndices.size(); j++) {
                 int e2index = pair.cluster2->clusterIndices[j];
-                CurveEdge* p2 = curves->GetEdge(e2index);
-                bool isNeighbors = (p1 == p2 || p1->IsNeighbors(p2));
-                
-                Vector3 mid1 = p1->Midpoint();
-                Vector3 mid2 = p2->Midpoint();
-                Vector3 tan1 = p1->Tangent();
-                Vector3 tan2 = p2->Tangent();
+                bool isNeighbors = geom.EdgesTouch(e1index, e2index);
+
+                Vector3 mid2 = geom.Midpoint(e2index);
+                Vector3 tan2 = geom.EdgeTangent(e2index);
 
                 double l2 = tree_root->bvhRoot->fullMasses(e2index);
 
@@ -311,85 +394,76 @@ namespace LWS {
 
                 // We dot this row of Af(i, j) with the all-ones vector, which means we
                 // just add up all entries of that row.
-                a_times_one[i] += af_ij;
+                a_times_one += af_ij;
 
                 // We also dot it with v_hat(J).
-                a_times_v[i] += af_ij * v_mid(e2index);
+                a_times_v += af_ij * v_mid(e2index);
             }
 
-            a_times_one[i] *= l1;
-            a_times_v[i] *= l1;
+            a_times_one *= l1;
+            a_times_v *= l1;
 
             // We've computed everything from row i now, so add to the results vector
-            double toAdd = 2 * (a_times_one[i] * v_mid(e1index) - a_times_v[i]);
+            double toAdd = 2 * (a_times_one * v_mid(e1index) - a_times_v);
             result(e1index) += toAdd;
         }
     }
     
     void BlockClusterTree::AfApproxProduct(ClusterPair pair, const Eigen::MatrixXd &v_hat, Eigen::MatrixXd &result) const
     {
-        long traversalStart = Utils::currentTimeMilliseconds();
-        Eigen::VectorXd wf_i;
-        pair.cluster1->fillClusterMassVector(wf_i);
-        Eigen::VectorXd wf_j;
-        pair.cluster2->fillClusterMassVector(wf_j);
-        long traversalEnd = Utils::currentTimeMilliseconds();
-
-        traversalTime += (traversalEnd - traversalStart);
+        // Cluster masses w_f are read straight from the root's mass vector
+        const Eigen::VectorXd &masses = tree_root->bvhRoot->fullMasses;
+        const ArraySpan<int> &indices_i = pair.cluster1->clusterIndices;
+        const ArraySpan<int> &indices_j = pair.cluster2->clusterIndices;
+        PROFILE_COUNT(KernelEvaluations, 1);
         
         double a_IJ = SobolevCurves::MetricDistanceTerm(alpha, beta,
             pair.cluster1->centerOfMass, pair.cluster2->centerOfMass,
             pair.cluster1->averageTangent, pair.cluster2->averageTangent);
-        // Evaluate a(I,J) * w_f(J)^T * 1(J)
-        double a_wf_1 = a_IJ * wf_j.sum();
 
-        // Evaluate a(I,J) * w_f(J)^T * v_hat(J)
+        // Evaluate a(I,J) * w_f(J)^T * 1(J) and a(I,J) * w_f(J)^T * v_hat(J)
+        double wf_1 = 0;
         Vector3 a_wf_J{0, 0, 0};
-        // Dot w_f(J) with v_hat(J)
-        for (int j = 0; j < wf_j.rows(); j++) {
-            a_wf_J += wf_j(j) * SelectRow(v_hat, pair.cluster2->clusterIndices[j]);
+        for (int j : indices_j) {
+            wf_1 += masses(j);
+            a_wf_J += masses(j) * SelectRow(v_hat, j);
         }
+        double a_wf_1 = a_IJ * wf_1;
         a_wf_J *= a_IJ;
 
         // Add in the results
-        for (int i = 0; i < wf_i.rows(); i++) {
-            Vector3 toAdd = wf_i[i] * 2 * (a_wf_1 * SelectRow(v_hat, pair.cluster1->clusterIndices[i]) - a_wf_J);
-            CurveEdge* e_i = curves->GetEdge(pair.cluster1->clusterIndices[i]);
-            AddToRow(result, pair.cluster1->clusterIndices[i], toAdd);
+        for (int i : indices_i) {
+            Vector3 toAdd = masses(i) * 2 * (a_wf_1 * SelectRow(v_hat, i) - a_wf_J);
+            AddToRow(result, i, toAdd);
         }
     }
     
     void BlockClusterTree::AfApproxProductLow(ClusterPair pair, const Eigen::VectorXd &v_mid, Eigen::VectorXd &result) const
     {
-        long traversalStart = Utils::currentTimeMilliseconds();
-        Eigen::VectorXd wf_i;
-        pair.cluster1->fillClusterMassVector(wf_i);
-        Eigen::VectorXd wf_j;
-        pair.cluster2->fillClusterMassVector(wf_j);
-        long traversalEnd = Utils::currentTimeMilliseconds();
-
-        traversalTime += (traversalEnd - traversalStart);
+        // Cluster masses w_f are read straight from the root's mass vector
+        const Eigen::VectorXd &masses = tree_root->bvhRoot->fullMasses;
+        const ArraySpan<int> &indices_i = pair.cluster1->clusterIndices;
+        const ArraySpan<int> &indices_j = pair.cluster2->clusterIndices;
+        PROFILE_COUNT(KernelEvaluations, 1);
         
         double a_IJ = SobolevCurves::MetricDistanceTermLow(alpha, beta,
             pair.cluster1->centerOfMass, pair.cluster2->centerOfMass,
             pair.cluster1->averageTangent, pair.cluster2->averageTangent);
 
-        // Evaluate a(I,J) * w_f(J)^T * 1(J)
-        double a_wf_1 = a_IJ * wf_j.sum();
-
-        // Evaluate a(I,J) * w_f(J)^T * v_hat(J)
+        // Evaluate a(I,J) * w_f(J)^T * 1(J) and a(I,J) * w_f(J)^T * v_hat(J)
+        double wf_1 = 0;
         double a_wf_J = 0;
-        // Dot w_f(J) with v_hat(J)
-        for (int j = 0; j < wf_j.rows(); j++) {
-            a_wf_J += wf_j(j) * v_mid(pair.cluster2->clusterIndices[j]);
+        for (int j : indices_j) {
+            wf_1 += masses(j);
+            a_wf_J += masses(j) * v_mid(j);
         }
+        double a_wf_1 = a_IJ * wf_1;
         a_wf_J *= a_IJ;
 
         // Add in the results
-        for (int i = 0; i < wf_i.rows(); i++) {
-            double toAdd = wf_i[i] * 2 * (a_wf_1 * v_mid(pair.cluster1->clusterIndices[i]) - a_wf_J);
-            CurveEdge* e_i = curves->GetEdge(pair.cluster1->clusterIndices[i]);
-            result(pair.cluster1->clusterIndices[i]) += toAdd;
+        for (int i : indices_i) {
+            double toAdd = masses(i) * 2 * (a_wf_1 * v_mid(i) - a_wf_J);
+            result(i) += toAdd;
         }
     }
 }
@@ -0,0 +1,324 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+namespace LWS {
+
+    namespace {
+        const int numCounters = (int)ProfileCounter::NumCounters;
+        // Beyond this many trace events per thread, phases still count toward
+        // the summary but are no longer written to the trace
+        const size_t maxTraceEvents = 1 << 20;
+
+        // Allocations are counted globally rather than per thread, so that the
+        // allocator hook never touches thread-local state that might itself allocate
+        std::atomic<uint64_t> allocatedBytes(0);
+        std::atomic<uint64_t> allocationCount(0);
+
+        struct TraceEvent {
+            const char* name;
+            int64_t start;
+            int64_t duration;
+            uint64_t counts[numCounters];
+        };
+
+        struct OpenPhase {
+            const char* name;
+            int64_t start;
+            uint64_t counts[numCounters];
+        };
+
+        struct PhaseStats {
+            uint64_t calls;
+            int64_t total;
+            int64_t max;
+            uint64_t counts[numCounters];
+        };
+
+        struct ThreadRecord {
+            int id;
+            // Only the owning thread writes its counters, so relaxed
+            // load-and-store is enough; other threads only read them.
+            std::atomic<uint64_t> counters[numCounters];
+            std::vector<OpenPhase> stack;
+            std::vector<TraceEvent> events;
+            std::unordered_map<const char*, PhaseStats> stats;
+            size_t droppedEvents;
+        };
+
+        std::mutex registryMutex;
+        std::deque<std::unique_ptr<ThreadRecord>> registry;
+        std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+        ThreadRecord* threadRecord() {
+            thread_local ThreadRecord* record = 0;
+            if (!record) {
+                std::lock_guard<std::mutex> lock(registryMutex);
+                registry.push_back(std::unique_ptr<ThreadRecord>(new ThreadRecord()));
+                record = registry.back().get();
+                record->id = registry.size() - 1;
+                for (int i = 0; i < numCounters; i++) record->counters[i].store(0);
+                record->droppedEvents = 0;
+            }
+            return record;
+        }
+
+        inline int64_t nowMicroseconds() {
+            using namespace std::chrono;
+            return duration_cast<microseconds>(steady_clock::now() - epoch).count();
+        }
+
+        void snapshotCounters(uint64_t* counts) {
+            std::lock_guard<std::mutex> lock(registryMutex);
+            for (int i = 0; i < numCounters; i++) counts[i] = 0;
+            for (const std::unique_ptr<ThreadRecord> &record : registry) {
+                for (int i = 0; i < numCounters; i++) {
+                    counts[i] += record->counters[i].load(std::memory_order_relaxed);
+                }
+            }
+            counts[(int)ProfileCounter::BytesAllocated] = allocatedBytes.load(std::memory_order_relaxed);
+            counts[(int)ProfileCounter::Allocations] = allocationCount.load(std::memory_order_relaxed);
+        }
+    }
+
+    bool Profiler::enabled = false;
+
+    void Profiler::Enable() {
+        enabled = true;
+    }
+
+    void Profiler::Disable() {
+        enabled = false;
+    }
+
+    void Profiler::Reset() {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        for (const std::unique_ptr<ThreadRecord> &record : registry) {
+            for (int i = 0; i < numCounters; i++) record->counters[i].store(0);
+            record->stack.clear();
+            record->events.clear();
+            record->stats.clear();
+            record->droppedEvents = 0;
+        }
+        allocatedBytes.store(0);
+        allocationCount.store(0);
+        epoch = std::chrono::steady_clock::now();
+    }
+
+    void Profiler::Push(const char* name) {
+        ThreadRecord* record = threadRecord();
+        OpenPhase phase;
+        phase.name = name;
+        snapshotCounters(phase.counts);
+        phase.start = nowMicroseconds();
+        record->stack.push_back(phase);
+    }
+
+    void Profiler::Pop() {
+        int64_t end = nowMicroseconds();
+        ThreadRecord* record = threadRecord();
+        // Tolerate a profiler that was enabled while this phase was already open
+        if (record->stack.empty()) return;
+        OpenPhase phase = record->stack.back();
+        record->stack.pop_back();
+
+        uint64_t counts[numCounters];
+        snapshotCounters(counts);
+        for (int i = 0; i < numCounters; i++) {
+            counts[i] -= phase.counts[i];
+        }
+
+        int64_t duration = end - phase.start;
+        PhaseStats &stats = record->stats[phase.name];
+        if (stats.calls == 0) {
+            stats.total = 0;
+            stats.max = 0;
+            for (int i = 0; i < numCounters; i++) stats.counts[i] = 0;
+        }
+        stats.calls++;
+        stats.total += duration;
+        stats.max = std::max(stats.max, duration);
+        for (int i = 0; i < numCounters; i++) stats.counts[i] += counts[i];
+
+        if (record->events.size() < maxTraceEvents) {
+            TraceEvent event;
+            event.name = phase.name;
+            event.start = phase.start;
+            event.duration = duration;
+            for (int i = 0; i < numCounters; i++) event.counts[i] = counts[i];
+            record->events.push_back(event);
+        }
+        else {
+            record->droppedEvents++;
+        }
+    }
+
+    void Profiler::AddCount(ProfileCounter counter, uint64_t amount) {
+        std::atomic<uint64_t> &c = threadRecord()->counters[(int)counter];
+        c.store(c.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    uint64_t Profiler::CounterTotal(ProfileCounter counter) {
+        uint64_t counts[numCounters];
+        snapshotCounters(counts);
+        return counts[(int)counter];
+    }
+
+    const char* Profiler::CounterName(ProfileCounter counter) {
+        switch (counter) {
+            case ProfileCounter::KernelEvaluations: return "kernel_evals";
+            case ProfileCounter::TreeNodesVisited: return "tree_nodes";
+            case ProfileCounter::MatrixVectorProducts: return "matvecs";
+            case ProfileCounter::LineSearchBacktracks: return "ls_backtracks";
+            case ProfileCounter::BytesAllocated: return "bytes_allocated";
+            case ProfileCounter::Allocations: return "allocations";
+            default: return "unknown";
+        }
+    }
+
+    bool Profiler::WriteChromeTrace(const std::string &fname) {
+        std::ofstream out(fname);
+        if (!out.is_open()) {
+            std::cerr << "Could not open " << fname << " for writing" << std::endl;
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(registryMutex);
+        out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [" << std::endl;
+        bool first = true;
+        size_t dropped = 0;
+        for (const std::unique_ptr<ThreadRecord> &record : registry) {
+            dropped += record->droppedEvents;
+            if (record->events.empty()) continue;
+            out << (first ? "" : ",\n") << "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 0, \"tid\": " << record->id
+                << ", \"args\": {\"name\": \"" << (record->id == 0 ? "main" : "worker " + std::to_string(record->id)) << "\"}}";
+            first = false;
+
+            for (const TraceEvent &event : record->events) {
+                out << ",\n{\"ph\": \"X\", \"name\": \"" << event.name << "\", \"pid\": 0, \"tid\": " << record->id
+                    << ", \"ts\": " << event.start << ", \"dur\": " << event.duration << ", \"args\": {";
+                bool firstArg = true;
+                for (int i = 0; i < numCounters; i++) {
+                    if (event.counts[i] == 0) continue;
+                    out << (firstArg ? "" : ", ") << "\"" << CounterName((ProfileCounter)i) << "\": " << event.counts[i];
+                    firstArg = false;
+                }
+                out << "}}";
+            }
+        }
+        out << "\n]}" << std::endl;
+
+        std::cout << "Wrote performance trace to " << fname << std::endl;
+        if (dropped > 0) {
+            std::cout << "  (" << dropped << " phases were left out of the trace after the per-thread limit)" << std::endl;
+        }
+        return true;
+    }
+
+    void Profiler::PrintSummary(std::ostream &out) {
+        // Merge by name, since the same literal can have different addresses
+        std::map<std::string, PhaseStats> merged;
+        {
+            std::lock_guard<std::mutex> lock(registryMutex);
+            for (const std::unique_ptr<ThreadRecord> &record : registry) {
+                for (const std::pair<const char* const, PhaseStats> &entry : record->stats) {
+                    PhaseStats &m = merged[entry.first];
+                    if (m.calls == 0) {
+                        m = entry.second;
+                        continue;
+                    }
+                    m.calls += entry.second.calls;
+                    m.total += entry.second.total;
+                    m.max = std::max(m.max, entry.second.max);
+                    for (int i = 0; i < numCounters; i++) m.counts[i] += entry.second.counts[i];
+                }
+            }
+        }
+
+        std::vector<std::pair<std::string, PhaseStats>> rows(merged.begin(), merged.end());
+        std::sort(rows.begin(), rows.end(), [](const std::pair<std::string, PhaseStats> &a, const std::pair<std::string, PhaseStats> &b) {
+            return a.second.total > b.second.total;
+        });
+
+        std::ios::fmtflags flags = out.flags();
+        out << std::left << std::setw(28) << "phase" << std::right << std::setw(8) << "calls"
+            << std::setw(12) << "total ms" << std::setw(10) << "mean ms" << std::setw(10) << "max ms";
+        for (int i = 0; i < numCounters; i++) {
+            out << std::setw(16) << CounterName((ProfileCounter)i);
+        }
+        out << std::endl;
+
+        out << std::fixed << std::setprecision(2);
+        for (const std::pair<std::string, PhaseStats> &row : rows) {
+            const PhaseStats &s = row.second;
+            out << std::left << std::setw(28) << row.first << std::right << std::setw(8) << s.calls
+                << std::setw(12) << s.total / 1000.0 << std::setw(10) << s.total / 1000.0 / s.calls
+                << std::setw(10) << s.max / 1000.0;
+            for (int i = 0; i < numCounters; i++) {
+                out << std::setw(16) << s.counts[i];
+            }
+            out << std::endl;
+        }
+        out.flags(flags);
+    }
+}
+
+#if defined(RCURVES_PROFILING) && defined(RCURVES_PROFILE_ALLOCATIONS)
+// Counting global allocator, only built with -DRCURVES_PROFILE_ALLOCATIONS=ON.
+// When profiling is disabled at runtime this adds a single branch in front of malloc.
+void* operator new(size_t size) {
+    if (LWS::Profiler::enabled) {
+        LWS::allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+        LWS::allocationCount.fetch_add(1, std::memory_order_relaxed);
+    }
+    void* p = std::malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    if (LWS::Profiler::enabled) {
+        LWS::allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+        LWS::allocationCount.fetch_add(1, std::memory_order_relaxed);
+    }
+    return std::malloc(size ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t &tag) noexcept {
+    return operator new(size, tag);
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    std::free(p);
+}
+#endif
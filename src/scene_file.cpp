@@ -1,7 +1,9 @@
 #include "scene_file.h"
+#include "implicit_csg.h"
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <typeinfo>
 
 namespace LWS {
 
@@ -32,6 +34,39 @@ namespace LWS {
 
     bool SceneData::useSmoothUnion = false;
 
+    template<typename A, typename B>
+    ImplicitSurface* makeStaticUnion(ImplicitSurface* s1, ImplicitSurface* s2, bool smooth) {
+        A &a = static_cast<A&>(*s1);
+        B &b = static_cast<B&>(*s2);
+        ImplicitSurface* combined;
+        if (smooth) combined = new StaticSmoothUnion<A, B>(a, b, 1);
+        else combined = new StaticUnion<A, B>(a, b);
+        // The static union holds copies of both
+        delete s1;
+        delete s2;
+        return combined;
+    }
+
+    template<typename A>
+    ImplicitSurface* makeStaticUnionWith(ImplicitSurface* s1, ImplicitSurface* s2, bool smooth) {
+        if (typeid(*s2) == typeid(ImplicitSphere)) return makeStaticUnion<A, ImplicitSphere>(s1, s2, smooth);
+        if (typeid(*s2) == typeid(ImplicitTorus)) return makeStaticUnion<A, ImplicitTorus>(s1, s2, smooth);
+        return 0;
+    }
+
+    // Unions of two spheres or tori are built as static trees, so that batched
+    // evaluation has no virtual calls below the root; anything else, including
+    // a third surface, falls back to the runtime unions.
+    ImplicitSurface* makeUnion(ImplicitSurface* s1, ImplicitSurface* s2, bool smooth) {
+        ImplicitSurface* combined = 0;
+        if (typeid(*s1) == typeid(ImplicitSphere)) combined = makeStaticUnionWith<ImplicitSphere>(s1, s2, smooth);
+        else if (typeid(*s1) == typeid(ImplicitTorus)) combined = makeStaticUnionWith<ImplicitTorus>(s1, s2, smooth);
+        if (combined) return combined;
+
+        if (smooth) return new ImplicitSmoothUnion(s1, s2, 1);
+        else return new ImplicitUnion(s1, s2);
+    }
+
     void processLine(SceneData &data, std::string dir_root, std::vector<std::string> &parts) {
         using namespace std;
         string key = parts[0];
@@ -318,6 +353,47 @@ namespace LWS {
             }
         }
 
+        else if (key == "barnes_hut_error") {
+            if (parts.size() == 2) {
+                data.bhErrorTarget = stod(parts[1]);
+            }
+            else {
+                std::cerr << "Incorrect arguments to barnes_hut_error" << std::endl;
+                exit(1);
+            }
+        }
+
+        else if (key == "cluster_separation") {
+            if (parts.size() == 2) {
+                data.bctSeparation = stod(parts[1]);
+            }
+            else {
+                std::cerr << "Incorrect arguments to cluster_separation" << std::endl;
+                exit(1);
+            }
+        }
+
+        else if (key == "cache_fields") {
+            if (parts.size() == 2 || parts.size() == 3) {
+                data.fieldCacheResolution = stoi(parts[1]);
+                if (parts.size() == 3) data.fieldCacheTolerance = stod(parts[2]);
+            }
+            else {
+                std::cerr << "Incorrect arguments to cache_fields" << std::endl;
+                exit(1);
+            }
+        }
+
+        else if (key == "surface_mesh_resolution") {
+            if (parts.size() == 2) {
+                data.surfaceMeshResolution = stoi(parts[1]);
+            }
+            else {
+                std::cerr << "Incorrect arguments to surface_mesh_resolution" << std::endl;
+                exit(1);
+            }
+        }
+
         else if (key == "union_type") {
             if (parts.size() == 2) {
                 if (parts[1] == "disjoint") {
@@ -403,11 +479,8 @@ namespace LWS {
                 if (!data.constraintSurface) {
                     data.constraintSurface = cSurface;
                 }
-                else if (SceneData::useSmoothUnion) {
-                    data.constraintSurface = new ImplicitSmoothUnion(cSurface, data.constraintSurface, 1);
-                }
                 else {
-                    data.constraintSurface = new ImplicitUnion(cSurface, data.constraintSurface);
+                    data.constraintSurface = makeUnion(cSurface, data.constraintSurface, SceneData::useSmoothUnion);
                 }
             }
             else {
@@ -479,6 +552,11 @@ namespace LWS {
         sceneData.constraintSurface = 0;
         sceneData.subdivideLimit = 0;
         sceneData.iterationLimit = 0;
+        sceneData.bhErrorTarget = 0.25;
+        sceneData.bctSeparation = 1;
+        sceneData.fieldCacheResolution = 0;
+        sceneData.fieldCacheTolerance = 1e-4;
+        sceneData.surfaceMeshResolution = 50;
 
         ifstream inFile;
         inFile.open(filename);
@@ -20,8 +20,7 @@ namespace LWS {
             #pragma omp for
             for (int i = 0; i < nVerts; i++)
             {
-                CurveVertex* i_pt = curveNetwork->GetVertex(i);
-                root->accumulateTPEGradient(partialOutput, i_pt, curveNetwork, alpha, beta);
+                root->accumulateTPEGradient(partialOutput, i, curveNetwork, alpha, beta);
             }
 
             #pragma omp critical
@@ -38,9 +37,8 @@ namespace LWS {
         #pragma omp parallel for reduction(+ : fullSum) shared(root)
         // Loop over all vertices and add up energy contributions
         for (int i = 0; i < nVerts; i++) {
-            CurveVertex* i_pt = curveNetwork->GetVertex(i);
             double vertSum = 0;
-            root->accumulateVertexEnergy(vertSum, i_pt, curveNetwork, alpha, beta);
+            root->accumulateVertexEnergy(vertSum, i, curveNetwork, alpha, beta);
             fullSum += vertSum;
         }
         return fullSum;
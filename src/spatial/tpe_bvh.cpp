@@ -1,10 +1,12 @@
 #include "spatial/tpe_bvh.h"
+#include "profiler.h"
 #include <algorithm>
 #include <omp.h>
 
 namespace LWS {
 
     int BVHNode3D::globalID = 0;
+    double BVHNode3D::errorTarget = 0.25;
 
     inline double GetCoordFromBody(VertexBody6D body, int axis) {
         switch (axis) {
@@ -58,43 +60,30 @@ namespace LWS {
         }
     }
 
-    inline VertexBody6D vertToBody(PolyCurveNetwork* curves, int i) {
-        CurveVertex* p = curves->GetVertex(i);
-        Vector3 pos = p->Position();
-        Vector3 tangent = p->Tangent();
-
-        PosTan ptan{pos, tangent};
-        double mass = p->DualLength();
-        int globalIndex = p->GlobalIndex();
-
-        return VertexBody6D{ptan, mass, globalIndex, BodyType::Vertex};
+    inline VertexBody6D vertToBody(const CurveGeometry &geom, int i) {
+        PosTan ptan{geom.Position(i), geom.VertexTangent(i)};
+        return VertexBody6D{ptan, geom.dualLength(i), i, BodyType::Vertex};
     }
 
-    inline VertexBody6D edgeToBody(PolyCurveNetwork* curves, int i) {
-        CurveEdge* edge = curves->GetEdge(i);
-
-        Vector3 pos = edge->Midpoint();
-        double mass = edge->Length();
-        Vector3 tangent = edge->Tangent();
-
-        PosTan ptan{pos, tangent};
-        int gIndex1 = edge->GlobalIndex();
-
-        return VertexBody6D{ptan, mass, gIndex1, BodyType::Edge};
+    inline VertexBody6D edgeToBody(const CurveGeometry &geom, int i) {
+        PosTan ptan{geom.Midpoint(i), geom.EdgeTangent(i)};
+        return VertexBody6D{ptan, geom.length(i), i, BodyType::Edge};
     }
 
-    BVHNode3D* CreateBVHFromCurve(PolyCurveNetwork *curves) {
+    BVHNode3D* CreateBVHFromCurve(PolyCurveNetwork *curves, MonotonicArena* arena) {
+        curves->UpdateGeometry();
+        const CurveGeometry &geom = curves->Geometry();
         int nVerts = curves->NumVertices();
         std::vector<VertexBody6D> verts(nVerts);
 
         // Loop over all the vertices
         for (int i = 0; i < nVerts; i++) {
-            VertexBody6D curBody = vertToBody(curves, i);
+            VertexBody6D curBody = vertToBody(geom, i);
             // Put vertex body into full list
             verts[curBody.elementIndex] = curBody;
         }
 
-        BVHNode3D* tree = new BVHNode3D(verts, 3, 0, true);
+        BVHNode3D* tree = new BVHNode3D(ArraySpan<VertexBody6D>(verts.data(), verts.size()), 3, 0, true, arena);
         tree->recomputeCentersOfMass(curves);
         BVHNode3D::globalID = 0;
         tree->recursivelyAssignIDs();
@@ -105,18 +94,20 @@ namespace LWS {
         return tree;
     }
 
-    BVHNode3D* CreateEdgeBVHFromCurve(PolyCurveNetwork *curves) {
+    BVHNode3D* CreateEdgeBVHFromCurve(PolyCurveNetwork *curves, MonotonicArena* arena) {
+        curves->UpdateGeometry();
+        const CurveGeometry &geom = curves->Geometry();
         int nEdges = curves->NumEdges();
         std::vector<VertexBody6D> verts(nEdges);
 
         // Loop over all the vertices
         for (int i = 0; i < nEdges; i++) {
-            VertexBody6D curBody = edgeToBody(curves, i);
+            VertexBody6D curBody = edgeToBody(geom, i);
             // Put vertex body into full list
             verts[curBody.elementIndex] = curBody;
         }
 
-        BVHNode3D* tree = new BVHNode3D(verts, 0, 0, true);
+        BVHNode3D* tree = new BVHNode3D(ArraySpan<VertexBody6D>(verts.data(), verts.size()), 0, 0, true, arena);
         tree->recomputeCentersOfMass(curves);
         BVHNode3D::globalID = 0;
         tree->recursivelyAssignIDs();
@@ -155,7 +146,7 @@ namespace LWS {
             verts[indices[v]] = curBody;
         }
 
-        BVHNode3D* tree = new BVHNode3D(verts, 0, 0, false);
+        BVHNode3D* tree = new BVHNode3D(ArraySpan<VertexBody6D>(verts.data(), verts.size()), 0, 0, false);
         auto pair = std::pair<std::shared_ptr<HalfedgeMesh>, std::shared_ptr<VertGeometry>>(mesh, geom);
         tree->recomputeCentersOfMass(pair);
         BVHNode3D::globalID = 0;
@@ -163,14 +154,35 @@ namespace LWS {
         return tree;
     }
 
-    BVHNode3D::BVHNode3D(std::vector<VertexBody6D> &points, int axis, BVHNode3D* root, bool splitTangents) {
+    BVHNode3D::BVHNode3D(ArraySpan<VertexBody6D> points, int axis, BVHNode3D* root, bool splitTangents,
+    MonotonicArena* sharedArena) {
         // Split the points into sets somehow
-        thresholdTheta = 0.25;
         splitAxis = axis;
         zeroMVFields();
 
-        if (!root) bvhRoot = this;
-        else bvhRoot = root;
+        if (!root) {
+            bvhRoot = this;
+            // A binary tree over n points has under 2n nodes, plus the index array
+            size_t bytes = points.size() * (2 * sizeof(BVHNode3D) + 2 * sizeof(BVHNode3D*) + sizeof(int)) + 64;
+            ownsArena = !sharedArena;
+            arena = (sharedArena) ? sharedArena : new MonotonicArena(bytes);
+            arena->Reserve(bytes);
+            // Splitting uses the calling thread's sub-arena as a scratch stack
+            arena->ReserveThreads(omp_get_max_threads());
+            clusterIndices = arena->AllocateSpan<int>(points.size());
+            numIndexed = 0;
+
+            // The points are reordered in place below, so read the masses first
+            fullMasses.setZero(points.size());
+            for (size_t i = 0; i < points.size(); i++) {
+                fullMasses(i) = points[i].mass;
+            }
+        }
+        else {
+            bvhRoot = root;
+            arena = root->arena;
+            ownsArena = false;
+        }
 
         if (points.size() == 0) {
             isLeaf = false;
@@ -193,30 +205,39 @@ namespace LWS {
             maxCoords = body.pt;
             numElements = 1;
 
-            clusterIndices.push_back(body.elementIndex);
+            int* slot = bvhRoot->clusterIndices.data() + bvhRoot->numIndexed++;
+            *slot = body.elementIndex;
+            clusterIndices = ArraySpan<int>(slot, 1);
         }
         else {
-            // Reserve space for splitting the points into lesser and greater
             int nPoints = points.size();
-            std::vector<VertexBody6D> lesserPoints;
-            lesserPoints.reserve(nPoints / 2 + 1);
-            std::vector<VertexBody6D> greaterPoints;
-            greaterPoints.reserve(nPoints / 2 + 1);
 
             // Compute the plane over which to split the points
             splitPoint = AxisSplittingPlane(points, axis);
 
-            // Split the points over the median
+            // Split the points over the median, keeping their order within each
+            // half: the lesser points are compacted to the front, and the greater
+            // ones are staged in scratch memory and copied in after them.
+            MonotonicArena &scratch = arena->Local();
+            MonotonicArena::Mark mark = scratch.GetMark();
+            VertexBody6D* greater = scratch.AllocateArray<VertexBody6D>(nPoints);
+            int nLesser = 0;
+            int nGreater = 0;
             for (int i = 0; i < nPoints; i++) {
                 double coord = GetCoordFromBody(points[i], axis);
 
                 if (coord <= splitPoint) {
-                    lesserPoints.push_back(points[i]);
+                    points[nLesser++] = points[i];
                 }
                 else {
-                    greaterPoints.push_back(points[i]);
+                    greater[nGreater++] = points[i];
                 }
             }
+            std::copy(greater, greater + nGreater, points.begin() + nLesser);
+            scratch.Rewind(mark);
+
+            ArraySpan<VertexBody6D> lesserPoints(points.data(), nLesser);
+            ArraySpan<VertexBody6D> greaterPoints(points.data() + nLesser, nGreater);
 
             // Compute the middle extents for the two halves
 
@@ -230,25 +251,16 @@ namespace LWS {
             else {
                 nextAxis = NextSpatialAxis(axis);
             }
-            // If this cell is "good" in terms of the tangent test, then split in spatial axes
-            // Otherwise, continue splitting in tangent axes
-            // int nextAxis = (testTangent()) ? NextSpatialAxis(axis) : NextAxis(axis);
 
             BVHNode3D* nextRoot = (root) ? root : this;
-            BVHNode3D* lesserNode = new BVHNode3D(lesserPoints, nextAxis, nextRoot, splitTangents);
-            BVHNode3D* greaterNode = new BVHNode3D(greaterPoints, nextAxis, nextRoot, splitTangents);
-
-            children.push_back(lesserNode);
-            children.push_back(greaterNode);
-
-            clusterIndices.insert(clusterIndices.end(), lesserNode->clusterIndices.begin(), lesserNode->clusterIndices.end());
-            clusterIndices.insert(clusterIndices.end(), greaterNode->clusterIndices.begin(), greaterNode->clusterIndices.end());
-
-            if (!root) {
-                fullMasses.setZero(points.size());
-                for (size_t i = 0; i < points.size(); i++) {
-                    fullMasses(i) = points[i].mass;
-                }
+            // The leaves below this node fill in the next stretch of the root's index array
+            size_t firstIndex = bvhRoot->numIndexed;
+            children = arena->AllocateSpan<BVHNode3D*>(2);
+            children[0] = arena->New<BVHNode3D>(lesserPoints, nextAxis, nextRoot, splitTangents);
+            children[1] = arena->New<BVHNode3D>(greaterPoints, nextAxis, nextRoot, splitTangents);
+
+            if (root) {
+                clusterIndices = ArraySpan<int>(bvhRoot->clusterIndices.data() + firstIndex, bvhRoot->numIndexed - firstIndex);
             }
 
             isLeaf = false;
@@ -257,9 +269,28 @@ namespace LWS {
     }
 
     BVHNode3D::~BVHNode3D() {
+        // Children live in the arena, so they are destroyed but not freed
         for (size_t i = 0; i < children.size(); i++) {
-            if (children[i]) delete children[i];
+            if (children[i]) children[i]->~BVHNode3D();
         }
+        if (ownsArena) delete arena;
+    }
+
+    BVHNode3D* BVHNode3D::CopyInto(MonotonicArena* target) {
+        return copyNode(target, 0);
+    }
+
+    BVHNode3D* BVHNode3D::copyNode(MonotonicArena* target, BVHNode3D* copyRoot) {
+        BVHNode3D* copy = target->New<BVHNode3D>(*this);
+        if (!copyRoot) copyRoot = copy;
+        copy->bvhRoot = copyRoot;
+        copy->arena = target;
+        copy->ownsArena = false;
+        copy->children = target->AllocateSpan<BVHNode3D*>(children.size());
+        for (size_t i = 0; i < children.size(); i++) {
+            copy->children[i] = children[i] ? children[i]->copyNode(target, copyRoot) : 0;
+        }
+        return copy;
     }
 
     void BVHNode3D::findCurveSegments(std::vector<VertexBody6D> &points, PolyCurveNetwork* curves) {
@@ -269,15 +300,17 @@ namespace LWS {
         throw 1;
     }
 
-    double BVHNode3D::AxisSplittingPlane(std::vector<VertexBody6D> &points, int axis) {
+    double BVHNode3D::AxisSplittingPlane(ArraySpan<VertexBody6D> points, int axis) {
         size_t nPoints = points.size();
-        std::vector<double> coords(nPoints);
+        MonotonicArena &scratch = arena->Local();
+        MonotonicArena::Mark mark = scratch.GetMark();
+        double* coords = scratch.AllocateArray<double>(nPoints);
 
         for (size_t i = 0; i < nPoints; i++) {
             coords[i] = GetCoordFromBody(points[i], axis);
         }
 
-        std::sort(coords.begin(), coords.end());
+        std::sort(coords, coords + nPoints);
 
         size_t splitIndex = -1;
         double minWidths = INFINITY;
@@ -294,23 +327,16 @@ namespace LWS {
         }
 
         double splitPoint = (coords[splitIndex] + coords[splitIndex + 1]) / 2;
+        scratch.Rewind(mark);
         return splitPoint;
     }
 
     void BVHNode3D::refreshWeightsVector(PolyCurveNetwork* curves, BodyType bType) {
         if (bType == BodyType::Vertex) {
-            int nVerts = curves->NumVertices();
-            for (int i = 0; i < nVerts; i++) {
-                CurveVertex* v = curves->GetVertex(i);
-                fullMasses(v->id) = v->DualLength();
-            }
+            fullMasses = curves->Geometry().dualLength;
         }
         else if (bType == BodyType::Edge) {
-            int nEdges = curves->NumEdges();
-            for (int i = 0; i < nEdges; i++) {
-                CurveEdge* e = curves->GetEdge(i);
-                fullMasses(e->id) = e->Length();
-            }
+            fullMasses = curves->Geometry().length;
         }
     }
 
@@ -358,92 +384,91 @@ namespace LWS {
         return Vector2{maxRadial, linearSpread};
     }
 
-    bool BVHNode3D::shouldUseCell(Vector3 vertPos) {
+    bool BVHNode3D::shouldUseCell(Vector3 vertPos, double alpha, double beta) {
         double d = norm(centerOfMass - vertPos);
-        // Vector2 ratios = viewspaceBounds(vertPos) / d;
-        // TODO: take into account some tangent-related criteria?
-        // return fmax(ratios.x, ratios.y) < thresholdTheta;
-        return nodeRatio(d) < thresholdTheta;
+        double s = norm(maxCoords.position - minCoords.position) / (2 * d);
+        if (s >= 1) return false;
+        // Once the tangents span opposite directions their average is meaningless,
+        // so if the kernel depends on tangents at all, open the cell regardless
+        double tau = norm(maxCoords.tangent - minCoords.tangent) / 2;
+        if (alpha > 0 && tau >= 1) return false;
+        return FarFieldError(s, tau, alpha, beta) < errorTarget;
     }
 
-    void BVHNode3D::accumulateVertexEnergy(double &result, CurveVertex* &i_pt,
+    void BVHNode3D::accumulateVertexEnergy(double &result, int i,
     PolyCurveNetwork* curves, double alpha, double beta) {
+        PROFILE_COUNT(TreeNodesVisited, 1);
+        const CurveGeometry &geom = curves->Geometry();
         if (isEmpty) {
             return;
         }
         else if (isLeaf) {
+            PROFILE_COUNT(KernelEvaluations, 1);
             // If this is a leaf, then it only has one element in it, so just use it
             if (body.type == BodyType::Vertex) {
-                // If the element is a vertex, just get that vertex
-                CurveVertex* j = curves->GetVertex(body.elementIndex);
-                // Don't sum if it's the same vertex
-                if (j == i_pt) return;
-                // Add contribution to energy at i from vertex j
-                result += TPESC::tpe_pair(i_pt, j, alpha, beta);
+                // Add contribution to energy at i from vertex j (zero if they're the same)
+                result += TPESC::tpe_pair(geom, i, body.elementIndex, alpha, beta);
             }
             else if (body.type == BodyType::Edge) {
                 // Otherwise the element is an edge, so we use its midpoint (stored in the body)
-                result += TPESC::tpe_pair_pts(i_pt->Position(), body.pt.position, i_pt->Tangent(), i_pt->DualLength(), body.mass, alpha, beta);
+                result += TPESC::tpe_pair_pts(geom.Position(i), body.pt.position, geom.VertexTangent(i),
+                    geom.dualLength(i), body.mass, alpha, beta);
             }
         }
         else {
-            if (shouldUseCell(i_pt->Position())) {
+            if (shouldUseCell(geom.Position(i), alpha, beta)) {
                 // This cell is far enough away that we can treat it as a single body
-                result += bodyEnergyEvaluation(i_pt, alpha, beta);
+                PROFILE_COUNT(KernelEvaluations, 1);
+                result += bodyEnergyEvaluation(geom, i, alpha, beta);
             }
             else {
                 // Otherwise we continue recursively traversing the tree
-                for (size_t i = 0; i < children.size(); i++) {
-                    if (children[i]) {
-                        children[i]->accumulateVertexEnergy(result, i_pt, curves, alpha, beta);
+                for (size_t c = 0; c < children.size(); c++) {
+                    if (children[c]) {
+                        children[c]->accumulateVertexEnergy(result, i, curves, alpha, beta);
                     }
                 }
             }
         }
     }
 
-    double BVHNode3D::bodyEnergyEvaluation(CurveVertex* &i_pt, double alpha, double beta) {
+    double BVHNode3D::bodyEnergyEvaluation(const CurveGeometry &geom, int i, double alpha, double beta) {
         Vector3 tangent = averageTangent;
         tangent = tangent.normalize();
-        return TPESC::tpe_pair_pts(i_pt->Position(), centerOfMass, tangent, i_pt->DualLength(), totalMass, alpha, beta);
+        return TPESC::tpe_pair_pts(geom.Position(i), centerOfMass, tangent, geom.dualLength(i), totalMass, alpha, beta);
     }
 
-    void BVHNode3D::accumulateTPEGradient(Eigen::MatrixXd &gradients, CurveVertex* &i_pt,
+    void BVHNode3D::accumulateTPEGradient(Eigen::MatrixXd &gradients, int i,
     PolyCurveNetwork* curves, double alpha, double beta) {
+        PROFILE_COUNT(TreeNodesVisited, 1);
+        const CurveGeometry &geom = curves->Geometry();
+        // The terms involving i depend on i (k = -1 below) and its neighbors
+        int iStart = geom.adjStart[i];
+        int iDegree = geom.Degree(i);
+
         if (isEmpty) {
             return;
         }
         else if (isLeaf) {
+            PROFILE_COUNT(KernelEvaluations, 2 * (iDegree + 1));
             // With a vertex, we add gradient terms the same way as usual
             if (body.type == BodyType::Vertex) {
                 // If this is a leaf, then it only has one vertex in it, so just use it
-                CurveVertex* j_pt = curves->GetVertex(body.elementIndex);
+                int j = body.elementIndex;
                 // Don't sum if it's the same vertex
-                if (j_pt == i_pt) return;
-
-                // Add i and neighbors of i
-                std::vector<CurveVertex*> i_pts;
-                i_pts.push_back(i_pt);
-                for (int e = 0; e < i_pt->numEdges(); e++) {
-                    i_pts.push_back(i_pt->edge(e)->Opposite(i_pt));
-                }
-
-                // Add j and neighbors of j
-                std::vector<CurveVertex*> j_pts;
-                j_pts.push_back(j_pt);
-                for (int e = 0; e < j_pt->numEdges(); e++) {
-                    j_pts.push_back(j_pt->edge(e)->Opposite(j_pt));
-                }
-
-                for (CurveVertex* i_n : i_pts) {
-                    AddToRow(gradients, i_n->GlobalIndex(), TPESC::tpe_grad(i_pt, j_pt, alpha, beta, i_n));
-                    bool noOverlap = true;
-                    // Avoid double-counting on the reverse terms with these checks
-                    for (CurveVertex* j_n : j_pts) {
-                        if (i_n == j_n) noOverlap = false;
+                if (j == i) return;
+
+                for (int k = -1; k < iDegree; k++) {
+                    int i_n = (k < 0) ? i : geom.adjVert[iStart + k];
+                    AddToRow(gradients, i_n, TPESC::tpe_grad(geom, i, j, alpha, beta, i_n));
+                    // Avoid double-counting on the reverse terms, which the
+                    // traversal from j already adds for j and its neighbors
+                    bool noOverlap = (i_n != j);
+                    for (int m = geom.adjStart[j]; m < geom.adjStart[j + 1]; m++) {
+                        if (geom.adjVert[m] == i_n) noOverlap = false;
                     }
                     if (noOverlap) {
-                        AddToRow(gradients, i_n->GlobalIndex(), TPESC::tpe_grad(j_pt, i_pt, alpha, beta, i_n));
+                        AddToRow(gradients, i_n, TPESC::tpe_grad(geom, j, i, alpha, beta, i_n));
                     }
                 }
             }
@@ -451,21 +476,16 @@ namespace LWS {
             else if (body.type == BodyType::Edge) {
                 Vector3 tangent = body.pt.tangent;
                 tangent = tangent.normalize();
+                CurveVertex* i_pt = curves->GetVertex(i);
                 CurveEdge* e = curves->GetEdge(body.elementIndex);
                 CurveVertex* j1 = e->prevVert;
                 CurveVertex* j2 = e->nextVert;
 
-                // Add i and neighbors of i
-                std::vector<CurveVertex*> i_pts;
-                i_pts.push_back(i_pt);
-                for (int e = 0; e < i_pt->numEdges(); e++) {
-                    i_pts.push_back(i_pt->edge(e)->Opposite(i_pt));
-                }
-
                 TangentMassPoint jm{tangent, body.mass, body.pt.position, j1, j2};
 
                 if (i_pt != j1 && i_pt != j2) {
-                    for (CurveVertex* i_n : i_pts) {
+                    for (int k = -1; k < iDegree; k++) {
+                        CurveVertex* i_n = curves->GetVertex((k < 0) ? i : geom.adjVert[iStart + k]);
                         AddToRow(gradients, i_n->GlobalIndex(), TPESC::tpe_grad(i_pt, jm, alpha, beta, i_n));
                         AddToRow(gradients, i_n->GlobalIndex(), TPESC::tpe_grad(jm, i_pt, alpha, beta, i_n));
                     }
@@ -473,30 +493,25 @@ namespace LWS {
             }
         }
         else {
-            if (shouldUseCell(i_pt->Position())) {
+            if (shouldUseCell(geom.Position(i), alpha, beta)) {
                 Vector3 tangent = averageTangent;
                 tangent = tangent.normalize();
                 // This cell is far enough away that we can treat it as a single body
                 TangentMassPoint j{tangent, totalMass, centerOfMass, 0, 0};
-
-                // Add i and neighbors of i
-                std::vector<CurveVertex*> i_pts;
-                i_pts.push_back(i_pt);
-                for (int e = 0; e < i_pt->numEdges(); e++) {
-                    i_pts.push_back(i_pt->edge(e)->Opposite(i_pt));
-                }
+                PROFILE_COUNT(KernelEvaluations, 2 * (iDegree + 1));
 
                 // Differentiate both terms for previous, middle, and next
-                for (CurveVertex* i_n : i_pts) {
-                    AddToRow(gradients, i_n->GlobalIndex(), TPESC::tpe_grad(i_pt, j, alpha, beta, i_n));
-                    AddToRow(gradients, i_n->GlobalIndex(), TPESC::tpe_grad(j, i_pt, alpha, beta, i_n));
+                for (int k = -1; k < iDegree; k++) {
+                    int i_n = (k < 0) ? i : geom.adjVert[iStart + k];
+                    AddToRow(gradients, i_n, TPESC::tpe_grad(geom, i, j, alpha, beta, i_n));
+                    AddToRow(gradients, i_n, TPESC::tpe_grad(geom, j, i, alpha, beta, i_n));
                 }
             }
             else {
                 // Otherwise we continue recursively traversing the tree
-                for (size_t i = 0; i < children.size(); i++) {
-                    if (children[i]) {
-                        children[i]->accumulateTPEGradient(gradients, i_pt, curves, alpha, beta);
+                for (size_t c = 0; c < children.size(); c++) {
+                    if (children[c]) {
+                        children[c]->accumulateTPEGradient(gradients, i, curves, alpha, beta);
                     }
                 }
             }
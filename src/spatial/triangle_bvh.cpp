@@ -0,0 +1,175 @@
+#include "spatial/triangle_bvh.h"
+#include "spatial/tpe_bvh.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace LWS {
+
+    namespace {
+        // Triangles per leaf
+        const int leafSize = 4;
+        // Nodes are split at the median, so the depth stays near log2(triangles / leafSize)
+        const int maxStackDepth = 128;
+        // Times a nearby triangle may be split into four before falling back to quadrature
+        const int maxSubdivisions = 4;
+
+        // Degree-4 symmetric rule (Dunavant): two orbits of three points each
+        const double quadWeights[2] = {0.223381589678011, 0.109951743655322};
+        const double quadCoords[2][2] = {{0.108103018168070, 0.445948490915965},
+                                         {0.816847572980459, 0.091576213509771}};
+
+        inline void addSample(Vector3 sample, double mass, Vector3 point, double p, double &energy, Vector3 &gradient) {
+            Vector3 diff = sample - point;
+            double d2 = norm2(diff);
+            if (d2 == 0) return;
+            double inv = mass / pow(d2, p / 2);
+            energy += inv;
+            // Derivative of 1 / |x - y|^p with respect to x
+            gradient += diff * (p * inv / d2);
+        }
+    }
+
+    double TriangleBVH::errorTarget = 1.0 / 64;
+
+    TriangleBVH::TriangleBVH(const std::vector<Vector3> &positions, const std::vector<std::array<size_t, 3>> &triangles) {
+        tris.reserve(triangles.size());
+        for (const std::array<size_t, 3> &t : triangles) {
+            Triangle tri;
+            tri.a = positions[t[0]];
+            tri.b = positions[t[1]];
+            tri.c = positions[t[2]];
+            tri.centroid = (tri.a + tri.b + tri.c) / 3;
+            tri.area = norm(cross(tri.b - tri.a, tri.c - tri.a)) / 2;
+            tris.push_back(tri);
+        }
+        nodes.reserve(2 * tris.size() / leafSize + 1);
+        if (!tris.empty()) {
+            nodes.push_back(Node());
+            build(0, 0, tris.size());
+        }
+    }
+
+    void TriangleBVH::build(int index, int start, int count) {
+        Vector3 boxMin = tris[start].a;
+        Vector3 boxMax = tris[start].a;
+        Vector3 centerMin = tris[start].centroid;
+        Vector3 centerMax = tris[start].centroid;
+        Vector3 weighted{0, 0, 0};
+        double mass = 0;
+        for (int i = start; i < start + count; i++) {
+            const Triangle &t = tris[i];
+            for (const Vector3 &v : {t.a, t.b, t.c}) {
+                boxMin = vector_min(boxMin, v);
+                boxMax = vector_max(boxMax, v);
+            }
+            centerMin = vector_min(centerMin, t.centroid);
+            centerMax = vector_max(centerMax, t.centroid);
+            weighted += t.area * t.centroid;
+            mass += t.area;
+        }
+
+        Node node;
+        node.mass = mass;
+        // Fall back to the box center for degenerate (zero-area) clusters
+        node.center = (mass > 0) ? weighted / mass : (boxMin + boxMax) / 2;
+        node.radius = norm(boxMax - boxMin) / 2;
+        node.start = start;
+        node.count = count;
+        node.left = -1;
+
+        if (count > leafSize) {
+            // Split at the median centroid along the longest axis
+            Vector3 extent = centerMax - centerMin;
+            int axis = (extent.x > extent.y) ? ((extent.x > extent.z) ? 0 : 2) : ((extent.y > extent.z) ? 1 : 2);
+            int half = count / 2;
+            std::nth_element(tris.begin() + start, tris.begin() + start + half, tris.begin() + start + count,
+                [axis](const Triangle &t1, const Triangle &t2) {
+                    return t1.centroid[axis] < t2.centroid[axis];
+                });
+
+            // Reserve both children next to each other, then fill them in
+            node.left = nodes.size();
+            nodes.push_back(Node());
+            nodes.push_back(Node());
+            nodes[index] = node;
+            build(node.left, start, half);
+            build(node.left + 1, start + half, count - half);
+        }
+        else {
+            nodes[index] = node;
+        }
+    }
+
+    double TriangleBVH::Energy(Vector3 point, double p) const {
+        double energy = 0;
+        Vector3 gradient{0, 0, 0};
+        Evaluate(point, p, energy, gradient);
+        return energy;
+    }
+
+    Vector3 TriangleBVH::Gradient(Vector3 point, double p) const {
+        double energy = 0;
+        Vector3 gradient{0, 0, 0};
+        Evaluate(point, p, energy, gradient);
+        return gradient;
+    }
+
+    void TriangleBVH::Evaluate(Vector3 point, double p, double &energy, Vector3 &gradient) const {
+        if (nodes.empty()) return;
+        int stack[maxStackDepth];
+        int top = 0;
+        stack[top++] = 0;
+
+        while (top > 0) {
+            const Node &node = nodes[stack[--top]];
+            double d = norm(node.center - point);
+            double s = node.radius / d;
+            if (s < 1 && BVHNode3D::FarFieldError(s, 0, 0, p) < errorTarget) {
+                addSample(node.center, node.mass, point, p, energy, gradient);
+            }
+            else if (node.left < 0) {
+                for (int i = node.start; i < node.start + node.count; i++) {
+                    const Triangle &t = tris[i];
+                    integrateTriangle(t.a, t.b, t.c, t.area, point, p, 0, energy, gradient);
+                }
+            }
+            else {
+                stack[top++] = node.left;
+                stack[top++] = node.left + 1;
+            }
+        }
+    }
+
+    void TriangleBVH::integrateTriangle(Vector3 a, Vector3 b, Vector3 c, double area, Vector3 point, double p, int depth,
+    double &energy, Vector3 &gradient) const {
+        Vector3 centroid = (a + b + c) / 3;
+        double r = fmax(norm(a - centroid), fmax(norm(b - centroid), norm(c - centroid)));
+        double d = norm(centroid - point);
+
+        if (r < d && BVHNode3D::FarFieldError(r / d, 0, 0, p) < errorTarget) {
+            addSample(centroid, area, point, p, energy, gradient);
+        }
+        else if (depth < maxSubdivisions) {
+            Vector3 ab = (a + b) / 2;
+            Vector3 bc = (b + c) / 2;
+            Vector3 ca = (c + a) / 2;
+            double quarter = area / 4;
+            integrateTriangle(a, ab, ca, quarter, point, p, depth + 1, energy, gradient);
+            integrateTriangle(ab, b, bc, quarter, point, p, depth + 1, energy, gradient);
+            integrateTriangle(ca, bc, c, quarter, point, p, depth + 1, energy, gradient);
+            integrateTriangle(ab, bc, ca, quarter, point, p, depth + 1, energy, gradient);
+        }
+        else {
+            for (int orbit = 0; orbit < 2; orbit++) {
+                double u = quadCoords[orbit][0];
+                double v = quadCoords[orbit][1];
+                double w = quadWeights[orbit] * area;
+                addSample(u * a + v * b + v * c, w, point, p, energy, gradient);
+                addSample(v * a + u * b + v * c, w, point, p, energy, gradient);
+                addSample(v * a + v * b + u * c, w, point, p, energy, gradient);
+            }
+        }
+    }
+}
@@ -636,4 +636,142 @@ namespace LWS {
         }
     }
 
-}
\ No newline at end of file
+    namespace {
+        // One side of an energy term: a curve vertex, or a cluster if vertex is -1
+        struct KernelPoint {
+            Vector3 position;
+            Vector3 tangent;
+            double mass;
+            int vertex;
+        };
+
+        inline KernelPoint vertexPoint(const CurveGeometry &geom, int v) {
+            return KernelPoint{geom.Position(v), geom.VertexTangent(v), geom.dualLength(v), v};
+        }
+
+        inline KernelPoint clusterPoint(const TangentMassPoint &p) {
+            return KernelPoint{p.point, p.tangent, p.mass, -1};
+        }
+
+        // Gradient of K_f(x, y) * l_x * l_y with respect to the vertex wrt, following
+        // the same steps as tpe_grad, tpe_grad_Kf, grad_norm_proj_alpha and
+        // grad_tangent_proj do for CurveVertex arguments
+        Vector3 kernelGradient(const CurveGeometry &geom, const KernelPoint &x, const KernelPoint &y,
+        double alpha, double beta, int wrt) {
+            Vector3 zero{0, 0, 0};
+            Vector3 disp = x.position - y.position;
+            Vector3 T_x = x.tangent;
+            Vector3 unit_disp = disp;
+            unit_disp = unit_disp.normalize();
+
+            double disp_dot_T = dot(disp, T_x);
+            Vector3 normal_proj = disp - disp_dot_T * T_x;
+            double proj_len = norm(normal_proj);
+            double dist = norm(disp);
+            double A = pow(proj_len, alpha);
+            double B = pow(dist, beta);
+
+            // Moving x moves the displacement forward, and moving y moves it back
+            double dispSign = (wrt == x.vertex) ? 1 : ((wrt == y.vertex) ? -1 : 0);
+
+            Vector3 deriv_A = zero;
+            if (proj_len >= 1e-10) {
+                VertJacobian deriv_T{zero, zero, zero};
+                if (x.vertex >= 0) deriv_T = TPESC::vertex_tangent_wrt_vert(geom, x.vertex, wrt);
+
+                // Derivative of <f(x) - f(y), T> * T
+                Vector3 deriv_inner = dispSign * T_x + deriv_T.LeftMultiply(disp);
+                VertJacobian deriv_T_inner = outer_product_to_jacobian(T_x, deriv_inner) + disp_dot_T * deriv_T;
+                VertJacobian deriv_disp{Vector3{dispSign, 0, 0}, Vector3{0, dispSign, 0}, Vector3{0, 0, dispSign}};
+
+                double alpha_deriv = alpha * pow(proj_len, alpha - 1);
+                deriv_A = alpha_deriv * (deriv_disp - deriv_T_inner).LeftMultiply(normal_proj / proj_len);
+            }
+            Vector3 deriv_B = dispSign * beta * pow(dist, beta - 1) * unit_disp;
+
+            Vector3 grad_Kf = (deriv_A * B - A * deriv_B) / (B * B);
+            double Kf = A / B;
+
+            Vector3 grad_lx = (x.vertex >= 0) ? TPESC::length_wrt_vert(geom, x.vertex, wrt) : zero;
+            Vector3 grad_ly = (y.vertex >= 0) ? TPESC::length_wrt_vert(geom, y.vertex, wrt) : zero;
+            Vector3 prod_rule = grad_lx * y.mass + x.mass * grad_ly;
+            return grad_Kf * x.mass * y.mass + Kf * prod_rule;
+        }
+    }
+
+    double TPESC::tpe_pair(const CurveGeometry &geom, int i, int j, double alpha, double beta) {
+        if (i == j || geom.Degree(i) > 2) return 0;
+        double kfxy = tpe_Kf_pts(geom.Position(i), geom.Position(j), geom.VertexTangent(i), alpha, beta);
+        return geom.dualLength(i) * geom.dualLength(j) * kfxy;
+    }
+
+    Vector3 TPESC::tpe_grad(const CurveGeometry &geom, int x, int y, double alpha, double beta, int wrt) {
+        if (x == y || geom.Degree(x) > 2) return Vector3{0, 0, 0};
+        return kernelGradient(geom, vertexPoint(geom, x), vertexPoint(geom, y), alpha, beta, wrt);
+    }
+
+    Vector3 TPESC::tpe_grad(const CurveGeometry &geom, int x, const TangentMassPoint &y, double alpha, double beta, int wrt) {
+        return kernelGradient(geom, vertexPoint(geom, x), clusterPoint(y), alpha, beta, wrt);
+    }
+
+    Vector3 TPESC::tpe_grad(const CurveGeometry &geom, const TangentMassPoint &x, int y, double alpha, double beta, int wrt) {
+        return kernelGradient(geom, clusterPoint(x), vertexPoint(geom, y), alpha, beta, wrt);
+    }
+
+    Vector3 TPESC::length_wrt_vert(const CurveGeometry &geom, int lengthVert, int wrt) {
+        Vector3 sumDirections{0, 0, 0};
+        for (int k = geom.adjStart[lengthVert]; k < geom.adjStart[lengthVert + 1]; k++) {
+            int e = geom.adjEdge[k];
+            // Unit vector from lengthVert towards the other endpoint
+            Vector3 outward = (geom.edgePrev[e] == lengthVert) ? geom.EdgeTangent(e) : -geom.EdgeTangent(e);
+            if (lengthVert == wrt) sumDirections += outward;
+            else if (geom.adjVert[k] == wrt) return outward / 2;
+        }
+        // Differentiating wrt itself, both sides count
+        return -0.5 * sumDirections;
+    }
+
+    VertJacobian TPESC::edge_tangent_wrt_vert(const CurveGeometry &geom, int edge, int wrtVert) {
+        Vector3 zero{0, 0, 0};
+        bool isPrev = (geom.edgePrev[edge] == wrtVert);
+        if (!isPrev && geom.edgeNext[edge] != wrtVert) {
+            return VertJacobian{zero, zero, zero};
+        }
+
+        // (I - T T^T) / length, negated for the tail vertex
+        Vector3 t = geom.EdgeTangent(edge);
+        VertJacobian I{Vector3{1, 0, 0}, Vector3{0, 1, 0}, Vector3{0, 0, 1}};
+        double scale = (isPrev ? -1.0 : 1.0) / geom.length(edge);
+        return (I - outer_product_to_jacobian(t, t)) * scale;
+    }
+
+    VertJacobian TPESC::vertex_tangent_wrt_vert(const CurveGeometry &geom, int tangentVert, int wrtVert) {
+        Vector3 zero{0, 0, 0};
+        int start = geom.adjStart[tangentVert];
+        int degree = geom.Degree(tangentVert);
+
+        if (degree == 1) {
+            return edge_tangent_wrt_vert(geom, geom.adjEdge[start], wrtVert);
+        }
+        else if (degree != 2) {
+            return VertJacobian{zero, zero, zero};
+        }
+
+        int prevEdge = geom.adjEdge[start];
+        int nextEdge = geom.adjEdge[start + 1];
+
+        Vector3 sumTangents = geom.EdgeTangent(prevEdge) + geom.EdgeTangent(nextEdge);
+        double normSum = norm(sumTangents);
+        Vector3 vertTangent = sumTangents / normSum;
+
+        // Quotient rule on (T1 + T2) / |T1 + T2|
+        VertJacobian derivSumTs = edge_tangent_wrt_vert(geom, prevEdge, wrtVert)
+            + edge_tangent_wrt_vert(geom, nextEdge, wrtVert);
+
+        Vector3 derivNorm = derivSumTs.LeftMultiply(vertTangent);
+        VertJacobian deriv_A_B = derivSumTs * normSum;
+        VertJacobian A_deriv_B = outer_product_to_jacobian(sumTangents, derivNorm);
+
+        return (deriv_A_B - A_deriv_B) * (1.0 / (normSum * normSum));
+    }
+}
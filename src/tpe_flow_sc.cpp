@@ -1,11 +1,20 @@
 #include "tpe_flow_sc.h"
 #include "utils.h"
+#include "profiler.h"
+#include "lws_options.h"
 #include "product/dense_matrix.h"
 
 #include "circle_search.h"
+#include "flow/flow_checkpoint.h"
+
+#include <omp.h>
 
 namespace LWS {
 
+    namespace {
+        const int maxLineSearchCandidates = 4;
+    }
+
     TPEFlowSolverSC::TPEFlowSolverSC(PolyCurveNetwork* g, double a, double b) : constraint(g)
     {
         curveNetwork = g;
@@ -15,8 +24,16 @@ namespace LWS {
         backproj_threshold = 1e-4;
         iterNum = 0;
         lastStepSize = 0;
+        lastLineSearchEvals = 0;
+        numEnergyEvals = 0;
+        numGradientEvals = 0;
+        targetLength = 0;
+        lengthScaleStep = 0;
 
-        mg_tolerance = 1e-2;
+        mg_tolerance = solveTolerance.Current();
+        lastRelativeDecrease = -1;
+        mgProductsAtStart = 0;
+        mgIterationsSaved = 0;
 
         double averageLength = g->TotalLength();
         averageLength /= g->NumEdges();
@@ -34,6 +51,14 @@ namespace LWS {
             delete obstacles[i];
         }
         obstacles.clear();
+        clearTrialCurves();
+    }
+
+    void TPEFlowSolverSC::clearTrialCurves() {
+        for (PolyCurveNetwork* c : trialCurves) {
+            delete c;
+        }
+        trialCurves.clear();
     }
 
     void TPEFlowSolverSC::UpdateTargetLengths() {
@@ -42,6 +67,11 @@ namespace LWS {
 
     void TPEFlowSolverSC::ReplaceCurve(PolyCurveNetwork* new_p) {
         curveNetwork = new_p;
+        clearTrialCurves();
+        lbfgs.Clear();
+        lbfgsPrevPositions.resize(0);
+        solveTolerance.Reset();
+        lastRelativeDecrease = -1;
         constraint = ConstraintClassType(curveNetwork);
         UpdateTargetLengths();
         if (useEdgeLengthScale) {
@@ -50,6 +80,47 @@ namespace LWS {
         }
     }
 
+    void TPEFlowSolverSC::ReplaceCurve(PolyCurveNetwork* new_p, Eigen::SparseMatrix<double> &edgeTransfer) {
+        // Remember where each constraint's targets were on the old curve
+        Eigen::VectorXd oldTargets = constraintTargets;
+        std::vector<int> oldStarts, oldRows;
+        for (ConstraintType type : curveNetwork->appliedConstraints) {
+            oldStarts.push_back(constraint.startIndexOfConstraint(type));
+            oldRows.push_back(constraint.rowsOfConstraint(type));
+        }
+        // The remeshed curve is the same shape, so the tolerance controller's
+        // gradient norm and decrease history still apply to it
+        SolveTolerance oldTolerance = solveTolerance;
+        double oldRelativeDecrease = lastRelativeDecrease;
+        int droppedPairs = lbfgs.NumPairs();
+
+        ReplaceCurve(new_p);
+
+        solveTolerance = oldTolerance;
+        mg_tolerance = solveTolerance.Current();
+        lastRelativeDecrease = oldRelativeDecrease;
+        // The L-BFGS pairs are vectors over the old vertices, and there is no
+        // vertex map to carry them over with
+        if (droppedPairs > 0) {
+            std::cout << "Remeshing dropped " << droppedPairs
+                << " L-BFGS pairs; the next step starts over from the Sobolev gradient" << std::endl;
+        }
+
+        // Carry the old targets over, instead of taking the new curve's current values.
+        // Pins keep their order when remeshing, and surface targets are always zero.
+        for (size_t i = 0; i < curveNetwork->appliedConstraints.size(); i++) {
+            ConstraintType type = curveNetwork->appliedConstraints[i];
+            int start = constraint.startIndexOfConstraint(type);
+            int rows = constraint.rowsOfConstraint(type);
+            if (type == ConstraintType::EdgeLengths) {
+                constraintTargets.segment(start, rows) = edgeTransfer * oldTargets.segment(oldStarts[i], oldRows[i]);
+            }
+            else if (type != ConstraintType::Surface && rows == oldRows[i]) {
+                constraintTargets.segment(start, rows) = oldTargets.segment(oldStarts[i], rows);
+            }
+        }
+    }
+
     void TPEFlowSolverSC::EnablePerformanceLog(std::string logFile) {
         perfFile.open(logFile);
         perfLogEnabled = true;
@@ -60,6 +131,62 @@ namespace LWS {
         perfFile.close();
     }
 
+    void TPEFlowSolverSC::FillCheckpoint(FlowCheckpoint &cp) {
+        Checkpoint::FillFromCurve(curveNetwork, cp);
+        cp.constraintTargets = constraintTargets;
+        cp.alpha = alpha;
+        cp.beta = beta;
+        cp.targetLength = targetLength;
+        cp.lengthScaleStep = lengthScaleStep;
+        cp.useEdgeLengthScale = useEdgeLengthScale;
+        cp.useTotalLengthScale = useTotalLengthScale;
+        cp.lastStepSize = lastStepSize;
+        cp.mg_backproj_threshold = mg_backproj_threshold;
+        cp.iterNum = iterNum;
+        cp.solveTolerance = solveTolerance.Current();
+        cp.solveToleranceFirstGradNorm = solveTolerance.FirstGradientNorm();
+        cp.lastRelativeDecrease = lastRelativeDecrease;
+
+        cp.lbfgsMaxPairs = lbfgs.MaxPairs();
+        cp.lbfgsSteps.clear();
+        cp.lbfgsGradientChanges.clear();
+        for (int i = 0; i < lbfgs.NumPairs(); i++) {
+            cp.lbfgsSteps.push_back(lbfgs.Step(i));
+            cp.lbfgsGradientChanges.push_back(lbfgs.GradientChange(i));
+        }
+        cp.lbfgsPrevPositions = lbfgsPrevPositions;
+        cp.lbfgsPrevGradient = lbfgsPrevGradient;
+    }
+
+    bool TPEFlowSolverSC::RestoreCheckpoint(FlowCheckpoint &cp) {
+        if (cp.constraintTargets.rows() != constraint.NumConstraintRows()) {
+            return false;
+        }
+        constraintTargets = cp.constraintTargets;
+        alpha = cp.alpha;
+        beta = cp.beta;
+        targetLength = cp.targetLength;
+        lengthScaleStep = cp.lengthScaleStep;
+        useEdgeLengthScale = cp.useEdgeLengthScale;
+        useTotalLengthScale = cp.useTotalLengthScale;
+        lastStepSize = cp.lastStepSize;
+        mg_backproj_threshold = cp.mg_backproj_threshold;
+        iterNum = cp.iterNum;
+        solveTolerance.Restore(cp.solveTolerance, cp.solveToleranceFirstGradNorm);
+        mg_tolerance = solveTolerance.Current();
+        lastRelativeDecrease = cp.lastRelativeDecrease;
+
+        // The pairs are replayed oldest first, so the history ends up in the same order
+        lbfgs = LBFGSHistory(std::max(cp.lbfgsMaxPairs, 1));
+        for (size_t i = 0; i < cp.lbfgsSteps.size(); i++) {
+            lbfgs.AddPair(cp.lbfgsSteps[i], cp.lbfgsGradientChanges[i]);
+        }
+        lbfgsPrevPositions = cp.lbfgsPrevPositions;
+        lbfgsPrevGradient = cp.lbfgsPrevGradient;
+        std::cout << "Resumed solver at iteration " << iterNum << " (last step size " << lastStepSize << ")" << std::endl;
+        return true;
+    }
+
     void TPEFlowSolverSC::SetTotalLengthScaleTarget(double scale) {
         useTotalLengthScale = true;
         int startIndex = constraint.startIndexOfConstraint(ConstraintType::TotalLength);
@@ -90,17 +217,24 @@ namespace LWS {
     }
 
     double TPEFlowSolverSC::CurrentEnergy(SpatialTree *root) {
+        return curveEnergy(curveNetwork, root);
+    }
+
+    double TPEFlowSolverSC::curveEnergy(PolyCurveNetwork* curves, SpatialTree *root) {
         double energy = 0;
+        // Line search candidates call this concurrently
+        #pragma omp atomic
+        numEnergyEvals++;
 
-        if (root) energy = TPEnergyBH(root);
-        else energy = TPEnergyDirect();
+        if (root) energy = SpatialTree::TPEnergyBH(curves, root, alpha, beta);
+        else energy = TPESC::tpe_total(curves, alpha, beta);
 
         for (CurvePotential* p : potentials) {
-            energy += p->CurrentValue(curveNetwork);
+            energy += p->CurrentValue(curves);
         }
 
         for (Obstacle* obs : obstacles) {
-            energy += obs->ComputeEnergy(curveNetwork);
+            energy += obs->ComputeEnergy(curves);
         }
 
         return energy;
@@ -125,6 +259,7 @@ namespace LWS {
     }
 
     void TPEFlowSolverSC::AddAllGradients(SpatialTree *tree_root, Eigen::MatrixXd &vertGradients) {
+        numGradientEvals++;
         // Barnes-Hut for gradient accumulation
         if (tree_root) {
             FillGradientVectorBH(tree_root, vertGradients);
@@ -157,6 +292,7 @@ namespace LWS {
             CurveVertex* pt = curveNetwork->GetVertex(i);
             pt->SetPosition(pt->Position() - h * SelectRow(gradients, i));
         }
+        curveNetwork->UpdateGeometry();
         return true;
     }
 
@@ -166,13 +302,15 @@ namespace LWS {
 
     void TPEFlowSolverSC::RestoreOriginalPositions() {
         curveNetwork->positions = originalPositionMatrix;
+        curveNetwork->UpdateGeometry();
     }
 
     void TPEFlowSolverSC::SetGradientStep(Eigen::MatrixXd &gradient, double delta) {
-        curveNetwork->positions = originalPositionMatrix - delta * gradient;
+        curveNetwork->positions.noalias() = originalPositionMatrix - delta * gradient;
+        curveNetwork->UpdateGeometry();
     }
 
-    double TPEFlowSolverSC::LineSearchStep(Eigen::MatrixXd &gradient, double gradDot, BVHNode3D* root, bool resetStep) {
+    double TPEFlowSolverSC::LineSearchStep(Eigen::MatrixXd &gradient, double gradDot, BVHNode3D* root, bool resetStep, double slope) {
         double gradNorm = gradient.norm();
         //std::cout << "Norm of gradient = " << gradNorm << std::endl;
         double initGuess = (gradNorm > 1) ? 1.0 / gradNorm : 1.0 / sqrt(gradNorm);
@@ -181,14 +319,36 @@ namespace LWS {
             initGuess = fmin(lastStepSize * 1.5, initGuess * 4);
         }
         std::cout << "  Starting line search with initial guess " << initGuess << std::endl;
-        return LineSearchStep(gradient, initGuess, 0, gradDot, root);
+        return LineSearchStep(gradient, initGuess, 0, gradDot, root, slope);
+    }
+
+    // Minimizer of the quadratic or cubic through the energy and slope at 0
+    // and the energies at the last one or two trial steps, kept within
+    // [0.1, 0.5] of the current step so that a bad fit can't stall the search
+    // (Nocedal and Wright, section 3.5).
+    inline double interpolateStep(double e0, double slope0, double delta, double e, double prevDelta, double prevE) {
+        double next;
+        if (prevDelta <= 0) {
+            next = -slope0 * delta * delta / (2 * (e - e0 - slope0 * delta));
+        }
+        else {
+            double r1 = e - e0 - slope0 * delta;
+            double r0 = prevE - e0 - slope0 * prevDelta;
+            double denom = delta * delta * prevDelta * prevDelta * (delta - prevDelta);
+            double a = (prevDelta * prevDelta * r1 - delta * delta * r0) / denom;
+            double b = (-prevDelta * prevDelta * prevDelta * r1 + delta * delta * delta * r0) / denom;
+            if (a == 0) next = -slope0 / (2 * b);
+            else next = (-b + sqrt(b * b - 3 * a * slope0)) / (3 * a);
+        }
+        if (!std::isfinite(next)) return delta / 2;
+        return fmin(fmax(next, 0.1 * delta), 0.5 * delta);
     }
 
     double TPEFlowSolverSC::LineSearchStep(Eigen::MatrixXd &gradient, double initGuess, int doublingLimit,
-    double gradDot, BVHNode3D* root) {
+    double gradDot, BVHNode3D* root, double slope) {
+        PROFILE_SCOPE("Line search");
         double delta = initGuess;
-        // Save initial positions
-        SaveCurrentPositions();
+        lastLineSearchEvals = 0;
 
         double initialEnergy = CurrentEnergy(root);
         double gradNorm = gradient.norm();
@@ -198,9 +358,29 @@ namespace LWS {
 
         if (gradNorm < 1e-10) {
             std::cout << "  Gradient is very close to zero" << std::endl;
+            // Backprojection still steps from the saved positions
+            SaveCurrentPositions();
+            lastRelativeDecrease = 0;
             return 0;
         }
 
+        // Save initial positions. Every trial overwrites all of the positions,
+        // so the current matrix can be swapped out rather than copied.
+        originalPositionMatrix.swap(curveNetwork->positions);
+        curveNetwork->positions.resize(originalPositionMatrix.rows(), originalPositionMatrix.cols());
+
+        // Derivative of the energy along -gradient; without one from the caller,
+        // gradient is taken to be the L2 gradient itself
+        if (slope <= 0) slope = gradDot * gradNorm * gradNorm;
+        double prevDelta = 0, prevEnergy = 0, acceptedEnergy = initialEnergy;
+
+        // Past four candidates (down to delta / 8), extra candidates are rarely
+        // the accepted one, but each takes threads away from every evaluation
+        int numCandidates = std::min(std::min(LWSOptions::lineSearchCandidates, maxLineSearchCandidates), omp_get_max_threads());
+        if (numCandidates > 1 && doublingLimit == 0) {
+            return parallelLineSearch(gradient, initGuess, initialEnergy, slope, root, numCandidates);
+        }
+
         // std::cout << "Initial energy " << initialEnergy << std::endl;
 
         while (delta > ls_step_threshold) {
@@ -210,27 +390,41 @@ namespace LWS {
                 root->recomputeCentersOfMass(curveNetwork);
             }
             newEnergy = CurrentEnergy(root);
+            lastLineSearchEvals++;
 
             double decrease = initialEnergy - newEnergy;
-            double targetDecrease = sigma * delta * gradNorm * gradDot;
+            double targetDecrease = sigma * delta * slope;
 
-            // If the energy hasn't decreased enough to meet the Armijo condition,
-            // halve the step size.
-            if (decrease < targetDecrease) {
+            // A doubled step that fails falls back to the step it doubled, which
+            // already met the Armijo condition
+            if (!(decrease >= targetDecrease) && numDoubles > 0 && numBacktracks == 0) {
                 delta /= 2;
+                SetGradientStep(gradient, delta);
+                if (root) {
+                    root->recomputeCentersOfMass(curveNetwork);
+                }
+                newEnergy = acceptedEnergy;
+                break;
+            }
+            // If the energy hasn't decreased enough to meet the Armijo condition,
+            // shrink the step to the minimizer of an interpolant of the energies
+            // seen so far.
+            else if (!(decrease >= targetDecrease)) {
+                double next = std::isfinite(newEnergy) ?
+                    interpolateStep(initialEnergy, -slope, delta, newEnergy, prevDelta, prevEnergy) : delta / 2;
+                prevDelta = delta;
+                prevEnergy = newEnergy;
+                delta = next;
                 numBacktracks++;
+                PROFILE_COUNT(LineSearchBacktracks, 1);
             }
-            else if (decrease >= targetDecrease && numBacktracks == 0 && numDoubles < doublingLimit) {
+            else if (numBacktracks == 0 && numDoubles < doublingLimit) {
+                acceptedEnergy = newEnergy;
                 delta *= 2;
                 numDoubles++;
             }
-            // Otherwise, accept the current step.
+            // Otherwise, accept the current step, which is already in place.
             else {
-                SetGradientStep(gradient, delta);
-                if (root) {
-                    // Update the centers of mass to reflect the new positions
-                    root->recomputeCentersOfMass(curveNetwork);
-                }
                 break;
             }
         }
@@ -241,27 +435,119 @@ namespace LWS {
             // PlotEnergyInDirection(gradient, sigma * gradDot);
             // Restore initial positions if step size goes to 0
             RestoreOriginalPositions();
+            lastRelativeDecrease = 0;
             return 0;
         }
         else {
+            lastRelativeDecrease = (initialEnergy - newEnergy) / initialEnergy;
             std::cout << "  Energy: " << initialEnergy << " -> " << newEnergy
-                << " (step size " << delta << ", " << numBacktracks << " backtracks)" << std::endl;
+                << " (step size " << delta << ", " << numBacktracks << " backtracks, "
+                << lastLineSearchEvals << " evaluations)" << std::endl;
             return delta;
         }
     }
 
+    double TPEFlowSolverSC::parallelLineSearch(Eigen::MatrixXd &gradient, double initGuess, double initialEnergy,
+    double slope, BVHNode3D* root, int numCandidates) {
+        double sigma = 0.01f;
+
+        // Each candidate step gets its own copy of the curve, which persists
+        // across steps, and its own copy of the tree to refit
+        if (trialCurves.size() > 0 && (trialCurves[0]->NumVertices() != curveNetwork->NumVertices()
+            || trialCurves[0]->NumEdges() != curveNetwork->NumEdges())) {
+            clearTrialCurves();
+        }
+        if ((int)trialCurves.size() < numCandidates) {
+            FlowCheckpoint cp;
+            Checkpoint::FillFromCurve(curveNetwork, cp);
+            while ((int)trialCurves.size() < numCandidates) {
+                trialCurves.push_back(Checkpoint::CreateCurve(cp));
+            }
+        }
+        std::vector<BVHNode3D*> trialTrees(numCandidates, (BVHNode3D*)0);
+        if (root) {
+            for (int k = 0; k < numCandidates; k++) {
+                trialTrees[k] = root->CopyInto(&iterationArena);
+            }
+        }
+
+        std::vector<double> deltas(numCandidates), energies(numCandidates);
+        double delta = initGuess;
+        int numRounds = 0, accepted = -1;
+
+        // Split the threads between the candidates, so that each energy evaluation
+        // still runs in parallel rather than on the single thread of its candidate
+        int threadsPerCandidate = std::max(1, omp_get_max_threads() / numCandidates);
+        int savedActiveLevels = omp_get_max_active_levels();
+        omp_set_max_active_levels(std::max(savedActiveLevels, 2));
+
+        while (delta > ls_step_threshold) {
+            numRounds++;
+            // Try delta, delta / 2, delta / 4, ... at once
+            for (int k = 0; k < numCandidates; k++) {
+                deltas[k] = delta / (1 << k);
+            }
+
+            #pragma omp parallel for num_threads(numCandidates) schedule(static, 1)
+            for (int k = 0; k < numCandidates; k++) {
+                // Only affects parallel regions nested inside this candidate
+                omp_set_num_threads(threadsPerCandidate);
+                PolyCurveNetwork* trial = trialCurves[k];
+                trial->positions.noalias() = originalPositionMatrix - deltas[k] * gradient;
+                trial->UpdateGeometry();
+                if (trialTrees[k]) trialTrees[k]->recomputeCentersOfMass(trial);
+                energies[k] = curveEnergy(trial, trialTrees[k]);
+            }
+            lastLineSearchEvals += numCandidates;
+
+            // Take the largest step that meets the Armijo condition
+            for (int k = 0; k < numCandidates && accepted < 0; k++) {
+                double decrease = initialEnergy - energies[k];
+                if (decrease >= sigma * deltas[k] * slope) accepted = k;
+            }
+            if (accepted >= 0) break;
+
+            PROFILE_COUNT(LineSearchBacktracks, numCandidates);
+            int last = numCandidates - 1;
+            delta = std::isfinite(energies[last]) ? interpolateStep(initialEnergy, -slope, deltas[last], energies[last],
+                deltas[last - 1], energies[last - 1]) : deltas[last] / 2;
+        }
+
+        omp_set_max_active_levels(savedActiveLevels);
+        for (BVHNode3D* tree : trialTrees) {
+            if (tree) tree->~BVHNode3D();
+        }
+
+        if (accepted < 0) {
+            std::cout << "Failed to find a non-trivial step after " << numRounds << " rounds of "
+                << numCandidates << " candidates" << std::endl;
+            RestoreOriginalPositions();
+            lastRelativeDecrease = 0;
+            return 0;
+        }
+
+        // Take over the accepted candidate's positions
+        curveNetwork->positions.swap(trialCurves[accepted]->positions);
+        curveNetwork->UpdateGeometry();
+        if (root) root->recomputeCentersOfMass(curveNetwork);
+        lastRelativeDecrease = (initialEnergy - energies[accepted]) / initialEnergy;
+
+        std::cout << "  Energy: " << initialEnergy << " -> " << energies[accepted]
+            << " (step size " << deltas[accepted] << ", " << numRounds << " rounds of " << numCandidates
+            << " candidates, " << lastLineSearchEvals << " evaluations)" << std::endl;
+        return deltas[accepted];
+    }
+
     inline double alpha_of_delta(double delta, double alpha_0, double alpha_1, double R) {
         return (1.0 / R) * (alpha_0 * delta + alpha_1 * delta * delta);
     }
 
     void TPEFlowSolverSC::SetCircleStep(Eigen::MatrixXd &P_dot, Eigen::MatrixXd &K, double sqrt_G, double R, double alpha_delta) {
         curveNetwork->positions = originalPositionMatrix + R * (-P_dot * (sin(alpha_delta) / sqrt_G) + R * K * (1 - cos(alpha_delta)));
+        curveNetwork->UpdateGeometry();
     }
 
     double TPEFlowSolverSC::CircleSearchStep(Eigen::MatrixXd &P_dot, Eigen::MatrixXd &P_ddot, Eigen::MatrixXd &G, BVHNode3D* root) {
-        // Save initial positions
-        SaveCurrentPositions();
-        int nVerts = curveNetwork->NumVertices();
         int nRows = curveNetwork->NumVertices() * 3;
 
         // TODO: use only Gram matrix or full constraint matrix?
@@ -270,24 +556,136 @@ namespace LWS {
         Eigen::VectorXd P_ddot_vec(nRows);
         MatrixIntoVectorX3(P_ddot, P_ddot_vec);
 
-        double G_Pd_Pd = P_dot_vec.dot(G.block(0, 0, nRows, nRows) * P_dot_vec);
-        double G_Pd_Pdd = P_dot_vec.dot(G.block(0, 0, nRows, nRows) * P_ddot_vec);
+        Eigen::VectorXd G_Pd = G.block(0, 0, nRows, nRows) * P_dot_vec;
+        Eigen::VectorXd G_Pdd = G.block(0, 0, nRows, nRows) * P_ddot_vec;
+        return CircleSearchStep(P_dot, P_ddot, G_Pd, G_Pdd, root);
+    }
+
+    double TPEFlowSolverSC::CircleSearchStep(Eigen::MatrixXd &P_dot, Eigen::MatrixXd &P_ddot,
+    Eigen::VectorXd &G_Pd, Eigen::VectorXd &G_Pdd, BVHNode3D* root) {
+        PROFILE_SCOPE("Circle search");
+        int nVerts = curveNetwork->NumVertices();
+        int nRows = nVerts * 3;
+        lastLineSearchEvals = 0;
 
-        Eigen::VectorXd K_vec = 1.0 / G_Pd_Pd * (-P_ddot_vec + P_dot_vec * (G_Pd_Pdd / G_Pd_Pd));
-        double R = 1.0 / sqrt(K_vec.dot(G.block(0, 0, nRows, nRows) * K_vec));
+        Eigen::VectorXd P_dot_vec(nRows);
+        MatrixIntoVectorX3(P_dot, P_dot_vec);
+        Eigen::VectorXd P_ddot_vec(nRows);
+        MatrixIntoVectorX3(P_ddot, P_ddot_vec);
+
+        double G_Pd_Pd = P_dot_vec.dot(G_Pd);
+        double G_Pd_Pdd = P_dot_vec.dot(G_Pdd);
+        double G_Pdd_Pdd = P_ddot_vec.dot(G_Pdd);
+
+        // Curvature of the flow, and the radius of its osculating circle
+        double c = G_Pd_Pdd / G_Pd_Pd;
+        Eigen::VectorXd K_vec = 1.0 / G_Pd_Pd * (-P_ddot_vec + P_dot_vec * c);
+        double G_K_K = (G_Pdd_Pdd - c * G_Pd_Pdd) / (G_Pd_Pd * G_Pd_Pd);
+        double R = 1.0 / sqrt(G_K_K);
         double alpha_0 = sqrt(G_Pd_Pd);
         double alpha_1 = 0.5 * G_Pd_Pdd / alpha_0;
 
+        double delta = -2 * alpha_0 / alpha_1;
+        std::cout << "  Delta estimate = " << delta << " (radius " << R << ")" << std::endl;
+        if (!(G_Pd_Pd > 0) || !std::isfinite(R) || !(delta > 0) || !std::isfinite(delta)) {
+            return 0;
+        }
+
         Eigen::MatrixXd K(nVerts, 3);
         K.setZero();
         VectorXdIntoMatrix(K_vec, K);
 
-        double delta = -2 * alpha_0 / alpha_1;
-        std::cout << "Delta estimate = " << delta << std::endl;
-        delta = fmax(0, delta);
+        double initialEnergy = CurrentEnergy(root);
+        double sigma = 0.01;
+        SaveCurrentPositions();
 
-        SetCircleStep(P_dot, K, alpha_0, R, alpha_of_delta(delta, alpha_0, alpha_1, R));
-        return delta;
+        while (delta > ls_step_threshold && lastLineSearchEvals < 20) {
+            double angle = alpha_of_delta(delta, alpha_0, alpha_1, R);
+            // Past a quarter turn, the arc heads back towards where it started
+            if (angle > M_PI / 2) {
+                delta /= 2;
+                continue;
+            }
+            SetCircleStep(P_dot, K, alpha_0, R, angle);
+            if (root) {
+                root->recomputeCentersOfMass(curveNetwork);
+            }
+            double newEnergy = CurrentEnergy(root);
+            lastLineSearchEvals++;
+
+            // Near its start, the arc follows -P_dot, along which the energy decreases at rate G_Pd_Pd
+            if (initialEnergy - newEnergy >= sigma * delta * G_Pd_Pd) {
+                lastRelativeDecrease = (initialEnergy - newEnergy) / initialEnergy;
+                std::cout << "  Circle search: step size " << delta << ", angle " << angle
+                    << " (" << lastLineSearchEvals << " evaluations)" << std::endl;
+                return delta;
+            }
+            delta /= 2;
+        }
+
+        RestoreOriginalPositions();
+        if (root) {
+            root->recomputeCentersOfMass(curveNetwork);
+        }
+        return 0;
+    }
+
+    void TPEFlowSolverSC::differentiateSobolevRHS(Eigen::MatrixXd &P_dot, Eigen::MatrixXd &l2Gradient, BVHNode3D* root,
+    double epsilon, Eigen::VectorXd &rhs) {
+        int nVerts = curveNetwork->NumVertices();
+        rhs.setZero(3 * nVerts);
+
+        // Difference over a step that moves no vertex by more than a small fraction of an edge
+        double maxMove = 0;
+        for (int i = 0; i < nVerts; i++) {
+            maxMove = fmax(maxMove, P_dot.row(i).norm());
+        }
+        if (maxMove == 0) return;
+        double h = 1e-3 * curveNetwork->TotalLength() / (curveNetwork->NumEdges() * maxMove);
+
+        Eigen::VectorXd P_dot_vec(3 * nVerts);
+        MatrixIntoVectorX3(P_dot, P_dot_vec);
+        Eigen::VectorXd G_Pd, G_Pd_h;
+        G_Pd.setZero(3 * nVerts);
+        G_Pd_h.setZero(3 * nVerts);
+
+        double sep = LWSOptions::bctSeparation;
+        BVHNode3D* edgeTree = CreateEdgeBVHFromCurve(curveNetwork, &iterationArena);
+        {
+            BlockClusterTree bct(curveNetwork, edgeTree, sep, alpha, beta, epsilon, &iterationArena);
+            bct.SetBlockTreeMode(BlockTreeMode::Matrix3Only);
+            bct.Multiply(P_dot_vec, G_Pd);
+        }
+
+        // Move to the perturbed positions, refitting both trees rather than rebuilding
+        // them, so that the Barnes-Hut errors at either end mostly cancel
+        SaveCurrentPositions();
+        SetGradientStep(P_dot, h);
+        if (root) {
+            root->recomputeCentersOfMass(curveNetwork);
+        }
+        edgeTree->recomputeCentersOfMass(curveNetwork);
+        edgeTree->refreshWeightsVector(curveNetwork, BodyType::Edge);
+
+        Eigen::MatrixXd l2Gradient_h;
+        l2Gradient_h.setZero(nVerts, 3);
+        AddAllGradients(root, l2Gradient_h);
+        {
+            BlockClusterTree bct(curveNetwork, edgeTree, sep, alpha, beta, epsilon, &iterationArena);
+            bct.SetBlockTreeMode(BlockTreeMode::Matrix3Only);
+            bct.Multiply(P_dot_vec, G_Pd_h);
+        }
+
+        RestoreOriginalPositions();
+        if (root) {
+            root->recomputeCentersOfMass(curveNetwork);
+        }
+        delete edgeTree;
+
+        // Numerical derivatives of the L2 gradient and of Gram * P_dot
+        Eigen::MatrixXd l2Deriv = (l2Gradient_h - l2Gradient) / h;
+        MatrixIntoVectorX3(l2Deriv, rhs);
+        rhs -= (G_Pd_h - G_Pd) / h;
     }
 
     double TPEFlowSolverSC::LSBackproject(Eigen::MatrixXd &gradient, double initGuess,
@@ -321,14 +719,20 @@ namespace LWS {
     }
 
     bool TPEFlowSolverSC::StepLS(bool useBH) {
+        PROFILE_SCOPE("Step");
         int nVerts = curveNetwork->NumVertices();
         Eigen::MatrixXd gradients(nVerts, 3);
         gradients.setZero();
 
+        // Trees from the last step are gone, so their memory can be reused
+        iterationArena.Reset();
+
         // FillGradientVectorDirect(gradients);
         BVHNode3D *tree_root = 0;
-        if (useBH) tree_root = CreateBVHFromCurve(curveNetwork);
+        PROFILE_PUSH("Gradient");
+        if (useBH) tree_root = CreateBVHFromCurve(curveNetwork, &iterationArena);
         AddAllGradients(tree_root, gradients);
+        PROFILE_POP();
         double gradNorm = gradients.norm();
         double step_size = LineSearchStep(gradients, 1, tree_root);
 
@@ -344,8 +748,9 @@ namespace LWS {
         int nVerts = curveNetwork->NumVertices();
         Eigen::MatrixXd gradients(nVerts, 3);
         gradients.setZero();
+        iterationArena.Reset();
         BVHNode3D *tree_root = 0;
-        if (useBH) tree_root = CreateBVHFromCurve(curveNetwork);
+        if (useBH) tree_root = CreateBVHFromCurve(curveNetwork, &iterationArena);
         AddAllGradients(tree_root, gradients);
 
         // Set up saddle matrix
@@ -370,10 +775,12 @@ namespace LWS {
         lu.compute(A);
 
         // Project gradient onto constraint differential
+        Eigen::MatrixXd l2gradients = gradients;
         ProjectSoboSloboGradient(lu, gradients);
         double gradNorm = gradients.norm();
         std::cout << "  Norm gradient = " << gradNorm << std::endl;
-        double step_size = LineSearchStep(gradients, 1, tree_root);
+        double slope = (l2gradients.array() * gradients.array()).sum();
+        double step_size = LineSearchStep(gradients, 1, tree_root, false, slope);
 
         // Backprojection
         if (useBackproj) {
@@ -430,6 +837,7 @@ namespace LWS {
             CurveVertex* pt = curveNetwork->GetVertex(i);
             pt->SetPosition(pt->Position() + correction);
         }
+        curveNetwork->UpdateGeometry();
         // Compute constraint violation after correction
         maxViolation = constraint.FillConstraintValues(b, constraintTargets, 3 * nVerts);
         std::cout << "  Constraint value = " << maxViolation << std::endl;
@@ -437,20 +845,43 @@ namespace LWS {
         return maxViolation;
     }
 
+    void TPEFlowSolverSC::updateSolveTolerance(Eigen::MatrixXd &l2gradients) {
+        int nVerts = curveNetwork->NumVertices();
+        Eigen::VectorXd g(3 * nVerts);
+        auto block = l2gradients.block(0, 0, nVerts, 3);
+        MatrixIntoVectorX3(block, g);
+        g = curveNetwork->constraintProjector->ProjectToNullspace(g);
+
+        mg_tolerance = solveTolerance.Update(g.norm(), lastRelativeDecrease);
+        double averageLength = curveNetwork->TotalLength() / curveNetwork->NumEdges();
+        mg_backproj_threshold = fmin(1e-4, averageLength * mg_tolerance * 1e-2);
+        mgProductsAtStart = BlockClusterTree::numProducts.load();
+        std::cout << "  Multigrid tolerance = " << mg_tolerance << " (backprojection threshold "
+            << mg_backproj_threshold << ")" << std::endl;
+    }
+
+    void TPEFlowSolverSC::reportSolveTolerance() {
+        double products = BlockClusterTree::numProducts.load() - mgProductsAtStart;
+        double saved = solveTolerance.EstimateSaved(products);
+        mgIterationsSaved += saved;
+        std::cout << "  Multigrid products: " << products << " (about " << saved << " saved over tolerance "
+            << solveTolerance.Reference() << ", " << mgIterationsSaved << " in total)" << std::endl;
+    }
+
     double TPEFlowSolverSC::ProjectGradient(Eigen::MatrixXd &gradients, Eigen::MatrixXd &A, Eigen::PartialPivLU<Eigen::MatrixXd> &lu) {
         size_t nVerts = curveNetwork->NumVertices();
         Eigen::MatrixXd l2gradients = gradients;
 
         // Assemble the Sobolev gram matrix with constraints
-        double ss_start = Utils::currentTimeMilliseconds();
+        PROFILE_PUSH("Assemble Sobolev matrix");
         SobolevCurves::Sobolev3XWithConstraints(curveNetwork, constraint, alpha, beta, A);
-        double ss_end = Utils::currentTimeMilliseconds();
+        PROFILE_POP();
 
         // Factorize and solve
-        double factor_start = Utils::currentTimeMilliseconds();
+        PROFILE_PUSH("Factor and solve");
         lu.compute(A);
         ProjectSoboSloboGradient(lu, gradients);
-        double factor_end = Utils::currentTimeMilliseconds();
+        PROFILE_POP();
 
         double soboDot = 0;
 
@@ -470,6 +901,7 @@ namespace LWS {
         double eps = 1e-5;
         // Evaluate new L2 gradients
         curveNetwork->positions -= eps * projected1;
+        curveNetwork->UpdateGeometry();
         Eigen::MatrixXd projectedEps;
         projectedEps.setZero(nVerts, 3);
         AddAllGradients(tree_root, projectedEps);
@@ -480,6 +912,7 @@ namespace LWS {
 
         secondDeriv = (projectedEps - projected1) / eps;
         curveNetwork->positions = origPos;
+        curveNetwork->UpdateGeometry();
     }
 
     bool TPEFlowSolverSC::TargetLengthReached() {
@@ -553,6 +986,7 @@ namespace LWS {
     }
 
     bool TPEFlowSolverSC::StepSobolevLS(bool useBH, bool useBackproj) {
+        PROFILE_SCOPE("Step");
         long start = Utils::currentTimeMilliseconds();
 
         size_t nVerts = curveNetwork->NumVertices();
@@ -562,13 +996,16 @@ namespace LWS {
 
         // If applicable, move constraint targets
         MoveLengthTowardsTarget();
+        iterationArena.Reset();
 
         // Assemble gradient, either exactly or with Barnes-Hut
         long bh_start = Utils::currentTimeMilliseconds();
+        PROFILE_PUSH("Gradient");
         BVHNode3D *tree_root = 0;
-        if (useBH) tree_root = CreateBVHFromCurve(curveNetwork);
+        if (useBH) tree_root = CreateBVHFromCurve(curveNetwork, &iterationArena);
         AddAllGradients(tree_root, vertGradients);
         Eigen::MatrixXd l2Gradients = vertGradients;
+        PROFILE_POP();
 
         std::cout << "=== Iteration " << ++iterNum << " ===" << std::endl;
         double bh_end = Utils::currentTimeMilliseconds();
@@ -583,7 +1020,9 @@ namespace LWS {
 
         long project_start = Utils::currentTimeMilliseconds();
         // Compute the Sobolev gradient
+        PROFILE_PUSH("Sobolev projection");
         double soboDot = ProjectGradient(vertGradients, A, lu);
+        PROFILE_POP();
         long project_end = Utils::currentTimeMilliseconds();
 
         std::cout << "  Sobolev gradient norm = " << soboDot << std::endl;
@@ -597,10 +1036,10 @@ namespace LWS {
 
         // Take a line search step using this gradient
         double ls_start = Utils::currentTimeMilliseconds();
-        double step_size = LineSearchStep(vertGradients, dot_acc, tree_root);
+        double step_size = LineSearchStep(vertGradients, dot_acc, tree_root, false, soboDot);
         // double step_size = CircleSearchStep(vertGradients, secondDeriv, A, tree_root);
         double ls_end = Utils::currentTimeMilliseconds();
-        std::cout << "  Line search: " << (ls_end - ls_start) << " ms" << std::endl;
+        std::cout << "  Line search: " << (ls_end - ls_start) << " ms (" << lastLineSearchEvals << " energy evaluations)" << std::endl;
 
         if (useEdgeLengthScale && step_size < ls_step_threshold) {
             vertGradients.setZero();
@@ -609,6 +1048,7 @@ namespace LWS {
         // Correct for drift with backprojection
         double bp_start = Utils::currentTimeMilliseconds();
         if (useBackproj) {
+            PROFILE_SCOPE("Backprojection");
             step_size = LSBackproject(vertGradients, step_size, lu, dot_acc, tree_root);
         }
         double bp_end = Utils::currentTimeMilliseconds();
@@ -632,7 +1072,8 @@ namespace LWS {
             double bp_time = bp_end - bp_start;
             double all_time = end - start;
 
-            perfFile << iterNum << ", " << bh_time << ", " << mg_time << ", " << ls_time << ", " << bp_time << ", " << all_time << std::endl;
+            perfFile << iterNum << ", " << bh_time << ", " << mg_time << ", " << ls_time << ", " << bp_time << ", " << all_time
+                << ", " << lastLineSearchEvals << std::endl;
         }
 
         lastStepSize = step_size;
@@ -642,6 +1083,7 @@ namespace LWS {
     }
 
     bool TPEFlowSolverSC::StepSobolevLSIterative(double epsilon, bool useBackproj) {
+        PROFILE_SCOPE("Step");
         std::cout << "=== Iteration " << ++iterNum << " ===" << std::endl;
         long all_start = Utils::currentTimeMilliseconds();
 
@@ -653,29 +1095,43 @@ namespace LWS {
 
         // If applicable, move constraint targets
         MoveLengthTowardsTarget();
+        // Every tree below is deleted by the end of this step
+        iterationArena.Reset();
 
         // Assemble the L2 gradient
         long bh_start = Utils::currentTimeMilliseconds();
-        tree_root = CreateBVHFromCurve(curveNetwork);
+        PROFILE_PUSH("Gradient");
+        tree_root = CreateBVHFromCurve(curveNetwork, &iterationArena);
         AddAllGradients(tree_root, vertGradients);
         Eigen::MatrixXd l2gradients = vertGradients;
+        PROFILE_POP();
         long bh_end = Utils::currentTimeMilliseconds();
         std::cout << "  Barnes-Hut: " << (bh_end - bh_start) << " ms" << std::endl;
 
         // Set up multigrid stuff
         long mg_setup_start = Utils::currentTimeMilliseconds();
+        PROFILE_PUSH("Multigrid setup");
         using MultigridDomain = ConstraintProjectorDomain<ConstraintClassType>;
         using MultigridSolver = MultigridHierarchy<MultigridDomain>;
-        double sep = 1.0;
-        MultigridDomain* domain = new MultigridDomain(curveNetwork, alpha, beta, sep, epsilon);
-        MultigridSolver* multigrid = new MultigridSolver(domain);
+        double sep = LWSOptions::bctSeparation;
+        MultigridDomain* domain = new MultigridDomain(curveNetwork, alpha, beta, sep, epsilon, &iterationArena);
+        int numLevels = domain->NumLevelsForCache();
+        MultigridSolver* multigrid = new MultigridSolver(domain, numLevels);
+        PROFILE_POP();
         long mg_setup_end = Utils::currentTimeMilliseconds();
-        std::cout << "  Multigrid setup: " << (mg_setup_end - mg_setup_start) << " ms" << std::endl;
+        std::cout << "  Multigrid setup: " << (mg_setup_end - mg_setup_start) << " ms (" << numLevels
+            << " levels, coarsest " << domain->CoarsestVertices() << " vertices)" << std::endl;
+        updateSolveTolerance(vertGradients);
+        std::cout << "  Constraint factorization: " << curveNetwork->constraintProjector->LastFactorizeMs() << " ms ("
+            << curveNetwork->constraintProjector->NumAnalyses() << " symbolic, "
+            << curveNetwork->constraintProjector->NumFactorizations() << " numeric so far)" << std::endl;
 
         // Use multigrid to compute the Sobolev gradient
         long mg_start = Utils::currentTimeMilliseconds();
-        double soboDot = ProjectGradientMultigrid<MultigridDomain, MultigridSolver::EigenCG>(vertGradients, multigrid, vertGradients, mg_tolerance);
+        PROFILE_PUSH("Multigrid solve");
+        double soboDot = ProjectGradientMultigrid<MultigridDomain, SelectedMultigridSolver>(vertGradients, multigrid, vertGradients, mg_tolerance);
         double dot_acc = soboDot / (l2gradients.norm() * vertGradients.norm());
+        PROFILE_POP();
         long mg_end = Utils::currentTimeMilliseconds();
         std::cout << "  Multigrid solve: " << (mg_end - mg_start) << " ms" << std::endl;
         std::cout << "  Sobolev gradient norm = " << soboDot << std::endl;
@@ -684,25 +1140,30 @@ namespace LWS {
         long ls_start = Utils::currentTimeMilliseconds();
         // double step_size = CircleSearch::CircleSearchStep<MultigridSolver, MultigridSolver::EigenCG>(curveNetwork,
         //     vertGradients, l2gradients, tree_root, multigrid, initialLengths, dot_acc, alpha, beta, 1e-6);
-        double step_size = LineSearchStep(vertGradients, dot_acc, tree_root);
+        double step_size = LineSearchStep(vertGradients, dot_acc, tree_root, false, soboDot);
         long ls_end = Utils::currentTimeMilliseconds();
-        std::cout << "  Line search: " << (ls_end - ls_start) << " ms" << std::endl;
+        std::cout << "  Line search: " << (ls_end - ls_start) << " ms (" << lastLineSearchEvals << " energy evaluations)" << std::endl;
 
         // Correct for drift with backprojection
         long bp_start = Utils::currentTimeMilliseconds();
         if (useBackproj) {
-            step_size = LSBackprojectMultigrid<MultigridDomain, MultigridSolver::EigenCG>(vertGradients,
+            PROFILE_SCOPE("Backprojection");
+            step_size = LSBackprojectMultigrid<MultigridDomain, SelectedMultigridSolver>(vertGradients,
             step_size, multigrid, tree_root, mg_tolerance);
         }
         long bp_end = Utils::currentTimeMilliseconds();
         std::cout << "  Backprojection: " << (bp_end - bp_start) << " ms" << std::endl;
         std::cout << "  Final step size = " << step_size << std::endl;
 
+        reportSolveTolerance();
         delete multigrid;
         if (tree_root) delete tree_root;
 
         long all_end = Utils::currentTimeMilliseconds();
-        std::cout << "  Total time: " << (all_end - all_start) << " ms" << std::endl;
+        std::cout << "  Total time: " << (all_end - all_start) << " ms (" << numEnergyEvals << " energy and "
+            << numGradientEvals << " gradient evaluations so far)" << std::endl;
+        std::cout << "  Arena: " << iterationArena.NumAllocations() << " allocations, "
+            << iterationArena.BytesReserved() / (1024 * 1024) << " MB reserved" << std::endl;
 
         if (perfLogEnabled) {
             double bh_time = bh_end - bh_start;
@@ -711,7 +1172,8 @@ namespace LWS {
             double bp_time = bp_end - bp_start;
             double all_time = all_end - all_start;
 
-            perfFile << iterNum << ", " << bh_time << ", " << mg_time << ", " << ls_time << ", " << bp_time << ", " << all_time << std::endl;
+            perfFile << iterNum << ", " << bh_time << ", " << mg_time << ", " << ls_time << ", " << bp_time << ", " << all_time
+                << ", " << lastLineSearchEvals << std::endl;
         }
 
         soboNormZero = (soboDot < 1e-4);
@@ -719,4 +1181,277 @@ namespace LWS {
         lastStepSize = step_size;
         return step_size > ls_step_threshold;
     }
+
+    bool TPEFlowSolverSC::StepLBFGS(double epsilon, bool useBackproj) {
+        PROFILE_SCOPE("Step");
+        std::cout << "=== Iteration " << ++iterNum << " (L-BFGS) ===" << std::endl;
+        long all_start = Utils::currentTimeMilliseconds();
+
+        size_t nVerts = curveNetwork->NumVertices();
+        BVHNode3D* tree_root = 0;
+
+        Eigen::MatrixXd vertGradients;
+        vertGradients.setZero(nVerts, 3);
+
+        // If applicable, move constraint targets
+        MoveLengthTowardsTarget();
+        // Every tree below is deleted by the end of this step
+        iterationArena.Reset();
+
+        // Assemble the L2 gradient
+        long bh_start = Utils::currentTimeMilliseconds();
+        PROFILE_PUSH("Gradient");
+        tree_root = CreateBVHFromCurve(curveNetwork, &iterationArena);
+        AddAllGradients(tree_root, vertGradients);
+        PROFILE_POP();
+        long bh_end = Utils::currentTimeMilliseconds();
+        std::cout << "  Barnes-Hut: " << (bh_end - bh_start) << " ms" << std::endl;
+
+        // Set up multigrid stuff
+        long mg_setup_start = Utils::currentTimeMilliseconds();
+        PROFILE_PUSH("Multigrid setup");
+        using MultigridDomain = ConstraintProjectorDomain<ConstraintClassType>;
+        using MultigridSolver = MultigridHierarchy<MultigridDomain>;
+        double sep = LWSOptions::bctSeparation;
+        MultigridDomain* domain = new MultigridDomain(curveNetwork, alpha, beta, sep, epsilon, &iterationArena);
+        int numLevels = domain->NumLevelsForCache();
+        MultigridSolver* multigrid = new MultigridSolver(domain, numLevels);
+        PROFILE_POP();
+        long mg_setup_end = Utils::currentTimeMilliseconds();
+        std::cout << "  Multigrid setup: " << (mg_setup_end - mg_setup_start) << " ms (" << numLevels
+            << " levels, coarsest " << domain->CoarsestVertices() << " vertices)" << std::endl;
+        updateSolveTolerance(vertGradients);
+
+        // Flatten the positions and the gradient, projected onto the constraint null space
+        int nRows = 3 * nVerts;
+        ConstraintProjector* projector = curveNetwork->constraintProjector;
+        Eigen::VectorXd x(nRows), g(nRows);
+        MatrixIntoVectorX3(curveNetwork->positions, x);
+        MatrixIntoVectorX3(vertGradients, g);
+        g = projector->ProjectToNullspace(g);
+
+        // Record the change since the last step
+        if (lbfgsPrevPositions.rows() == nRows) {
+            Eigen::VectorXd s = projector->ProjectToNullspace(x - lbfgsPrevPositions);
+            lbfgs.AddPair(s, g - lbfgsPrevGradient);
+        }
+        else {
+            lbfgs.Clear();
+        }
+        lbfgsPrevPositions = x;
+        lbfgsPrevGradient = g;
+
+        // The initial inverse Hessian is the Sobolev solve, scaled so that it
+        // agrees with the last pair in the Sobolev norm: gamma = <s, G s> / <s, y>
+        long mg_start = Utils::currentTimeMilliseconds();
+        PROFILE_PUSH("Multigrid solve");
+        double gamma = 1;
+        if (lbfgs.NumPairs() > 0) {
+            Product::MatrixReplacement<MultigridDomain::MultType> G(multigrid->GetTopLevelMultiplier(), nRows);
+            const Eigen::VectorXd &s = lbfgs.LastStep();
+            Eigen::VectorXd Gs = G * s;
+            gamma = s.dot(Gs) / s.dot(lbfgs.LastGradientChange());
+        }
+        auto applyH0 = [&](const Eigen::VectorXd &q, Eigen::VectorXd &r) {
+            Eigen::VectorXd Pq = projector->ProjectToNullspace(q);
+            r = gamma * MultigridSolve<SelectedMultigridSolver>(multigrid, Pq, mg_tolerance);
+        };
+
+        Eigen::VectorXd d;
+        lbfgs.Apply(g, d, applyH0);
+        double slope = g.dot(d);
+        if (!(slope > 0) || !(gamma > 0)) {
+            // The history no longer describes the energy well; restart from the Sobolev gradient
+            std::cout << "  L-BFGS direction is not a descent direction; clearing history" << std::endl;
+            lbfgs.Clear();
+            gamma = 1;
+            applyH0(g, d);
+            slope = g.dot(d);
+        }
+        PROFILE_POP();
+        long mg_end = Utils::currentTimeMilliseconds();
+        std::cout << "  Multigrid solve: " << (mg_end - mg_start) << " ms (" << lbfgs.NumPairs()
+            << " L-BFGS pairs, scale " << gamma << ")" << std::endl;
+        std::cout << "  Directional derivative = " << slope << std::endl;
+
+        Eigen::MatrixXd direction(nVerts, 3);
+        VectorXdIntoMatrix(d, direction);
+        double dot_acc = slope / (g.norm() * d.norm());
+
+        // Take a line search step; with a history, the unit step is the natural first guess
+        long ls_start = Utils::currentTimeMilliseconds();
+        double step_size = (lbfgs.NumPairs() > 0) ? LineSearchStep(direction, 1.0, 0, dot_acc, tree_root, slope)
+            : LineSearchStep(direction, dot_acc, tree_root, false, slope);
+        long ls_end = Utils::currentTimeMilliseconds();
+        std::cout << "  Line search: " << (ls_end - ls_start) << " ms (" << lastLineSearchEvals << " energy evaluations)" << std::endl;
+
+        // Correct for drift with backprojection
+        long bp_start = Utils::currentTimeMilliseconds();
+        if (useBackproj) {
+            PROFILE_SCOPE("Backprojection");
+            step_size = LSBackprojectMultigrid<MultigridDomain, SelectedMultigridSolver>(direction,
+            step_size, multigrid, tree_root, mg_tolerance);
+        }
+        long bp_end = Utils::currentTimeMilliseconds();
+        std::cout << "  Backprojection: " << (bp_end - bp_start) << " ms" << std::endl;
+        std::cout << "  Final step size = " << step_size << std::endl;
+
+        if (step_size <= ls_step_threshold) {
+            // Start over from the Sobolev gradient next time
+            lbfgs.Clear();
+            lbfgsPrevPositions.resize(0);
+        }
+
+        reportSolveTolerance();
+        delete multigrid;
+        if (tree_root) delete tree_root;
+
+        long all_end = Utils::currentTimeMilliseconds();
+        std::cout << "  Total time: " << (all_end - all_start) << " ms (" << numEnergyEvals << " energy and "
+            << numGradientEvals << " gradient evaluations so far)" << std::endl;
+
+        if (perfLogEnabled) {
+            double bh_time = bh_end - bh_start;
+            double mg_time = mg_end - mg_setup_start;
+            double ls_time = ls_end - ls_start;
+            double bp_time = bp_end - bp_start;
+            double all_time = all_end - all_start;
+
+            perfFile << iterNum << ", " << bh_time << ", " << mg_time << ", " << ls_time << ", " << bp_time << ", " << all_time
+                << ", " << lastLineSearchEvals << std::endl;
+        }
+
+        soboNormZero = (slope < 1e-4);
+
+        lastStepSize = step_size;
+        return step_size > ls_step_threshold;
+    }
+
+    bool TPEFlowSolverSC::StepSobolevCircleIterative(double epsilon, bool useBackproj) {
+        PROFILE_SCOPE("Step");
+        std::cout << "=== Iteration " << ++iterNum << " (circle search) ===" << std::endl;
+        long all_start = Utils::currentTimeMilliseconds();
+
+        size_t nVerts = curveNetwork->NumVertices();
+        BVHNode3D* tree_root = 0;
+
+        Eigen::MatrixXd vertGradients;
+        vertGradients.setZero(nVerts, 3);
+
+        // If applicable, move constraint targets
+        MoveLengthTowardsTarget();
+        // Every tree below is deleted by the end of this step
+        iterationArena.Reset();
+
+        // Assemble the L2 gradient
+        long bh_start = Utils::currentTimeMilliseconds();
+        PROFILE_PUSH("Gradient");
+        tree_root = CreateBVHFromCurve(curveNetwork, &iterationArena);
+        AddAllGradients(tree_root, vertGradients);
+        Eigen::MatrixXd l2gradients = vertGradients;
+        PROFILE_POP();
+        long bh_end = Utils::currentTimeMilliseconds();
+        std::cout << "  Barnes-Hut: " << (bh_end - bh_start) << " ms" << std::endl;
+
+        // Set up multigrid stuff
+        long mg_setup_start = Utils::currentTimeMilliseconds();
+        PROFILE_PUSH("Multigrid setup");
+        using MultigridDomain = ConstraintProjectorDomain<ConstraintClassType>;
+        using MultigridSolver = MultigridHierarchy<MultigridDomain>;
+        double sep = LWSOptions::bctSeparation;
+        MultigridDomain* domain = new MultigridDomain(curveNetwork, alpha, beta, sep, epsilon, &iterationArena);
+        int numLevels = domain->NumLevelsForCache();
+        MultigridSolver* multigrid = new MultigridSolver(domain, numLevels);
+        PROFILE_POP();
+        long mg_setup_end = Utils::currentTimeMilliseconds();
+        std::cout << "  Multigrid setup: " << (mg_setup_end - mg_setup_start) << " ms (" << numLevels
+            << " levels, coarsest " << domain->CoarsestVertices() << " vertices)" << std::endl;
+        updateSolveTolerance(vertGradients);
+
+        // Use multigrid to compute the Sobolev gradient
+        long mg_start = Utils::currentTimeMilliseconds();
+        PROFILE_PUSH("Multigrid solve");
+        double soboDot = ProjectGradientMultigrid<MultigridDomain, SelectedMultigridSolver>(vertGradients, multigrid, vertGradients, mg_tolerance);
+        double dot_acc = soboDot / (l2gradients.norm() * vertGradients.norm());
+        PROFILE_POP();
+        long mg_end = Utils::currentTimeMilliseconds();
+        std::cout << "  Multigrid solve: " << (mg_end - mg_start) << " ms" << std::endl;
+        std::cout << "  Sobolev gradient norm = " << soboDot << std::endl;
+
+        // Solve G * P_ddot = P * (differentiated right-hand side) for the second derivative
+        long sd_start = Utils::currentTimeMilliseconds();
+        PROFILE_PUSH("Second derivative");
+        int nRows = 3 * nVerts;
+        ConstraintProjector* projector = curveNetwork->constraintProjector;
+        Eigen::VectorXd rhs;
+        differentiateSobolevRHS(vertGradients, l2gradients, tree_root, epsilon, rhs);
+        rhs = projector->ProjectToNullspace(rhs);
+        Eigen::VectorXd P_ddot_vec = MultigridSolve<SelectedMultigridSolver>(multigrid, rhs, mg_tolerance);
+        Eigen::MatrixXd P_ddot(nVerts, 3);
+        VectorXdIntoMatrix(P_ddot_vec, P_ddot);
+
+        Product::MatrixReplacement<MultigridDomain::MultType> G(multigrid->GetTopLevelMultiplier(), nRows);
+        Eigen::VectorXd P_dot_vec(nRows);
+        MatrixIntoVectorX3(vertGradients, P_dot_vec);
+        Eigen::VectorXd G_Pd = G * P_dot_vec;
+        Eigen::VectorXd G_Pdd = G * P_ddot_vec;
+        PROFILE_POP();
+        long sd_end = Utils::currentTimeMilliseconds();
+        std::cout << "  Second derivative: " << (sd_end - sd_start) << " ms" << std::endl;
+
+        // Search along the osculating circle, falling back to a straight line search
+        long ls_start = Utils::currentTimeMilliseconds();
+        double step_size = CircleSearchStep(vertGradients, P_ddot, G_Pd, G_Pdd, tree_root);
+        bool onCircle = (step_size > 0);
+        if (!onCircle) {
+            std::cout << "  No usable circle step; falling back to line search" << std::endl;
+            step_size = LineSearchStep(vertGradients, dot_acc, tree_root, false, soboDot);
+        }
+        long ls_end = Utils::currentTimeMilliseconds();
+        std::cout << "  Line search: " << (ls_end - ls_start) << " ms (" << lastLineSearchEvals << " energy evaluations)" << std::endl;
+
+        // Correct for drift with backprojection. A circle step is backtracked along
+        // its chord, which reaches the accepted positions at 1.
+        long bp_start = Utils::currentTimeMilliseconds();
+        if (useBackproj) {
+            PROFILE_SCOPE("Backprojection");
+            if (onCircle) {
+                Eigen::MatrixXd chord = originalPositionMatrix - curveNetwork->positions;
+                step_size *= LSBackprojectMultigrid<MultigridDomain, SelectedMultigridSolver>(chord,
+                1, multigrid, tree_root, mg_tolerance);
+            }
+            else {
+                step_size = LSBackprojectMultigrid<MultigridDomain, SelectedMultigridSolver>(vertGradients,
+                step_size, multigrid, tree_root, mg_tolerance);
+            }
+        }
+        long bp_end = Utils::currentTimeMilliseconds();
+        std::cout << "  Backprojection: " << (bp_end - bp_start) << " ms" << std::endl;
+        std::cout << "  Final step size = " << step_size << std::endl;
+
+        reportSolveTolerance();
+        delete multigrid;
+        if (tree_root) delete tree_root;
+
+        long all_end = Utils::currentTimeMilliseconds();
+        std::cout << "  Total time: " << (all_end - all_start) << " ms (" << numEnergyEvals << " energy and "
+            << numGradientEvals << " gradient evaluations so far)" << std::endl;
+
+        if (perfLogEnabled) {
+            double bh_time = bh_end - bh_start;
+            double mg_time = sd_end - mg_setup_start;
+            double ls_time = ls_end - ls_start;
+            double bp_time = bp_end - bp_start;
+            double all_time = all_end - all_start;
+
+            perfFile << iterNum << ", " << bh_time << ", " << mg_time << ", " << ls_time << ", " << bp_time << ", " << all_time
+                << ", " << lastLineSearchEvals << std::endl;
+        }
+
+        soboNormZero = (soboDot < 1e-4);
+
+        // Circle steps are measured along the arc, so they shouldn't seed a later line search
+        lastStepSize = onCircle ? 0 : step_size;
+        return step_size > ls_step_threshold;
+    }
 }